@@ -0,0 +1,233 @@
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+#include "compact-format.hpp"
+
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/util/delta.hpp>
+
+// Workaround: This must be included before buffer_string.hpp due to a missing
+// include in the upstream code. https://github.com/mapbox/protozero/pull/104
+#include <protozero/config.hpp>
+
+#include <protozero/buffer_string.hpp>
+#include <protozero/exception.hpp>
+#include <protozero/varint.hpp>
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+void add_string(std::string *data, char const *str, std::size_t size)
+{
+    protozero::add_varint_to_buffer(data, size);
+    data->append(str, size);
+}
+
+void add_string(std::string *data, char const *str)
+{
+    add_string(data, str, std::strlen(str));
+}
+
+void add_tags(std::string *data, osmium::OSMObject const &object, bool attrs)
+{
+    taglist_t extra;
+    if (attrs) {
+        extra.add_attributes(object);
+    }
+
+    protozero::add_varint_to_buffer(data, object.tags().size() + extra.size());
+
+    for (auto const &tag : object.tags()) {
+        add_string(data, tag.key());
+        add_string(data, tag.value());
+    }
+
+    for (auto const &tag : extra) {
+        add_string(data, tag.key.data(), tag.key.size());
+        add_string(data, tag.value.data(), tag.value.size());
+    }
+}
+
+/**
+ * Reads the parts of the compact format from a chunk of memory. All
+ * strings point into the original memory.
+ */
+class decoder_t
+{
+public:
+    decoder_t(char const *data, std::size_t size) noexcept
+    : m_data(data), m_end(data + size)
+    {}
+
+    std::uint64_t get_varint()
+    {
+        try {
+            return protozero::decode_varint(&m_data, m_end);
+        } catch (protozero::exception const &) {
+            throw_invalid();
+        }
+    }
+
+    std::int64_t get_zigzag() { return protozero::decode_zigzag64(get_varint()); }
+
+    std::size_t get_count()
+    {
+        auto const count = get_varint();
+        // Every element needs at least one byte, so this is a cheap check
+        // against garbage data.
+        if (count > static_cast<std::uint64_t>(m_end - m_data)) {
+            throw_invalid();
+        }
+        return static_cast<std::size_t>(count);
+    }
+
+    std::pair<char const *, std::size_t> get_string()
+    {
+        auto const size = get_varint();
+        if (size > static_cast<std::uint64_t>(m_end - m_data)) {
+            throw_invalid();
+        }
+        char const *str = m_data;
+        m_data += size;
+        return {str, static_cast<std::size_t>(size)};
+    }
+
+    void check_at_end() const
+    {
+        if (m_data != m_end) {
+            throw_invalid();
+        }
+    }
+
+private:
+    [[noreturn]] static void throw_invalid()
+    {
+        throw std::runtime_error{"Invalid object data in middle table."};
+    }
+
+    char const *m_data;
+    char const *m_end;
+};
+
+template <typename TBuilder>
+void decode_tags(decoder_t *decoder, osmium::memory::Buffer *buffer,
+                 TBuilder *parent)
+{
+    auto count = decoder->get_count();
+    if (count == 0) {
+        return;
+    }
+
+    osmium::builder::TagListBuilder builder{*buffer, parent};
+    while (count > 0) {
+        auto const key = decoder->get_string();
+        auto const value = decoder->get_string();
+        builder.add_tag(key.first, key.second, value.first, value.second);
+        --count;
+    }
+}
+
+} // anonymous namespace
+
+void compact_encode_way(osmium::Way const &way, bool attrs, std::string *data)
+{
+    assert(data);
+
+    protozero::add_varint_to_buffer(data, way.nodes().size());
+
+    osmium::DeltaEncode<osmid_t> delta;
+    for (auto const &nr : way.nodes()) {
+        protozero::add_varint_to_buffer(
+            data, protozero::encode_zigzag64(delta.update(nr.ref())));
+    }
+
+    add_tags(data, way, attrs);
+}
+
+void compact_encode_relation(osmium::Relation const &relation, bool attrs,
+                             std::string *data)
+{
+    assert(data);
+
+    protozero::add_varint_to_buffer(data, relation.members().size());
+
+    osmium::DeltaEncode<osmid_t> delta;
+    for (auto const &member : relation.members()) {
+        protozero::add_varint_to_buffer(
+            data, osmium::item_type_to_nwr_index(member.type()));
+        protozero::add_varint_to_buffer(
+            data, protozero::encode_zigzag64(delta.update(member.ref())));
+        add_string(data, member.role());
+    }
+
+    add_tags(data, relation, attrs);
+}
+
+void compact_decode_way(osmid_t id, char const *data, std::size_t size,
+                        osmium::memory::Buffer *buffer)
+{
+    assert(buffer);
+
+    decoder_t decoder{data, size};
+
+    osmium::builder::WayBuilder builder{*buffer};
+    builder.set_id(id);
+
+    {
+        auto count = decoder.get_count();
+        osmium::DeltaDecode<osmid_t> delta;
+        osmium::builder::WayNodeListBuilder wnl_builder{*buffer, &builder};
+        while (count > 0) {
+            wnl_builder.add_node_ref(delta.update(decoder.get_zigzag()));
+            --count;
+        }
+    }
+
+    decode_tags(&decoder, buffer, &builder);
+    decoder.check_at_end();
+}
+
+void compact_decode_relation(osmid_t id, char const *data, std::size_t size,
+                             osmium::memory::Buffer *buffer)
+{
+    assert(buffer);
+
+    decoder_t decoder{data, size};
+
+    osmium::builder::RelationBuilder builder{*buffer};
+    builder.set_id(id);
+
+    {
+        auto count = decoder.get_count();
+        osmium::DeltaDecode<osmid_t> delta;
+        osmium::builder::RelationMemberListBuilder rml_builder{*buffer,
+                                                               &builder};
+        while (count > 0) {
+            auto const type = decoder.get_varint();
+            if (type > 2) {
+                throw std::runtime_error{
+                    "Invalid object data in middle table."};
+            }
+            auto const ref = delta.update(decoder.get_zigzag());
+            auto const role = decoder.get_string();
+            rml_builder.add_member(
+                osmium::nwr_index_to_item_type(static_cast<unsigned>(type)),
+                ref, role.first, role.second);
+            --count;
+        }
+    }
+
+    decode_tags(&decoder, buffer, &builder);
+    decoder.check_at_end();
+}
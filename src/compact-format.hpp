@@ -0,0 +1,68 @@
+#ifndef OSM2PGSQL_COMPACT_FORMAT_HPP
+#define OSM2PGSQL_COMPACT_FORMAT_HPP
+
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+/**
+ * \file
+ *
+ * Compact binary encoding of ways and relations used by the pgsql middle
+ * when the middle tables don't need to support updates.
+ *
+ * All numbers are stored as varints, ids are delta encoded and zigzagged.
+ * Strings are stored as length followed by the bytes. The encoding of a
+ * way is the node list (count and ids) followed by the tags. The encoding
+ * of a relation is the member list (count and for each member the type,
+ * id and role) followed by the tags. Tags are encoded as count and then
+ * key and value for each tag.
+ *
+ * The id of the object itself is not part of the encoding.
+ */
+
+#include "osmtypes.hpp"
+
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm.hpp>
+
+#include <cstddef>
+#include <string>
+
+/**
+ * Append compact encoding of the way to data. If attrs is set, the
+ * attributes of the way are added as pseudo-tags.
+ */
+void compact_encode_way(osmium::Way const &way, bool attrs, std::string *data);
+
+/**
+ * Append compact encoding of the relation to data. If attrs is set, the
+ * attributes of the relation are added as pseudo-tags.
+ */
+void compact_encode_relation(osmium::Relation const &relation, bool attrs,
+                             std::string *data);
+
+/**
+ * Decode a way from compact encoding and add it with the specified id to
+ * the buffer. The buffer is not committed.
+ *
+ * \throws std::runtime_error if the data is invalid.
+ */
+void compact_decode_way(osmid_t id, char const *data, std::size_t size,
+                        osmium::memory::Buffer *buffer);
+
+/**
+ * Decode a relation from compact encoding and add it with the specified
+ * id to the buffer. The buffer is not committed.
+ *
+ * \throws std::runtime_error if the data is invalid.
+ */
+void compact_decode_relation(osmid_t id, char const *data, std::size_t size,
+                             osmium::memory::Buffer *buffer);
+
+#endif // OSM2PGSQL_COMPACT_FORMAT_HPP
@@ -0,0 +1,169 @@
+#ifndef OSM2PGSQL_DB_COPY_ESCAPE_HPP
+#define OSM2PGSQL_DB_COPY_ESCAPE_HPP
+
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+/**
+ * \file
+ *
+ * Functions for escaping strings for the COPY text format.
+ *
+ * Most strings (tag keys and values) don't contain any characters that need
+ * escaping. So the strings are scanned for those characters several bytes
+ * at a time (using SSE2 or AVX2 instructions if the compiler is allowed to
+ * use them) and the runs of characters in between are appended in one go.
+ */
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/// Return the number of trailing zero bits in mask, which must not be 0.
+inline unsigned int count_trailing_zeros(unsigned int mask) noexcept
+{
+    assert(mask != 0);
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned int>(index);
+#else
+    return static_cast<unsigned int>(__builtin_ctz(mask));
+#endif
+}
+
+/**
+ * Find the first character in the range [begin, end) that has to be
+ * escaped in the COPY text format: tab, newline, carriage return, backslash
+ * or double quote. Returns end if there is no such character.
+ */
+inline char const *find_copy_escape_char(char const *begin,
+                                         char const *end) noexcept
+{
+#if defined(__AVX2__)
+    {
+        auto const tab = _mm256_set1_epi8('\t');
+        auto const newline = _mm256_set1_epi8('\n');
+        auto const cr = _mm256_set1_epi8('\r');
+        auto const backslash = _mm256_set1_epi8('\\');
+        auto const quote = _mm256_set1_epi8('"');
+
+        while (end - begin >= 32) {
+            auto const data = _mm256_loadu_si256(
+                reinterpret_cast<__m256i const *>(begin));
+            auto const match = _mm256_or_si256(
+                _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(data, tab),
+                                                _mm256_cmpeq_epi8(data, newline)),
+                                _mm256_cmpeq_epi8(data, cr)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(data, backslash),
+                                _mm256_cmpeq_epi8(data, quote)));
+            auto const mask =
+                static_cast<unsigned int>(_mm256_movemask_epi8(match));
+            if (mask != 0) {
+                return begin + count_trailing_zeros(mask);
+            }
+            begin += 32;
+        }
+    }
+#endif
+
+#if defined(__SSE2__)
+    {
+        auto const tab = _mm_set1_epi8('\t');
+        auto const newline = _mm_set1_epi8('\n');
+        auto const cr = _mm_set1_epi8('\r');
+        auto const backslash = _mm_set1_epi8('\\');
+        auto const quote = _mm_set1_epi8('"');
+
+        while (end - begin >= 16) {
+            auto const data =
+                _mm_loadu_si128(reinterpret_cast<__m128i const *>(begin));
+            auto const match = _mm_or_si128(
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(data, tab),
+                                          _mm_cmpeq_epi8(data, newline)),
+                             _mm_cmpeq_epi8(data, cr)),
+                _mm_or_si128(_mm_cmpeq_epi8(data, backslash),
+                             _mm_cmpeq_epi8(data, quote)));
+            auto const mask = static_cast<unsigned int>(_mm_movemask_epi8(match));
+            if (mask != 0) {
+                return begin + count_trailing_zeros(mask);
+            }
+            begin += 16;
+        }
+    }
+#endif
+
+    for (; begin != end; ++begin) {
+        switch (*begin) {
+        case '\t':
+        case '\n':
+        case '\r':
+        case '\\':
+        case '"':
+            return begin;
+        default:
+            break;
+        }
+    }
+
+    return end;
+}
+
+/**
+ * Append the string s escaped for the COPY text format to the buffer.
+ *
+ * If quoted is set, the string is escaped for use inside double quotes
+ * in an array or hstore value. In that case backslashes and double quotes
+ * need an additional level of escaping.
+ */
+inline void append_copy_escaped(std::string *buffer, char const *s,
+                                bool quoted)
+{
+    char const *const end = s + std::strlen(s);
+
+    while (true) {
+        char const *const special = find_copy_escape_char(s, end);
+        buffer->append(s, static_cast<std::size_t>(special - s));
+        if (special == end) {
+            return;
+        }
+
+        switch (*special) {
+        case '"':
+            *buffer += quoted ? "\\\\\"" : "\\\"";
+            break;
+        case '\\':
+            *buffer += quoted ? "\\\\\\\\" : "\\\\";
+            break;
+        case '\n':
+            *buffer += "\\n";
+            break;
+        case '\r':
+            *buffer += "\\r";
+            break;
+        default: // '\t'
+            *buffer += "\\t";
+            break;
+        }
+        s = special + 1;
+    }
+}
+
+#endif // OSM2PGSQL_DB_COPY_ESCAPE_HPP
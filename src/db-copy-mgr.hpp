@@ -10,15 +10,35 @@
  * For a full list of authors see the git log.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <memory>
 #include <string>
+#include <type_traits>
+#include <vector>
 
+#include "db-copy-escape.hpp"
 #include "db-copy.hpp"
+#include "row-sorter.hpp"
 #include "util.hpp"
 
 /**
  * Management class that fills and manages copy buffers.
+ *
+ * Buffers are taken from the buffer pool of the copy thread. Their size
+ * is adapted for each target: It grows if buffers fill up, unless the queue
+ * of the copy thread is full, and shrinks if buffers are sent mostly empty,
+ * because the target changes often. It is always large enough to hold a
+ * number of the largest rows seen so far.
+ *
+ * Data is written in the text COPY format unless the target is marked as
+ * binary. In that case the binary COPY format is used and the encoding of
+ * each value is determined by its C++ type, so callers must hand in values
+ * of the type matching the column type (int16_t for int2, int32_t for int4,
+ * int64_t for int8, float for real, double for float8, bool for boolean and
+ * strings for everything that is transferred as text).
  */
 template <typename DELETER>
 class db_copy_mgr_t
@@ -38,36 +58,83 @@ public:
     {
         if (!m_current || !m_current->target->same_copy_target(*table)) {
             if (m_current) {
-                m_processor->add_buffer(std::move(m_current));
+                send_buffer();
             }
 
-            m_current = std::make_unique<db_cmd_copy_delete_t<DELETER>>(table);
+            m_size_idx = find_buffer_size(table);
+            auto const size = m_buffer_sizes[m_size_idx].size;
+            m_current = std::make_unique<db_cmd_copy_delete_t<DELETER>>(
+                table, m_processor->get_buffer(size), size);
+        }
+
+        m_row_start = m_current->buffer.size();
+
+        if (binary()) {
+            // The number of fields is written by finish_line(). This can't
+            // be done here, because new_line() is also used to select the
+            // target for deletes without adding a row.
+            m_num_fields = 0;
         }
     }
 
     /**
      * Finish a table row.
      *
-     * Adds the row delimiter to the buffer. If the buffer is at capacity
-     * it will be forwarded to the copy thread.
+     * Adds the row delimiter to the buffer (or the field count in front of
+     * the row in binary format). If the buffer is at capacity it will be
+     * forwarded to the copy thread.
      */
     void finish_line()
     {
-        assert(m_current);
+        terminate_line();
 
-        auto &buf = m_current->buffer;
-        assert(!buf.empty());
-
-        // Expect that a column has been written last which ended in a '\t'.
-        // Replace it with the row delimiter '\n'.
-        assert(buf.back() == '\t');
-        buf.back() = '\n';
+        auto &buffer_size = m_buffer_sizes[m_size_idx];
+        buffer_size.max_row_size =
+            std::max(buffer_size.max_row_size,
+                     m_current->buffer.size() - m_row_start);
 
         if (m_current->is_full()) {
-            m_processor->add_buffer(std::move(m_current));
+            send_buffer();
         }
     }
 
+    /**
+     * Finish a table row and hand it over to the sorter instead of sending
+     * it to the database.
+     *
+     * \param sorter The sorter the row is added to.
+     * \param wkb The geometry of the row used for sorting.
+     * \param type The type of the object the row belongs to.
+     * \param id The id of the object the row belongs to.
+     */
+    void finish_sorted_line(row_sorter_t *sorter, std::string const &wkb,
+                            char type, osmid_t id)
+    {
+        assert(sorter);
+        terminate_line();
+
+        auto &buf = m_current->buffer;
+        sorter->add(wkb, type, id, buf.data() + m_row_start,
+                    buf.size() - m_row_start);
+        buf.resize(m_row_start);
+    }
+
+    /**
+     * Send all rows from the sorter to the database in sorted order.
+     */
+    void add_sorted_lines(std::shared_ptr<db_target_descr_t> const &table,
+                          row_sorter_t *sorter)
+    {
+        assert(sorter);
+        sorter->for_each([&](char const *data, std::size_t size) {
+            new_line(table);
+            m_current->buffer.append(data, size);
+            if (m_current->is_full()) {
+                send_buffer();
+            }
+        });
+    }
+
     /**
      * Add many simple columns.
      *
@@ -95,25 +162,75 @@ public:
     template <typename T>
     void add_column(T value)
     {
+        if (binary()) {
+            add_binary_value(value);
+            ++m_num_fields;
+            return;
+        }
         add_value(value);
         m_current->buffer += '\t';
     }
 
+    /**
+     * Add a column with JSON text for a jsonb column.
+     *
+     * This is the same as add_column() in text format, in binary format
+     * the jsonb format version has to be written before the JSON text.
+     */
+    void add_jsonb_column(char const *json)
+    {
+        if (binary()) {
+            auto const len = std::strlen(json);
+            add_binary_int<int32_t>(static_cast<int32_t>(len + 1));
+            m_current->buffer += '\1';
+            m_current->buffer.append(json, len);
+            ++m_num_fields;
+            return;
+        }
+        add_column(json);
+    }
+
     /**
      * Add an empty column.
      *
      * Adds a NULL value for the column.
      */
-    void add_null_column() { m_current->buffer += "\\N\t"; }
+    void add_null_column()
+    {
+        if (binary()) {
+            add_binary_int<int32_t>(-1);
+            ++m_num_fields;
+            return;
+        }
+        m_current->buffer += "\\N\t";
+    }
 
     /**
      * Start an array column.
      *
-     * An array is a list of simple elements of the same type.
+     * An array is a list of simple elements of the same type T, which
+     * must be the type of the values later added with add_array_elem().
      *
      * Must be finished with a call to finish_array().
      */
-    void new_array() { m_current->buffer += "{"; }
+    template <typename T>
+    void new_array()
+    {
+        if (binary()) {
+            // Field length and size of the dimension are filled in by
+            // finish_array().
+            m_field_start = m_current->buffer.size();
+            m_num_elements = 0;
+            add_binary_int<int32_t>(0);
+            add_binary_int<int32_t>(1); // number of dimensions
+            add_binary_int<int32_t>(0); // flags
+            add_binary_int<uint32_t>(binary_oid<T>());
+            add_binary_int<int32_t>(0); // size of dimension
+            add_binary_int<int32_t>(1); // lower bound of dimension
+            return;
+        }
+        m_current->buffer += "{";
+    }
 
     /**
      * Add a single value to an array column.
@@ -124,6 +241,11 @@ public:
     template <typename T>
     void add_array_elem(T value)
     {
+        if (binary()) {
+            add_binary_value(value);
+            ++m_num_elements;
+            return;
+        }
         add_value(value);
         m_current->buffer += ',';
     }
@@ -133,6 +255,11 @@ public:
     void add_array_elem(char const *s)
     {
         assert(m_current);
+        if (binary()) {
+            add_binary_value(s);
+            ++m_num_elements;
+            return;
+        }
         m_current->buffer += '"';
         add_escaped_string(s);
         m_current->buffer += "\",";
@@ -147,6 +274,18 @@ public:
     void finish_array()
     {
         assert(!m_current->buffer.empty());
+        if (binary()) {
+            if (m_num_elements == 0) {
+                // An empty array has zero dimensions and no dimension info.
+                set_binary_int<int32_t>(m_field_start + 4, 0);
+                m_current->buffer.resize(m_field_start + 16);
+            } else {
+                set_binary_int<int32_t>(m_field_start + 16,
+                                        static_cast<int32_t>(m_num_elements));
+            }
+            finish_binary_field();
+            return;
+        }
         if (m_current->buffer.back() == '{') {
             m_current->buffer += '}';
         } else {
@@ -167,7 +306,15 @@ public:
      * Must be closed with a finish_hash() call.
      */
     void new_hash()
-    { /* nothing */
+    {
+        if (binary()) {
+            // Field length and number of pairs are filled in by
+            // finish_hash().
+            m_field_start = m_current->buffer.size();
+            m_num_elements = 0;
+            add_binary_int<int32_t>(0);
+            add_binary_int<int32_t>(0);
+        }
     }
 
     void add_hash_elem(std::string const &k, std::string const &v)
@@ -183,6 +330,10 @@ public:
      */
     void add_hash_elem(char const *k, char const *v)
     {
+        if (binary()) {
+            add_binary_hash_elem(k, v);
+            return;
+        }
         m_current->buffer += '"';
         add_escaped_string(k);
         m_current->buffer += "\"=>\"";
@@ -198,6 +349,10 @@ public:
      */
     void add_hash_elem_noescape(char const *k, char const *v)
     {
+        if (binary()) {
+            add_binary_hash_elem(k, v);
+            return;
+        }
         m_current->buffer += '"';
         m_current->buffer += k;
         m_current->buffer += "\"=>\"";
@@ -218,6 +373,10 @@ public:
     template <typename T>
     void add_hstore_num_noescape(char const *k, T const value)
     {
+        if (binary()) {
+            add_binary_hash_elem(k, std::to_string(value).c_str());
+            return;
+        }
         m_current->buffer += '"';
         m_current->buffer += k;
         m_current->buffer += "\"=>\"";
@@ -233,6 +392,12 @@ public:
      */
     void finish_hash()
     {
+        if (binary()) {
+            set_binary_int<int32_t>(m_field_start + 4,
+                                    static_cast<int32_t>(m_num_elements));
+            finish_binary_field();
+            return;
+        }
         auto const idx = m_current->buffer.size() - 1;
         if (!m_current->buffer.empty() && m_current->buffer[idx] == ',') {
             m_current->buffer[idx] = '\t';
@@ -244,10 +409,17 @@ public:
     /**
      * Add a column with the given WKB geometry in WKB hex format.
      *
-     * The geometry is converted on-the-fly from WKB binary to WKB hex.
+     * The geometry is converted on-the-fly from WKB binary to WKB hex. In
+     * binary COPY format the WKB is written as is.
      */
     void add_hex_geom(std::string const &wkb)
     {
+        if (binary()) {
+            add_binary_value(wkb);
+            ++m_num_fields;
+            return;
+        }
+
         char const *const lookup_hex = "0123456789ABCDEF";
 
         for (auto c : wkb) {
@@ -280,19 +452,236 @@ public:
     {
         // finish any ongoing copy operations
         if (m_current) {
-            m_processor->add_buffer(std::move(m_current));
+            send_buffer();
         }
 
         m_processor->sync_and_wait();
     }
 
 private:
+    enum
+    {
+        /// Minimum number of the largest rows seen that fit into a buffer.
+        Min_rows_per_buffer = 16
+    };
+
+    /// Size of the buffers used for one target.
+    struct buffer_size_t
+    {
+        std::shared_ptr<db_target_descr_t> target;
+        std::size_t size = db_cmd_copy_t::Min_buf_size;
+        std::size_t max_row_size = 0;
+
+        explicit buffer_size_t(std::shared_ptr<db_target_descr_t> const &t)
+        : target(t)
+        {}
+    };
+
+    /**
+     * Get the index of the buffer size for the target in m_buffer_sizes,
+     * adding a new entry if there isn't one yet.
+     */
+    std::size_t
+    find_buffer_size(std::shared_ptr<db_target_descr_t> const &table)
+    {
+        auto const it = std::find_if(m_buffer_sizes.begin(),
+                                     m_buffer_sizes.end(),
+                                     [&](buffer_size_t const &bs) {
+                                         return bs.target->same_copy_target(
+                                             *table);
+                                     });
+        if (it != m_buffer_sizes.end()) {
+            return static_cast<std::size_t>(it - m_buffer_sizes.begin());
+        }
+
+        m_buffer_sizes.emplace_back(table);
+        return m_buffer_sizes.size() - 1;
+    }
+
+    /**
+     * Send the current buffer to the copy thread and adapt the size of the
+     * next buffer for this target.
+     */
+    void send_buffer()
+    {
+        assert(m_current);
+
+        auto &buffer_size = m_buffer_sizes[m_size_idx];
+        auto const used = m_current->buffer.size();
+        auto const max_size = m_current->max_size;
+
+        bool const back_pressure =
+            m_processor->add_buffer(std::move(m_current));
+
+        if (used >= max_size / 4 * 3) {
+            // If the database can't keep up with the data, larger buffers
+            // would only use more memory without making anything faster.
+            if (!back_pressure) {
+                buffer_size.size = std::min<std::size_t>(
+                    buffer_size.size * 2, db_cmd_copy_t::Max_buf_size);
+            }
+        } else if (used < max_size / 4) {
+            buffer_size.size = std::max<std::size_t>(
+                buffer_size.size / 2, db_cmd_copy_t::Min_buf_size);
+        }
+
+        buffer_size.size = std::min<std::size_t>(
+            std::max(buffer_size.size,
+                     buffer_size.max_row_size * Min_rows_per_buffer),
+            db_cmd_copy_t::Max_buf_size);
+    }
+
+    bool binary() const noexcept
+    {
+        assert(m_current);
+        return m_current->target->binary;
+    }
+
+    /**
+     * Add the row delimiter to the buffer (or the field count in front of
+     * the row in binary format).
+     */
+    void terminate_line()
+    {
+        assert(m_current);
+
+        auto &buf = m_current->buffer;
+        assert(!buf.empty());
+
+        if (binary()) {
+            char num_fields[sizeof(int16_t)];
+            set_binary_int_in(num_fields, static_cast<int16_t>(m_num_fields));
+            buf.insert(m_row_start, num_fields, sizeof(num_fields));
+            return;
+        }
+
+        // Expect that a column has been written last which ended in a '\t'.
+        // Replace it with the row delimiter '\n'.
+        assert(buf.back() == '\t');
+        buf.back() = '\n';
+    }
+
+    /// Write integer in network byte order as used by binary COPY.
+    template <typename T>
+    void add_binary_int(T value)
+    {
+        static_assert(std::is_integral<T>::value && sizeof(T) > 1,
+                      "Only integer types with at least 2 bytes supported");
+        char buf[sizeof(T)];
+        set_binary_int_in(buf, value);
+        m_current->buffer.append(buf, sizeof(T));
+    }
+
+    /// Overwrite integer at position pos in the buffer.
+    template <typename T>
+    void set_binary_int(std::size_t pos, T value)
+    {
+        assert(pos + sizeof(T) <= m_current->buffer.size());
+        set_binary_int_in(&m_current->buffer[pos], value);
+    }
+
+    template <typename T>
+    static void set_binary_int_in(char *buf, T value) noexcept
+    {
+        auto v = static_cast<typename std::make_unsigned<T>::type>(value);
+        for (std::size_t i = sizeof(T); i > 0; --i) {
+            buf[i - 1] = static_cast<char>(v & 0xffU);
+            v >>= 8U;
+        }
+    }
+
+    /// Return PostgreSQL type oid for array elements of type T.
+    template <typename T>
+    static constexpr uint32_t binary_oid() noexcept
+    {
+        static_assert((std::is_integral<T>::value && sizeof(T) > 1) ||
+                          std::is_convertible<T, std::string>::value,
+                      "Unsupported array element type");
+        if (!std::is_integral<T>::value) {
+            return 25; // text
+        }
+        if (sizeof(T) == 2) {
+            return 21; // int2
+        }
+        if (sizeof(T) == 4) {
+            return 23; // int4
+        }
+        return 20; // int8
+    }
+
+    /**
+     * Set the length of the field started at m_field_start to cover
+     * everything written after it.
+     */
+    void finish_binary_field()
+    {
+        set_binary_int<int32_t>(m_field_start,
+                                static_cast<int32_t>(m_current->buffer.size() -
+                                                     m_field_start - 4));
+        ++m_num_fields;
+    }
+
+    /**
+     * Write a single value (field length and data) in binary COPY format.
+     */
+    template <typename T, typename std::enable_if<std::is_integral<T>::value,
+                                                  int>::type = 0>
+    void add_binary_value(T value)
+    {
+        add_binary_int<int32_t>(sizeof(T));
+        add_binary_int(value);
+    }
+
+    void add_binary_value(bool value)
+    {
+        add_binary_int<int32_t>(1);
+        m_current->buffer += value ? '\1' : '\0';
+    }
+
+    void add_binary_value(float value)
+    {
+        uint32_t bits = 0;
+        std::memcpy(&bits, &value, sizeof(bits));
+        add_binary_int<int32_t>(sizeof(bits));
+        add_binary_int(bits);
+    }
+
+    void add_binary_value(double value)
+    {
+        uint64_t bits = 0;
+        std::memcpy(&bits, &value, sizeof(bits));
+        add_binary_int<int32_t>(sizeof(bits));
+        add_binary_int(bits);
+    }
+
+    void add_binary_value(std::string const &s)
+    {
+        add_binary_int<int32_t>(static_cast<int32_t>(s.size()));
+        m_current->buffer += s;
+    }
+
+    void add_binary_value(char const *s)
+    {
+        auto const len = std::strlen(s);
+        add_binary_int<int32_t>(static_cast<int32_t>(len));
+        m_current->buffer.append(s, len);
+    }
+
+    void add_binary_hash_elem(char const *k, char const *v)
+    {
+        add_binary_value(k);
+        add_binary_value(v);
+        ++m_num_elements;
+    }
+
     template <typename T>
     void add_value(T value)
     {
         m_current->buffer += std::to_string(value);
     }
 
+    void add_value(float value) { add_value(static_cast<double>(value)); }
+
     void add_value(double value)
     {
         util::double_to_buffer tmp{value};
@@ -304,58 +693,34 @@ private:
     void add_value(char const *s)
     {
         assert(m_current);
-        for (char const *c = s; *c; ++c) {
-            switch (*c) {
-            case '"':
-                m_current->buffer += "\\\"";
-                break;
-            case '\\':
-                m_current->buffer += "\\\\";
-                break;
-            case '\n':
-                m_current->buffer += "\\n";
-                break;
-            case '\r':
-                m_current->buffer += "\\r";
-                break;
-            case '\t':
-                m_current->buffer += "\\t";
-                break;
-            default:
-                m_current->buffer += *c;
-                break;
-            }
-        }
+        append_copy_escaped(&m_current->buffer, s, false);
     }
 
     void add_escaped_string(char const *s)
     {
-        for (char const *c = s; *c; ++c) {
-            switch (*c) {
-            case '"':
-                m_current->buffer += "\\\\\"";
-                break;
-            case '\\':
-                m_current->buffer += "\\\\\\\\";
-                break;
-            case '\n':
-                m_current->buffer += "\\n";
-                break;
-            case '\r':
-                m_current->buffer += "\\r";
-                break;
-            case '\t':
-                m_current->buffer += "\\t";
-                break;
-            default:
-                m_current->buffer += *c;
-                break;
-            }
-        }
+        append_copy_escaped(&m_current->buffer, s, true);
     }
 
     std::shared_ptr<db_copy_thread_t> m_processor;
     std::unique_ptr<db_cmd_copy_delete_t<DELETER>> m_current;
+
+    /// Buffer sizes for all targets seen so far.
+    std::vector<buffer_size_t> m_buffer_sizes;
+
+    /// Index of the buffer size for the current buffer in m_buffer_sizes.
+    std::size_t m_size_idx = 0;
+
+    /// Start of the current row in the buffer.
+    std::size_t m_row_start = 0;
+
+    /// Binary format: Number of fields written in the current row.
+    std::size_t m_num_fields = 0;
+
+    /// Binary format: Start of the current array or hash field in the buffer.
+    std::size_t m_field_start = 0;
+
+    /// Binary format: Number of elements in the current array or hash.
+    std::size_t m_num_elements = 0;
 };
 
 #endif // OSM2PGSQL_DB_COPY_MGR_HPP
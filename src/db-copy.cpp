@@ -7,32 +7,66 @@
  * For a full list of authors see the git log.
  */
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <chrono>
 
 #include "db-copy.hpp"
 #include "format.hpp"
 #include "logging.hpp"
 #include "pgsql.hpp"
 
+/**
+ * How long the worker waits for new commands before it tries again to send
+ * data still buffered in libpq.
+ */
+static constexpr std::chrono::milliseconds flush_interval{1};
+
+/**
+ * Finish a list of values in PostgreSQL array syntax by replacing the
+ * final comma with the closing brace.
+ */
+static void finish_array_param(fmt::memory_buffer *buffer)
+{
+    assert(buffer->size() > 1);
+    (*buffer)[buffer->size() - 1] = '}';
+    buffer->push_back('\0');
+}
+
+/**
+ * Delete all rows from the table with an id in the ids array (in PostgreSQL
+ * array syntax). The ids are joined with the table, so the planner can use
+ * a hash join for large numbers of ids.
+ */
+static void delete_by_ids(std::string const &table, std::string const &column,
+                          char const *ids, pg_conn_t *conn)
+{
+    auto const sql = "DELETE FROM {} p USING unnest($1::int8[]) AS t (osm_id)"
+                     " WHERE p.{} = t.osm_id"_format(table, column);
+    conn->exec_params(sql.c_str(), 1, &ids);
+}
+
 void db_deleter_by_id_t::delete_rows(std::string const &table,
                                      std::string const &column, pg_conn_t *conn)
 {
-    fmt::memory_buffer sql;
-    // Each deletable contributes an OSM ID and a comma. The highest node ID
-    // currently has 10 digits, so 15 characters should do for a couple of years.
-    // Add 50 characters for the SQL statement itself.
-    sql.reserve(m_deletables.size() * 15 + 50);
+    assert(!m_deletables.empty());
 
-    fmt::format_to(sql, FMT_STRING("DELETE FROM {} WHERE {} IN ("), table,
-                   column);
+    // The ids are sent as a single array parameter instead of being part of
+    // the SQL command, so PostgreSQL doesn't have to parse and plan a huge
+    // statement. Each deletable contributes an OSM ID and a comma. The
+    // highest node ID currently has 10 digits, so 15 characters should do
+    // for a couple of years.
+    fmt::memory_buffer ids;
+    ids.reserve(m_deletables.size() * 15 + 2);
 
+    ids.push_back('{');
     for (auto id : m_deletables) {
-        format_to(sql, FMT_STRING("{},"), id);
+        format_to(ids, FMT_STRING("{},"), id);
     }
-    sql[sql.size() - 1] = ')';
+    finish_array_param(&ids);
 
-    sql.push_back('\0');
-    conn->exec(sql.data());
+    delete_by_ids(table, column, ids.data(), conn);
 }
 
 void db_deleter_by_type_and_id_t::delete_rows(std::string const &table,
@@ -41,64 +75,132 @@ void db_deleter_by_type_and_id_t::delete_rows(std::string const &table,
 {
     assert(!m_deletables.empty());
 
-    fmt::memory_buffer sql;
-    // Need a VALUES line for each deletable: type (3 bytes), id (15 bytes),
-    // braces etc. (4 bytes). And additional space for the remainder of the
-    // SQL command.
-    sql.reserve(m_deletables.size() * 22 + 200);
-
-    if (m_has_type) {
-        fmt::format_to(sql, "DELETE FROM {} p USING (VALUES ", table);
+    // See db_deleter_by_id_t::delete_rows() for the size of the ids.
+    fmt::memory_buffer ids;
+    ids.reserve(m_deletables.size() * 15 + 2);
 
-        for (auto const &item : m_deletables) {
-            fmt::format_to(sql, FMT_STRING("('{}',{}),"), item.osm_type,
-                           item.osm_id);
-        }
+    ids.push_back('{');
+    for (auto const &item : m_deletables) {
+        format_to(ids, FMT_STRING("{},"), item.osm_id);
+    }
+    finish_array_param(&ids);
 
-        sql.resize(sql.size() - 1);
+    if (!m_has_type) {
+        delete_by_ids(table, column, ids.data(), conn);
+        return;
+    }
 
-        auto const pos = column.find(',');
-        assert(pos != std::string::npos);
-        std::string type = column.substr(0, pos);
+    // Each type is a single character plus a comma.
+    fmt::memory_buffer types;
+    types.reserve(m_deletables.size() * 2 + 2);
 
-        fmt::format_to(sql,
-                       ") AS t (osm_type, osm_id) WHERE"
-                       " p.{} = t.osm_type AND p.{} = t.osm_id",
-                       type, column.c_str() + pos + 1);
-    } else {
-        fmt::format_to(sql, FMT_STRING("DELETE FROM {} WHERE {} IN ("), table,
-                       column);
+    types.push_back('{');
+    for (auto const &item : m_deletables) {
+        types.push_back(item.osm_type);
+        types.push_back(',');
+    }
+    finish_array_param(&types);
+
+    auto const pos = column.find(',');
+    assert(pos != std::string::npos);
+    std::string const type = column.substr(0, pos);
+
+    auto const sql = "DELETE FROM {} p"
+                     " USING unnest($1::char(1)[], $2::int8[])"
+                     " AS t (osm_type, osm_id)"
+                     " WHERE p.{} = t.osm_type AND p.{} = t.osm_id"_format(
+                         table, type, column.c_str() + pos + 1);
+    std::array<char const *, 2> const params{{types.data(), ids.data()}};
+    conn->exec_params(sql.c_str(), params.size(), params.data());
+}
 
-        for (auto const &item : m_deletables) {
-            format_to(sql, FMT_STRING("{},"), item.osm_id);
+std::string db_copy_buffer_pool_t::get(std::size_t capacity)
+{
+    std::string buffer;
+    {
+        std::lock_guard<std::mutex> const lock{m_mutex};
+        if (!m_buffers.empty()) {
+            // Use the smallest buffer that is large enough or, if there is
+            // none, the largest buffer available.
+            auto it = std::min_element(
+                m_buffers.begin(), m_buffers.end(),
+                [capacity](std::string const &a, std::string const &b) {
+                    bool const a_fits = a.capacity() >= capacity;
+                    bool const b_fits = b.capacity() >= capacity;
+                    if (a_fits != b_fits) {
+                        return a_fits;
+                    }
+                    return a_fits ? a.capacity() < b.capacity()
+                                  : a.capacity() > b.capacity();
+                });
+            std::iter_swap(it, m_buffers.end() - 1);
+            buffer = std::move(m_buffers.back());
+            m_buffers.pop_back();
         }
-        sql[sql.size() - 1] = ')';
     }
 
-    sql.push_back('\0');
-    conn->exec(sql.data());
+    buffer.clear();
+    buffer.reserve(capacity);
+    return buffer;
+}
+
+void db_copy_buffer_pool_t::put(std::string &&buffer)
+{
+    buffer.clear();
+
+    std::lock_guard<std::mutex> const lock{m_mutex};
+    if (m_buffers.size() < Max_free_buffers) {
+        m_buffers.push_back(std::move(buffer));
+    }
 }
 
-db_copy_thread_t::db_copy_thread_t(std::string const &conninfo)
+std::size_t db_copy_buffer_pool_t::size() const
 {
+    std::lock_guard<std::mutex> const lock{m_mutex};
+    return m_buffers.size();
+}
+
+db_copy_thread_t::db_copy_thread_t(std::string const &conninfo,
+                                   std::size_t max_streams)
+{
+    assert(max_streams > 0);
+
     // conninfo is captured by copy here, because we don't know wether the
     // reference will still be valid once we get around to running the thread
-    m_worker = std::thread{thread_t{conninfo, m_shared}};
+    m_worker = std::thread{thread_t{conninfo, max_streams, m_shared}};
 }
 
 db_copy_thread_t::~db_copy_thread_t() { finish(); }
 
-void db_copy_thread_t::add_buffer(std::unique_ptr<db_cmd_t> &&buffer)
+/// Number of bytes of COPY data in a command.
+static std::size_t copy_data_size(db_cmd_t const &cmd) noexcept
+{
+    if (cmd.type != db_cmd_t::Cmd_copy) {
+        return 0;
+    }
+    return static_cast<db_cmd_copy_t const &>(cmd).buffer.size();
+}
+
+bool db_copy_thread_t::add_buffer(std::unique_ptr<db_cmd_t> &&buffer)
 {
     assert(m_worker.joinable()); // thread must not have been finished
 
+    auto const size = copy_data_size(*buffer);
+
     std::unique_lock<std::mutex> lock{m_shared.queue_mutex};
-    m_shared.queue_full_cond.wait(lock, [&] {
-        return m_shared.worker_queue.size() < db_cmd_copy_t::Max_buffers;
-    });
+    auto const has_space = [&] {
+        return m_shared.worker_queue.size() < db_cmd_copy_t::Max_buffers &&
+               m_shared.queue_size < db_cmd_copy_t::Max_queue_size;
+    };
+
+    bool const waited = !has_space();
+    m_shared.queue_full_cond.wait(lock, has_space);
 
+    m_shared.queue_size += size;
     m_shared.worker_queue.push_back(std::move(buffer));
     m_shared.queue_cond.notify_one();
+
+    return waited;
 }
 
 void db_copy_thread_t::sync_and_wait()
@@ -117,41 +219,77 @@ void db_copy_thread_t::finish()
     }
 }
 
-db_copy_thread_t::thread_t::thread_t(std::string conninfo, shared &shared)
-: m_conninfo(std::move(conninfo)), m_shared(shared)
+db_copy_thread_t::thread_t::thread_t(std::string conninfo,
+                                     std::size_t max_streams, shared &shared)
+: m_conninfo(std::move(conninfo)), m_max_streams(max_streams),
+  m_shared(shared)
 {}
 
-void db_copy_thread_t::thread_t::operator()()
+std::unique_ptr<pg_conn_t> db_copy_thread_t::thread_t::connect() const
 {
-    try {
-        m_conn = std::make_unique<pg_conn_t>(m_conninfo);
+    auto conn = std::make_unique<pg_conn_t>(m_conninfo);
 
-        // Let commits happen faster by delaying when they actually occur.
-        m_conn->exec("SET synchronous_commit = off");
+    // Let commits happen faster by delaying when they actually occur.
+    conn->exec("SET synchronous_commit = off");
 
-        // Do not show messages about invalid geometries (they are removed
-        // by the trigger).
-        m_conn->exec("SET client_min_messages = WARNING");
+    // Do not show messages about invalid geometries (they are removed
+    // by the trigger).
+    conn->exec("SET client_min_messages = WARNING");
+
+    conn->set_nonblocking();
+
+    return conn;
+}
+
+void db_copy_thread_t::thread_t::operator()()
+{
+    try {
+        // The first connection is opened right away so that connection
+        // problems show up early.
+        m_streams.reserve(m_max_streams);
+        m_streams.emplace_back();
+        m_streams.back().conn = connect();
 
         bool done = false;
         while (!done) {
             std::unique_ptr<db_cmd_t> item;
             {
                 std::unique_lock<std::mutex> lock{m_shared.queue_mutex};
-                m_shared.queue_cond.wait(
-                    lock, [&] { return !m_shared.worker_queue.empty(); });
+                auto const has_work = [&] {
+                    return !m_shared.worker_queue.empty();
+                };
+                // Nothing else to do, so keep sending the buffered data to
+                // the database while waiting for the next command. The
+                // socket is only polled without blocking, so that new
+                // commands are picked up right away.
+                while (!has_work()) {
+                    lock.unlock();
+                    bool const flushed = try_flush_all_streams();
+                    lock.lock();
+                    if (flushed) {
+                        m_shared.queue_cond.wait(lock, has_work);
+                    } else {
+                        m_shared.queue_cond.wait_for(lock, flush_interval,
+                                                     has_work);
+                    }
+                }
 
                 item = std::move(m_shared.worker_queue.front());
                 m_shared.worker_queue.pop_front();
+                m_shared.queue_size -= copy_data_size(*item);
                 m_shared.queue_full_cond.notify_one();
             }
 
             switch (item->type) {
-            case db_cmd_t::Cmd_copy:
-                write_to_db(static_cast<db_cmd_copy_t *>(item.get()));
+            case db_cmd_t::Cmd_copy: {
+                auto *cmd = static_cast<db_cmd_copy_t *>(item.get());
+                write_to_db(cmd);
+                m_shared.buffer_pool.put(std::move(cmd->buffer));
                 break;
+            }
             case db_cmd_t::Cmd_sync:
-                finish_copy();
+                finish_all_copies();
+                log_stats();
                 static_cast<db_cmd_sync_t *>(item.get())->barrier.set_value();
                 break;
             case db_cmd_t::Cmd_finish:
@@ -160,39 +298,83 @@ void db_copy_thread_t::thread_t::operator()()
             }
         }
 
-        finish_copy();
+        finish_all_copies();
 
-        m_conn.reset();
+        m_streams.clear();
     } catch (std::runtime_error const &e) {
         log_error("DB copy thread failed: {}", e.what());
         exit(2);
     }
 }
 
+db_copy_thread_t::thread_t::stream_t &
+db_copy_thread_t::thread_t::get_stream(db_target_descr_t const &target)
+{
+    // Data for a table must always go through the stream which has the
+    // table in flight, otherwise it could overtake earlier data.
+    stream_t *free_stream = nullptr;
+    for (auto &stream : m_streams) {
+        if (!stream.inflight) {
+            if (!free_stream) {
+                free_stream = &stream;
+            }
+        } else if (stream.inflight->same_table(target)) {
+            return stream;
+        }
+    }
+
+    if (free_stream) {
+        return *free_stream;
+    }
+
+    if (m_streams.size() < m_max_streams) {
+        m_streams.emplace_back();
+        m_streams.back().conn = connect();
+        return m_streams.back();
+    }
+
+    auto &stream = *std::min_element(
+        m_streams.begin(), m_streams.end(),
+        [](stream_t const &a, stream_t const &b) {
+            return a.last_used < b.last_used;
+        });
+    finish_copy(&stream);
+    return stream;
+}
+
 void db_copy_thread_t::thread_t::write_to_db(db_cmd_copy_t *buffer)
 {
+    auto &stream = get_stream(*buffer->target);
+    stream.last_used = ++m_buffer_count;
+
     if (buffer->has_deletables() ||
-        (m_inflight && !buffer->target->same_copy_target(*m_inflight))) {
-        finish_copy();
+        (stream.inflight &&
+         !buffer->target->same_copy_target(*stream.inflight))) {
+        finish_copy(&stream);
     }
 
-    buffer->delete_data(m_conn.get());
+    buffer->delete_data(stream.conn.get());
 
-    if (!m_inflight) {
-        start_copy(buffer->target);
+    if (!stream.inflight) {
+        start_copy(&stream, buffer->target);
     }
 
-    m_conn->copy_data(buffer->buffer, buffer->target->name);
+    auto &stats = m_stats[buffer->target->name];
+    auto const start = std::chrono::steady_clock::now();
+    stream.conn->copy_data(buffer->buffer, buffer->target->name);
+    stats.time += std::chrono::steady_clock::now() - start;
+    stats.bytes += buffer->buffer.size();
 }
 
 void db_copy_thread_t::thread_t::start_copy(
-    std::shared_ptr<db_target_descr_t> const &target)
+    stream_t *stream, std::shared_ptr<db_target_descr_t> const &target)
 {
-    assert(!m_inflight);
+    assert(stream);
+    assert(!stream->inflight);
 
     auto const qname = qualified_name(target->schema, target->name);
     fmt::memory_buffer sql;
-    sql.reserve(qname.size() + target->rows.size() + 20);
+    sql.reserve(qname.size() + target->rows.size() + 40);
     if (target->rows.empty()) {
         fmt::format_to(sql, FMT_STRING("COPY {} FROM STDIN"), qname);
     } else {
@@ -200,16 +382,77 @@ void db_copy_thread_t::thread_t::start_copy(
                        target->rows);
     }
 
+    if (target->binary) {
+        fmt::format_to(sql, " WITH (FORMAT binary)");
+    }
+
     sql.push_back('\0');
-    m_conn->query(PGRES_COPY_IN, sql.data());
+    stream->conn->query(PGRES_COPY_IN, sql.data());
+
+    if (target->binary) {
+        // Signature, flags field and length of header extension area.
+        static std::string const header{"PGCOPY\n\377\r\n\0"
+                                        "\0\0\0\0"
+                                        "\0\0\0\0",
+                                        19};
+        stream->conn->copy_data(header, target->name);
+    }
+
+    stream->inflight = target;
+}
+
+void db_copy_thread_t::thread_t::finish_copy(stream_t *stream)
+{
+    assert(stream);
+
+    if (stream->inflight) {
+        auto const start = std::chrono::steady_clock::now();
+        if (stream->inflight->binary) {
+            // File trailer: a tuple field count of -1.
+            static std::string const trailer{"\377\377", 2};
+            stream->conn->copy_data(trailer, stream->inflight->name);
+        }
+        stream->conn->end_copy(stream->inflight->name);
+        m_stats[stream->inflight->name].time +=
+            std::chrono::steady_clock::now() - start;
+        stream->inflight.reset();
+    }
+}
+
+void db_copy_thread_t::thread_t::finish_all_copies()
+{
+    for (auto &stream : m_streams) {
+        finish_copy(&stream);
+    }
+}
 
-    m_inflight = target;
+bool db_copy_thread_t::thread_t::try_flush_all_streams()
+{
+    bool flushed = true;
+    for (auto &stream : m_streams) {
+        // Data is only left in the libpq buffer while a COPY is ongoing.
+        if (stream.inflight) {
+            auto const start = std::chrono::steady_clock::now();
+            if (!stream.conn->try_flush()) {
+                flushed = false;
+            }
+            m_stats[stream.inflight->name].time +=
+                std::chrono::steady_clock::now() - start;
+        }
+    }
+    return flushed;
 }
 
-void db_copy_thread_t::thread_t::finish_copy()
+void db_copy_thread_t::thread_t::log_stats()
 {
-    if (m_inflight) {
-        m_conn->end_copy(m_inflight->name);
-        m_inflight.reset();
+    for (auto const &stat : m_stats) {
+        double const mbytes =
+            static_cast<double>(stat.second.bytes) / (1024.0 * 1024.0);
+        double const seconds =
+            std::chrono::duration<double>(stat.second.time).count();
+        log_debug("COPY into '{}': {:.1f} MB sent in {:.2f}s ({:.1f} MB/s)",
+                  stat.first, mbytes, seconds,
+                  seconds > 0.0 ? mbytes / seconds : 0.0);
     }
+    m_stats.clear();
 }
@@ -10,9 +10,13 @@
  * For a full list of authors see the git log.
  */
 
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <deque>
 #include <future>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -36,14 +40,29 @@ struct db_target_descr_t
     std::string id;
     /// Comma-separated list of rows for copy operation (when empty: all rows)
     std::string rows;
+    /**
+     * Use the binary COPY format instead of the text format. Only possible
+     * if the copy manager knows how to encode all column types of the table.
+     */
+    bool binary = false;
+
+    /**
+     * Check if this is the same table as the other target.
+     */
+    bool same_table(db_target_descr_t const &other) const noexcept
+    {
+        return (this == &other) ||
+               (schema == other.schema && name == other.name);
+    }
 
     /**
      * Check if the buffer would use exactly the same copy operation.
      */
     bool same_copy_target(db_target_descr_t const &other) const noexcept
     {
-        return (this == &other) || (schema == other.schema &&
-                                    name == other.name && rows == other.rows);
+        return (this == &other) ||
+               (schema == other.schema && name == other.name &&
+                rows == other.rows && binary == other.binary);
     }
 
     db_target_descr_t() = default;
@@ -147,26 +166,35 @@ struct db_cmd_copy_t : public db_cmd_t
 {
     enum
     {
-        /** Size of a single buffer with COPY data for Postgresql.
+        /** Maximum size of a single buffer with COPY data for Postgresql.
          *  This is a trade-off between memory usage and sending large chunks
-         *  to speed up processing. Currently a one-size fits all value.
-         *  Needs more testing and individual values per queue.
+         *  to speed up processing. The copy manager starts with smaller
+         *  buffers and adapts the size for each target between Min_buf_size
+         *  and this value, see db_copy_mgr_t.
          */
         Max_buf_size = 10 * 1024 * 1024,
-        /** Maximum length of the queue with COPY data.
+        /// Minimum size of a single buffer with COPY data.
+        Min_buf_size = 256 * 1024,
+        /** Maximum number of bytes in the queue with COPY data.
          *  In the usual case, PostgreSQL should be faster processing the
          *  data than it can be produced and there should only be one element
          *  in the queue. If PostgreSQL is slower, then the queue will always
          *  be full and it is better to keep the queue smaller to reduce memory
          *  usage. Current value is just assumed to be a reasonable trade off.
+         *  Because the limit is on the bytes, more buffers can be queued
+         *  for targets with smaller buffers.
          */
-        Max_buffers = 10
+        Max_queue_size = 10 * Max_buf_size,
+        /// Maximum length of the queue (in number of commands).
+        Max_buffers = 100
     };
 
     /// Name of the target table for the copy operation
     std::shared_ptr<db_target_descr_t> target;
     /// actual copy buffer
     std::string buffer;
+    /// Size from which on the buffer is considered full.
+    std::size_t max_size = Max_buf_size;
 
     virtual bool has_deletables() const noexcept = 0;
     virtual void delete_data(pg_conn_t *conn) = 0;
@@ -176,6 +204,19 @@ struct db_cmd_copy_t : public db_cmd_t
     {
         buffer.reserve(Max_buf_size);
     }
+
+    /**
+     * Create a copy command reusing the memory of an existing (empty)
+     * buffer, usually one from the db_copy_buffer_pool_t.
+     */
+    db_cmd_copy_t(std::shared_ptr<db_target_descr_t> const &t,
+                  std::string &&buf, std::size_t size)
+    : db_cmd_t(db_cmd_t::Cmd_copy), target(t), buffer(std::move(buf)),
+      max_size(size)
+    {
+        buffer.clear();
+        buffer.reserve(max_size);
+    }
 };
 
 template <typename DELETER>
@@ -187,7 +228,7 @@ public:
     /// Return true if the buffer is filled up.
     bool is_full() const noexcept
     {
-        return (buffer.size() > Max_buf_size - 100) || m_deleter.is_full();
+        return (buffer.size() > max_size - 100) || m_deleter.is_full();
     }
 
     bool has_deletables() const noexcept override
@@ -228,13 +269,67 @@ struct db_cmd_finish_t : public db_cmd_t
     db_cmd_finish_t() : db_cmd_t(db_cmd_t::Cmd_finish) {}
 };
 
+/**
+ * A pool of empty copy buffers.
+ *
+ * Buffers are taken from the pool by the copy managers and given back by
+ * the copy thread once their content has been sent to the database. This
+ * way the memory of the buffers is reused instead of being allocated (and
+ * faulted in) again for every new buffer. The pool is thread-safe.
+ */
+class db_copy_buffer_pool_t
+{
+public:
+    enum
+    {
+        /// Maximum number of buffers kept in the pool.
+        Max_free_buffers = 4
+    };
+
+    /**
+     * Get an empty buffer from the pool or a new one if the pool is empty.
+     * The buffer has at least the given capacity.
+     */
+    std::string get(std::size_t capacity);
+
+    /**
+     * Give a buffer back to the pool. It is freed if the pool is full.
+     */
+    void put(std::string &&buffer);
+
+    /// Number of buffers currently in the pool.
+    std::size_t size() const;
+
+private:
+    mutable std::mutex m_mutex;
+    std::vector<std::string> m_buffers;
+};
+
 /**
  * The manager for the worker thread that streams copy data into the database.
+ *
+ * The worker can keep several COPY streams open at the same time, each on
+ * its own database connection. The data for a table always goes to the
+ * stream which has a COPY into this table open, so data for different
+ * tables doesn't interrupt each other's COPY and is processed by several
+ * backends in parallel. If all streams are in use, the COPY on the stream
+ * used least recently is ended and the stream is used for the new table.
+ *
+ * The connections are in non-blocking mode, so that one buffer can be sent
+ * to the database while the next one is taken from the queue. On sync the
+ * COPY throughput for each table (based on the time spent sending data and
+ * ending the COPY) is logged.
  */
 class db_copy_thread_t
 {
 public:
-    explicit db_copy_thread_t(std::string const &conninfo);
+    /**
+     * \param conninfo Connection string for the database.
+     * \param max_streams Maximum number of COPY streams (and database
+     *                    connections) used at the same time.
+     */
+    explicit db_copy_thread_t(std::string const &conninfo,
+                              std::size_t max_streams = 1);
 
     db_copy_thread_t(db_copy_thread_t const &) = delete;
     db_copy_thread_t &operator=(db_copy_thread_t const &) = delete;
@@ -246,8 +341,21 @@ public:
 
     /**
      * Add another command for the worker.
+     *
+     * \returns true if the queue was full and the caller had to wait,
+     *          i.e. the database is slower than the data is produced.
      */
-    void add_buffer(std::unique_ptr<db_cmd_t> &&buffer);
+    bool add_buffer(std::unique_ptr<db_cmd_t> &&buffer);
+
+    /**
+     * Get an empty buffer with at least the given capacity for COPY data.
+     * Buffers are given back to the pool after they have been sent to the
+     * database.
+     */
+    std::string get_buffer(std::size_t capacity)
+    {
+        return m_shared.buffer_pool.get(capacity);
+    }
 
     /**
      * Send sync command and wait for the notification.
@@ -269,27 +377,67 @@ private:
         std::condition_variable queue_cond;
         std::condition_variable queue_full_cond;
         std::deque<std::unique_ptr<db_cmd_t>> worker_queue;
+
+        /// Number of bytes of COPY data in the worker queue.
+        std::size_t queue_size = 0;
+
+        db_copy_buffer_pool_t buffer_pool;
     };
 
     // This is the class that actually instantiated and run in the thread.
     class thread_t
     {
     public:
-        thread_t(std::string conninfo, shared &shared);
+        thread_t(std::string conninfo, std::size_t max_streams,
+                 shared &shared);
 
         void operator()();
 
     private:
+        /// A database connection with (possibly) an ongoing COPY.
+        struct stream_t
+        {
+            std::unique_ptr<pg_conn_t> conn;
+
+            // Target for copy operation currently ongoing.
+            std::shared_ptr<db_target_descr_t> inflight;
+
+            // Sequence number of the last buffer written to this stream.
+            std::uint64_t last_used = 0;
+        };
+
+        /**
+         * Amount of data copied into a table and the time spent sending it
+         * to the database and ending the COPY. The time waiting for new
+         * data is not included.
+         */
+        struct copy_stats_t
+        {
+            std::size_t bytes = 0;
+            std::chrono::steady_clock::duration time{};
+        };
+
+        std::unique_ptr<pg_conn_t> connect() const;
+        stream_t &get_stream(db_target_descr_t const &target);
+
         void write_to_db(db_cmd_copy_t *buffer);
-        void start_copy(std::shared_ptr<db_target_descr_t> const &target);
-        void finish_copy();
-        void delete_rows(db_cmd_copy_t *buffer);
+        void start_copy(stream_t *stream,
+                        std::shared_ptr<db_target_descr_t> const &target);
+        void finish_copy(stream_t *stream);
+        void finish_all_copies();
+        bool try_flush_all_streams();
+        void log_stats();
 
         std::string m_conninfo;
-        std::unique_ptr<pg_conn_t> m_conn;
+        std::size_t m_max_streams;
+        std::vector<stream_t> m_streams;
+
+        // Number of buffers written, used for finding the stream used
+        // least recently.
+        std::uint64_t m_buffer_count = 0;
 
-        // Target for copy operation currently ongoing.
-        std::shared_ptr<db_target_descr_t> m_inflight;
+        // COPY statistics for each table since the last sync.
+        std::map<std::string, copy_stats_t> m_stats;
 
         // These are shared with the db_copy_thread_t in the main program.
         shared &m_shared;
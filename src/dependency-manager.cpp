@@ -8,36 +8,58 @@
  */
 
 #include "dependency-manager.hpp"
+#include "logging.hpp"
 #include "middle.hpp"
+#include "util.hpp"
 
 #include <algorithm>
 #include <iterator>
 
 void full_dependency_manager_t::node_changed(osmid_t id)
 {
-    for (auto const way_id : m_object_store->get_ways_by_node(id)) {
-        way_changed(way_id);
-        m_ways_pending_tracker.set(way_id);
-    }
-
-    for (auto const rel_id : m_object_store->get_rels_by_node(id)) {
-        m_rels_pending_tracker.set(rel_id);
-    }
+    m_changed_nodes.set(id);
 }
 
 void full_dependency_manager_t::way_changed(osmid_t id)
 {
-    if (m_ways_pending_tracker.get(id)) {
+    m_changed_ways.set(id);
+}
+
+void full_dependency_manager_t::resolve_changed()
+{
+    if (m_changed_nodes.empty() && m_changed_ways.empty()) {
         return;
     }
 
-    for (auto const rel_id : m_object_store->get_rels_by_way(id)) {
+    util::timer_t timer;
+
+    auto const node_ids = get_ids(m_changed_nodes);
+    if (!node_ids.empty()) {
+        // Ways containing changed nodes have changed themselves, so their
+        // parent relations have to be looked up, too.
+        for (auto const way_id : m_object_store->get_ways_by_nodes(node_ids)) {
+            m_ways_pending_tracker.set(way_id);
+            m_changed_ways.set(way_id);
+        }
+
+        for (auto const rel_id : m_object_store->get_rels_by_nodes(node_ids)) {
+            m_rels_pending_tracker.set(rel_id);
+        }
+    }
+
+    auto const way_ids = get_ids(m_changed_ways);
+    for (auto const rel_id : m_object_store->get_rels_by_ways(way_ids)) {
         m_rels_pending_tracker.set(rel_id);
     }
+
+    log_debug("Looking up parents of {} nodes and {} ways took {}",
+              node_ids.size(), way_ids.size(),
+              util::human_readable_duration(timer.stop()));
 }
 
-bool full_dependency_manager_t::has_pending() const noexcept
+bool full_dependency_manager_t::has_pending()
 {
+    resolve_changed();
     return !m_ways_pending_tracker.empty() || !m_rels_pending_tracker.empty();
 }
 
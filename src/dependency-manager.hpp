@@ -52,8 +52,12 @@ public:
      */
     virtual void way_changed(osmid_t) {}
 
-    /// Are there pending objects that need to be processed?
-    virtual bool has_pending() const noexcept { return false; }
+    /**
+     * Are there pending objects that need to be processed? This will
+     * first look up the parents of all objects marked as changed since
+     * the last call.
+     */
+    virtual bool has_pending() { return false; }
 
     /**
      * Get the list of pending way ids. After calling this, the internal
@@ -73,7 +77,9 @@ public:
  * between OSM objects, that is nodes in ways and members of relations.
  *
  * Whenever an OSM object changes, this class is notified and remembers
- * the ids for later use.
+ * the ids for later use. The ways and relations depending on the changed
+ * objects are looked up in bulk from the middle when they are needed,
+ * because looking them up one by one is much slower.
  */
 class full_dependency_manager_t : public dependency_manager_t
 {
@@ -95,23 +101,34 @@ public:
     void node_changed(osmid_t id) override;
     void way_changed(osmid_t id) override;
 
-    bool has_pending() const noexcept override;
+    bool has_pending() override;
 
     idlist_t get_pending_way_ids() override
     {
+        resolve_changed();
         return get_ids(m_ways_pending_tracker);
     }
 
     idlist_t get_pending_relation_ids() override
     {
+        resolve_changed();
         return get_ids(m_rels_pending_tracker);
     }
 
 private:
     static idlist_t get_ids(osmium::index::IdSetSmall<osmid_t> &tracker);
 
+    /**
+     * Look up the parents of all changed nodes and ways and add them to
+     * the pending ways and relations.
+     */
+    void resolve_changed();
+
     std::shared_ptr<middle_t> m_object_store;
 
+    osmium::index::IdSetSmall<osmid_t> m_changed_nodes;
+    osmium::index::IdSetSmall<osmid_t> m_changed_ways;
+
     osmium::index::IdSetSmall<osmid_t> m_ways_pending_tracker;
     osmium::index::IdSetSmall<osmid_t> m_rels_pending_tracker;
 };
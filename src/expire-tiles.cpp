@@ -15,10 +15,12 @@
  * http://subversion.nexusuk.org/projects/openpistemap/trunk/scripts/expire_tiles.py
  */
 
+#include <algorithm>
 #include <cerrno>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <iterator>
 #include <string>
 
 #include "expire-tiles.hpp"
@@ -35,6 +37,10 @@
 // How many tiles worth of space to leave either side of a changed feature
 #define TILE_EXPIRY_LEEWAY 0.1
 
+// Minimum number of new tiles collected before they are sorted and merged
+// into the list of dirty tiles
+static constexpr std::size_t const min_unsorted_tiles = 1024UL * 1024UL;
+
 tile_output_t::tile_output_t(char const *filename)
 : outfile(fopen(filename, "a"))
 {
@@ -110,12 +116,37 @@ void expire_tiles::expire_tile(uint32_t x, uint32_t y)
     // Only try to insert to tile into the set if the last inserted tile
     // is different from this tile.
     if (last_tile_x != x || last_tile_y != y) {
-        m_dirty_tiles.insert(xy_to_quadkey(x, y, maxzoom));
+        m_dirty_tiles.push_back(xy_to_quadkey(x, y, maxzoom));
         last_tile_x = x;
         last_tile_y = y;
+
+        // Merge new tiles once there are as many of them as sorted ones,
+        // so the list never gets much larger than twice the number of
+        // distinct tiles.
+        if (m_dirty_tiles.size() - m_num_sorted >=
+            std::max(m_num_sorted, min_unsorted_tiles)) {
+            compact_dirty_tiles();
+        }
     }
 }
 
+void expire_tiles::compact_dirty_tiles()
+{
+    if (m_num_sorted == m_dirty_tiles.size()) {
+        return;
+    }
+
+    auto const middle = m_dirty_tiles.begin() +
+                        static_cast<std::ptrdiff_t>(m_num_sorted);
+    std::sort(middle, m_dirty_tiles.end());
+    std::inplace_merge(m_dirty_tiles.begin(), middle, m_dirty_tiles.end());
+    m_dirty_tiles.erase(
+        std::unique(m_dirty_tiles.begin(), m_dirty_tiles.end()),
+        m_dirty_tiles.end());
+
+    m_num_sorted = m_dirty_tiles.size();
+}
+
 uint32_t expire_tiles::normalise_tile_x_coord(int x) const
 {
     x %= map_width;
@@ -412,12 +443,24 @@ void expire_tiles::merge_and_destroy(expire_tiles &other)
                                      tile_width, other.tile_width)};
     }
 
+    other.compact_dirty_tiles();
+
     if (m_dirty_tiles.empty()) {
         m_dirty_tiles = std::move(other.m_dirty_tiles);
+        m_num_sorted = other.m_num_sorted;
     } else {
-        m_dirty_tiles.insert(other.m_dirty_tiles.begin(),
-                             other.m_dirty_tiles.end());
+        compact_dirty_tiles();
+
+        std::vector<uint64_t> merged;
+        merged.reserve(m_dirty_tiles.size() + other.m_dirty_tiles.size());
+        std::set_union(m_dirty_tiles.begin(), m_dirty_tiles.end(),
+                       other.m_dirty_tiles.begin(), other.m_dirty_tiles.end(),
+                       std::back_inserter(merged));
+        m_dirty_tiles = std::move(merged);
+        m_num_sorted = m_dirty_tiles.size();
     }
 
     other.m_dirty_tiles.clear();
+    other.m_dirty_tiles.shrink_to_fit();
+    other.m_num_sorted = 0;
 }
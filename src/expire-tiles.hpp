@@ -10,8 +10,10 @@
  * For a full list of authors see the git log.
  */
 
+#include <algorithm>
+#include <cstddef>
 #include <memory>
-#include <unordered_set>
+#include <vector>
 
 #include "logging.hpp"
 #include "osmtypes.hpp"
@@ -103,10 +105,8 @@ struct expire_tiles
     void output_and_destroy(TILE_WRITER &output_writer, uint32_t minzoom)
     {
         assert(minzoom <= maxzoom);
-        // build a sorted vector of all expired tiles
-        std::vector<uint64_t> tiles_maxzoom(m_dirty_tiles.begin(),
-                                            m_dirty_tiles.end());
-        std::sort(tiles_maxzoom.begin(), tiles_maxzoom.end());
+        // make sure all expired tiles are sorted and unique
+        compact_dirty_tiles();
         /* Loop over all requested zoom levels (from maximum down to the minimum zoom level).
          * Tile IDs of the tiles enclosing this tile at lower zoom levels are calculated using
          * bit shifts.
@@ -115,7 +115,7 @@ struct expire_tiles
          * (larger than largest possible quadkey). */
         uint64_t last_quadkey = 1ULL << (2 * maxzoom);
         std::size_t count = 0;
-        for (auto const quadkey : tiles_maxzoom) {
+        for (auto const quadkey : m_dirty_tiles) {
             for (uint32_t dz = 0; dz <= maxzoom - minzoom; ++dz) {
                 // scale down to the current zoom level
                 uint64_t qt_current = quadkey >> (dz * 2);
@@ -133,6 +133,10 @@ struct expire_tiles
             last_quadkey = quadkey;
         }
         log_info("Wrote {} entries to expired tiles list", count);
+
+        m_dirty_tiles.clear();
+        m_dirty_tiles.shrink_to_fit();
+        m_num_sorted = 0;
     }
 
     /**
@@ -178,6 +182,13 @@ private:
      * \param y y index of the tile to be expired.
      */
     void expire_tile(uint32_t x, uint32_t y);
+
+    /**
+     * Sort the tiles added since the last call and merge them into the
+     * sorted part of m_dirty_tiles removing duplicates.
+     */
+    void compact_dirty_tiles();
+
     uint32_t normalise_tile_x_coord(int x) const;
     void from_line(double lon_a, double lat_a, double lon_b, double lat_b);
 
@@ -192,19 +203,19 @@ private:
     std::shared_ptr<reprojection> projection;
 
     /**
-     * x coordinate of the tile which has been added as last tile to the unordered set
+     * x coordinate of the tile which has been added as last tile to the list
      */
     uint32_t last_tile_x;
 
     /**
-     * y coordinate of the tile which has been added as last tile to the unordered set
+     * y coordinate of the tile which has been added as last tile to the list
      */
     uint32_t last_tile_y;
 
     /**
      * manages which tiles have been marked as empty
      *
-     * This set stores the IDs of the tiles at the maximum zoom level. We don't
+     * This list stores the IDs of the tiles at the maximum zoom level. We don't
      * store the IDs of the expired tiles of lower zoom levels. They are calculated
      * on the fly at the end.
      *
@@ -219,8 +230,15 @@ private:
      *
      * Bing Maps itself uses the quadkeys as a base-4 number converted to a string.
      * We interpret this IDs as simple 64-bit integers due to performance reasons.
+     *
+     * New IDs are appended to the list. The first m_num_sorted entries are
+     * sorted and unique, the rest is merged into them in batches by
+     * compact_dirty_tiles().
      */
-    std::unordered_set<uint64_t> m_dirty_tiles;
+    std::vector<uint64_t> m_dirty_tiles;
+
+    /// Number of entries at the beginning of m_dirty_tiles which are sorted.
+    std::size_t m_num_sorted = 0;
 };
 
 #endif // OSM2PGSQL_EXPIRE_TILES_HPP
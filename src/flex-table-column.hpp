@@ -102,6 +102,9 @@ public:
 
     bool create_only() const noexcept { return m_create_only; }
 
+    /// Has the user set the SQL type of this column explicitly?
+    bool has_sql_type() const noexcept { return !m_sql_type.empty(); }
+
     void set_not_null(bool value = true) noexcept { m_not_null = value; }
 
     void set_create_only(bool value = true) noexcept { m_create_only = value; }
@@ -13,6 +13,7 @@
 #include "pgsql-helper.hpp"
 #include "util.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <string>
 
@@ -145,6 +146,15 @@ std::string flex_table_t::build_sql_column_list() const
     return result;
 }
 
+bool flex_table_t::can_use_binary_copy() const noexcept
+{
+    return std::none_of(m_columns.cbegin(), m_columns.cend(),
+                        [](flex_table_column_t const &column) {
+                            return !column.create_only() &&
+                                   column.has_sql_type();
+                        });
+}
+
 std::string flex_table_t::build_sql_create_id_index() const
 {
     return "CREATE INDEX ON {} USING BTREE ({}) {}"_format(
@@ -155,6 +165,7 @@ void table_connection_t::connect(std::string const &conninfo)
 {
     assert(!m_db_connection);
 
+    m_conninfo = conninfo;
     m_db_connection = std::make_unique<pg_conn_t>(conninfo);
     m_db_connection->exec("SET synchronous_commit = off");
 }
@@ -176,9 +187,12 @@ void table_connection_t::start(bool append)
     m_db_connection->exec("RESET client_min_messages");
 
     if (!append) {
+        // If the rows are sorted on the client side, the table is not
+        // rewritten at the end, so it is created as permanent table.
+        bool const interim = table().cluster_by_geom() && !table().sorter();
         m_db_connection->exec(table().build_sql_create_table(
-            table().cluster_by_geom() ? flex_table_t::table_type::interim
-                                      : flex_table_t::table_type::permanent,
+            interim ? flex_table_t::table_type::interim
+                    : flex_table_t::table_type::permanent,
             table().full_name()));
 
         if (table().has_geom_column() &&
@@ -203,7 +217,24 @@ void table_connection_t::stop(bool updateable, bool append)
         return;
     }
 
-    if (table().cluster_by_geom()) {
+    if (table().sorter()) {
+        log_info("Writing {} rows to table '{}' sorted by geometry...",
+                 table().sorter()->size(), table().name());
+
+        // Use a separate connection, so that the tables can be loaded in
+        // parallel.
+        auto const copy_thread =
+            std::make_shared<db_copy_thread_t>(m_conninfo);
+        db_copy_mgr_t<db_deleter_by_type_and_id_t> copy{copy_thread};
+        copy.add_sorted_lines(m_target, table().sorter());
+        copy.sync();
+        copy_thread->finish();
+
+        if (!updateable && table().geom_column().needs_isvalid()) {
+            drop_geom_check_trigger(m_db_connection.get(), table().schema(),
+                                    table().name());
+        }
+    } else if (table().cluster_by_geom()) {
         if (table().geom_column().needs_isvalid()) {
             drop_geom_check_trigger(m_db_connection.get(), table().schema(),
                                     table().name());
@@ -311,13 +342,35 @@ pg_result_t table_connection_t::get_geom_by_id(osmium::item_type type,
     return m_db_connection->exec_prepared("get_wkb", id_str);
 }
 
-void table_connection_t::delete_rows_with(osmium::item_type type, osmid_t id)
+void table_connection_t::finish_line(osmium::item_type type, osmid_t id,
+                                     std::string const &geom)
 {
-    m_copy_mgr.new_line(m_target);
+    auto *const sorter = table().sorter();
+    if (!sorter) {
+        m_copy_mgr.finish_line();
+        return;
+    }
 
     if (!table().has_multicolumn_id_index()) {
         type = osmium::item_type::undefined;
     }
+    m_copy_mgr.finish_sorted_line(sorter, geom, type_to_char(type)[0], id);
+}
+
+void table_connection_t::delete_rows_with(osmium::item_type type, osmid_t id)
+{
+    if (!table().has_multicolumn_id_index()) {
+        type = osmium::item_type::undefined;
+    }
+
+    // In create mode all rows of a table clustered on the client side are
+    // still in the sorter.
+    if (auto *const sorter = table().sorter()) {
+        sorter->remove(type_to_char(type)[0], id);
+        return;
+    }
+
+    m_copy_mgr.new_line(m_target);
     m_copy_mgr.delete_object(type_to_char(type)[0], id);
 }
 
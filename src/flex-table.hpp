@@ -14,6 +14,7 @@
 #include "flex-table-column.hpp"
 #include "osmium-builder.hpp"
 #include "pgsql.hpp"
+#include "row-sorter.hpp"
 #include "thread-pool.hpp"
 
 #include <osmium/osm/item_type.hpp>
@@ -80,6 +81,17 @@ public:
         m_index_tablespace = tablespace;
     }
 
+    /**
+     * The sorter for the rows of this table if the table is clustered on
+     * the client side, nullptr otherwise.
+     */
+    row_sorter_t *sorter() const noexcept { return m_sorter.get(); }
+
+    void set_sorter(std::shared_ptr<row_sorter_t> sorter) noexcept
+    {
+        m_sorter = std::move(sorter);
+    }
+
     osmium::item_type id_type() const noexcept { return m_id_type; }
 
     void set_id_type(osmium::item_type type) noexcept { m_id_type = type; }
@@ -129,6 +141,13 @@ public:
 
     std::string build_sql_column_list() const;
 
+    /**
+     * Can the data for this table be sent using the binary COPY format?
+     * This is the case if we know the exact database types of all columns,
+     * ie. if no column has a user-defined SQL type.
+     */
+    bool can_use_binary_copy() const noexcept;
+
     std::string build_sql_create_id_index() const;
 
     /// Does this table take objects of the specified type?
@@ -225,6 +244,12 @@ private:
     /// Cluster the table by geometry.
     bool m_cluster_by_geom = true;
 
+    /**
+     * Sorter used for clustering on the client side. Shared between all
+     * threads writing to this table.
+     */
+    std::shared_ptr<row_sorter_t> m_sorter;
+
 }; // class flex_table_t
 
 class table_connection_t
@@ -239,6 +264,7 @@ public:
       m_copy_mgr(copy_thread), m_db_connection(nullptr)
     {
         m_target->schema = table->schema();
+        m_target->binary = table->can_use_binary_copy();
     }
 
     void connect(std::string const &conninfo);
@@ -261,6 +287,13 @@ public:
 
     void new_line() { m_copy_mgr.new_line(m_target); }
 
+    /**
+     * Finish the current row. If the table is clustered on the client side
+     * the row is handed to the sorter of the table.
+     */
+    void finish_line(osmium::item_type type, osmid_t id,
+                     std::string const &geom);
+
     db_copy_mgr_t<db_deleter_by_type_and_id_t> *copy_mgr() noexcept
     {
         return &m_copy_mgr;
@@ -290,6 +323,8 @@ private:
      */
     db_copy_mgr_t<db_deleter_by_type_and_id_t> m_copy_mgr;
 
+    std::string m_conninfo;
+
     /// The connection to the database server.
     std::unique_ptr<pg_conn_t> m_db_connection;
 
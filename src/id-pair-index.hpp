@@ -0,0 +1,158 @@
+#ifndef OSM2PGSQL_ID_PAIR_INDEX_HPP
+#define OSM2PGSQL_ID_PAIR_INDEX_HPP
+
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+#include "osmtypes.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <limits>
+#include <unordered_map>
+#include <utility>
+
+/// An entry in an id_pair_index_t.
+struct id_pair_t
+{
+    osmid_t id;
+    osmid_t ref_id;
+
+    friend bool operator==(id_pair_t a, id_pair_t b) noexcept
+    {
+        return a.id == b.id && a.ref_id == b.ref_id;
+    }
+
+    friend bool operator<(id_pair_t a, id_pair_t b) noexcept
+    {
+        return std::make_pair(a.id, a.ref_id) < std::make_pair(b.id, b.ref_id);
+    }
+};
+
+/**
+ * Index from OSM ids to the ids of other objects referencing them, for
+ * instance from node ids to the ids of the ways containing those nodes.
+ * The pairs are kept in a vector-like container of id_pair_t, which can be
+ * a std::vector or one of the memory-mapped vectors from osmium.
+ *
+ * On import pairs are appended to the vector and sorted in merge(). Once
+ * the index is in use for lookups new pairs are kept in a hash map until
+ * the next merge().
+ *
+ * Single pairs are never removed from the index, so results can contain
+ * objects which don't reference the id any more and have to be checked by
+ * the caller. The index can be rebuilt after clear().
+ */
+template <typename TVector>
+class id_pair_index_t
+{
+public:
+    /**
+     * Create the index. If use_overlay is true, the pairs already in the
+     * vector constructed from args must be sorted and the index can be used
+     * for lookups immediately.
+     */
+    template <typename... TArgs>
+    explicit id_pair_index_t(bool use_overlay, TArgs &&... args)
+    : m_data(std::forward<TArgs>(args)...), m_num_sorted(m_data.size()),
+      m_use_overlay(use_overlay)
+    {}
+
+    void add(osmid_t id, osmid_t ref_id)
+    {
+        if (m_use_overlay) {
+            m_changes.emplace(id, ref_id);
+        } else {
+            m_data.push_back(id_pair_t{id, ref_id});
+        }
+    }
+
+    /// Append all ids referencing the id to the result.
+    void get(osmid_t id, idlist_t *result) const
+    {
+        assert(result);
+
+        auto const end = m_data.cbegin() + m_num_sorted;
+        for (auto it = std::lower_bound(
+                 m_data.cbegin(), end,
+                 id_pair_t{id, std::numeric_limits<osmid_t>::min()});
+             it != end && it->id == id; ++it) {
+            result->push_back(it->ref_id);
+        }
+
+        auto const range = m_changes.equal_range(id);
+        for (auto it = range.first; it != range.second; ++it) {
+            result->push_back(it->second);
+        }
+    }
+
+    /// Sort the index and merge all changes into it.
+    void merge()
+    {
+        for (auto const &change : m_changes) {
+            m_data.push_back(id_pair_t{change.first, change.second});
+        }
+        m_changes.clear();
+
+        if (m_num_sorted != m_data.size()) {
+            auto const middle = m_data.begin() + m_num_sorted;
+            std::sort(middle, m_data.end());
+            std::inplace_merge(m_data.begin(), middle, m_data.end());
+            erase_tail(std::unique(m_data.begin(), m_data.end()));
+            m_num_sorted = m_data.size();
+        }
+
+        m_use_overlay = true;
+    }
+
+    /// Remove all pairs. New pairs are added as on import.
+    void clear()
+    {
+        m_changes.clear();
+        erase_tail(m_data.begin());
+        m_num_sorted = 0;
+        m_use_overlay = false;
+    }
+
+    std::size_t size() const noexcept
+    {
+        return m_data.size() + m_changes.size();
+    }
+
+private:
+    /**
+     * Remove all entries from first to the end of the vector. The space
+     * they used is cleared, so that it is detected as unused when the
+     * vector is backed by a file which is opened again.
+     */
+    template <typename IT>
+    void erase_tail(IT first)
+    {
+        std::fill(first, m_data.end(), id_pair_t{});
+        m_data.resize(static_cast<std::size_t>(first - m_data.begin()));
+    }
+
+    TVector m_data;
+
+    /// Number of entries at the beginning of m_data which are sorted.
+    std::size_t m_num_sorted;
+
+    /// Pairs added while the index is in use for lookups.
+    std::unordered_multimap<osmid_t, osmid_t> m_changes;
+
+    /**
+     * New pairs go into m_changes if the index can be used for lookups,
+     * ie. when updating or after merge() was called. When importing they
+     * are appended to m_data and sorted in merge().
+     */
+    bool m_use_overlay;
+};
+
+#endif // OSM2PGSQL_ID_PAIR_INDEX_HPP
@@ -7,12 +7,17 @@
  * For a full list of authors see the git log.
  */
 
+#include <deque>
+#include <exception>
+#include <future>
 #include <memory>
-#include <queue>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
 #include <osmium/io/any_input.hpp>
+#include <osmium/osm/box.hpp>
+#include <osmium/thread/pool.hpp>
 #include <osmium/visitor.hpp>
 
 #include "format.hpp"
@@ -61,18 +66,270 @@ type_id check_input(type_id const &last, osmium::OSMObject const &object)
     return check_input(last, {object.type(), object.id()});
 }
 
+namespace {
+
 /**
- * A data source is where we get the OSM objects from, one at a time. It
- * wraps the osmium::io::Reader.
+ * Check whether a node should be imported. Nodes with invalid locations and,
+ * if a bounding box is set, nodes outside the bounding box are ignored.
+ */
+bool node_wanted(osmium::Node const &node, osmium::Box const &bbox)
+{
+    if (!node.visible()) {
+        return true;
+    }
+
+    if (!node.location().valid()) {
+        return false;
+    }
+
+    return !bbox.valid() || bbox.contains(node.location());
+}
+
+} // anonymous namespace
+
+/**
+ * Reads buffers from an input file and prepares them for processing: The
+ * order of the objects is checked and nodes which should not be imported
+ * are marked as removed. Preparing the buffers happens in the libosmium
+ * thread pool, several buffers ahead of the one currently processed, so
+ * that the main thread only has to hand the objects over to osmdata_t.
+ * This is also where prefetching of way node locations is triggered.
+ *
+ * Nodes with invalid locations are only counted in the thread pool, the
+ * warning about them is logged from the main thread when the buffer is
+ * taken from the pipeline, so the log stays in input order.
+ */
+class buffer_pipeline_t
+{
+public:
+    buffer_pipeline_t(osmium::io::File const &file, osmdata_t const *osmdata)
+    : m_reader(std::make_unique<osmium::io::Reader>(file)),
+      m_osmdata(osmdata), m_bbox(osmdata->bbox())
+    {
+        fill();
+    }
+
+    buffer_pipeline_t(buffer_pipeline_t const &) = delete;
+    buffer_pipeline_t &operator=(buffer_pipeline_t const &) = delete;
+
+    buffer_pipeline_t(buffer_pipeline_t &&) = delete;
+    buffer_pipeline_t &operator=(buffer_pipeline_t &&) = delete;
+
+    ~buffer_pipeline_t() noexcept
+    {
+        // Buffers still being prepared use osmdata_t, wait for them.
+        for (auto &future : m_queue) {
+            future.wait();
+        }
+    }
+
+    /**
+     * Get the next prepared buffer. Returns an invalid buffer at the end
+     * of the input.
+     *
+     * \throws std::runtime_error if the input data is not ordered.
+     */
+    osmium::memory::Buffer next()
+    {
+        if (m_queue.empty()) {
+            return osmium::memory::Buffer{};
+        }
+
+        auto result = m_queue.front().get();
+        m_queue.pop_front();
+        fill();
+
+        if (result.has_objects) {
+            m_last = check_input(m_last, result.first);
+        }
+
+        if (result.error) {
+            std::rethrow_exception(result.error);
+        }
+
+        if (result.has_objects) {
+            m_last = result.last;
+        }
+
+        if (result.invalid_nodes == 1) {
+            log_warn("Ignored node {} (version {}) with invalid location.",
+                     result.first_invalid_node_id,
+                     result.first_invalid_node_version);
+        } else if (result.invalid_nodes > 1) {
+            log_warn("Ignored {} nodes with invalid location, the first one "
+                     "was node {} (version {}).",
+                     result.invalid_nodes, result.first_invalid_node_id,
+                     result.first_invalid_node_version);
+        }
+
+        return std::move(result.buffer);
+    }
+
+    /**
+     * Type and id of the last object in the last buffer returned from
+     * next(). Only valid if that buffer contained any objects.
+     */
+    type_id const &last() const noexcept { return m_last; }
+
+    void close()
+    {
+        // Wait for buffers still being prepared before closing the reader.
+        for (auto &future : m_queue) {
+            future.wait();
+        }
+        m_queue.clear();
+        m_reader->close();
+    }
+
+private:
+    /// Number of buffers that are prepared ahead.
+    static constexpr std::size_t const max_queued_buffers = 8;
+
+    struct prepared_buffer_t
+    {
+        osmium::memory::Buffer buffer;
+        bool has_objects = false;
+        type_id first{osmium::item_type::node, 0};
+        type_id last{osmium::item_type::node, 0};
+        std::exception_ptr error;
+
+        /// Number of nodes in the buffer ignored because of invalid location.
+        std::size_t invalid_nodes = 0;
+        osmid_t first_invalid_node_id = 0;
+        osmium::object_version_type first_invalid_node_version = 0;
+    };
+
+    static prepared_buffer_t prepare(osmium::memory::Buffer buffer,
+                                     osmium::Box const &bbox,
+                                     osmdata_t const *osmdata)
+    {
+        prepared_buffer_t result;
+
+        auto const objects = buffer.select<osmium::OSMObject>();
+        auto it = objects.begin();
+        if (it != objects.end()) {
+            // The first object is checked against the last object of the
+            // previous buffer when the buffer is taken from the queue.
+            result.has_objects = true;
+            result.first = {it->type(), it->id()};
+            result.last = result.first;
+            try {
+                for (++it; it != objects.end(); ++it) {
+                    result.last = check_input(result.last, *it);
+                }
+            } catch (...) {
+                result.error = std::current_exception();
+                return result;
+            }
+        }
+
+        for (auto &node : buffer.select<osmium::Node>()) {
+            if (!node_wanted(node, bbox)) {
+                node.set_removed(true);
+                if (!node.location().valid()) {
+                    if (result.invalid_nodes == 0) {
+                        result.first_invalid_node_id = node.id();
+                        result.first_invalid_node_version = node.version();
+                    }
+                    ++result.invalid_nodes;
+                }
+            }
+        }
+
+        // Objects are ordered, so this checks whether there are any ways.
+        if (result.has_objects &&
+            result.first.type <= osmium::item_type::way &&
+            result.last.type >= osmium::item_type::way) {
+            osmdata->prefetch(buffer);
+        }
+
+        result.buffer = std::move(buffer);
+        return result;
+    }
+
+    void fill()
+    {
+        while (!m_eof && m_queue.size() < max_queued_buffers) {
+            auto buffer = m_reader->read();
+            if (!buffer) {
+                m_eof = true;
+                return;
+            }
+
+            // The pipeline might be destroyed while this task is still
+            // running, so the bounding box is copied.
+            m_queue.push_back(osmium::thread::Pool::default_instance().submit(
+                [b = std::move(buffer), bbox = m_bbox,
+                 osmdata = m_osmdata]() mutable {
+                    return prepare(std::move(b), bbox, osmdata);
+                }));
+        }
+    }
+
+    std::unique_ptr<osmium::io::Reader> m_reader;
+    std::deque<std::future<prepared_buffer_t>> m_queue;
+    osmdata_t const *m_osmdata;
+    osmium::Box m_bbox;
+    type_id m_last{osmium::item_type::node, 0};
+    bool m_eof = false;
+
+}; // class buffer_pipeline_t
+
+/**
+ * The part of an OSM object relevant for ordering objects from different
+ * input files. Comparison is the same as for osmium::OSMObject (for
+ * objects with positive ids), but it is cheaper, because the data doesn't
+ * have to be fetched from the object every time.
+ */
+struct merge_key_t
+{
+    osmium::item_type type = osmium::item_type::undefined;
+    osmid_t id = 0;
+    osmium::object_version_type version = 0;
+    osmium::Timestamp timestamp{};
+
+    merge_key_t() = default;
+
+    explicit merge_key_t(osmium::OSMObject const &object) noexcept
+    : type(object.type()), id(object.id()), version(object.version()),
+      timestamp(object.timestamp())
+    {}
+
+    bool same_object(merge_key_t const &other) const noexcept
+    {
+        return type == other.type && id == other.id;
+    }
+
+    friend bool operator<(merge_key_t const &lhs,
+                          merge_key_t const &rhs) noexcept
+    {
+        if (lhs.type != rhs.type) {
+            return lhs.type < rhs.type;
+        }
+        if (lhs.id != rhs.id) {
+            return lhs.id < rhs.id;
+        }
+        if (lhs.version != rhs.version) {
+            return lhs.version < rhs.version;
+        }
+        // Timestamps are only compared if both are set, same as in libosmium.
+        return lhs.timestamp.valid() && rhs.timestamp.valid() &&
+               lhs.timestamp < rhs.timestamp;
+    }
+}; // struct merge_key_t
+
+/**
+ * A data source is where we get the OSM objects from when merging several
+ * input files. It wraps the buffer_pipeline_t and gives access to the
+ * objects one at a time or to the rest of the current buffer at once.
  */
 class data_source_t
 {
 public:
-    explicit data_source_t(osmium::io::File const &file)
-    : m_reader(std::make_unique<osmium::io::Reader>(file))
+    data_source_t(osmium::io::File const &file, osmdata_t const *osmdata)
+    : m_pipeline(std::make_unique<buffer_pipeline_t>(file, osmdata))
     {
         get_next_nonempty_buffer();
-        m_last = check_input(m_last, *m_it);
     }
 
     bool empty() const noexcept { return !m_buffer; }
@@ -82,37 +339,62 @@ public:
         assert(!empty());
         ++m_it;
 
-        while (m_it == m_end) {
-            if (!get_next_nonempty_buffer()) {
-                return false;
-            }
+        if (m_it == m_end) {
+            return get_next_nonempty_buffer();
         }
 
-        m_last = check_input(m_last, *m_it);
+        m_key = merge_key_t{*m_it};
         return true;
     }
 
-    osmium::OSMObject *get() noexcept
+    osmium::OSMObject &get() noexcept
     {
         assert(!empty());
-        return &*m_it;
+        return *m_it;
     }
 
-    std::size_t offset() const noexcept { return m_reader->offset(); }
+    /// The key of the current object.
+    merge_key_t const &key() const noexcept
+    {
+        assert(!empty());
+        return m_key;
+    }
+
+    /// Type and id of the last object in the current buffer.
+    type_id const &buffer_last() const noexcept
+    {
+        assert(!empty());
+        return m_pipeline->last();
+    }
+
+    /**
+     * Call func for the current object and all following objects in the
+     * current buffer and then move on to the next buffer.
+     */
+    template <typename FUNC>
+    bool apply_rest_of_buffer(FUNC &&func)
+    {
+        assert(!empty());
+        for (; m_it != m_end; ++m_it) {
+            std::forward<FUNC>(func)(*m_it);
+        }
+        return get_next_nonempty_buffer();
+    }
 
     void close()
     {
-        m_reader->close();
-        m_reader.reset();
+        m_pipeline->close();
+        m_pipeline.reset();
     }
 
 private:
     bool get_next_nonempty_buffer()
     {
-        while ((m_buffer = m_reader->read())) {
+        while ((m_buffer = m_pipeline->next())) {
             m_it = m_buffer.begin<osmium::OSMObject>();
             m_end = m_buffer.end<osmium::OSMObject>();
             if (m_it != m_end) {
+                m_key = merge_key_t{*m_it};
                 return true;
             }
         }
@@ -121,59 +403,109 @@ private:
 
     using iterator = osmium::memory::Buffer::t_iterator<osmium::OSMObject>;
 
-    std::unique_ptr<osmium::io::Reader> m_reader;
+    std::unique_ptr<buffer_pipeline_t> m_pipeline;
     osmium::memory::Buffer m_buffer{};
     iterator m_it{};
     iterator m_end{};
-    type_id m_last = {osmium::item_type::node, 0};
+    merge_key_t m_key{};
 
 }; // class data_source_t
 
 /**
- * A element in a priority queue of OSM objects. Holds a pointer to the OSM
- * object as well as a pointer to the source the OSM object came from.
+ * Loser tree (tournament tree) over the data sources used for merging
+ * them. The root holds the source with the smallest current object, all
+ * other nodes hold the source which lost the match in that node. After
+ * the winner was advanced only the matches on the path from its leaf to
+ * the root have to be replayed. Empty sources lose against everything.
  */
-class queue_element_t
+class loser_tree_t
 {
 public:
-    queue_element_t(osmium::OSMObject *object, data_source_t *source) noexcept
-    : m_object(object), m_source(source)
-    {}
+    explicit loser_tree_t(std::vector<data_source_t> *sources)
+    : m_sources(sources), m_tree(sources->size())
+    {
+        assert(!m_tree.empty());
+        m_tree[0] = init(1);
+    }
 
-    osmium::OSMObject const &object() const noexcept { return *m_object; }
+    /// The source with the smallest current object.
+    std::size_t winner() const noexcept { return m_tree[0]; }
 
-    osmium::OSMObject &object() noexcept { return *m_object; }
+    bool empty() const noexcept { return source(winner()).empty(); }
 
-    data_source_t *data_source() const noexcept { return m_source; }
+    /**
+     * The source with the smallest current object of all sources except
+     * the winner. This is the smallest of the losers on the path from the
+     * winner to the root. Returns nullptr if all other sources are empty.
+     */
+    data_source_t const *runner_up() const noexcept
+    {
+        std::size_t best = winner();
+        for (std::size_t node = leaf(winner()) / 2; node > 0; node /= 2) {
+            if (best == winner() || less(m_tree[node], best)) {
+                best = m_tree[node];
+            }
+        }
+
+        if (best == winner() || source(best).empty()) {
+            return nullptr;
+        }
+        return &source(best);
+    }
 
-    friend bool operator<(queue_element_t const &lhs,
-                          queue_element_t const &rhs) noexcept
+    /// Re-establish the tree after the winner has been advanced.
+    void update() noexcept
     {
-        // This is needed for the priority queue. We want objects with smaller
-        // id (and earlier versions of the same object) to come first, but
-        // the priority queue expects largest first. So we need to reverse the
-        // comparison here.
-        return lhs.object() > rhs.object();
+        std::size_t current = winner();
+        for (std::size_t node = leaf(current) / 2; node > 0; node /= 2) {
+            if (less(m_tree[node], current)) {
+                std::swap(m_tree[node], current);
+            }
+        }
+        m_tree[0] = current;
     }
 
-    friend bool operator==(queue_element_t const &lhs,
-                           queue_element_t const &rhs) noexcept
+private:
+    std::size_t leaf(std::size_t n) const noexcept { return n + m_tree.size(); }
+
+    data_source_t const &source(std::size_t n) const noexcept
     {
-        return lhs.object().type() == rhs.object().type() &&
-               lhs.object().id() == rhs.object().id();
+        return (*m_sources)[n];
     }
 
-    friend bool operator!=(queue_element_t const &lhs,
-                           queue_element_t const &rhs) noexcept
+    bool less(std::size_t a, std::size_t b) const noexcept
     {
-        return !(lhs == rhs);
+        if (source(a).empty()) {
+            return false;
+        }
+        if (source(b).empty()) {
+            return true;
+        }
+        return source(a).key() < source(b).key();
     }
 
-private:
-    osmium::OSMObject *m_object;
-    data_source_t *m_source;
+    /// Build the subtree below node and return the winner of it.
+    std::size_t init(std::size_t node)
+    {
+        if (node >= m_tree.size()) {
+            return node - m_tree.size();
+        }
+
+        std::size_t winner = init(2 * node);
+        std::size_t loser = init(2 * node + 1);
+        if (less(loser, winner)) {
+            std::swap(winner, loser);
+        }
+        m_tree[node] = loser;
+        return winner;
+    }
 
-}; // class queue_element_t
+    std::vector<data_source_t> *m_sources;
+
+    /// Node 0 is the overall winner, nodes 1..n-1 the internal nodes.
+    std::vector<std::size_t> m_tree;
+
+}; // class loser_tree_t
 
 std::vector<osmium::io::File>
 prepare_input_files(std::vector<std::string> const &input_files,
@@ -237,6 +569,12 @@ public:
             m_last_type = object.type();
         }
 
+        // Objects marked as removed by the input pipeline are only counted.
+        if (object.removed()) {
+            osmium::apply_item(object, *m_progress);
+            return;
+        }
+
         osmium::apply_item(object, *m_osmdata, *m_progress);
     }
 
@@ -268,19 +606,17 @@ static void process_single_file(osmium::io::File const &file,
                                 osmdata_t *osmdata,
                                 progress_display_t *progress, bool append)
 {
-    osmium::io::Reader reader{file};
-    type_id last{osmium::item_type::node, 0};
+    buffer_pipeline_t pipeline{file, osmdata};
 
     input_context_t ctx{osmdata, progress, append};
-    while (osmium::memory::Buffer buffer = reader.read()) {
+    while (osmium::memory::Buffer buffer = pipeline.next()) {
         for (auto &object : buffer.select<osmium::OSMObject>()) {
-            last = check_input(last, object);
             ctx.apply(object);
         }
     }
     ctx.eof();
 
-    reader.close();
+    pipeline.close();
 }
 
 static void process_multiple_files(std::vector<osmium::io::File> const &files,
@@ -290,28 +626,49 @@ static void process_multiple_files(std::vector<osmium::io::File> const &files,
     std::vector<data_source_t> data_sources;
     data_sources.reserve(files.size());
 
-    std::priority_queue<queue_element_t> queue;
-
     for (osmium::io::File const &file : files) {
-        data_sources.emplace_back(file);
-
-        if (!data_sources.back().empty()) {
-            queue.emplace(data_sources.back().get(), &data_sources.back());
-        }
+        data_sources.emplace_back(file, osmdata);
     }
 
     input_context_t ctx{osmdata, progress, append};
-    while (!queue.empty()) {
-        auto element = queue.top();
-        queue.pop();
-        if (queue.empty() || element != queue.top()) {
-            ctx.apply(element.object());
-        }
+    loser_tree_t tree{&data_sources};
 
-        auto *source = element.data_source();
-        if (source->next()) {
-            queue.emplace(source->get(), source);
+    while (!tree.empty()) {
+        auto &source = data_sources[tree.winner()];
+        auto const *const other = tree.runner_up();
+
+        if (!other) {
+            // All other sources are done, the rest of the objects can be
+            // passed through.
+            while (source.apply_rest_of_buffer(
+                [&](osmium::OSMObject &object) { ctx.apply(object); })) {
+            }
+        } else {
+            type_id const &last = source.buffer_last();
+            merge_key_t const &bound = other->key();
+
+            if (std::make_pair(last.type, last.id) <
+                std::make_pair(bound.type, bound.id)) {
+                // All objects in the rest of the buffer come before any
+                // object in the other sources, so the buffer doesn't need
+                // to be merged.
+                source.apply_rest_of_buffer(
+                    [&](osmium::OSMObject &object) { ctx.apply(object); });
+            } else {
+                // Take objects from this source until the other source
+                // comes first. If the same object is in several sources
+                // only the latest version is used.
+                bool more = true;
+                while (more && !(bound < source.key())) {
+                    if (!source.key().same_object(bound)) {
+                        ctx.apply(source.get());
+                    }
+                    more = source.next();
+                }
+            }
         }
+
+        tree.update();
     }
     ctx.eof();
 
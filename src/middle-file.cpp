@@ -0,0 +1,710 @@
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+#include "format.hpp"
+#include "logging.hpp"
+#include "middle-file.hpp"
+#include "node-persistent-cache.hpp"
+#include "options.hpp"
+#include "util.hpp"
+
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/util/file.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+/// Initial size of object store files and step size for growing them.
+constexpr std::size_t const object_store_min_size = 1024UL * 1024UL;
+
+/// File in the middle directory with the properties of the middle data.
+constexpr char const *const properties_file_name = "properties";
+
+/**
+ * Open a middle file. If truncate is set, the file is created if needed
+ * and truncated, otherwise it must exist already.
+ */
+int open_file(std::string const &file_name, bool truncate)
+{
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-vararg, hicpp-signed-bitwise)
+    int const fd = open(file_name.c_str(),
+                        O_RDWR | (truncate ? (O_CREAT | O_TRUNC) : 0), 0644);
+    if (fd < 0) {
+        throw std::runtime_error{"Unable to open middle file '{}': {}"_format(
+            file_name, std::strerror(errno))};
+    }
+    return fd;
+}
+
+/**
+ * Remove all entries from first to the end of the vector and clear the
+ * space they used so that it is detected as unused when the file is opened
+ * again.
+ */
+template <typename T, typename IT>
+void erase_tail(osmium::detail::mmap_vector_file<T> *data, IT first)
+{
+    std::fill(first, data->end(), T{});
+    data->resize(static_cast<std::size_t>(first - data->begin()));
+}
+
+} // anonymous namespace
+
+mmap_object_store_t::mmap_object_store_t(std::string file_name, bool truncate)
+: m_file_name(std::move(file_name)), m_fd(open_file(m_file_name, truncate)),
+  m_mapping(std::max(object_store_min_size, osmium::file_size(m_fd)),
+            osmium::MemoryMapping::mapping_mode::write_shared, m_fd)
+{
+    // The first 8 bytes in the file contain the number of bytes used.
+    if (used() == 0) {
+        used() = sizeof(std::uint64_t);
+    }
+}
+
+mmap_object_store_t::~mmap_object_store_t() noexcept
+{
+    m_mapping.unmap();
+    close(m_fd);
+}
+
+std::uint64_t mmap_object_store_t::add(osmium::OSMObject const &object)
+{
+    auto const offset = used();
+    auto const needed = offset + object.padded_size();
+
+    if (needed > m_mapping.size()) {
+        m_mapping.resize(std::max(static_cast<std::size_t>(needed),
+                                  m_mapping.size() * 2));
+    }
+
+    std::memcpy(m_mapping.get_addr<char>() + offset, object.data(),
+                object.padded_size());
+    used() = needed;
+
+    return offset;
+}
+
+bool mmap_object_store_t::compact(mmap_id_index_t *index)
+{
+    assert(index);
+
+    std::uint64_t live = 0;
+    for (auto const &entry : *index) {
+        live += get(entry.offset).padded_size();
+    }
+
+    auto const old_size = size();
+    if (old_size - sizeof(std::uint64_t) - live <= live) {
+        return false;
+    }
+
+    util::timer_t timer;
+
+    // The new file is written completely before it replaces the old one.
+    // The index is only changed after that.
+    std::string const tmp_file_name = m_file_name + ".tmp";
+    std::vector<std::uint64_t> offsets;
+    offsets.reserve(index->size());
+    {
+        mmap_object_store_t tmp{tmp_file_name, true};
+        tmp.m_mapping.resize(std::max(
+            object_store_min_size,
+            static_cast<std::size_t>(sizeof(std::uint64_t) + live)));
+        for (auto const &entry : *index) {
+            offsets.push_back(tmp.add(get(entry.offset)));
+        }
+    }
+
+    if (std::rename(tmp_file_name.c_str(), m_file_name.c_str()) != 0) {
+        throw std::runtime_error{
+            "Unable to rename middle file '{}' to '{}': {}"_format(
+                tmp_file_name, m_file_name, std::strerror(errno))};
+    }
+
+    m_mapping.unmap();
+    close(m_fd);
+    m_fd = open_file(m_file_name, false);
+    m_mapping = osmium::MemoryMapping{
+        std::max(object_store_min_size, osmium::file_size(m_fd)),
+        osmium::MemoryMapping::mapping_mode::write_shared, m_fd};
+
+    auto it = offsets.cbegin();
+    for (auto &entry : *index) {
+        entry.offset = *it++;
+    }
+
+    log_info("Compacted middle file '{}' from {}MB to {}MB in {}",
+             m_file_name, old_size / (1024 * 1024), size() / (1024 * 1024),
+             util::human_readable_duration(timer.stop()));
+
+    return true;
+}
+
+mmap_id_index_t::mmap_id_index_t(std::string file_name, bool truncate)
+: m_file_name(std::move(file_name)), m_fd(open_file(m_file_name, truncate)),
+  m_data(m_fd)
+{}
+
+mmap_id_index_t::~mmap_id_index_t() noexcept
+{
+    m_data.close();
+    close(m_fd);
+}
+
+void mmap_id_index_t::set(osmid_t id, std::uint64_t offset)
+{
+    if (m_changes.empty() &&
+        (m_data.empty() || m_data[m_data.size() - 1].id < id)) {
+        m_data.push_back(entry_t{id, offset});
+        return;
+    }
+
+    m_changes[id] = offset;
+}
+
+std::uint64_t mmap_id_index_t::get(osmid_t id) const noexcept
+{
+    if (!m_changes.empty()) {
+        auto const it = m_changes.find(id);
+        if (it != m_changes.end()) {
+            return it->second;
+        }
+    }
+
+    auto const it = std::lower_bound(m_data.cbegin(), m_data.cend(),
+                                     entry_t{id, 0});
+    if (it == m_data.cend() || it->id != id) {
+        return not_found_value();
+    }
+
+    return it->offset;
+}
+
+void mmap_id_index_t::merge()
+{
+    if (m_changes.empty()) {
+        return;
+    }
+
+    std::vector<entry_t> new_entries;
+    for (auto const &change : m_changes) {
+        auto const it = std::lower_bound(m_data.begin(), m_data.end(),
+                                         entry_t{change.first, 0});
+        if (it != m_data.end() && it->id == change.first) {
+            it->offset = change.second;
+        } else if (change.second != not_found_value()) {
+            new_entries.push_back(entry_t{change.first, change.second});
+        }
+    }
+    m_changes.clear();
+
+    std::sort(new_entries.begin(), new_entries.end());
+
+    auto const old_size = m_data.size();
+    for (auto const &entry : new_entries) {
+        m_data.push_back(entry);
+    }
+    std::inplace_merge(m_data.begin(), m_data.begin() + old_size,
+                       m_data.end());
+
+    erase_tail(&m_data,
+               std::remove_if(m_data.begin(), m_data.end(),
+                              [](entry_t const &entry) {
+                                  return entry.offset == not_found_value();
+                              }));
+}
+
+mmap_id_pair_index_t::mmap_id_pair_index_t(std::string const &file_name,
+                                           bool truncate)
+: mmap_id_pair_index_t(file_name, open_file(file_name, truncate), !truncate)
+{}
+
+mmap_id_pair_index_t::mmap_id_pair_index_t(std::string file_name, int fd,
+                                           bool use_overlay)
+: id_pair_index_t(use_overlay, fd), m_file_name(std::move(file_name)),
+  m_fd(fd)
+{}
+
+// The mapping of the index stays valid when the file is closed.
+mmap_id_pair_index_t::~mmap_id_pair_index_t() noexcept { close(m_fd); }
+
+static std::string prepare_middle_dir(options_t const &options)
+{
+    assert(!options.middle_dir.empty());
+
+    if (options.append) {
+        if (!boost::filesystem::is_directory(options.middle_dir)) {
+            throw std::runtime_error{
+                "Middle directory '{}' does not exist."_format(
+                    options.middle_dir)};
+        }
+    } else {
+        boost::filesystem::create_directories(options.middle_dir);
+    }
+
+    return options.middle_dir + '/';
+}
+
+/**
+ * Return whether the middle has reverse indexes from nodes to ways and from
+ * nodes and ways to relations. On import they are built if needed, on
+ * update this is read from the properties file written after the import.
+ */
+static bool has_reverse_indexes(options_t const &options,
+                                std::string const &dir)
+{
+    if (!options.append) {
+        return options.with_forward_dependencies && !options.droptemp;
+    }
+
+    std::string const file_name = dir + properties_file_name;
+    std::ifstream file{file_name};
+    if (!file) {
+        throw std::runtime_error{
+            "Middle directory '{}' doesn't contain the data of a finished "
+            "import with --middle-dir (and without --drop)."_format(
+                options.middle_dir)};
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line == "reverse_indexes=true") {
+            return true;
+        }
+        if (line == "reverse_indexes=false") {
+            if (options.with_forward_dependencies) {
+                throw std::runtime_error{
+                    "Middle data in '{}' was imported without forward "
+                    "dependencies. Use "
+                    "--with-forward-dependencies=false."_format(
+                        options.middle_dir)};
+            }
+            return false;
+        }
+    }
+
+    throw std::runtime_error{
+        "Invalid middle properties file '{}'."_format(file_name)};
+}
+
+middle_file_t::middle_file_t(std::shared_ptr<thread_pool_t> thread_pool,
+                             options_t const *options)
+: middle_t(std::move(thread_pool)), m_options(options),
+  m_dir(prepare_middle_dir(*options)),
+  m_reverse_indexes(has_reverse_indexes(*options, m_dir)),
+  m_node_locations(std::make_unique<node_persistent_cache>(
+      options->flat_node_file.empty() ? m_dir + "nodes.bin"
+                                      : options->flat_node_file,
+      options->droptemp, options->flat_node_file_format)),
+  m_ways(m_dir + "ways.data", !options->append),
+  m_ways_index(m_dir + "ways.idx", !options->append),
+  m_relations(m_dir + "rels.data", !options->append),
+  m_relations_index(m_dir + "rels.idx", !options->append)
+{
+    // Once built, the reverse indexes are always kept up to date, so that
+    // later updates with forward dependencies can still use them.
+    if (m_reverse_indexes) {
+        m_ways_by_node = std::make_unique<mmap_id_pair_index_t>(
+            m_dir + "ways-by-node.idx", !options->append);
+        m_rels_by_node = std::make_unique<mmap_id_pair_index_t>(
+            m_dir + "rels-by-node.idx", !options->append);
+        m_rels_by_way = std::make_unique<mmap_id_pair_index_t>(
+            m_dir + "rels-by-way.idx", !options->append);
+    }
+
+    if (!options->append) {
+        m_node_locations->advise(node_persistent_cache::access_t::sequential);
+    }
+
+    log_debug("Mid: file, directory={}", options->middle_dir);
+}
+
+middle_file_t::~middle_file_t() noexcept = default;
+
+void middle_file_t::node(osmium::Node const &node)
+{
+    if (node.deleted()) {
+        m_node_locations->set(node.id(), osmium::Location{});
+    } else {
+        m_node_locations->set(node.id(), node.location());
+    }
+}
+
+void middle_file_t::after_nodes()
+{
+    // From now on node locations are looked up for the way nodes.
+    m_node_locations->advise(node_persistent_cache::access_t::random);
+}
+
+void middle_file_t::prefetch_way_node_locations(
+    osmium::memory::Buffer const &buffer)
+{
+    m_node_locations->will_need(buffer);
+}
+
+/// Add tags of the object and (if requested) its attributes as tags.
+static void add_tags(osmium::memory::Buffer *buffer,
+                     osmium::builder::Builder *parent,
+                     osmium::OSMObject const &object, bool attrs)
+{
+    osmium::builder::TagListBuilder builder{*buffer, parent};
+    for (auto const &tag : object.tags()) {
+        builder.add_tag(tag);
+    }
+
+    if (attrs) {
+        taglist_t extra;
+        extra.add_attributes(object);
+        for (auto const &tag : extra) {
+            builder.add_tag(tag.key, tag.value);
+        }
+    }
+}
+
+void middle_file_t::way_set(osmium::Way const &way)
+{
+    m_buffer.clear();
+    {
+        osmium::builder::WayBuilder builder{m_buffer};
+        builder.set_id(way.id());
+        {
+            osmium::builder::WayNodeListBuilder wnl_builder{m_buffer,
+                                                            &builder};
+            for (auto const &nr : way.nodes()) {
+                wnl_builder.add_node_ref(nr.ref());
+            }
+        }
+        add_tags(&m_buffer, &builder, way, m_options->extra_attributes);
+    }
+    m_buffer.commit();
+
+    m_ways_index.set(way.id(),
+                     m_ways.add(m_buffer.get<osmium::OSMObject>(0)));
+
+    if (m_ways_by_node) {
+        for (auto const &nr : way.nodes()) {
+            m_ways_by_node->add(nr.ref(), way.id());
+        }
+    }
+}
+
+void middle_file_t::way(osmium::Way const &way)
+{
+    if (way.deleted()) {
+        m_ways_index.remove(way.id());
+    } else {
+        way_set(way);
+    }
+}
+
+void middle_file_t::relation_set(osmium::Relation const &relation)
+{
+    m_buffer.clear();
+    {
+        osmium::builder::RelationBuilder builder{m_buffer};
+        builder.set_id(relation.id());
+        {
+            osmium::builder::RelationMemberListBuilder rml_builder{m_buffer,
+                                                                   &builder};
+            for (auto const &member : relation.members()) {
+                rml_builder.add_member(member.type(), member.ref(),
+                                       member.role());
+            }
+        }
+        add_tags(&m_buffer, &builder, relation, m_options->extra_attributes);
+    }
+    m_buffer.commit();
+
+    m_relations_index.set(relation.id(),
+                          m_relations.add(m_buffer.get<osmium::OSMObject>(0)));
+
+    if (m_rels_by_node) {
+        for (auto const &member : relation.members()) {
+            if (member.type() == osmium::item_type::node) {
+                m_rels_by_node->add(member.ref(), relation.id());
+            } else if (member.type() == osmium::item_type::way) {
+                m_rels_by_way->add(member.ref(), relation.id());
+            }
+        }
+    }
+}
+
+void middle_file_t::relation(osmium::Relation const &relation)
+{
+    if (relation.deleted()) {
+        m_relations_index.remove(relation.id());
+    } else {
+        relation_set(relation);
+    }
+}
+
+void middle_file_t::after_relations()
+{
+    util::timer_t timer;
+
+    m_ways_index.merge();
+    m_relations_index.merge();
+
+    if (m_ways_by_node) {
+        m_ways_by_node->merge();
+        m_rels_by_node->merge();
+        m_rels_by_way->merge();
+    }
+
+    log_debug("Middle 'file': Writing indexes took {}",
+              util::human_readable_duration(timer.stop()));
+
+    // Old versions of objects only exist after updates.
+    if (m_options->append) {
+        compact();
+    }
+}
+
+void middle_file_t::compact()
+{
+    if (m_ways.compact(&m_ways_index) && m_ways_by_node) {
+        m_ways_by_node->clear();
+        for (auto const &entry : m_ways_index) {
+            auto const &way =
+                static_cast<osmium::Way const &>(m_ways.get(entry.offset));
+            for (auto const &nr : way.nodes()) {
+                m_ways_by_node->add(nr.ref(), way.id());
+            }
+        }
+        m_ways_by_node->merge();
+    }
+
+    if (m_relations.compact(&m_relations_index) && m_rels_by_node) {
+        m_rels_by_node->clear();
+        m_rels_by_way->clear();
+        for (auto const &entry : m_relations_index) {
+            auto const &relation = static_cast<osmium::Relation const &>(
+                m_relations.get(entry.offset));
+            for (auto const &member : relation.members()) {
+                if (member.type() == osmium::item_type::node) {
+                    m_rels_by_node->add(member.ref(), relation.id());
+                } else if (member.type() == osmium::item_type::way) {
+                    m_rels_by_way->add(member.ref(), relation.id());
+                }
+            }
+        }
+        m_rels_by_node->merge();
+        m_rels_by_way->merge();
+    }
+}
+
+void middle_file_t::remove_files()
+{
+    for (auto const *file_name :
+         {&m_ways.file_name(), &m_ways_index.file_name(),
+          &m_relations.file_name(), &m_relations_index.file_name()}) {
+        log_debug("Removing middle file '{}'.", *file_name);
+        unlink(file_name->c_str());
+    }
+    unlink((m_dir + properties_file_name).c_str());
+}
+
+void middle_file_t::write_properties() const
+{
+    std::string const file_name = m_dir + properties_file_name;
+    std::ofstream file{file_name};
+    file << "reverse_indexes=" << (m_reverse_indexes ? "true" : "false")
+         << '\n';
+    file.close();
+    if (!file) {
+        throw std::runtime_error{
+            "Writing middle properties file '{}' failed."_format(file_name)};
+    }
+}
+
+void middle_file_t::stop()
+{
+    log_debug("Middle 'file': ways={} ({} bytes) relations={} ({} bytes)",
+              m_ways_index.size(), m_ways.size(), m_relations_index.size(),
+              m_relations.size());
+
+    if (m_ways_by_node) {
+        log_debug("Middle 'file': ways by node={} rels by node={}"
+                  " rels by way={}",
+                  m_ways_by_node->size(), m_rels_by_node->size(),
+                  m_rels_by_way->size());
+    }
+
+    if (m_options->droptemp) {
+        remove_files();
+    } else if (!m_options->append) {
+        write_properties();
+    }
+}
+
+osmium::OSMObject const *
+middle_file_t::get_object(mmap_object_store_t const &store,
+                          mmap_id_index_t const &index,
+                          osmid_t id) const noexcept
+{
+    auto const offset = index.get(id);
+    if (offset == mmap_id_index_t::not_found_value()) {
+        return nullptr;
+    }
+    return &store.get(offset);
+}
+
+idlist_t middle_file_t::get_ways_by_node(osmid_t osm_id)
+{
+    if (!m_ways_by_node) {
+        return {};
+    }
+
+    idlist_t ids;
+    m_ways_by_node->get(osm_id, &ids);
+
+    return filter_ways_by_node(std::move(ids), osm_id, [&](osmid_t id) {
+        return static_cast<osmium::Way const *>(
+            get_object(m_ways, m_ways_index, id));
+    });
+}
+
+idlist_t middle_file_t::get_rels_by_node(osmid_t osm_id)
+{
+    if (!m_rels_by_node) {
+        return {};
+    }
+
+    idlist_t ids;
+    m_rels_by_node->get(osm_id, &ids);
+
+    return filter_rels_by_member(
+        std::move(ids), osmium::item_type::node, osm_id, [&](osmid_t id) {
+            return static_cast<osmium::Relation const *>(
+                get_object(m_relations, m_relations_index, id));
+        });
+}
+
+idlist_t middle_file_t::get_rels_by_way(osmid_t osm_id)
+{
+    if (!m_rels_by_way) {
+        return {};
+    }
+
+    idlist_t ids;
+    m_rels_by_way->get(osm_id, &ids);
+
+    return filter_rels_by_member(
+        std::move(ids), osmium::item_type::way, osm_id, [&](osmid_t id) {
+            return static_cast<osmium::Relation const *>(
+                get_object(m_relations, m_relations_index, id));
+        });
+}
+
+std::size_t middle_file_t::nodes_get_list(osmium::WayNodeList *nodes) const
+{
+    assert(nodes);
+
+    std::size_t count = 0;
+
+    for (auto &nr : *nodes) {
+        auto const loc =
+            nr.ref() >= 0 ? m_node_locations->get(nr.ref()) : osmium::Location{};
+        nr.set_location(loc);
+        if (loc.valid()) {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+std::size_t middle_file_t::nodes_get_lists(osmium::memory::Buffer *buffer) const
+{
+    assert(buffer);
+
+    // Looking up the locations in sorted order means the pages of the
+    // node locations file are accessed in order.
+    return nodes_get_lists_sorted(
+        buffer, [this](idlist_t const &ids,
+                       std::vector<osmium::Location> *locations) {
+            locations->clear();
+            locations->reserve(ids.size());
+            for (auto const id : ids) {
+                locations->push_back(id >= 0 ? m_node_locations->get(id)
+                                             : osmium::Location{});
+            }
+        });
+}
+
+bool middle_file_t::way_get(osmid_t id, osmium::memory::Buffer *buffer) const
+{
+    assert(buffer);
+
+    auto const *object = get_object(m_ways, m_ways_index, id);
+    if (!object) {
+        return false;
+    }
+
+    buffer->add_item(*object);
+    buffer->commit();
+    return true;
+}
+
+std::size_t
+middle_file_t::rel_members_get(osmium::Relation const &rel,
+                               osmium::memory::Buffer *buffer,
+                               osmium::osm_entity_bits::type types) const
+{
+    assert(buffer);
+
+    // Only way members are supported by this middle, same as for the
+    // pgsql middle.
+    if ((types & osmium::osm_entity_bits::way) == 0) {
+        return 0;
+    }
+
+    std::size_t count = 0;
+    for (auto const &member : rel.members()) {
+        if (member.type() == osmium::item_type::way &&
+            way_get(member.ref(), buffer)) {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+bool middle_file_t::relation_get(osmid_t id,
+                                 osmium::memory::Buffer *buffer) const
+{
+    assert(buffer);
+
+    auto const *object = get_object(m_relations, m_relations_index, id);
+    if (!object) {
+        return false;
+    }
+
+    buffer->add_item(*object);
+    buffer->commit();
+    return true;
+}
+
+std::shared_ptr<middle_query_t> middle_file_t::get_query_instance()
+{
+    return shared_from_this();
+}
@@ -0,0 +1,293 @@
+#ifndef OSM2PGSQL_MIDDLE_FILE_HPP
+#define OSM2PGSQL_MIDDLE_FILE_HPP
+
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+#include "id-pair-index.hpp"
+#include "middle.hpp"
+#include "osmtypes.hpp"
+
+#include <osmium/index/detail/mmap_vector_file.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm.hpp>
+#include <osmium/util/memory_mapping.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+class mmap_id_index_t;
+class node_persistent_cache;
+class options_t;
+
+/**
+ * Store for OSM objects in a memory-mapped file. Objects are only ever
+ * appended, they are stored in the same format as in an osmium buffer and
+ * are referenced by their offset in the file. Old versions of changed
+ * objects stay in the file until it is rewritten by compact().
+ *
+ * Adding objects can remap the file, so it must not be read from other
+ * threads while objects are added.
+ */
+class mmap_object_store_t
+{
+public:
+    mmap_object_store_t(std::string file_name, bool truncate);
+
+    mmap_object_store_t(mmap_object_store_t const &) = delete;
+    mmap_object_store_t &operator=(mmap_object_store_t const &) = delete;
+
+    mmap_object_store_t(mmap_object_store_t &&) = delete;
+    mmap_object_store_t &operator=(mmap_object_store_t &&) = delete;
+
+    ~mmap_object_store_t() noexcept;
+
+    /// Add object to the store and return its offset.
+    std::uint64_t add(osmium::OSMObject const &object);
+
+    /// Get object stored at the offset.
+    osmium::OSMObject const &get(std::uint64_t offset) const noexcept
+    {
+        return *reinterpret_cast<osmium::OSMObject const *>(
+            m_mapping.get_addr<char>() + offset);
+    }
+
+    /// The number of bytes used in the file.
+    std::uint64_t size() const noexcept { return used(); }
+
+    /**
+     * Rewrite the file with only the objects referenced from the index if
+     * more than half of the space used is taken up by objects which are
+     * not referenced any more (old versions of changed objects and deleted
+     * objects). The offsets in the index are updated. All changes to the
+     * index must have been merged.
+     *
+     * \returns true if the file was rewritten.
+     */
+    bool compact(mmap_id_index_t *index);
+
+    std::string const &file_name() const noexcept { return m_file_name; }
+
+private:
+    std::uint64_t &used() const noexcept
+    {
+        return *m_mapping.get_addr<std::uint64_t>();
+    }
+
+    std::string m_file_name;
+    int m_fd;
+    osmium::MemoryMapping m_mapping;
+};
+
+/**
+ * Index from OSM ids to offsets in a mmap_object_store_t. The index is
+ * kept in a memory-mapped file as an array of (id, offset) pairs sorted
+ * by id.
+ *
+ * Ids added in ascending order are appended to the array directly, this
+ * is the normal case when importing. All other changes are kept in an
+ * in-memory overlay until merge() is called.
+ */
+class mmap_id_index_t
+{
+public:
+    mmap_id_index_t(std::string file_name, bool truncate);
+
+    mmap_id_index_t(mmap_id_index_t const &) = delete;
+    mmap_id_index_t &operator=(mmap_id_index_t const &) = delete;
+
+    mmap_id_index_t(mmap_id_index_t &&) = delete;
+    mmap_id_index_t &operator=(mmap_id_index_t &&) = delete;
+
+    ~mmap_id_index_t() noexcept;
+
+    static constexpr std::uint64_t not_found_value() noexcept
+    {
+        return std::numeric_limits<std::uint64_t>::max();
+    }
+
+    void set(osmid_t id, std::uint64_t offset);
+
+    void remove(osmid_t id) { m_changes[id] = not_found_value(); }
+
+    /// Return offset for this id or not_found_value().
+    std::uint64_t get(osmid_t id) const noexcept;
+
+    /// Merge all changes into the index on disk.
+    void merge();
+
+    std::size_t size() const noexcept { return m_data.size(); }
+
+    std::string const &file_name() const noexcept { return m_file_name; }
+
+    struct entry_t
+    {
+        osmid_t id;
+        std::uint64_t offset;
+
+        friend bool operator==(entry_t a, entry_t b) noexcept
+        {
+            return a.id == b.id && a.offset == b.offset;
+        }
+
+        friend bool operator<(entry_t a, entry_t b) noexcept
+        {
+            return a.id < b.id;
+        }
+    };
+
+    /// Access the entries on disk. Only complete after merge().
+    entry_t *begin() noexcept { return m_data.begin(); }
+    entry_t *end() noexcept { return m_data.end(); }
+    entry_t const *begin() const noexcept { return m_data.cbegin(); }
+    entry_t const *end() const noexcept { return m_data.cend(); }
+
+private:
+    std::string m_file_name;
+    int m_fd;
+    osmium::detail::mmap_vector_file<entry_t> m_data;
+    std::unordered_map<osmid_t, std::uint64_t> m_changes;
+};
+
+/**
+ * Index from OSM ids to the ids of other objects referencing them (see
+ * id_pair_index_t), kept in a memory-mapped file.
+ */
+class mmap_id_pair_index_t
+: public id_pair_index_t<osmium::detail::mmap_vector_file<id_pair_t>>
+{
+public:
+    mmap_id_pair_index_t(std::string const &file_name, bool truncate);
+
+    mmap_id_pair_index_t(mmap_id_pair_index_t const &) = delete;
+    mmap_id_pair_index_t &operator=(mmap_id_pair_index_t const &) = delete;
+
+    mmap_id_pair_index_t(mmap_id_pair_index_t &&) = delete;
+    mmap_id_pair_index_t &operator=(mmap_id_pair_index_t &&) = delete;
+
+    ~mmap_id_pair_index_t() noexcept;
+
+    std::string const &file_name() const noexcept { return m_file_name; }
+
+private:
+    mmap_id_pair_index_t(std::string file_name, int fd, bool use_overlay);
+
+    std::string m_file_name;
+    int m_fd;
+};
+
+/**
+ * Implementation of middle for slim mode which stores all data in
+ * memory-mapped files in a directory instead of in database tables. It
+ * supports updates.
+ *
+ * Node locations are stored in a flat node file. Ways and relations are
+ * stored as osmium objects with only the data the pgsql middle keeps. For
+ * updates there are reverse indexes from nodes to ways and from nodes and
+ * ways to relations, so that get_ways_by_node() and friends are local
+ * lookups.
+ *
+ * All changes to the indexes are written to disk in after_relations().
+ * After an update the ways and relations files are rewritten without the
+ * old versions of changed objects once those take up more than half of the
+ * file. The reverse indexes for the objects of that type are rebuilt then,
+ * which removes the pairs for the old versions.
+ */
+class middle_file_t : public middle_t, public middle_query_t
+{
+public:
+    middle_file_t(std::shared_ptr<thread_pool_t> thread_pool,
+                  options_t const *options);
+
+    ~middle_file_t() noexcept override;
+
+    void start() override {}
+    void stop() override;
+
+    void node(osmium::Node const &node) override;
+    void way(osmium::Way const &way) override;
+    void relation(osmium::Relation const &relation) override;
+
+    void after_nodes() override;
+
+    void prefetch_way_node_locations(
+        osmium::memory::Buffer const &buffer) override;
+    void after_relations() override;
+
+    idlist_t get_ways_by_node(osmid_t osm_id) override;
+    idlist_t get_rels_by_node(osmid_t osm_id) override;
+    idlist_t get_rels_by_way(osmid_t osm_id) override;
+
+    std::size_t nodes_get_list(osmium::WayNodeList *nodes) const override;
+
+    std::size_t nodes_get_lists(osmium::memory::Buffer *buffer) const override;
+
+    bool way_get(osmid_t id, osmium::memory::Buffer *buffer) const override;
+
+    std::size_t
+    rel_members_get(osmium::Relation const &rel, osmium::memory::Buffer *buffer,
+                    osmium::osm_entity_bits::type types) const override;
+
+    bool relation_get(osmid_t id,
+                      osmium::memory::Buffer *buffer) const override;
+
+    std::shared_ptr<middle_query_t> get_query_instance() override;
+
+private:
+    void way_set(osmium::Way const &way);
+    void relation_set(osmium::Relation const &relation);
+
+    /// Get object from store if it is in the index.
+    osmium::OSMObject const *get_object(mmap_object_store_t const &store,
+                                        mmap_id_index_t const &index,
+                                        osmid_t id) const noexcept;
+
+    void remove_files();
+
+    /**
+     * Write the properties file after an import. It marks the directory
+     * as containing complete middle data, which is checked on update.
+     */
+    void write_properties() const;
+
+    /// Compact the object stores and rebuild the reverse indexes if needed.
+    void compact();
+
+    options_t const *m_options;
+
+    /// The directory where all files are stored.
+    std::string m_dir;
+
+    /// Are there reverse indexes (needed for forward dependencies)?
+    bool m_reverse_indexes;
+
+    std::unique_ptr<node_persistent_cache> m_node_locations;
+
+    mmap_object_store_t m_ways;
+    mmap_id_index_t m_ways_index;
+
+    mmap_object_store_t m_relations;
+    mmap_id_index_t m_relations_index;
+
+    /// Reverse indexes, only available if the data is updatable.
+    std::unique_ptr<mmap_id_pair_index_t> m_ways_by_node;
+    std::unique_ptr<mmap_id_pair_index_t> m_rels_by_node;
+    std::unique_ptr<mmap_id_pair_index_t> m_rels_by_way;
+
+    /// Buffer used for building the objects we store.
+    osmium::memory::Buffer m_buffer{1024,
+                                    osmium::memory::Buffer::auto_grow::yes};
+}; // class middle_file_t
+
+#endif // OSM2PGSQL_MIDDLE_FILE_HPP
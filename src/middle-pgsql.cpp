@@ -18,16 +18,22 @@
 #include <stdexcept>
 #include <unordered_map>
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstdlib>
 #include <functional>
+#include <future>
+#include <limits>
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include <osmium/builder/osm_object_builder.hpp>
 #include <osmium/memory/buffer.hpp>
 #include <osmium/osm/types_from_string.hpp>
 
+#include "compact-format.hpp"
 #include "format.hpp"
 #include "logging.hpp"
 #include "middle-pgsql.hpp"
@@ -65,6 +71,7 @@ middle_pgsql_t::table_desc::table_desc(options_t const &options,
     m_copy_target->name = build_sql(options, ts.name);
     m_copy_target->schema = options.middle_dbschema;
     m_copy_target->id = "id"; // XXX hardcoded column name
+    m_copy_target->binary = true;
 
     if (options.with_forward_dependencies) {
         m_prepare_fw_dep_lookups =
@@ -206,6 +213,39 @@ void pgsql_parse_nodes(char const *string, osmium::memory::Buffer *buffer,
     }
 }
 
+/**
+ * Copy the object with the specified id from the source buffer into the
+ * buffer if it is in the index.
+ */
+bool copy_object(osmium::memory::Buffer const &source,
+                 std::unordered_map<osmid_t, std::size_t> const &index,
+                 osmid_t id, osmium::memory::Buffer *buffer)
+{
+    auto const it = index.find(id);
+    if (it == index.end()) {
+        return false;
+    }
+
+    buffer->add_item(source.get<osmium::memory::Item>(it->second));
+    buffer->commit();
+
+    return true;
+}
+
+/// Get an int8 value from a result in binary format.
+osmid_t get_binary_id(pg_result_t const &res, int row, int col) noexcept
+{
+    assert(res.get_length(row, col) == 8);
+    auto const *data =
+        reinterpret_cast<unsigned char const *>(res.get_value(row, col));
+
+    std::uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value = (value << 8U) | data[i];
+    }
+    return static_cast<osmid_t>(value);
+}
+
 } // anonymous namespace
 
 void middle_pgsql_t::buffer_store_tags(osmium::OSMObject const &obj, bool attrs)
@@ -213,7 +253,7 @@ void middle_pgsql_t::buffer_store_tags(osmium::OSMObject const &obj, bool attrs)
     if (obj.tags().empty() && !attrs) {
         m_db_copy.add_null_column();
     } else {
-        m_db_copy.new_array();
+        m_db_copy.new_array<char const *>();
 
         for (auto const &it : obj.tags()) {
             m_db_copy.add_array_elem(it.key());
@@ -233,16 +273,36 @@ void middle_pgsql_t::buffer_store_tags(osmium::OSMObject const &obj, bool attrs)
     }
 }
 
+void middle_query_pgsql_t::fetch_node_locations(
+    std::string const &id_list,
+    std::unordered_map<osmid_t, osmium::Location> *locs) const
+{
+    // Nodes must have been written back at this point.
+    auto const res = m_sql_conn.exec_prepared("get_node_list", id_list);
+    for (int i = 0; i < res.num_tuples(); ++i) {
+        locs->emplace(
+            osmium::string_to_object_id(res.get_value(i, 0)),
+            osmium::Location{(int)strtol(res.get_value(i, 1), nullptr, 10),
+                             (int)strtol(res.get_value(i, 2), nullptr, 10)});
+    }
+}
+
 std::size_t middle_query_pgsql_t::get_way_node_locations_db(
     osmium::WayNodeList *nodes) const
 {
     size_t count = 0;
     util::string_id_list_t id_list;
 
-    // get nodes where possible from cache,
+    // get nodes where possible from cache or the prefetched locations,
     // at the same time build a list for querying missing nodes from DB
     for (auto &n : *nodes) {
-        auto const loc = m_cache->get(n.ref());
+        auto loc = m_cache->get(n.ref());
+        if (!loc.valid()) {
+            auto const el = m_prefetched_locations.find(n.ref());
+            if (el != m_prefetched_locations.end()) {
+                loc = el->second;
+            }
+        }
         if (loc.valid()) {
             n.set_location(loc);
             ++count;
@@ -256,15 +316,8 @@ std::size_t middle_query_pgsql_t::get_way_node_locations_db(
     }
 
     // get any remaining nodes from the DB
-    // Nodes must have been written back at this point.
-    auto const res = m_sql_conn.exec_prepared("get_node_list", id_list.get());
     std::unordered_map<osmid_t, osmium::Location> locs;
-    for (int i = 0; i < res.num_tuples(); ++i) {
-        locs.emplace(
-            osmium::string_to_object_id(res.get_value(i, 0)),
-            osmium::Location{(int)strtol(res.get_value(i, 1), nullptr, 10),
-                             (int)strtol(res.get_value(i, 2), nullptr, 10)});
-    }
+    fetch_node_locations(id_list.get(), &locs);
 
     for (auto &n : *nodes) {
         auto const el = locs.find(n.ref());
@@ -352,6 +405,63 @@ size_t middle_query_pgsql_t::nodes_get_list(osmium::WayNodeList *nodes) const
                               : get_way_node_locations_db(nodes);
 }
 
+void middle_query_pgsql_t::get_node_locations_sorted(
+    idlist_t const &ids, std::vector<osmium::Location> *locations) const
+{
+    m_cache->get_sorted(ids, locations);
+
+    if (m_persistent_cache) {
+        for (std::size_t i = 0; i < ids.size(); ++i) {
+            if (!(*locations)[i].valid() && ids[i] >= 0) {
+                (*locations)[i] = m_persistent_cache->get(ids[i]);
+            }
+        }
+        return;
+    }
+
+    // get nodes not in the cache from the prefetched locations, at the
+    // same time build a list for querying missing nodes from DB
+    util::string_id_list_t id_list;
+    for (std::size_t i = 0; i < ids.size(); ++i) {
+        if ((*locations)[i].valid()) {
+            continue;
+        }
+        auto const el = m_prefetched_locations.find(ids[i]);
+        if (el != m_prefetched_locations.end()) {
+            (*locations)[i] = el->second;
+        } else {
+            id_list.add(ids[i]);
+        }
+    }
+
+    if (id_list.empty()) {
+        return;
+    }
+
+    // get all remaining nodes from the DB with a single query
+    std::unordered_map<osmid_t, osmium::Location> locs;
+    fetch_node_locations(id_list.get(), &locs);
+
+    for (std::size_t i = 0; i < ids.size(); ++i) {
+        if (!(*locations)[i].valid()) {
+            auto const el = locs.find(ids[i]);
+            if (el != locs.end()) {
+                (*locations)[i] = el->second;
+            }
+        }
+    }
+}
+
+std::size_t
+middle_query_pgsql_t::nodes_get_lists(osmium::memory::Buffer *buffer) const
+{
+    return nodes_get_lists_sorted(
+        buffer, [this](idlist_t const &ids,
+                       std::vector<osmium::Location> *locations) {
+            get_node_locations_sorted(ids, locations);
+        });
+}
+
 void middle_pgsql_t::node_delete(osmid_t osm_id)
 {
     assert(m_options->append);
@@ -379,14 +489,105 @@ idlist_t middle_pgsql_t::get_rels_by_way(osmid_t osm_id)
     return get_ids_from_db(&m_db_connection, "mark_rels_by_way", osm_id);
 }
 
+idlist_t middle_pgsql_t::get_ways_by_nodes(idlist_t const &node_ids)
+{
+    return get_ids_for_list("mark_ways_by_node_list", node_ids);
+}
+
+idlist_t middle_pgsql_t::get_rels_by_nodes(idlist_t const &node_ids)
+{
+    return get_ids_for_list("mark_rels_by_node_list", node_ids);
+}
+
+idlist_t middle_pgsql_t::get_rels_by_ways(idlist_t const &way_ids)
+{
+    return get_ids_for_list("mark_rels_by_way_list", way_ids);
+}
+
+idlist_t middle_pgsql_t::get_ids_for_list(char const *stmt,
+                                          idlist_t const &ids) const
+{
+    idlist_t result;
+
+    if (ids.empty()) {
+        return result;
+    }
+
+    std::size_t const num_chunks =
+        (ids.size() + max_ids_per_dependency_query - 1) /
+        max_ids_per_dependency_query;
+
+    auto const query_chunk = [&](pg_conn_t const &db_connection,
+                                 std::size_t chunk, idlist_t *found) {
+        auto const first = chunk * max_ids_per_dependency_query;
+        auto const last = std::min(ids.size(),
+                                   first + max_ids_per_dependency_query);
+
+        util::string_id_list_t id_list;
+        for (auto n = first; n < last; ++n) {
+            id_list.add(ids[n]);
+        }
+
+        auto const res = db_connection.exec_prepared(stmt, id_list.get());
+        auto const chunk_ids = get_ids_from_result(res);
+        found->insert(found->end(), chunk_ids.cbegin(), chunk_ids.cend());
+    };
+
+    std::size_t const num_threads =
+        std::min(static_cast<std::size_t>(m_options->num_procs), num_chunks);
+
+    if (num_threads <= 1) {
+        for (std::size_t chunk = 0; chunk < num_chunks; ++chunk) {
+            query_chunk(m_db_connection, chunk, &result);
+        }
+    } else {
+        // Spread the chunks over several database connections, each
+        // running in its own thread.
+        std::vector<std::future<idlist_t>> workers;
+        workers.reserve(num_threads);
+        for (std::size_t n = 0; n < num_threads; ++n) {
+            workers.push_back(std::async(std::launch::async, [&, n]() {
+                pg_conn_t db_connection{
+                    m_options->database_options.conninfo()};
+                prepare_fw_dep_lookups(db_connection);
+
+                idlist_t found;
+                for (std::size_t chunk = n; chunk < num_chunks;
+                     chunk += num_threads) {
+                    query_chunk(db_connection, chunk, &found);
+                }
+                return found;
+            }));
+        }
+
+        for (auto &worker : workers) {
+            auto const found = worker.get();
+            result.insert(result.end(), found.cbegin(), found.cend());
+        }
+    }
+
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+
+    return result;
+}
+
 void middle_pgsql_t::way_set(osmium::Way const &way)
 {
     m_db_copy.new_line(m_tables.ways().copy_target());
 
     m_db_copy.add_column(way.id());
 
+    if (m_compact_format) {
+        m_compact_data.clear();
+        compact_encode_way(way, m_options->extra_attributes, &m_compact_data);
+        m_db_copy.add_column(m_compact_data);
+        m_db_copy.finish_line();
+        return;
+    }
+
     // nodes
-    m_db_copy.new_array();
+    m_db_copy.new_array<osmid_t>();
     for (auto const &n : way.nodes()) {
         m_db_copy.add_array_elem(n.ref());
     }
@@ -397,11 +598,65 @@ void middle_pgsql_t::way_set(osmium::Way const &way)
     m_db_copy.finish_line();
 }
 
+void middle_query_pgsql_t::fetch_ways(std::string const &id_list,
+                                      osmium::memory::Buffer *buffer,
+                                      offset_index_t *index) const
+{
+    if (m_compact_format) {
+        auto const res = m_sql_conn.exec_prepared_binary("get_way_list", id_list);
+        for (int i = 0; i < res.num_tuples(); ++i) {
+            auto const id = get_binary_id(res, i, 0);
+            auto const offset = buffer->committed();
+            compact_decode_way(id, res.get_value(i, 1),
+                               static_cast<std::size_t>(res.get_length(i, 1)),
+                               buffer);
+            buffer->commit();
+            index->emplace(id, offset);
+        }
+        return;
+    }
+
+    auto const res = m_sql_conn.exec_prepared("get_way_list", id_list);
+    idlist_t const ids = get_ids_from_result(res);
+
+    for (int i = 0; i < res.num_tuples(); ++i) {
+        auto const id = ids[static_cast<std::size_t>(i)];
+        auto const offset = buffer->committed();
+        {
+            osmium::builder::WayBuilder builder{*buffer};
+            builder.set_id(id);
+
+            pgsql_parse_nodes(res.get_value(i, 1), buffer, builder);
+            pgsql_parse_tags(res.get_value(i, 2), buffer, builder);
+        }
+        buffer->commit();
+        index->emplace(id, offset);
+    }
+}
+
 bool middle_query_pgsql_t::way_get(osmid_t id,
                                    osmium::memory::Buffer *buffer) const
 {
     assert(buffer);
 
+    if (copy_object(m_prefetch_buffer, m_prefetched_ways, id, buffer)) {
+        return true;
+    }
+
+    if (m_compact_format) {
+        auto const res = m_sql_conn.exec_prepared_binary("get_way", id);
+        if (res.num_tuples() != 1) {
+            return false;
+        }
+
+        compact_decode_way(id, res.get_value(0, 0),
+                           static_cast<std::size_t>(res.get_length(0, 0)),
+                           buffer);
+        buffer->commit();
+
+        return true;
+    }
+
     auto const res = m_sql_conn.exec_prepared("get_way", id);
 
     if (res.num_tuples() != 1) {
@@ -438,39 +693,31 @@ middle_query_pgsql_t::rel_members_get(osmium::Relation const &rel,
     util::string_id_list_t id_list;
 
     for (auto const &m : rel.members()) {
-        if (m.type() == osmium::item_type::way) {
+        if (m.type() == osmium::item_type::way &&
+            m_prefetched_ways.count(m.ref()) == 0) {
             id_list.add(m.ref());
         }
     }
 
-    if (id_list.empty()) {
-        return 0;
+    // Get the ways which haven't been prefetched from the database.
+    osmium::memory::Buffer fetched_buffer{};
+    offset_index_t fetched;
+    if (!id_list.empty()) {
+        fetched_buffer = osmium::memory::Buffer{
+            1024, osmium::memory::Buffer::auto_grow::yes};
+        fetch_ways(id_list.get(), &fetched_buffer, &fetched);
     }
 
-    auto const res = m_sql_conn.exec_prepared("get_way_list", id_list.get());
-    idlist_t const wayidspg = get_ids_from_result(res);
-
-    // Match the list of ways coming from postgres in a different order
-    //   back to the list of ways given by the caller */
+    // Add the ways in the order of the members.
     size_t outres = 0;
     for (auto const &m : rel.members()) {
         if (m.type() != osmium::item_type::way) {
             continue;
         }
-        for (int j = 0; j < res.num_tuples(); ++j) {
-            if (m.ref() == wayidspg[static_cast<std::size_t>(j)]) {
-                {
-                    osmium::builder::WayBuilder builder{*buffer};
-                    builder.set_id(m.ref());
-
-                    pgsql_parse_nodes(res.get_value(j, 1), buffer, builder);
-                    pgsql_parse_tags(res.get_value(j, 2), buffer, builder);
-                }
-
-                buffer->commit();
-                ++outres;
-                break;
-            }
+        if (copy_object(m_prefetch_buffer, m_prefetched_ways, m.ref(),
+                        buffer) ||
+            copy_object(fetched_buffer, fetched, m.ref(), buffer)) {
+            ++outres;
         }
     }
 
@@ -486,6 +733,16 @@ void middle_pgsql_t::way_delete(osmid_t osm_id)
 
 void middle_pgsql_t::relation_set(osmium::Relation const &rel)
 {
+    if (m_compact_format) {
+        m_compact_data.clear();
+        compact_encode_relation(rel, m_options->extra_attributes,
+                                &m_compact_data);
+        m_db_copy.new_line(m_tables.relations().copy_target());
+        m_db_copy.add_columns(rel.id(), m_compact_data);
+        m_db_copy.finish_line();
+        return;
+    }
+
     // Sort relation members by their type.
     idlist_t parts[3];
 
@@ -493,14 +750,24 @@ void middle_pgsql_t::relation_set(osmium::Relation const &rel)
         parts[osmium::item_type_to_nwr_index(m.type())].push_back(m.ref());
     }
 
+    // The offsets are stored in int2 columns.
+    auto const way_off = parts[0].size();
+    auto const rel_off = way_off + parts[1].size();
+    if (rel_off >
+        static_cast<std::size_t>(std::numeric_limits<int16_t>::max())) {
+        throw std::runtime_error{
+            "Relation {} has too many node and way members ({}) for the "
+            "middle table."_format(rel.id(), rel_off)};
+    }
+
     m_db_copy.new_line(m_tables.relations().copy_target());
 
     // id, way offset, relation offset
-    m_db_copy.add_columns(rel.id(), parts[0].size(),
-                          parts[0].size() + parts[1].size());
+    m_db_copy.add_columns(rel.id(), static_cast<int16_t>(way_off),
+                          static_cast<int16_t>(rel_off));
 
     // parts
-    m_db_copy.new_array();
+    m_db_copy.new_array<osmid_t>();
     for (auto const &part : parts) {
         for (auto it : part) {
             m_db_copy.add_array_elem(it);
@@ -512,7 +779,7 @@ void middle_pgsql_t::relation_set(osmium::Relation const &rel)
     if (rel.members().empty()) {
         m_db_copy.add_null_column();
     } else {
-        m_db_copy.new_array();
+        m_db_copy.new_array<std::string>();
         for (auto const &m : rel.members()) {
             m_db_copy.add_array_elem(osmium::item_type_to_char(m.type()) +
                                      std::to_string(m.ref()));
@@ -532,6 +799,24 @@ bool middle_query_pgsql_t::relation_get(osmid_t id,
 {
     assert(buffer);
 
+    if (copy_object(m_prefetch_buffer, m_prefetched_relations, id, buffer)) {
+        return true;
+    }
+
+    if (m_compact_format) {
+        auto const res = m_sql_conn.exec_prepared_binary("get_rel", id);
+        if (res.num_tuples() != 1) {
+            return false;
+        }
+
+        compact_decode_relation(id, res.get_value(0, 0),
+                                static_cast<std::size_t>(res.get_length(0, 0)),
+                                buffer);
+        buffer->commit();
+
+        return true;
+    }
+
     auto const res = m_sql_conn.exec_prepared("get_rel", id);
     // Fields are: members, tags, member_count */
     //
@@ -552,6 +837,120 @@ bool middle_query_pgsql_t::relation_get(osmid_t id,
     return true;
 }
 
+void middle_query_pgsql_t::fetch_relations(std::string const &id_list,
+                                           osmium::memory::Buffer *buffer,
+                                           offset_index_t *index) const
+{
+    if (m_compact_format) {
+        auto const res = m_sql_conn.exec_prepared_binary("get_rel_list", id_list);
+        for (int i = 0; i < res.num_tuples(); ++i) {
+            auto const id = get_binary_id(res, i, 0);
+            auto const offset = buffer->committed();
+            compact_decode_relation(
+                id, res.get_value(i, 1),
+                static_cast<std::size_t>(res.get_length(i, 1)), buffer);
+            buffer->commit();
+            index->emplace(id, offset);
+        }
+        return;
+    }
+
+    auto const res = m_sql_conn.exec_prepared("get_rel_list", id_list);
+    idlist_t const ids = get_ids_from_result(res);
+
+    for (int i = 0; i < res.num_tuples(); ++i) {
+        auto const id = ids[static_cast<std::size_t>(i)];
+        auto const offset = buffer->committed();
+        {
+            osmium::builder::RelationBuilder builder{*buffer};
+            builder.set_id(id);
+
+            pgsql_parse_members(res.get_value(i, 1), buffer, builder);
+            pgsql_parse_tags(res.get_value(i, 2), buffer, builder);
+        }
+        buffer->commit();
+        index->emplace(id, offset);
+    }
+}
+
+void middle_query_pgsql_t::clear_prefetched()
+{
+    m_prefetch_buffer.clear();
+    m_prefetched_ways.clear();
+    m_prefetched_relations.clear();
+    m_prefetched_locations.clear();
+}
+
+void middle_query_pgsql_t::prefetch_node_locations()
+{
+    // Node locations from the flat node file are cheap to get.
+    if (m_persistent_cache) {
+        return;
+    }
+
+    util::string_id_list_t id_list;
+    for (auto const &way : m_prefetch_buffer.select<osmium::Way>()) {
+        for (auto const &nr : way.nodes()) {
+            if (!m_cache->get(nr.ref()).valid()) {
+                id_list.add(nr.ref());
+            }
+        }
+    }
+
+    if (!id_list.empty()) {
+        fetch_node_locations(id_list.get(), &m_prefetched_locations);
+    }
+}
+
+void middle_query_pgsql_t::prefetch_ways(idlist_t const &ids)
+{
+    clear_prefetched();
+
+    if (ids.empty()) {
+        return;
+    }
+
+    util::string_id_list_t id_list;
+    for (auto const id : ids) {
+        id_list.add(id);
+    }
+
+    fetch_ways(id_list.get(), &m_prefetch_buffer, &m_prefetched_ways);
+    prefetch_node_locations();
+}
+
+void middle_query_pgsql_t::prefetch_relations(idlist_t const &ids)
+{
+    clear_prefetched();
+
+    if (ids.empty()) {
+        return;
+    }
+
+    util::string_id_list_t id_list;
+    for (auto const id : ids) {
+        id_list.add(id);
+    }
+
+    fetch_relations(id_list.get(), &m_prefetch_buffer,
+                    &m_prefetched_relations);
+
+    // Also get the member ways, they are needed for rel_members_get().
+    util::string_id_list_t way_id_list;
+    for (auto const &relation : m_prefetch_buffer.select<osmium::Relation>()) {
+        for (auto const &m : relation.members()) {
+            if (m.type() == osmium::item_type::way) {
+                way_id_list.add(m.ref());
+            }
+        }
+    }
+
+    if (!way_id_list.empty()) {
+        fetch_ways(way_id_list.get(), &m_prefetch_buffer, &m_prefetched_ways);
+        prefetch_node_locations();
+    }
+}
+
 void middle_pgsql_t::relation_delete(osmid_t osm_id)
 {
     assert(m_options->append);
@@ -566,6 +965,17 @@ void middle_pgsql_t::after_nodes()
     if (m_options->flat_node_file.empty()) {
         auto const &table = m_tables.nodes();
         analyze_table(m_db_connection, table.schema(), table.name());
+    } else {
+        // From now on node locations are looked up for the way nodes.
+        m_persistent_cache->advise(node_persistent_cache::access_t::random);
+    }
+}
+
+void middle_pgsql_t::prefetch_way_node_locations(
+    osmium::memory::Buffer const &buffer)
+{
+    if (m_persistent_cache) {
+        m_persistent_cache->will_need(buffer);
     }
 }
 
@@ -588,8 +998,11 @@ void middle_pgsql_t::after_relations()
 
 middle_query_pgsql_t::middle_query_pgsql_t(
     std::string const &conninfo, std::shared_ptr<node_locations_t> const &cache,
-    std::shared_ptr<node_persistent_cache> const &persistent_cache)
-: m_sql_conn(conninfo), m_cache(cache), m_persistent_cache(persistent_cache)
+    std::shared_ptr<node_persistent_cache const> persistent_cache,
+    bool compact_format)
+: m_sql_conn(conninfo), m_cache(cache),
+  m_persistent_cache(std::move(persistent_cache)),
+  m_compact_format(compact_format)
 {
     // Disable JIT and parallel workers as they are known to cause
     // problems when accessing the intarrays.
@@ -597,20 +1010,26 @@ middle_query_pgsql_t::middle_query_pgsql_t(
     m_sql_conn.set_config("max_parallel_workers_per_gather", "0");
 }
 
-void middle_pgsql_t::start()
+void middle_pgsql_t::prepare_fw_dep_lookups(
+    pg_conn_t const &db_connection) const
 {
-    if (m_options->append) {
-        // Disable JIT and parallel workers as they are known to cause
-        // problems when accessing the intarrays.
-        m_db_connection.set_config("jit_above_cost", "-1");
-        m_db_connection.set_config("max_parallel_workers_per_gather", "0");
+    // Disable JIT and parallel workers as they are known to cause
+    // problems when accessing the intarrays.
+    db_connection.set_config("jit_above_cost", "-1");
+    db_connection.set_config("max_parallel_workers_per_gather", "0");
 
-        // Prepare queries for updating dependent objects
-        for (auto &table : m_tables) {
-            if (!table.m_prepare_fw_dep_lookups.empty()) {
-                m_db_connection.exec(table.m_prepare_fw_dep_lookups);
-            }
+    // Prepare queries for updating dependent objects
+    for (auto const &table : m_tables) {
+        if (!table.m_prepare_fw_dep_lookups.empty()) {
+            db_connection.exec(table.m_prepare_fw_dep_lookups);
         }
+    }
+}
+
+void middle_pgsql_t::start()
+{
+    if (m_options->append) {
+        prepare_fw_dep_lookups(m_db_connection);
     } else {
         m_db_connection.exec("SET client_min_messages = WARNING");
         for (auto const &table : m_tables) {
@@ -705,12 +1124,20 @@ static table_sql sql_for_ways(bool has_bucket_index,
             "  SELECT id FROM {schema}\"{prefix}_ways\" w"
             "    WHERE $1 = ANY(nodes)"
             "      AND {schema}\"{prefix}_index_bucket\"(w.nodes)"
-            "       && {schema}\"{prefix}_index_bucket\"(ARRAY[$1]);\n";
+            "       && {schema}\"{prefix}_index_bucket\"(ARRAY[$1]);\n"
+            "PREPARE mark_ways_by_node_list(int8[]) AS"
+            "  SELECT id FROM {schema}\"{prefix}_ways\" w"
+            "    WHERE nodes && $1::int8[]"
+            "      AND {schema}\"{prefix}_index_bucket\"(w.nodes)"
+            "       && {schema}\"{prefix}_index_bucket\"($1::int8[]);\n";
     } else {
         sql.prepare_fw_dep_lookups =
             "PREPARE mark_ways_by_node(int8) AS"
             "  SELECT id FROM {schema}\"{prefix}_ways\""
-            "    WHERE nodes && ARRAY[$1];\n";
+            "    WHERE nodes && ARRAY[$1];\n"
+            "PREPARE mark_ways_by_node_list(int8[]) AS"
+            "  SELECT id FROM {schema}\"{prefix}_ways\""
+            "    WHERE nodes && $1::int8[];\n";
     }
 
     if (way_node_index_id_shift == 0) {
@@ -734,6 +1161,50 @@ static table_sql sql_for_ways(bool has_bucket_index,
     return sql;
 }
 
+static table_sql sql_for_ways_compact() noexcept
+{
+    table_sql sql{};
+
+    sql.name = "{prefix}_ways";
+
+    sql.create_table = "CREATE {unlogged} TABLE {schema}\"{prefix}_ways\" ("
+                       "  id int8 PRIMARY KEY {using_tablespace},"
+                       "  data bytea NOT NULL"
+                       ") {data_tablespace};\n";
+
+    sql.prepare_query = "PREPARE get_way(int8) AS"
+                        "  SELECT data"
+                        "    FROM {schema}\"{prefix}_ways\" WHERE id = $1;\n"
+                        "PREPARE get_way_list(int8[]) AS"
+                        "  SELECT id, data"
+                        "    FROM {schema}\"{prefix}_ways\""
+                        "      WHERE id = ANY($1::int8[]);\n";
+
+    return sql;
+}
+
+static table_sql sql_for_relations_compact() noexcept
+{
+    table_sql sql{};
+
+    sql.name = "{prefix}_rels";
+
+    sql.create_table = "CREATE {unlogged} TABLE {schema}\"{prefix}_rels\" ("
+                       "  id int8 PRIMARY KEY {using_tablespace},"
+                       "  data bytea NOT NULL"
+                       ") {data_tablespace};\n";
+
+    sql.prepare_query = "PREPARE get_rel(int8) AS"
+                        "  SELECT data"
+                        "    FROM {schema}\"{prefix}_rels\" WHERE id = $1;\n"
+                        "PREPARE get_rel_list(int8[]) AS"
+                        "  SELECT id, data"
+                        "    FROM {schema}\"{prefix}_rels\""
+                        "      WHERE id = ANY($1::int8[]);\n";
+
+    return sql;
+}
+
 static table_sql sql_for_relations() noexcept
 {
     table_sql sql{};
@@ -751,7 +1222,11 @@ static table_sql sql_for_relations() noexcept
 
     sql.prepare_query = "PREPARE get_rel(int8) AS"
                         "  SELECT members, tags"
-                        "    FROM {schema}\"{prefix}_rels\" WHERE id = $1;\n";
+                        "    FROM {schema}\"{prefix}_rels\" WHERE id = $1;\n"
+                        "PREPARE get_rel_list(int8[]) AS"
+                        "  SELECT id, members, tags"
+                        "    FROM {schema}\"{prefix}_rels\""
+                        "      WHERE id = ANY($1::int8[]);\n";
 
     sql.prepare_fw_dep_lookups =
         "PREPARE mark_rels_by_node(int8) AS"
@@ -761,7 +1236,15 @@ static table_sql sql_for_relations() noexcept
         "PREPARE mark_rels_by_way(int8) AS"
         "  SELECT id FROM {schema}\"{prefix}_rels\""
         "    WHERE parts && ARRAY[$1]"
-        "      AND parts[way_off+1:rel_off] && ARRAY[$1];\n";
+        "      AND parts[way_off+1:rel_off] && ARRAY[$1];\n"
+        "PREPARE mark_rels_by_node_list(int8[]) AS"
+        "  SELECT id FROM {schema}\"{prefix}_rels\""
+        "    WHERE parts && $1::int8[]"
+        "      AND parts[1:way_off] && $1::int8[];\n"
+        "PREPARE mark_rels_by_way_list(int8[]) AS"
+        "  SELECT id FROM {schema}\"{prefix}_rels\""
+        "    WHERE parts && $1::int8[]"
+        "      AND parts[way_off+1:rel_off] && $1::int8[];\n";
 
     sql.create_fw_dep_indexes =
         "CREATE INDEX ON {schema}\"{prefix}_rels\" USING GIN (parts)"
@@ -780,6 +1263,19 @@ static bool check_bucket_index(pg_conn_t *db_connection,
     return res.num_tuples() > 0;
 }
 
+static bool check_compact_format(pg_conn_t *db_connection,
+                                 options_t const &options)
+{
+    auto const qual_name =
+        qualified_name(options.middle_dbschema, options.prefix + "_ways");
+    auto const res = db_connection->query(
+        PGRES_TUPLES_OK,
+        "SELECT attname FROM pg_attribute"
+        "  WHERE attrelid = to_regclass('{}') AND attname = 'data';"_format(
+            qual_name));
+    return res.num_tuples() > 0;
+}
+
 middle_pgsql_t::middle_pgsql_t(std::shared_ptr<thread_pool_t> thread_pool,
                                options_t const *options)
 : middle_t(std::move(thread_pool)), m_options(options),
@@ -792,7 +1288,12 @@ middle_pgsql_t::middle_pgsql_t(std::shared_ptr<thread_pool_t> thread_pool,
 {
     if (!options->flat_node_file.empty()) {
         m_persistent_cache = std::make_shared<node_persistent_cache>(
-            options->flat_node_file, options->droptemp);
+            options->flat_node_file, options->droptemp,
+            options->flat_node_file_format);
+        if (!options->append) {
+            m_persistent_cache->advise(
+                node_persistent_cache::access_t::sequential);
+        }
     }
 
     log_debug("Mid: pgsql, cache={}", options->cache);
@@ -805,12 +1306,37 @@ middle_pgsql_t::middle_pgsql_t(std::shared_ptr<thread_pool_t> thread_pool,
         log_debug("You don't have a bucket index. See manual for details.");
     }
 
+    // The compact format can't be used for updates with forward
+    // dependencies, because the lookups of dependent objects need the arrays
+    // of member ids. So it is only used if asked for or if the tables are
+    // dropped after the import anyway.
+    if (options->append) {
+        m_compact_format = check_compact_format(&m_db_connection, *options);
+        if (m_compact_format && options->with_forward_dependencies) {
+            throw std::runtime_error{
+                "Middle tables are in compact format which doesn't support "
+                "updates with forward dependencies. Use "
+                "--with-forward-dependencies=false."};
+        }
+    } else {
+        m_compact_format = options->droptemp || options->middle_compact;
+    }
+
+    log_debug("Mid: pgsql, compact format: {}", m_compact_format);
+
     m_tables.nodes() =
         table_desc{*options, sql_for_nodes(options->flat_node_file.empty())};
-    m_tables.ways() =
-        table_desc{*options, sql_for_ways(has_bucket_index,
-                                          options->way_node_index_id_shift)};
-    m_tables.relations() = table_desc{*options, sql_for_relations()};
+
+    if (m_compact_format) {
+        m_tables.ways() = table_desc{*options, sql_for_ways_compact()};
+        m_tables.relations() =
+            table_desc{*options, sql_for_relations_compact()};
+    } else {
+        m_tables.ways() =
+            table_desc{*options, sql_for_ways(has_bucket_index,
+                                              options->way_node_index_id_shift)};
+        m_tables.relations() = table_desc{*options, sql_for_relations()};
+    }
 }
 
 std::shared_ptr<middle_query_t>
@@ -819,7 +1345,8 @@ middle_pgsql_t::get_query_instance()
     // NOTE: this is thread safe for use in pending async processing only because
     // during that process they are only read from
     auto mid = std::make_unique<middle_query_pgsql_t>(
-        m_options->database_options.conninfo(), m_cache, m_persistent_cache);
+        m_options->database_options.conninfo(), m_cache, m_persistent_cache,
+        m_compact_format);
 
     // We use a connection per table to enable the use of COPY
     for (auto &table : m_tables) {
@@ -18,15 +18,20 @@
  * emit the final geometry-enabled output formats
 */
 
+#include <cstddef>
+#include <string>
+#include <unordered_map>
 #include <memory>
 
 #include <osmium/index/nwr_array.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/location.hpp>
 
 #include "db-copy-mgr.hpp"
 #include "middle.hpp"
+#include "node-locations.hpp"
 #include "pgsql.hpp"
 
-class node_locations_t;
 class node_persistent_cache;
 class options_t;
 
@@ -36,10 +41,13 @@ public:
     middle_query_pgsql_t(
         std::string const &conninfo,
         std::shared_ptr<node_locations_t> const &cache,
-        std::shared_ptr<node_persistent_cache> const &persistent_cache);
+        std::shared_ptr<node_persistent_cache const> persistent_cache,
+        bool compact_format);
 
     size_t nodes_get_list(osmium::WayNodeList *nodes) const override;
 
+    std::size_t nodes_get_lists(osmium::memory::Buffer *buffer) const override;
+
     bool way_get(osmid_t id, osmium::memory::Buffer *buffer) const override;
 
     size_t rel_members_get(osmium::Relation const &rel,
@@ -49,15 +57,71 @@ public:
     bool relation_get(osmid_t id,
                       osmium::memory::Buffer *buffer) const override;
 
+    void prefetch_ways(idlist_t const &ids) override;
+
+    void prefetch_relations(idlist_t const &ids) override;
+
     void exec_sql(std::string const &sql_cmd) const;
 
 private:
+    /// Maps object ids to the offset of the object in a buffer.
+    using offset_index_t = std::unordered_map<osmid_t, std::size_t>;
+
     std::size_t get_way_node_locations_flatnodes(osmium::WayNodeList *nodes) const;
     std::size_t get_way_node_locations_db(osmium::WayNodeList *nodes) const;
+    void get_node_locations_sorted(idlist_t const &ids,
+                                   std::vector<osmium::Location> *locations) const;
+
+    /// Get locations of the nodes in the id list from the database.
+    void
+    fetch_node_locations(std::string const &id_list,
+                         std::unordered_map<osmid_t, osmium::Location> *locs) const;
+
+    /**
+     * Get the ways in the id list from the database, add them to the
+     * buffer and remember their offsets in the index.
+     */
+    void fetch_ways(std::string const &id_list, osmium::memory::Buffer *buffer,
+                    offset_index_t *index) const;
+
+    /**
+     * Get the relations in the id list from the database, add them to the
+     * buffer and remember their offsets in the index.
+     */
+    void fetch_relations(std::string const &id_list,
+                         osmium::memory::Buffer *buffer,
+                         offset_index_t *index) const;
+
+    /**
+     * Get the locations of all nodes of the prefetched ways which are not
+     * in the cache.
+     */
+    void prefetch_node_locations();
+
+    void clear_prefetched();
 
     pg_conn_t m_sql_conn;
     std::shared_ptr<node_locations_t> m_cache;
-    std::shared_ptr<node_persistent_cache> m_persistent_cache;
+    /**
+     * The query instances only read from the flat node file, which only
+     * happens after all nodes have been written (after_nodes()).
+     */
+    std::shared_ptr<node_persistent_cache const> m_persistent_cache;
+
+    /// Are the ways and relations stored in the compact format?
+    bool m_compact_format;
+
+    /**
+     * Objects fetched by prefetch_ways() and prefetch_relations() and the
+     * indexes into this buffer.
+     */
+    osmium::memory::Buffer m_prefetch_buffer{
+        1024, osmium::memory::Buffer::auto_grow::yes};
+    offset_index_t m_prefetched_ways;
+    offset_index_t m_prefetched_relations;
+
+    /// Node locations for the prefetched ways.
+    std::unordered_map<osmid_t, osmium::Location> m_prefetched_locations;
 };
 
 struct table_sql {
@@ -83,6 +147,9 @@ struct middle_pgsql_t : public middle_t
     void relation(osmium::Relation const &rel) override;
 
     void after_nodes() override;
+
+    void prefetch_way_node_locations(
+        osmium::memory::Buffer const &buffer) override;
     void after_ways() override;
     void after_relations() override;
 
@@ -90,6 +157,10 @@ struct middle_pgsql_t : public middle_t
     idlist_t get_rels_by_node(osmid_t osm_id) override;
     idlist_t get_rels_by_way(osmid_t osm_id) override;
 
+    idlist_t get_ways_by_nodes(idlist_t const &node_ids) override;
+    idlist_t get_rels_by_nodes(idlist_t const &node_ids) override;
+    idlist_t get_rels_by_ways(idlist_t const &way_ids) override;
+
     class table_desc
     {
     public:
@@ -134,6 +205,24 @@ struct middle_pgsql_t : public middle_t
     std::shared_ptr<middle_query_t> get_query_instance() override;
 
 private:
+    /**
+     * Maximum number of ids sent to the database in a single query by
+     * get_ids_for_list().
+     */
+    static constexpr std::size_t const max_ids_per_dependency_query = 10000;
+
+    /// Prepare the forward dependency queries on this connection.
+    void prepare_fw_dep_lookups(pg_conn_t const &db_connection) const;
+
+    /**
+     * Run the prepared statement stmt taking an int8[] parameter with the
+     * ids in chunks of at most max_ids_per_dependency_query ids. If there
+     * are several chunks, they are run in parallel on up to num_procs
+     * database connections. Returns the ids found, sorted and without
+     * duplicates.
+     */
+    idlist_t get_ids_for_list(char const *stmt, idlist_t const &ids) const;
+
     void node_set(osmium::Node const &node);
     void node_delete(osmid_t id);
 
@@ -150,6 +239,12 @@ private:
     options_t const *m_options;
 
     std::shared_ptr<node_locations_t> m_cache;
+
+    /**
+     * The flat node file (if used). This is the only place where it is
+     * written to (in node_set() and node_delete()), the query instances
+     * only get read-only access.
+     */
     std::shared_ptr<node_persistent_cache> m_persistent_cache;
 
     pg_conn_t m_db_connection;
@@ -157,6 +252,16 @@ private:
     // middle keeps its own thread for writing to the database.
     std::shared_ptr<db_copy_thread_t> m_copy_thread;
     db_copy_mgr_t<db_deleter_by_id_t> m_db_copy;
+
+    /**
+     * Ways and relations are stored in the compact format (see
+     * compact-format.hpp) instead of as arrays. This is used when the
+     * middle tables don't have to support updates.
+     */
+    bool m_compact_format = false;
+
+    /// Buffer used for encoding objects in compact format.
+    std::string m_compact_data;
 };
 
 #endif // OSM2PGSQL_MIDDLE_PGSQL_HPP
@@ -7,12 +7,15 @@
  * For a full list of authors see the git log.
  */
 
+#include "format.hpp"
 #include "logging.hpp"
 #include "middle-ram.hpp"
 #include "options.hpp"
+#include "util.hpp"
 
 #include <osmium/builder/osm_object_builder.hpp>
 #include <osmium/util/delta.hpp>
+#include <osmium/util/file.hpp>
 
 // Workaround: This must be included before buffer_string.hpp due to a missing
 // include in the upstream code. https://github.com/mapbox/protozero/pull/104
@@ -21,8 +24,140 @@
 #include <protozero/buffer_string.hpp>
 #include <protozero/varint.hpp>
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <memory>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+/**
+ * The snapshot file starts with the magic and the version. It is followed
+ * by the number of nodes and an array of snapshot_node_t sorted by id. Then
+ * comes the size in bytes of the objects which follow as in an osmium
+ * buffer: first nodes, then ways, then relations, each sorted by id.
+ */
+constexpr char const snapshot_magic[] = "o2p-snap";
+constexpr std::uint64_t const snapshot_version = 1;
+
+static_assert(sizeof(snapshot_magic) - 1 == sizeof(std::uint64_t),
+              "Snapshot magic must have the size of a value");
+
+struct snapshot_node_t
+{
+    osmid_t id;
+    std::int32_t x;
+    std::int32_t y;
+};
+
+// Objects must be aligned in the file so that they can be used directly
+// from the mapping.
+static_assert(sizeof(snapshot_node_t) % osmium::memory::align_bytes == 0,
+              "Snapshot nodes must keep objects aligned");
+
+/// Description of the write operation for error messages.
+constexpr char const *const write_what = "Writing middle snapshot";
+
+/// Make sure the directory entry of the file is on disk.
+void sync_directory(std::string const &file_name)
+{
+    auto const pos = file_name.find_last_of('/');
+    std::string const dir_name =
+        pos == std::string::npos ? "." : file_name.substr(0, pos + 1);
+
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-vararg, hicpp-signed-bitwise)
+    int const fd = open(dir_name.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fsync(fd) != 0) {
+        auto const err = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw std::runtime_error{
+            "Unable to sync directory of middle snapshot '{}': {}"_format(
+                file_name, std::strerror(err))};
+    }
+    close(fd);
+}
+
+/// Overwrite the value at the position in the file and go back to the end.
+void patch_value(std::FILE *file, long pos, std::uint64_t value)
+{
+    if (std::fseek(file, pos, SEEK_SET) != 0) {
+        throw std::runtime_error{"Writing middle snapshot failed: {}"_format(
+            std::strerror(errno))};
+    }
+    util::write_value(file, value, write_what);
+    if (std::fseek(file, 0, SEEK_END) != 0) {
+        throw std::runtime_error{"Writing middle snapshot failed: {}"_format(
+            std::strerror(errno))};
+    }
+}
+
+} // anonymous namespace
+
+ram_object_store_t::ram_object_store_t() { m_buffers.reserve(Max_buffers); }
+
+std::size_t ram_object_store_t::add(osmium::OSMObject const &object)
+{
+    std::size_t const size = object.padded_size();
+
+    if (m_buffers.empty() ||
+        m_buffers.back()->capacity() - m_buffers.back()->committed() < size) {
+        if (m_buffers.size() == Max_buffers) {
+            throw std::runtime_error{"Too much data for ram middle."};
+        }
+        m_buffers.push_back(std::make_unique<osmium::memory::Buffer>(
+            std::max(Buffer_size, size),
+            osmium::memory::Buffer::auto_grow::no));
+    }
+
+    auto &buffer = *m_buffers.back();
+    auto const offset = buffer.committed();
+    buffer.add_item(object);
+    buffer.commit();
+
+    return ((m_buffers.size() - 1) << Offset_bits) | offset;
+}
+
+void ram_object_store_t::set_external_data(unsigned char *data,
+                                           std::size_t size)
+{
+    assert(m_buffers.empty());
+    m_buffers.push_back(std::make_unique<osmium::memory::Buffer>(data, size));
+}
+
+std::size_t ram_object_store_t::committed() const noexcept
+{
+    std::size_t sum = 0;
+    for (auto const &buffer : m_buffers) {
+        sum += buffer->committed();
+    }
+    return sum;
+}
+
+std::size_t ram_object_store_t::capacity() const noexcept
+{
+    std::size_t sum = 0;
+    for (auto const &buffer : m_buffers) {
+        sum += buffer->capacity();
+    }
+    return sum;
+}
+
+void ram_object_store_t::clear()
+{
+    m_buffers.clear();
+    m_buffers.shrink_to_fit();
+    m_buffers.reserve(Max_buffers);
+}
 
 middle_ram_t::middle_ram_t(std::shared_ptr<thread_pool_t> thread_pool,
                            options_t const *options)
@@ -33,6 +168,249 @@ middle_ram_t::middle_ram_t(std::shared_ptr<thread_pool_t> thread_pool,
     if (options->extra_attributes) {
         m_store_options.untagged_nodes = true;
     }
+
+    if (options->middle_snapshot.empty()) {
+        return;
+    }
+
+    // Updates need complete ways and relations.
+    m_snapshot_file = options->middle_snapshot;
+    m_store_options.way_nodes = false;
+    m_store_options.ways = true;
+    m_store_options.relations = true;
+    m_write_snapshot = !options->droptemp;
+
+    if (options->append) {
+        m_append = true;
+        if (options->with_forward_dependencies) {
+            m_ways_by_node = std::make_unique<ram_id_pair_index_t>(false);
+            m_rels_by_node = std::make_unique<ram_id_pair_index_t>(false);
+            m_rels_by_way = std::make_unique<ram_id_pair_index_t>(false);
+        }
+        read_snapshot();
+    }
+
+    log_debug("Mid: ram, snapshot={}", m_snapshot_file);
+}
+
+void middle_ram_t::read_snapshot()
+{
+    util::timer_t timer;
+
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-vararg)
+    int const fd = open(m_snapshot_file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error{"Unable to open middle snapshot '{}': {}"_format(
+            m_snapshot_file, std::strerror(errno))};
+    }
+
+    auto const invalid_snapshot = [this]() {
+        return std::runtime_error{
+            "File '{}' is not a valid middle snapshot."_format(
+                m_snapshot_file)};
+    };
+
+    std::size_t size = 0;
+    try {
+        size = osmium::file_size(fd);
+        if (size < 4 * sizeof(std::uint64_t)) {
+            close(fd);
+            throw invalid_snapshot();
+        }
+        m_snapshot = std::make_unique<osmium::util::MemoryMapping>(
+            size, osmium::util::MemoryMapping::mapping_mode::readonly, fd);
+    } catch (std::system_error const &e) {
+        close(fd);
+        throw std::runtime_error{"Unable to map middle snapshot '{}': {}"_format(
+            m_snapshot_file, e.what())};
+    }
+
+    // The mapping stays valid when the file is closed.
+    close(fd);
+
+    char *const data = m_snapshot->get_addr<char>();
+    std::size_t offset = 0;
+
+    auto const read_value = [&]() {
+        if (offset + sizeof(std::uint64_t) > size) {
+            throw invalid_snapshot();
+        }
+        std::uint64_t value = 0;
+        std::memcpy(&value, data + offset, sizeof(value));
+        offset += sizeof(value);
+        return value;
+    };
+
+    if (std::memcmp(data, snapshot_magic, sizeof(std::uint64_t)) != 0) {
+        throw invalid_snapshot();
+    }
+    offset += sizeof(std::uint64_t);
+
+    auto const version = read_value();
+    if (version != snapshot_version) {
+        throw std::runtime_error{
+            "Middle snapshot '{}' has unsupported version {}."_format(
+                m_snapshot_file, version)};
+    }
+
+    auto const node_count = read_value();
+    if (node_count > (size - offset) / sizeof(snapshot_node_t)) {
+        throw invalid_snapshot();
+    }
+    for (std::uint64_t n = 0; n < node_count; ++n) {
+        snapshot_node_t node{};
+        std::memcpy(&node, data + offset, sizeof(node));
+        offset += sizeof(node);
+        m_node_locations.set(node.id, osmium::Location{node.x, node.y});
+    }
+
+    auto const object_size = read_value();
+    if (object_size > size - offset) {
+        throw invalid_snapshot();
+    }
+
+    // The objects are used directly from the mapping.
+    if (object_size > 0) {
+        m_object_store.set_external_data(
+            reinterpret_cast<unsigned char *>(data + offset), object_size);
+    }
+
+    m_object_store.for_each(
+        [&](std::size_t object_offset, osmium::OSMObject const &object) {
+            m_object_index(object.type()).add(object.id(), object_offset);
+            add_to_reverse_indexes(object);
+        });
+
+    if (m_ways_by_node) {
+        m_ways_by_node->merge();
+        m_rels_by_node->merge();
+        m_rels_by_way->merge();
+    }
+
+    log_info("Reading middle snapshot with {} nodes took {}", node_count,
+             util::human_readable_duration(timer.stop()));
+}
+
+void middle_ram_t::write_snapshot() const
+{
+    util::timer_t timer;
+
+    // Write to a temporary file first, the old snapshot might still be in
+    // use and should stay intact if anything goes wrong.
+    std::string const tmp_file_name = m_snapshot_file + ".tmp";
+    util::file_ptr_t file{std::fopen(tmp_file_name.c_str(), "wb")};
+    if (!file) {
+        throw std::runtime_error{
+            "Unable to create middle snapshot '{}': {}"_format(
+                tmp_file_name, std::strerror(errno))};
+    }
+
+    util::write_data(file.get(), snapshot_magic, sizeof(std::uint64_t),
+                     write_what);
+    util::write_value(file.get(), snapshot_version, write_what);
+
+    // Node locations are merged with the changed locations.
+    std::vector<std::pair<osmid_t, osmium::Location>> changed_locations{
+        m_changed_locations.cbegin(), m_changed_locations.cend()};
+    std::sort(changed_locations.begin(), changed_locations.end());
+
+    std::uint64_t node_count = 0;
+    auto const node_count_pos = std::ftell(file.get());
+    util::write_value(file.get(), node_count, write_what);
+
+    auto const write_node = [&](osmid_t id, osmium::Location location) {
+        if (location.valid()) {
+            snapshot_node_t const node{id, location.x(), location.y()};
+            util::write_data(file.get(), &node, sizeof(node), write_what);
+            ++node_count;
+        }
+    };
+
+    auto change = changed_locations.cbegin();
+    m_node_locations.for_each([&](osmid_t id, osmium::Location location) {
+        for (; change != changed_locations.cend() && change->first < id;
+             ++change) {
+            write_node(change->first, change->second);
+        }
+        if (change != changed_locations.cend() && change->first == id) {
+            write_node(change->first, change->second);
+            ++change;
+        } else {
+            write_node(id, location);
+        }
+    });
+    for (; change != changed_locations.cend(); ++change) {
+        write_node(change->first, change->second);
+    }
+
+    patch_value(file.get(), node_count_pos, node_count);
+
+    // Objects are merged with the changed objects type by type.
+    std::uint64_t object_size = 0;
+    auto const object_size_pos = std::ftell(file.get());
+    util::write_value(file.get(), object_size, write_what);
+
+    auto const write_object = [&](osmium::OSMObject const &object) {
+        util::write_data(file.get(), object.data(), object.padded_size(),
+                         write_what);
+        object_size += object.padded_size();
+    };
+
+    for (auto const type : {osmium::item_type::node, osmium::item_type::way,
+                            osmium::item_type::relation}) {
+        auto const &changes = m_changed_index(type);
+        std::vector<std::pair<osmid_t, std::size_t>> changed{changes.cbegin(),
+                                                             changes.cend()};
+        std::sort(changed.begin(), changed.end());
+
+        auto const write_change =
+            [&](std::pair<osmid_t, std::size_t> const &entry) {
+                if (entry.second != ordered_index_t::not_found_value()) {
+                    write_object(m_changed_store.get(entry.second));
+                }
+            };
+
+        auto it = changed.cbegin();
+        m_object_store.for_each(
+            [&](std::size_t /*offset*/, osmium::OSMObject const &object) {
+                if (object.type() != type) {
+                    return;
+                }
+                for (; it != changed.cend() && it->first < object.id(); ++it) {
+                    write_change(*it);
+                }
+                if (it != changed.cend() && it->first == object.id()) {
+                    write_change(*it);
+                    ++it;
+                } else {
+                    write_object(object);
+                }
+            });
+        for (; it != changed.cend(); ++it) {
+            write_change(*it);
+        }
+    }
+
+    patch_value(file.get(), object_size_pos, object_size);
+
+    // The data has to be on disk before the rename, otherwise a crash
+    // could leave an incomplete file under the name of the snapshot.
+    if (std::fflush(file.get()) != 0 || fsync(fileno(file.get())) != 0 ||
+        std::fclose(file.release()) != 0) {
+        throw std::runtime_error{"Writing middle snapshot failed: {}"_format(
+            std::strerror(errno))};
+    }
+
+    if (std::rename(tmp_file_name.c_str(), m_snapshot_file.c_str()) != 0) {
+        throw std::runtime_error{
+            "Unable to rename middle snapshot '{}' to '{}': {}"_format(
+                tmp_file_name, m_snapshot_file, std::strerror(errno))};
+    }
+    sync_directory(m_snapshot_file);
+
+    log_info("Writing middle snapshot with {} nodes and {}MB of objects took {}",
+             node_count, object_size / (1024 * 1024),
+             util::human_readable_duration(timer.stop()));
 }
 
 void middle_ram_t::set_requirements(output_requirements const &requirements)
@@ -61,11 +439,19 @@ void middle_ram_t::set_requirements(output_requirements const &requirements)
 
 void middle_ram_t::stop()
 {
+    if (m_write_snapshot) {
+        write_snapshot();
+    }
+
     auto const mbyte = 1024 * 1024;
 
     log_debug("Middle 'ram': Node locations: size={} bytes={}M",
               m_node_locations.size(), m_node_locations.used_memory() / mbyte);
 
+    auto const cache_stats = m_node_locations.cache_stats();
+    log_debug("Middle 'ram': Node locations block cache: hits={} misses={}",
+              cache_stats.first, cache_stats.second);
+
     log_debug("Middle 'ram': Way nodes data: size={} capacity={} bytes={}M",
               m_way_nodes_data.size(), m_way_nodes_data.capacity(),
               m_way_nodes_data.capacity() / mbyte);
@@ -75,8 +461,8 @@ void middle_ram_t::stop()
               m_way_nodes_index.used_memory() / mbyte);
 
     log_debug("Middle 'ram': Object data: size={} capacity={} bytes={}M",
-              m_object_buffer.committed(), m_object_buffer.capacity(),
-              m_object_buffer.capacity() / mbyte);
+              m_object_store.committed(), m_object_store.capacity(),
+              m_object_store.capacity() / mbyte);
 
     std::size_t index_size = 0;
     std::size_t index_capacity = 0;
@@ -91,7 +477,7 @@ void middle_ram_t::stop()
 
     log_debug("Middle 'ram': Memory used overall: {}MBytes",
               (m_node_locations.used_memory() + m_way_nodes_data.capacity() +
-               m_way_nodes_index.used_memory() + m_object_buffer.capacity() +
+               m_way_nodes_index.used_memory() + m_object_store.capacity() +
                index_mem) /
                   mbyte);
 
@@ -101,19 +487,85 @@ void middle_ram_t::stop()
     m_way_nodes_data.clear();
     m_way_nodes_data.shrink_to_fit();
 
-    m_object_buffer = osmium::memory::Buffer{};
+    m_object_store.clear();
+    m_snapshot.reset();
 
     for (auto &index : m_object_index) {
         index.clear();
     }
+
+    m_changed_locations.clear();
+    m_changed_store.clear();
+    for (auto &index : m_changed_index) {
+        index.clear();
+    }
+
+    m_ways_by_node.reset();
+    m_rels_by_node.reset();
+    m_rels_by_way.reset();
+}
+
+void middle_ram_t::add_to_reverse_indexes(osmium::OSMObject const &object)
+{
+    if (!m_ways_by_node) {
+        return;
+    }
+
+    if (object.type() == osmium::item_type::way) {
+        for (auto const &nr : static_cast<osmium::Way const &>(object).nodes()) {
+            m_ways_by_node->add(nr.ref(), object.id());
+        }
+    } else if (object.type() == osmium::item_type::relation) {
+        for (auto const &member :
+             static_cast<osmium::Relation const &>(object).members()) {
+            if (member.type() == osmium::item_type::node) {
+                m_rels_by_node->add(member.ref(), object.id());
+            } else if (member.type() == osmium::item_type::way) {
+                m_rels_by_way->add(member.ref(), object.id());
+            }
+        }
+    }
 }
 
 void middle_ram_t::store_object(osmium::OSMObject const &object)
 {
-    auto const offset = m_object_buffer.committed();
-    m_object_buffer.add_item(object);
-    m_object_buffer.commit();
-    m_object_index(object.type()).add(object.id(), offset);
+    if (m_append) {
+        m_changed_index(object.type())[object.id()] =
+            m_changed_store.add(object);
+        add_to_reverse_indexes(object);
+        return;
+    }
+
+    // Objects in the store never move, so ways can be read by the parallel
+    // stage 1 workers while relations are added.
+    m_object_index(object.type()).add(object.id(), m_object_store.add(object));
+}
+
+void middle_ram_t::remove_object(osmium::item_type type, osmid_t id)
+{
+    assert(m_append);
+    m_changed_index(type)[id] = ordered_index_t::not_found_value();
+}
+
+osmium::OSMObject const *middle_ram_t::find_object(osmium::item_type type,
+                                                   osmid_t id) const
+{
+    auto const &changes = m_changed_index(type);
+    if (!changes.empty()) {
+        auto const it = changes.find(id);
+        if (it != changes.end()) {
+            if (it->second == ordered_index_t::not_found_value()) {
+                return nullptr;
+            }
+            return &m_changed_store.get(it->second);
+        }
+    }
+
+    auto const offset = m_object_index(type).get(id);
+    if (offset == ordered_index_t::not_found_value()) {
+        return nullptr;
+    }
+    return &m_object_store.get(offset);
 }
 
 bool middle_ram_t::get_object(osmium::item_type type, osmid_t id,
@@ -121,15 +573,26 @@ bool middle_ram_t::get_object(osmium::item_type type, osmid_t id,
 {
     assert(buffer);
 
-    auto const offset = m_object_index(type).get(id);
-    if (offset == ordered_index_t::not_found_value()) {
+    auto const *object = find_object(type, id);
+    if (!object) {
         return false;
     }
-    buffer->add_item(m_object_buffer.get<osmium::memory::Item>(offset));
+    buffer->add_item(*object);
     buffer->commit();
     return true;
 }
 
+osmium::Location middle_ram_t::get_location(osmid_t id) const
+{
+    if (!m_changed_locations.empty()) {
+        auto const it = m_changed_locations.find(id);
+        if (it != m_changed_locations.end()) {
+            return it->second;
+        }
+    }
+    return m_node_locations.get(id);
+}
+
 static void add_delta_encoded_way_node_list(std::string *data,
                                             osmium::WayNodeList const &wnl)
 {
@@ -148,22 +611,37 @@ static void add_delta_encoded_way_node_list(std::string *data,
 
 void middle_ram_t::node(osmium::Node const &node)
 {
-    assert(node.visible());
+    assert(m_append || node.visible());
 
     if (m_store_options.locations) {
-        m_node_locations.set(node.id(), node.location());
+        if (m_append) {
+            m_changed_locations[node.id()] =
+                node.deleted() ? osmium::Location{} : node.location();
+        } else {
+            m_node_locations.set(node.id(), node.location());
+        }
     }
 
-    if (m_store_options.nodes &&
-        (!node.tags().empty() || m_store_options.untagged_nodes)) {
-        store_object(node);
+    if (m_store_options.nodes) {
+        if (!node.deleted() &&
+            (!node.tags().empty() || m_store_options.untagged_nodes)) {
+            store_object(node);
+        } else if (m_append) {
+            remove_object(osmium::item_type::node, node.id());
+        }
     }
 }
 
 void middle_ram_t::way(osmium::Way const &way)
 {
-    assert(way.visible());
+    assert(m_append || way.visible());
+
+    if (way.deleted()) {
+        remove_object(osmium::item_type::way, way.id());
+        return;
+    }
 
+    // Only used without snapshot, so never in append mode.
     if (m_store_options.way_nodes) {
         auto const offset = m_way_nodes_data.size();
         add_delta_encoded_way_node_list(&m_way_nodes_data, way.nodes());
@@ -177,7 +655,12 @@ void middle_ram_t::way(osmium::Way const &way)
 
 void middle_ram_t::relation(osmium::Relation const &relation)
 {
-    assert(relation.visible());
+    assert(m_append || relation.visible());
+
+    if (relation.deleted()) {
+        remove_object(osmium::item_type::relation, relation.id());
+        return;
+    }
 
     if (m_store_options.relations) {
         store_object(relation);
@@ -192,7 +675,7 @@ std::size_t middle_ram_t::nodes_get_list(osmium::WayNodeList *nodes) const
 
     if (m_store_options.locations) {
         for (auto &nr : *nodes) {
-            nr.set_location(m_node_locations.get(nr.ref()));
+            nr.set_location(get_location(nr.ref()));
             if (nr.location().valid()) {
                 ++count;
             }
@@ -202,6 +685,30 @@ std::size_t middle_ram_t::nodes_get_list(osmium::WayNodeList *nodes) const
     return count;
 }
 
+std::size_t middle_ram_t::nodes_get_lists(osmium::memory::Buffer *buffer) const
+{
+    assert(buffer);
+
+    if (!m_store_options.locations) {
+        return 0;
+    }
+
+    return nodes_get_lists_sorted(
+        buffer, [this](idlist_t const &ids,
+                       std::vector<osmium::Location> *locations) {
+            m_node_locations.get_sorted(ids, locations);
+            if (m_changed_locations.empty()) {
+                return;
+            }
+            for (std::size_t i = 0; i < ids.size(); ++i) {
+                auto const it = m_changed_locations.find(ids[i]);
+                if (it != m_changed_locations.end()) {
+                    (*locations)[i] = it->second;
+                }
+            }
+        });
+}
+
 bool middle_ram_t::way_get(osmid_t id, osmium::memory::Buffer *buffer) const
 {
     assert(buffer);
@@ -251,23 +758,15 @@ middle_ram_t::rel_members_get(osmium::Relation const &rel,
 
         switch (member.type()) {
         case osmium::item_type::node:
-            if (m_store_options.nodes) {
-                auto const offset =
-                    m_object_index.nodes().get(member.ref());
-                if (offset != ordered_index_t::not_found_value()) {
-                    buffer->add_item(m_object_buffer.get<osmium::Node>(offset));
-                    buffer->commit();
-                    ++count;
-                }
+            if (m_store_options.nodes &&
+                get_object(osmium::item_type::node, member.ref(), buffer)) {
+                ++count;
             }
             break;
         case osmium::item_type::way:
             if (m_store_options.ways) {
-                auto const offset =
-                    m_object_index.ways().get(member.ref());
-                if (offset != ordered_index_t::not_found_value()) {
-                    buffer->add_item(m_object_buffer.get<osmium::Way>(offset));
-                    buffer->commit();
+                if (get_object(osmium::item_type::way, member.ref(),
+                               buffer)) {
                     ++count;
                 }
             } else if (m_store_options.way_nodes) {
@@ -283,15 +782,10 @@ middle_ram_t::rel_members_get(osmium::Relation const &rel,
             }
             break;
         default: // osmium::item_type::relation
-            if (m_store_options.relations) {
-                auto const offset =
-                    m_object_index.relations().get(member.ref());
-                if (offset != ordered_index_t::not_found_value()) {
-                    buffer->add_item(
-                        m_object_buffer.get<osmium::Relation>(offset));
-                    buffer->commit();
-                    ++count;
-                }
+            if (m_store_options.relations &&
+                get_object(osmium::item_type::relation, member.ref(),
+                           buffer)) {
+                ++count;
             }
         }
     }
@@ -314,3 +808,50 @@ std::shared_ptr<middle_query_t> middle_ram_t::get_query_instance()
 {
     return shared_from_this();
 }
+
+idlist_t middle_ram_t::get_ways_by_node(osmid_t osm_id)
+{
+    if (!m_ways_by_node) {
+        return {};
+    }
+
+    idlist_t ids;
+    m_ways_by_node->get(osm_id, &ids);
+
+    return filter_ways_by_node(std::move(ids), osm_id, [this](osmid_t id) {
+        return static_cast<osmium::Way const *>(
+            find_object(osmium::item_type::way, id));
+    });
+}
+
+idlist_t middle_ram_t::get_rels_by_node(osmid_t osm_id)
+{
+    if (!m_rels_by_node) {
+        return {};
+    }
+
+    idlist_t ids;
+    m_rels_by_node->get(osm_id, &ids);
+
+    return filter_rels_by_member(
+        std::move(ids), osmium::item_type::node, osm_id, [this](osmid_t id) {
+            return static_cast<osmium::Relation const *>(
+                find_object(osmium::item_type::relation, id));
+        });
+}
+
+idlist_t middle_ram_t::get_rels_by_way(osmid_t osm_id)
+{
+    if (!m_rels_by_way) {
+        return {};
+    }
+
+    idlist_t ids;
+    m_rels_by_way->get(osm_id, &ids);
+
+    return filter_rels_by_member(
+        std::move(ids), osmium::item_type::way, osm_id, [this](osmid_t id) {
+            return static_cast<osmium::Relation const *>(
+                find_object(osmium::item_type::relation, id));
+        });
+}
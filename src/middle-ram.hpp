@@ -10,6 +10,7 @@
  * For a full list of authors see the git log.
  */
 
+#include "id-pair-index.hpp"
 #include "middle.hpp"
 #include "node-locations.hpp"
 #include "osmtypes.hpp"
@@ -19,18 +20,95 @@
 #include <osmium/memory/buffer.hpp>
 #include <osmium/osm.hpp>
 
+#include <osmium/util/memory_mapping.hpp>
+
 #include <cstddef>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 class options_t;
 class thread_pool_t;
 
 /**
- * Implementation of middle for importing small to medium sized files into a
- * non-updateable database. It works completely in memory, no data is written
- * to disk.
+ * In-memory index from OSM ids to the ids of other objects referencing them
+ * (see id_pair_index_t). Used by middle_ram_t for updates.
+ */
+using ram_id_pair_index_t = id_pair_index_t<std::vector<id_pair_t>>;
+
+/**
+ * Store for OSM objects used by middle_ram_t. The objects are kept in a
+ * chain of buffers of fixed size, a new buffer is started when the current
+ * one is full. Buffers never grow, so objects never move once they have been
+ * added and can be read from other threads while more objects are added.
+ *
+ * The offset returned by add() contains the number of the buffer in the
+ * upper bits and the offset in that buffer in the lower bits.
+ */
+class ram_object_store_t
+{
+public:
+    ram_object_store_t();
+
+    /// Add a copy of the object to the store and return its offset.
+    std::size_t add(osmium::OSMObject const &object);
+
+    /// Get the object at the offset returned by add().
+    osmium::OSMObject const &get(std::size_t offset) const noexcept
+    {
+        auto const &buffer = *m_buffers[offset >> Offset_bits];
+        return *reinterpret_cast<osmium::OSMObject const *>(
+            buffer.data() + (offset & Offset_mask));
+    }
+
+    /**
+     * Use the (memory-mapped) data as the first buffer. The store must be
+     * empty. The data must stay valid as long as the store is used.
+     */
+    void set_external_data(unsigned char *data, std::size_t size);
+
+    /// Call func(offset, object) for all objects in the order they were added.
+    template <typename FUNC>
+    void for_each(FUNC &&func) const
+    {
+        for (std::size_t n = 0; n < m_buffers.size(); ++n) {
+            auto const &buffer = *m_buffers[n];
+            for (auto const &object : buffer.select<osmium::OSMObject>()) {
+                auto const offset =
+                    static_cast<std::size_t>(object.data() - buffer.data());
+                func((n << Offset_bits) | offset, object);
+            }
+        }
+    }
+
+    std::size_t committed() const noexcept;
+    std::size_t capacity() const noexcept;
+
+    void clear();
+
+private:
+    /// Size of a buffer, larger objects get a buffer of their own.
+    static constexpr std::size_t const Buffer_size = 16UL * 1024UL * 1024UL;
+
+    /**
+     * Maximum number of buffers. Space for the pointers to all buffers is
+     * reserved up front so that the vector never reallocates while it is
+     * read from other threads.
+     */
+    static constexpr std::size_t const Max_buffers = 1UL << 16U;
+
+    static constexpr unsigned const Offset_bits = 40U;
+    static constexpr std::size_t const Offset_mask =
+        (1ULL << Offset_bits) - 1U;
+
+    std::vector<std::unique_ptr<osmium::memory::Buffer>> m_buffers;
+}; // class ram_object_store_t
+
+/**
+ * Implementation of middle for importing small to medium sized files. It
+ * works completely in memory.
  *
  * The following traits of OSM objects can be stored. All are optional:
  * - Node locations for building geometries of ways.
@@ -38,6 +116,16 @@ class thread_pool_t;
  * - Tags and attributes for nodes, ways, and/or relations for full
  *   2-stage-processing support.
  * - Attributes for untagged nodes.
+ *
+ * Without a snapshot file (in non-slim mode) the database is not updateable
+ * and no data is written to disk.
+ *
+ * With a snapshot file (--middle-snapshot in slim mode) node locations and
+ * complete ways and relations are stored and written to the snapshot file
+ * in stop(). In append mode the snapshot is memory-mapped and its contents
+ * are used as the base data. Changes are kept in an in-memory overlay and
+ * merged with the base data when the new snapshot is written, so the
+ * snapshot is compacted after each update.
  */
 class middle_ram_t : public middle_t, public middle_query_t
 {
@@ -54,8 +142,14 @@ public:
     void way(osmium::Way const &way) override;
     void relation(osmium::Relation const &) override;
 
+    idlist_t get_ways_by_node(osmid_t osm_id) override;
+    idlist_t get_rels_by_node(osmid_t osm_id) override;
+    idlist_t get_rels_by_way(osmid_t osm_id) override;
+
     std::size_t nodes_get_list(osmium::WayNodeList *nodes) const override;
 
+    std::size_t nodes_get_lists(osmium::memory::Buffer *buffer) const override;
+
     bool way_get(osmid_t id, osmium::memory::Buffer *buffer) const override;
 
     size_t rel_members_get(osmium::Relation const &rel,
@@ -93,9 +187,23 @@ private:
 
     void store_object(osmium::OSMObject const &object);
 
+    /// Remove object (only in append mode).
+    void remove_object(osmium::item_type type, osmid_t id);
+
+    /// Get object from the overlay or the base data, nullptr if not found.
+    osmium::OSMObject const *find_object(osmium::item_type type,
+                                         osmid_t id) const;
+
     bool get_object(osmium::item_type type, osmid_t id,
                     osmium::memory::Buffer *buffer) const;
 
+    osmium::Location get_location(osmid_t id) const;
+
+    void add_to_reverse_indexes(osmium::OSMObject const &object);
+
+    void read_snapshot();
+    void write_snapshot() const;
+
     /// For storing the location of all nodes.
     node_locations_t m_node_locations;
 
@@ -105,15 +213,44 @@ private:
     /// The index for accessing way nodes.
     ordered_index_t m_way_nodes_index;
 
-    /// Buffer for all OSM objects we store.
-    osmium::memory::Buffer m_object_buffer{
-        1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+    /// Store for all OSM objects we store.
+    ram_object_store_t m_object_store;
 
-    /// Indexes into object buffer.
+    /// Indexes into object store.
     osmium::nwr_array<ordered_index_t> m_object_index;
 
     /// Options for this middle.
     middle_ram_options m_store_options;
+
+    /// The snapshot file. Empty if no snapshot is used.
+    std::string m_snapshot_file;
+
+    /// Write the snapshot file in stop()?
+    bool m_write_snapshot = false;
+
+    /// Changes go into the overlay (only in append mode).
+    bool m_append = false;
+
+    /// Snapshot read in append mode, m_object_store points into it.
+    std::unique_ptr<osmium::util::MemoryMapping> m_snapshot;
+
+    /// Changed node locations (invalid location for deleted nodes).
+    std::unordered_map<osmid_t, osmium::Location> m_changed_locations;
+
+    /// Store for changed OSM objects.
+    ram_object_store_t m_changed_store;
+
+    /**
+     * Indexes into the store for changed objects. Deleted objects have
+     * the offset ordered_index_t::not_found_value().
+     */
+    osmium::nwr_array<std::unordered_map<osmid_t, std::size_t>>
+        m_changed_index;
+
+    /// Reverse indexes, only available in append mode.
+    std::unique_ptr<ram_id_pair_index_t> m_ways_by_node;
+    std::unique_ptr<ram_id_pair_index_t> m_rels_by_node;
+    std::unique_ptr<ram_id_pair_index_t> m_rels_by_way;
 }; // class middle_ram_t
 
 #endif // OSM2PGSQL_MIDDLE_RAM_HPP
@@ -7,15 +7,182 @@
  * For a full list of authors see the git log.
  */
 
+#include "middle-file.hpp"
 #include "middle-pgsql.hpp"
 #include "middle-ram.hpp"
 #include "middle.hpp"
 #include "options.hpp"
 
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/way.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <utility>
+
+std::size_t middle_query_t::nodes_get_lists(osmium::memory::Buffer *buffer) const
+{
+    assert(buffer);
+
+    std::size_t count = 0;
+    for (auto &way : buffer->select<osmium::Way>()) {
+        count += nodes_get_list(&way.nodes());
+    }
+    return count;
+}
+
+std::size_t nodes_get_lists_sorted(
+    osmium::memory::Buffer *buffer,
+    std::function<void(idlist_t const &, std::vector<osmium::Location> *)> const
+        &get_locations)
+{
+    assert(buffer);
+
+    // Node ids of all ways in the order they appear in the buffer together
+    // with their position.
+    std::vector<std::pair<osmid_t, std::size_t>> refs;
+    for (auto const &way : buffer->select<osmium::Way>()) {
+        for (auto const &nr : way.nodes()) {
+            refs.emplace_back(nr.ref(), refs.size());
+        }
+    }
+
+    if (refs.empty()) {
+        return 0;
+    }
+
+    std::sort(refs.begin(), refs.end());
+
+    // Unique node ids and for each position the index into that list.
+    idlist_t ids;
+    std::vector<std::size_t> index(refs.size());
+    for (auto const &ref : refs) {
+        if (ids.empty() || ids.back() != ref.first) {
+            ids.push_back(ref.first);
+        }
+        index[ref.second] = ids.size() - 1;
+    }
+
+    std::vector<osmium::Location> locations;
+    get_locations(ids, &locations);
+    assert(locations.size() == ids.size());
+
+    std::size_t count = 0;
+    std::size_t pos = 0;
+    for (auto &way : buffer->select<osmium::Way>()) {
+        for (auto &nr : way.nodes()) {
+            auto const &location = locations[index[pos++]];
+            nr.set_location(location);
+            if (location.valid()) {
+                ++count;
+            }
+        }
+    }
+
+    return count;
+}
+
+idlist_t filter_ways_by_node(
+    idlist_t ids, osmid_t node_id,
+    std::function<osmium::Way const *(osmid_t)> const &get_way)
+{
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    ids.erase(std::remove_if(ids.begin(), ids.end(),
+                             [&](osmid_t id) {
+                                 auto const *way = get_way(id);
+                                 if (!way) {
+                                     return true;
+                                 }
+                                 auto const &nodes = way->nodes();
+                                 return std::none_of(
+                                     nodes.cbegin(), nodes.cend(),
+                                     [&](osmium::NodeRef const &nr) {
+                                         return nr.ref() == node_id;
+                                     });
+                             }),
+              ids.end());
+
+    return ids;
+}
+
+idlist_t filter_rels_by_member(
+    idlist_t ids, osmium::item_type type, osmid_t member_id,
+    std::function<osmium::Relation const *(osmid_t)> const &get_relation)
+{
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    ids.erase(std::remove_if(ids.begin(), ids.end(),
+                             [&](osmid_t id) {
+                                 auto const *relation = get_relation(id);
+                                 if (!relation) {
+                                     return true;
+                                 }
+                                 auto const &members = relation->members();
+                                 return std::none_of(
+                                     members.cbegin(), members.cend(),
+                                     [&](osmium::RelationMember const &m) {
+                                         return m.type() == type &&
+                                                m.ref() == member_id;
+                                     });
+                             }),
+              ids.end());
+
+    return ids;
+}
+
+static idlist_t
+get_ids_for_list(idlist_t const &ids,
+                 std::function<idlist_t(osmid_t)> const &get_ids)
+{
+    idlist_t result;
+
+    for (auto const id : ids) {
+        auto const found = get_ids(id);
+        result.insert(result.end(), found.cbegin(), found.cend());
+    }
+
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+
+    return result;
+}
+
+idlist_t middle_t::get_ways_by_nodes(idlist_t const &node_ids)
+{
+    return get_ids_for_list(
+        node_ids, [this](osmid_t id) { return get_ways_by_node(id); });
+}
+
+idlist_t middle_t::get_rels_by_nodes(idlist_t const &node_ids)
+{
+    return get_ids_for_list(
+        node_ids, [this](osmid_t id) { return get_rels_by_node(id); });
+}
+
+idlist_t middle_t::get_rels_by_ways(idlist_t const &way_ids)
+{
+    return get_ids_for_list(way_ids,
+                            [this](osmid_t id) { return get_rels_by_way(id); });
+}
+
 std::shared_ptr<middle_t>
 create_middle(std::shared_ptr<thread_pool_t> thread_pool,
               options_t const &options)
 {
+    if (options.slim && !options.middle_dir.empty()) {
+        return std::make_shared<middle_file_t>(std::move(thread_pool),
+                                               &options);
+    }
+
+    if (options.slim && !options.middle_snapshot.empty()) {
+        return std::make_shared<middle_ram_t>(std::move(thread_pool),
+                                              &options);
+    }
+
     if (options.slim) {
         return std::make_shared<middle_pgsql_t>(std::move(thread_pool),
                                                 &options);
@@ -12,8 +12,13 @@
 
 #include <osmium/memory/buffer.hpp>
 #include <osmium/osm/entity_bits.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/way.hpp>
 
+#include <functional>
 #include <memory>
+#include <vector>
 
 #include "osmtypes.hpp"
 #include "thread-pool.hpp"
@@ -23,6 +28,11 @@ struct output_requirements;
 
 /**
  * Interface for returning information about raw OSM input data from a cache.
+ *
+ * Query instances are used from several threads at the same time. Once
+ * middle_t::after_nodes() has been called, node locations must be available
+ * to queries from other threads while ways and relations are still being
+ * stored. The same is true for ways after middle_t::after_ways().
  */
 struct middle_query_t : std::enable_shared_from_this<middle_query_t>
 {
@@ -35,6 +45,19 @@ struct middle_query_t : std::enable_shared_from_this<middle_query_t>
      */
     virtual size_t nodes_get_list(osmium::WayNodeList *nodes) const = 0;
 
+    /**
+     * Retrieves node locations for the node lists of all ways in the
+     * buffer. The locations are saved directly in the ways.
+     *
+     * The default implementation calls nodes_get_list() for each way,
+     * middles which can do better should override it, usually by looking
+     * up all node ids at once in sorted order with
+     * nodes_get_lists_sorted().
+     *
+     * \return The number of nodes for which a (valid) location was found.
+     */
+    virtual std::size_t nodes_get_lists(osmium::memory::Buffer *buffer) const;
+
     /**
      * Retrieves a single way from the ways storage
      * and stores it in the given osmium buffer.
@@ -73,10 +96,64 @@ struct middle_query_t : std::enable_shared_from_this<middle_query_t>
      */
     virtual bool relation_get(osmid_t id,
                               osmium::memory::Buffer *buffer) const = 0;
+
+    /**
+     * Announce that the ways with the specified ids are going to be
+     * retrieved next. Implementations can use this to fetch all of them
+     * and the locations of their nodes at once instead of one by one in
+     * way_get() and nodes_get_list(). Any data prefetched before is
+     * discarded.
+     *
+     * Only call this while the middle isn't changed.
+     */
+    virtual void prefetch_ways(idlist_t const & /*ids*/) {}
+
+    /**
+     * Announce that the relations with the specified ids are going to be
+     * retrieved next. Like prefetch_ways() this is only a hint, it will
+     * also prefetch member ways of the relations if they are needed for
+     * rel_members_get().
+     *
+     * Only call this while the middle isn't changed.
+     */
+    virtual void prefetch_relations(idlist_t const & /*ids*/) {}
 };
 
 inline middle_query_t::~middle_query_t() = default;
 
+/**
+ * Helper for implementations of middle_query_t::nodes_get_lists(): Collects
+ * the node ids of all ways in the buffer, sorts them and removes duplicates.
+ * Then get_locations() is called once with the sorted list of ids. It must
+ * fill in the locations for those ids (in the same order). The locations
+ * are then written back into the ways.
+ *
+ * \return The number of nodes for which a (valid) location was found.
+ */
+std::size_t nodes_get_lists_sorted(
+    osmium::memory::Buffer *buffer,
+    std::function<void(idlist_t const &, std::vector<osmium::Location> *)> const
+        &get_locations);
+
+/**
+ * Helper for implementations of middle_t::get_ways_by_node() which use a
+ * reverse index that can contain stale entries: Sorts the ids of the ways
+ * found in the index, removes duplicates and keeps only those ways which
+ * still contain the node. get_way() must return the current version of a
+ * way or nullptr if it doesn't exist (any more).
+ */
+idlist_t filter_ways_by_node(
+    idlist_t ids, osmid_t node_id,
+    std::function<osmium::Way const *(osmid_t)> const &get_way);
+
+/**
+ * Like filter_ways_by_node() but for relations which must still contain a
+ * member of the specified type and id.
+ */
+idlist_t filter_rels_by_member(
+    idlist_t ids, osmium::item_type type, osmid_t member_id,
+    std::function<osmium::Relation const *(osmid_t)> const &get_relation);
+
 /**
  * Interface for storing "raw" OSM data in an intermediate object store and
  * getting it back.
@@ -113,10 +190,36 @@ public:
     /// Called after all relations from the input file(s) have been processed.
     virtual void after_relations() {}
 
+    /**
+     * Hint that the locations of the nodes of the ways in the buffer will
+     * be needed soon. This is called from the input threads for buffers
+     * read ahead of the one currently processed, so it must be thread-safe
+     * and shouldn't block. It is only called after after_nodes().
+     */
+    virtual void
+    prefetch_way_node_locations(osmium::memory::Buffer const & /*buffer*/)
+    {}
+
     virtual idlist_t get_ways_by_node(osmid_t) { return {}; }
     virtual idlist_t get_rels_by_node(osmid_t) { return {}; }
     virtual idlist_t get_rels_by_way(osmid_t) { return {}; }
 
+    /**
+     * Get the ids of all ways containing any of the nodes in the list.
+     * The default implementation calls get_ways_by_node() for each node,
+     * middles which can do better should override it.
+     *
+     * \param node_ids Sorted list of node ids.
+     * \return Sorted list of way ids without duplicates.
+     */
+    virtual idlist_t get_ways_by_nodes(idlist_t const &node_ids);
+
+    /// Like get_ways_by_nodes() but for relations with node members.
+    virtual idlist_t get_rels_by_nodes(idlist_t const &node_ids);
+
+    /// Like get_ways_by_nodes() but for relations with way members.
+    virtual idlist_t get_rels_by_ways(idlist_t const &way_ids);
+
     virtual std::shared_ptr<middle_query_t> get_query_instance() = 0;
 
     virtual void set_requirements(output_requirements const &) {}
@@ -16,9 +16,11 @@
 #include <protozero/buffer_string.hpp>
 #include <protozero/varint.hpp>
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
-bool node_locations_t::set(osmid_t id, osmium::Location location)
+bool node_locations_varint_t::set(osmid_t id, osmium::Location location)
 {
     if (used_memory() >= m_max_size && will_resize()) {
         return false;
@@ -28,6 +30,7 @@ bool node_locations_t::set(osmid_t id, osmium::Location location)
         m_did.clear();
         m_dx.clear();
         m_dy.clear();
+        m_last_block_offset = m_data.size();
         m_index.add(id, m_data.size());
     }
 
@@ -46,13 +49,95 @@ bool node_locations_t::set(osmid_t id, osmium::Location location)
     return true;
 }
 
-osmium::Location node_locations_t::get(osmid_t id) const
+osmium::Location node_locations_varint_t::get(osmid_t id) const
 {
     auto const offset = m_index.get_block(id);
     if (offset == ordered_index_t::not_found_value()) {
         return osmium::Location{};
     }
 
+    auto const &block = get_decoded_block(offset);
+
+    auto const end = block.ids.cbegin() + block.count;
+    auto const it = std::lower_bound(block.ids.cbegin(), end, id);
+    if (it == end || *it != id) {
+        return osmium::Location{};
+    }
+
+    return block.locations[static_cast<std::size_t>(it - block.ids.cbegin())];
+}
+
+std::uint64_t node_locations_varint_t::next_store_id() noexcept
+{
+    static std::atomic<std::uint64_t> id{0};
+    return ++id;
+}
+
+node_locations_varint_t::decoded_block_t const &
+node_locations_varint_t::get_decoded_block(std::size_t offset) const
+{
+    static thread_local block_cache_t cache;
+
+    // The last block can still change, so it is never cached.
+    if (offset >= m_last_block_offset) {
+        static thread_local decoded_block_t last_block;
+        last_block.store_id = 0;
+        last_block.count = decode_block(offset, last_block.ids.data(),
+                                        last_block.locations.data());
+        return last_block;
+    }
+
+    for (auto const &block : cache.blocks) {
+        if (block.store_id == m_store_id && block.offset == offset) {
+            count_cache_access(&cache, true);
+            return block;
+        }
+    }
+
+    count_cache_access(&cache, false);
+
+    auto &block = cache.blocks[cache.next];
+    cache.next = (cache.next + 1) % decoded_block_cache_size;
+
+    block.store_id = m_store_id;
+    block.offset = offset;
+    block.count =
+        decode_block(offset, block.ids.data(), block.locations.data());
+
+    return block;
+}
+
+void node_locations_varint_t::count_cache_access(block_cache_t *cache,
+                                                 bool hit) const noexcept
+{
+    // Counters are collected per thread and added to the (shared) store
+    // counters in batches to avoid contention. Counts for another store
+    // are dropped.
+    constexpr std::uint64_t const batch_size = 1024;
+
+    if (cache->store_id != m_store_id) {
+        cache->store_id = m_store_id;
+        cache->hits = 0;
+        cache->misses = 0;
+    }
+
+    if (hit) {
+        ++cache->hits;
+    } else {
+        ++cache->misses;
+    }
+
+    if (cache->hits + cache->misses >= batch_size) {
+        m_cache_hits.fetch_add(cache->hits, std::memory_order_relaxed);
+        m_cache_misses.fetch_add(cache->misses, std::memory_order_relaxed);
+        cache->hits = 0;
+        cache->misses = 0;
+    }
+}
+
+std::size_t node_locations_varint_t::decode_block(
+    std::size_t offset, osmid_t *ids, osmium::Location *locations) const
+{
     assert(offset < m_data.size());
 
     char const *begin = m_data.data() + offset;
@@ -62,27 +147,402 @@ osmium::Location node_locations_t::get(osmid_t id) const
     osmium::DeltaDecode<int64_t> dx;
     osmium::DeltaDecode<int64_t> dy;
 
-    for (std::size_t n = 0; n < block_size && begin != end; ++n) {
-        auto const bid = did.update(
+    std::size_t n = 0;
+    for (; n < block_size && begin != end; ++n) {
+        ids[n] = did.update(
             static_cast<int64_t>(protozero::decode_varint(&begin, end)));
         int32_t const x = dx.update(
             protozero::decode_zigzag64(protozero::decode_varint(&begin, end)));
         int32_t const y = dy.update(
             protozero::decode_zigzag64(protozero::decode_varint(&begin, end)));
-        if (bid == id) {
-            return osmium::Location{x, y};
+        locations[n] = osmium::Location{x, y};
+    }
+
+    return n;
+}
+
+void node_locations_varint_t::get_sorted(
+    idlist_t const &ids, std::vector<osmium::Location> *locations) const
+{
+    assert(locations);
+    assert(std::is_sorted(ids.cbegin(), ids.cend()));
+
+    locations->clear();
+    locations->reserve(ids.size());
+
+    std::array<osmid_t, block_size> block_ids{};
+    std::array<osmium::Location, block_size> block_locations;
+    std::size_t block_offset = ordered_index_t::not_found_value();
+    std::size_t block_count = 0;
+    std::size_t pos = 0;
+
+    for (auto const id : ids) {
+        if (block_count == 0 || id > block_ids[block_count - 1]) {
+            auto const offset = m_index.get_block(id);
+            if (offset == ordered_index_t::not_found_value()) {
+                locations->emplace_back();
+                continue;
+            }
+            if (offset != block_offset) {
+                block_count = decode_block(offset, block_ids.data(),
+                                           block_locations.data());
+                block_offset = offset;
+                pos = 0;
+            }
+        }
+
+        while (pos < block_count && block_ids[pos] < id) {
+            ++pos;
         }
-        if (bid > id) {
-            break;
+
+        if (pos < block_count && block_ids[pos] == id) {
+            locations->push_back(block_locations[pos]);
+        } else {
+            locations->emplace_back();
         }
     }
-    return osmium::Location{};
 }
 
-void node_locations_t::clear()
+void node_locations_varint_t::for_each(
+    std::function<void(osmid_t, osmium::Location)> const &func) const
+{
+    char const *begin = m_data.data();
+    char const *const end = m_data.data() + m_data.size();
+
+    osmium::DeltaDecode<osmid_t> did;
+    osmium::DeltaDecode<int64_t> dx;
+    osmium::DeltaDecode<int64_t> dy;
+
+    for (std::size_t n = 0; begin != end; ++n) {
+        // Delta encoding starts anew with each block.
+        if (n % block_size == 0) {
+            did.clear();
+            dx.clear();
+            dy.clear();
+        }
+        auto const id = did.update(
+            static_cast<int64_t>(protozero::decode_varint(&begin, end)));
+        int32_t const x = dx.update(
+            protozero::decode_zigzag64(protozero::decode_varint(&begin, end)));
+        int32_t const y = dy.update(
+            protozero::decode_zigzag64(protozero::decode_varint(&begin, end)));
+        func(id, osmium::Location{x, y});
+    }
+}
+
+void node_locations_varint_t::clear()
+{
+    m_data.clear();
+    m_data.shrink_to_fit();
+    m_index.clear();
+    m_count = 0;
+    m_last_block_offset = 0;
+
+    // Make sure blocks decoded before aren't found in the cache any more.
+    m_store_id = next_store_id();
+}
+
+namespace {
+
+/**
+ * Width code of a lane (0, 1, 2, 3 for 1, 2, 4, 8 bytes) needed for the
+ * value.
+ */
+unsigned int lane_width_code(std::uint64_t max_value) noexcept
+{
+    if (max_value <= 0xffU) {
+        return 0;
+    }
+    if (max_value <= 0xffffU) {
+        return 1;
+    }
+    if (max_value <= 0xffffffffUL) {
+        return 2;
+    }
+    return 3;
+}
+
+template <typename T>
+void add_lane_value(std::string *data, std::uint64_t value)
+{
+    auto const v = static_cast<T>(value);
+    char buffer[sizeof(T)];
+    std::memcpy(buffer, &v, sizeof(T));
+    data->append(buffer, sizeof(T));
+}
+
+void add_lane_value(std::string *data, unsigned int width_code,
+                    std::uint64_t value)
+{
+    switch (width_code) {
+    case 0:
+        add_lane_value<std::uint8_t>(data, value);
+        break;
+    case 1:
+        add_lane_value<std::uint16_t>(data, value);
+        break;
+    case 2:
+        add_lane_value<std::uint32_t>(data, value);
+        break;
+    default:
+        add_lane_value<std::uint64_t>(data, value);
+        break;
+    }
+}
+
+template <typename T>
+T lane_value(char const *lane, std::size_t n) noexcept
+{
+    T value;
+    std::memcpy(&value, lane + n * sizeof(T), sizeof(T));
+    return value;
+}
+
+std::uint64_t lane_value(char const *lane, unsigned int width_code,
+                         std::size_t n) noexcept
+{
+    switch (width_code) {
+    case 0:
+        return lane_value<std::uint8_t>(lane, n);
+    case 1:
+        return lane_value<std::uint16_t>(lane, n);
+    case 2:
+        return lane_value<std::uint32_t>(lane, n);
+    default:
+        return lane_value<std::uint64_t>(lane, n);
+    }
+}
+
+/**
+ * Return the number of values in the lane smaller than the key. There are
+ * no branches in the loop so that the compiler can vectorize it.
+ */
+template <typename T>
+std::size_t count_smaller(char const *lane, std::size_t count,
+                          std::uint64_t key) noexcept
+{
+    std::size_t result = 0;
+    for (std::size_t n = 0; n < count; ++n) {
+        result += lane_value<T>(lane, n) < key ? 1 : 0;
+    }
+    return result;
+}
+
+std::size_t count_smaller(char const *lane, unsigned int width_code,
+                          std::size_t count, std::uint64_t key) noexcept
+{
+    switch (width_code) {
+    case 0:
+        return count_smaller<std::uint8_t>(lane, count, key);
+    case 1:
+        return count_smaller<std::uint16_t>(lane, count, key);
+    case 2:
+        return count_smaller<std::uint32_t>(lane, count, key);
+    default:
+        return count_smaller<std::uint64_t>(lane, count, key);
+    }
+}
+
+} // anonymous namespace
+
+bool node_locations_fixed_t::set(osmid_t id, osmium::Location location)
+{
+    if (used_memory() >= m_max_size && will_resize()) {
+        return false;
+    }
+
+    // Always true because ids in input must be unique and ordered
+    assert(m_pending.count == 0 ||
+           m_pending.ids[m_pending.count - 1] < id);
+
+    m_pending.ids[m_pending.count] = id;
+    m_pending.locations[m_pending.count] = location;
+    ++m_pending.count;
+
+    if (m_pending.count == block_size) {
+        write_block();
+    }
+
+    ++m_count;
+
+    return true;
+}
+
+void node_locations_fixed_t::write_block()
+{
+    assert(m_pending.count > 0 && m_pending.count <= block_size);
+
+    auto const count = m_pending.count;
+    auto const first_id = m_pending.ids[0];
+
+    std::int32_t min_x = std::numeric_limits<std::int32_t>::max();
+    std::int32_t min_y = std::numeric_limits<std::int32_t>::max();
+    std::int32_t max_x = std::numeric_limits<std::int32_t>::min();
+    std::int32_t max_y = std::numeric_limits<std::int32_t>::min();
+    for (std::size_t n = 0; n < count; ++n) {
+        auto const &location = m_pending.locations[n];
+        min_x = std::min(min_x, location.x());
+        min_y = std::min(min_y, location.y());
+        max_x = std::max(max_x, location.x());
+        max_y = std::max(max_y, location.y());
+    }
+
+    auto const id_width = lane_width_code(
+        static_cast<std::uint64_t>(m_pending.ids[count - 1] - first_id));
+    auto const x_width = lane_width_code(static_cast<std::uint64_t>(
+        static_cast<std::int64_t>(max_x) - min_x));
+    auto const y_width = lane_width_code(static_cast<std::uint64_t>(
+        static_cast<std::int64_t>(max_y) - min_y));
+
+    m_index.add(first_id, m_data.size());
+
+    add_lane_value<std::uint64_t>(&m_data, static_cast<std::uint64_t>(first_id));
+    add_lane_value<std::uint32_t>(&m_data, static_cast<std::uint32_t>(min_x));
+    add_lane_value<std::uint32_t>(&m_data, static_cast<std::uint32_t>(min_y));
+    m_data += static_cast<char>(count - 1);
+    m_data += static_cast<char>(id_width | (x_width << 2U) | (y_width << 4U));
+
+    for (std::size_t n = 0; n < count; ++n) {
+        add_lane_value(&m_data, id_width,
+                       static_cast<std::uint64_t>(m_pending.ids[n] - first_id));
+    }
+    for (std::size_t n = 0; n < count; ++n) {
+        add_lane_value(&m_data, x_width,
+                       static_cast<std::uint64_t>(
+                           static_cast<std::int64_t>(
+                               m_pending.locations[n].x()) -
+                           min_x));
+    }
+    for (std::size_t n = 0; n < count; ++n) {
+        add_lane_value(&m_data, y_width,
+                       static_cast<std::uint64_t>(
+                           static_cast<std::int64_t>(
+                               m_pending.locations[n].y()) -
+                           min_y));
+    }
+
+    m_pending.count = 0;
+}
+
+osmium::Location node_locations_fixed_t::get(osmid_t id) const
+{
+    // The entries of the last block might not be encoded yet.
+    if (m_pending.count > 0 && id >= m_pending.ids[0]) {
+        auto const end = m_pending.ids.begin() + m_pending.count;
+        auto const it = std::lower_bound(m_pending.ids.begin(), end, id);
+        if (it == end || *it != id) {
+            return osmium::Location{};
+        }
+        return m_pending.locations[static_cast<std::size_t>(
+            it - m_pending.ids.begin())];
+    }
+
+    auto const offset = m_index.get_block(id);
+    if (offset == ordered_index_t::not_found_value()) {
+        return osmium::Location{};
+    }
+
+    assert(offset + header_size <= m_data.size());
+
+    char const *const block = m_data.data() + offset;
+    auto const first_id =
+        static_cast<osmid_t>(lane_value<std::uint64_t>(block, 0));
+    auto const min_x =
+        static_cast<std::int32_t>(lane_value<std::uint32_t>(block + 8, 0));
+    auto const min_y =
+        static_cast<std::int32_t>(lane_value<std::uint32_t>(block + 12, 0));
+    std::size_t const count =
+        static_cast<unsigned char>(block[16]) + 1U;
+    auto const widths = static_cast<unsigned char>(block[17]);
+    unsigned int const id_width = widths & 0x3U;
+    unsigned int const x_width = (widths >> 2U) & 0x3U;
+    unsigned int const y_width = (widths >> 4U) & 0x3U;
+
+    assert(id >= first_id);
+    auto const key = static_cast<std::uint64_t>(id - first_id);
+
+    char const *const id_lane = block + header_size;
+    auto const pos = count_smaller(id_lane, id_width, count, key);
+    if (pos == count || lane_value(id_lane, id_width, pos) != key) {
+        return osmium::Location{};
+    }
+
+    char const *const x_lane = id_lane + (count << id_width);
+    char const *const y_lane = x_lane + (count << x_width);
+
+    return osmium::Location{
+        static_cast<std::int32_t>(min_x + static_cast<std::int64_t>(
+                                              lane_value(x_lane, x_width, pos))),
+        static_cast<std::int32_t>(min_y + static_cast<std::int64_t>(
+                                              lane_value(y_lane, y_width, pos)))};
+}
+
+void node_locations_fixed_t::get_sorted(
+    idlist_t const &ids, std::vector<osmium::Location> *locations) const
+{
+    assert(locations);
+
+    // Blocks don't have to be decoded in this encoding, so there is nothing
+    // to share between lookups. Sorted ids still give better memory
+    // locality.
+    locations->clear();
+    locations->reserve(ids.size());
+    for (auto const id : ids) {
+        locations->push_back(get(id));
+    }
+}
+
+void node_locations_fixed_t::for_each(
+    std::function<void(osmid_t, osmium::Location)> const &func) const
+{
+    std::size_t offset = 0;
+    while (offset < m_data.size()) {
+        assert(offset + header_size <= m_data.size());
+
+        char const *const block = m_data.data() + offset;
+        auto const first_id =
+            static_cast<osmid_t>(lane_value<std::uint64_t>(block, 0));
+        auto const min_x =
+            static_cast<std::int32_t>(lane_value<std::uint32_t>(block + 8, 0));
+        auto const min_y = static_cast<std::int32_t>(
+            lane_value<std::uint32_t>(block + 12, 0));
+        std::size_t const count = static_cast<unsigned char>(block[16]) + 1U;
+        auto const widths = static_cast<unsigned char>(block[17]);
+        unsigned int const id_width = widths & 0x3U;
+        unsigned int const x_width = (widths >> 2U) & 0x3U;
+        unsigned int const y_width = (widths >> 4U) & 0x3U;
+
+        char const *const id_lane = block + header_size;
+        char const *const x_lane = id_lane + (count << id_width);
+        char const *const y_lane = x_lane + (count << x_width);
+
+        for (std::size_t n = 0; n < count; ++n) {
+            func(first_id +
+                     static_cast<osmid_t>(lane_value(id_lane, id_width, n)),
+                 osmium::Location{
+                     static_cast<std::int32_t>(
+                         min_x + static_cast<std::int64_t>(
+                                     lane_value(x_lane, x_width, n))),
+                     static_cast<std::int32_t>(
+                         min_y + static_cast<std::int64_t>(
+                                     lane_value(y_lane, y_width, n)))});
+        }
+
+        offset = static_cast<std::size_t>(y_lane - m_data.data()) +
+                 (count << y_width);
+    }
+
+    // The entries of the last block might not be encoded yet.
+    for (std::size_t n = 0; n < m_pending.count; ++n) {
+        func(m_pending.ids[n], m_pending.locations[n]);
+    }
+}
+
+void node_locations_fixed_t::clear()
 {
     m_data.clear();
     m_data.shrink_to_fit();
     m_index.clear();
+    m_pending.count = 0;
     m_count = 0;
 }
@@ -10,16 +10,22 @@
  * For a full list of authors see the git log.
  */
 
+#include "config.h"
 #include "ordered-index.hpp"
 #include "osmtypes.hpp"
 
 #include <osmium/osm/location.hpp>
 #include <osmium/util/delta.hpp>
 
+#include <array>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <limits>
 #include <string>
+#include <utility>
+#include <vector>
 
 /**
  * Node locations storage. This implementation encodes ids and locations
@@ -31,11 +37,20 @@
  * delta encoded and then stored as varints. To access a stored location the
  * block must be decoded until the id is found.
  *
+ * Because neighbouring nodes of a way are usually in the same block, each
+ * thread keeps a small cache of recently decoded complete blocks.
+ *
  * Ids must be added in strictly ascending order.
  */
-class node_locations_t
+class node_locations_varint_t
 {
 public:
+    /**
+     * The number of decoded blocks cached per thread. Ways with nodes
+     * spread over more blocks than this won't profit from the cache.
+     */
+    static constexpr const std::size_t decoded_block_cache_size = 8;
+
     /**
      * Construct a node locations store. Takes a single optional argument
      * which gives the maximum number of bytes this store should be allowed
@@ -43,9 +58,9 @@ public:
      * memory. The store will try to keep the memory used under what's
      * specified here.
      */
-    explicit node_locations_t(
+    explicit node_locations_varint_t(
         std::size_t max_size = std::numeric_limits<std::size_t>::max())
-    : m_max_size(max_size)
+    : m_max_size(max_size), m_store_id(next_store_id())
     {}
 
     /**
@@ -62,6 +77,21 @@ public:
      */
     osmium::Location get(osmid_t id) const;
 
+    /**
+     * Retrieve the locations of many nodes at once. This is faster than
+     * calling get() for each id, because each block is decoded only once.
+     *
+     * \param ids Ids of the nodes, must be sorted.
+     * \param locations The locations are stored here in the same order as
+     *                  the ids. Locations not found are invalid.
+     */
+    void get_sorted(idlist_t const &ids,
+                    std::vector<osmium::Location> *locations) const;
+
+    /// Call func with the id and location of all nodes in id order.
+    void for_each(std::function<void(osmid_t, osmium::Location)> const &func)
+        const;
+
     /// The number of locations stored.
     std::size_t size() const noexcept { return m_count; }
 
@@ -71,6 +101,18 @@ public:
         return m_data.capacity() + m_index.used_memory();
     }
 
+    /**
+     * Number of lookups in get() answered from the decoded block cache
+     * (hits) and number of lookups which had to decode a block (misses).
+     * The counters are updated from the threads in batches, so they are
+     * only approximate.
+     */
+    std::pair<std::uint64_t, std::uint64_t> cache_stats() const noexcept
+    {
+        return {m_cache_hits.load(std::memory_order_relaxed),
+                m_cache_misses.load(std::memory_order_relaxed)};
+    }
+
     /**
      * Clear the memory used by this object. The object can be reused after
      * that.
@@ -94,12 +136,52 @@ private:
                (m_data.size() + max_bytes_per_entry() >= m_data.capacity());
     }
 
+    /**
+     * Decode all entries of the block at the specified offset into the
+     * arrays ids and locations which must have space for block_size
+     * entries.
+     *
+     * \return The number of entries in the block.
+     */
+    std::size_t decode_block(std::size_t offset, osmid_t *ids,
+                             osmium::Location *locations) const;
+
+    /// Unique id for each store (and each clear()) used in the cache keys.
+    static std::uint64_t next_store_id() noexcept;
+
     /**
      * The block size used for internal blocks. The larger the block size
      * the less memory is consumed but the more expensive the access is.
      */
     static constexpr const std::size_t block_size = 32;
 
+    /// A decoded block in the per-thread cache.
+    struct decoded_block_t
+    {
+        std::uint64_t store_id = 0;
+        std::size_t offset = 0;
+        std::size_t count = 0;
+        std::array<osmid_t, block_size> ids;
+        std::array<osmium::Location, block_size> locations;
+    };
+
+    struct block_cache_t
+    {
+        std::array<decoded_block_t, decoded_block_cache_size> blocks;
+
+        /// The slot which is replaced next.
+        std::size_t next = 0;
+
+        /// Counters not yet added to the store with this id.
+        std::uint64_t store_id = 0;
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+    };
+
+    decoded_block_t const &get_decoded_block(std::size_t offset) const;
+
+    void count_cache_access(block_cache_t *cache, bool hit) const noexcept;
+
     ordered_index_t m_index;
     std::string m_data;
 
@@ -109,9 +191,155 @@ private:
     /// The number of (id, location) pairs stored.
     std::size_t m_count = 0;
 
+    /// Offset of the last block which might still get more entries.
+    std::size_t m_last_block_offset = 0;
+
+    std::uint64_t m_store_id;
+
+    mutable std::atomic<std::uint64_t> m_cache_hits{0};
+    mutable std::atomic<std::uint64_t> m_cache_misses{0};
+
     osmium::DeltaEncode<osmid_t> m_did;
     osmium::DeltaEncode<int64_t> m_dx;
     osmium::DeltaEncode<int64_t> m_dy;
-}; // class node_locations_t
+}; // class node_locations_varint_t
+
+/**
+ * Node locations storage optimized for fast lookups. It has the same
+ * interface as node_locations_varint_t, but uses a block encoding that
+ * doesn't need sequential decoding.
+ *
+ * Nodes are collected into blocks of `block_size` (id, location) pairs. When
+ * a block is full, it is encoded with a header followed by three "lanes" of
+ * fixed-width values: The id offsets from the first id in the block, and the
+ * x and y coordinates as offsets from the smallest x and y coordinate in the
+ * block, respectively. The width of each lane is the smallest of 1, 2, 4 (or
+ * 8 for ids) bytes that fits all values in the block. A lookup searches the
+ * id lane with a simple branchless loop the compiler can vectorize and then
+ * reads the coordinates directly at the position found.
+ *
+ * This needs more memory than the varint encoding (about 40 percent more for
+ * typical OSM data), but lookups are several times faster.
+ *
+ * Ids must be added in strictly ascending order.
+ */
+class node_locations_fixed_t
+{
+public:
+    /**
+     * Construct a node locations store. Takes a single optional argument
+     * which gives the maximum number of bytes this store should be allowed
+     * to use. If this is not specified, the size is only limited by available
+     * memory. The store will try to keep the memory used under what's
+     * specified here.
+     */
+    explicit node_locations_fixed_t(
+        std::size_t max_size = std::numeric_limits<std::size_t>::max())
+    : m_max_size(max_size)
+    {}
+
+    /**
+     * Store a node location.
+     *
+     * \pre id must be strictly larger than all ids stored before.
+     * \return True if the entry was added, false if the index is full.
+     */
+    bool set(osmid_t id, osmium::Location location);
+
+    /**
+     * Retrieve a node location. If the location wasn't stored before, an
+     * invalid Location will be returned.
+     */
+    osmium::Location get(osmid_t id) const;
+
+    /**
+     * Retrieve the locations of many nodes at once.
+     *
+     * \param ids Ids of the nodes, must be sorted.
+     * \param locations The locations are stored here in the same order as
+     *                  the ids. Locations not found are invalid.
+     */
+    void get_sorted(idlist_t const &ids,
+                    std::vector<osmium::Location> *locations) const;
+
+    /// Call func with the id and location of all nodes in id order.
+    void for_each(std::function<void(osmid_t, osmium::Location)> const &func)
+        const;
+
+    /// The number of locations stored.
+    std::size_t size() const noexcept { return m_count; }
+
+    /// Return the approximate number of bytes used for internal storage.
+    std::size_t used_memory() const noexcept
+    {
+        return m_data.capacity() + m_index.used_memory() +
+               m_pending.count * (sizeof(osmid_t) + sizeof(osmium::Location));
+    }
+
+    /**
+     * Blocks don't have to be decoded in this encoding, so there is no
+     * decoded block cache. Always returns zero hits and misses.
+     */
+    std::pair<std::uint64_t, std::uint64_t> cache_stats() const noexcept
+    {
+        return {0, 0};
+    }
+
+    /**
+     * Clear the memory used by this object. The object can be reused after
+     * that.
+     */
+    void clear();
+
+private:
+    /// The block size used for internal blocks, at most 256.
+    static constexpr const std::size_t block_size = 32;
+
+    /// Size of the block header: first id, min x, min y, count, widths.
+    static constexpr const std::size_t header_size = 8 + 4 + 4 + 1 + 1;
+
+    /// The maximum number of bytes a block will need in storage.
+    constexpr static std::size_t max_bytes_per_block() noexcept
+    {
+        return header_size + block_size * (8U /*id*/ + 4U /*x*/ + 4U /*y*/);
+    }
+
+    bool will_resize() const noexcept
+    {
+        return m_index.will_resize() ||
+               (m_data.size() + max_bytes_per_block() >= m_data.capacity());
+    }
+
+    /// Encode the pending entries into a block and add it to the index.
+    void write_block();
+
+    /// Entries of the block not yet encoded.
+    struct pending_t
+    {
+        std::array<osmid_t, block_size> ids;
+        std::array<osmium::Location, block_size> locations;
+        std::size_t count = 0;
+    };
+
+    ordered_index_t m_index;
+    std::string m_data;
+    pending_t m_pending;
+
+    /// Maximum size in bytes this object may allocate.
+    std::size_t m_max_size;
+
+    /// The number of (id, location) pairs stored.
+    std::size_t m_count = 0;
+}; // class node_locations_fixed_t
+
+/**
+ * The node locations storage used by the middles. The encoding is selected
+ * at build time with the WITH_FIXED_WIDTH_NODE_LOCATIONS cmake option.
+ */
+#ifdef WITH_FIXED_WIDTH_NODE_LOCATIONS
+using node_locations_t = node_locations_fixed_t;
+#else
+using node_locations_t = node_locations_varint_t;
+#endif
 
 #endif // OSM2PGSQL_NODE_LOCATIONS_HPP
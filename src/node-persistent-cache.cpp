@@ -7,27 +7,686 @@
  * For a full list of authors see the git log.
  */
 
+#include "format.hpp"
 #include "logging.hpp"
 #include "node-persistent-cache.hpp"
 
+#include <osmium/osm/way.hpp>
+#include <osmium/util/delta.hpp>
+#include <osmium/util/file.hpp>
+
+// Workaround: This must be included before buffer_string.hpp due to a missing
+// include in the upstream code. https://github.com/mapbox/protozero/pull/104
+#include <protozero/config.hpp>
+
+#include <protozero/buffer_string.hpp>
+#include <protozero/exception.hpp>
+#include <protozero/varint.hpp>
+
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cerrno>
+#include <cstdint>
 #include <cstring>
+#include <limits>
 #include <stdexcept>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+/// Content of the slot for id 0 in sparse files.
+constexpr char const sparse_magic[] = "o2p-sprs";
+
+/// Start of the data file in the compressed format.
+constexpr char const compressed_magic[] = "o2p-cmpr";
+
+static_assert(sizeof(sparse_magic) - 1 == sizeof(std::uint64_t),
+              "magic must fill exactly one slot");
+static_assert(sizeof(compressed_magic) - 1 == sizeof(std::uint64_t),
+              "magic must fill exactly one slot");
+
+char const *format_name(flat_node_format format) noexcept
+{
+    switch (format) {
+    case flat_node_format::sparse:
+        return "sparse";
+    case flat_node_format::compressed:
+        return "compressed";
+    default:
+        break;
+    }
+    return "dense";
+}
+
+// The in-memory layout of osmium::Location (x followed by y) is the
+// format of the dense file.
+std::uint64_t location_bits(osmium::Location location) noexcept
+{
+    std::int32_t const coordinates[2] = {location.x(), location.y()};
+    std::uint64_t value = 0;
+    std::memcpy(&value, coordinates, sizeof(value));
+    return value;
+}
+
+void get_page_faults(long *minor, long *major) noexcept
+{
+#ifndef _WIN32
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        *minor = usage.ru_minflt;
+        *major = usage.ru_majflt;
+    }
+#else
+    *minor = 0;
+    *major = 0;
+#endif
+}
+
+void advise_mapping(osmium::util::MemoryMapping const &mapping,
+                    node_persistent_cache::access_t access) noexcept
+{
+#ifndef _WIN32
+    // Errors are ignored here, this is only a hint to the kernel.
+    madvise(mapping.get_addr<void>(), mapping.size(),
+            access == node_persistent_cache::access_t::sequential
+                ? MADV_SEQUENTIAL
+                : MADV_RANDOM);
+#endif
+#ifdef __linux__
+    // Only has an effect if the file is on a file system supporting
+    // transparent huge pages, such as tmpfs mounted with huge=advise.
+    madvise(mapping.get_addr<void>(), mapping.size(), MADV_HUGEPAGE);
+#else
+    (void)mapping;
+    (void)access;
+#endif
+}
+
+} // anonymous namespace
+
+/**
+ * Node locations in the compressed format.
+ *
+ * Ids are grouped into blocks of block_size consecutive ids. A block is
+ * encoded as a 64 bit bitmap of the ids in the block that have a location,
+ * followed by the x and y coordinates of those locations, delta encoded
+ * from the previous location in the block, zigzagged, and stored as
+ * varints.
+ *
+ * The data file starts with a 16 byte header: the magic and the size of
+ * the data in bytes. It is followed by the slots for the blocks. Slots are
+ * allocated in units of unit_size bytes and have a bit of room so a block
+ * can grow a little when it is updated. If it doesn't fit any more, a new
+ * slot is allocated at the end of the file (the old slot is not reused).
+ *
+ * The index file contains a 64 bit entry for each block with the offset
+ * (in units) of the slot in the upper 48 bits and its capacity (in units)
+ * in the lower 16 bits. The entry for blocks without data is 0.
+ *
+ * Changes are collected for one block at a time in m_pending and written
+ * when another block is changed or the store is closed. Reading from
+ * several threads is safe as long as no changes are made.
+ */
+class node_persistent_cache::compressed_store_t
+{
+public:
+    /**
+     * \param index_file_name Name of the index file.
+     * \param data_fd File descriptor of the data file.
+     * \param data Mapping of the data file.
+     * \param new_file Is this a new (empty) data file?
+     * \param remove_file Remove the index file when done?
+     */
+    compressed_store_t(std::string index_file_name, int data_fd,
+                       osmium::util::MemoryMapping *data, bool new_file,
+                       bool remove_file)
+    : m_index_file_name(std::move(index_file_name)), m_data_fd(data_fd),
+      m_data(data), m_remove_file(remove_file)
+    {
+        assert(m_data);
+
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-type-vararg, hicpp-signed-bitwise)
+        m_index_fd = open(m_index_file_name.c_str(), O_RDWR | O_CREAT, 0644);
+        if (m_index_fd < 0) {
+            throw std::runtime_error{
+                "Unable to open flatnode index file '{}': {}"_format(
+                    m_index_file_name, std::strerror(errno))};
+        }
+
+        if (new_file) {
+            std::memcpy(m_data->get_addr<char>(), compressed_magic,
+                        sizeof(std::uint64_t));
+            set_data_end(header_size);
+            osmium::resize_file(m_index_fd, 0);
+        } else if (osmium::file_size(m_index_fd) == 0 &&
+                   data_end() > header_size) {
+            close(m_index_fd);
+            throw std::runtime_error{
+                "Flatnode index file '{}' is missing or empty."_format(
+                    m_index_file_name)};
+        }
+
+        try {
+            auto size = osmium::file_size(m_index_fd);
+            if (size < grow_size) {
+                size = grow_size;
+                osmium::resize_file(m_index_fd, size);
+            }
+            m_index = std::make_unique<osmium::util::MemoryMapping>(
+                size, osmium::util::MemoryMapping::mapping_mode::write_shared,
+                m_index_fd);
+        } catch (std::system_error const &e) {
+            close(m_index_fd);
+            throw std::runtime_error{
+                "Unable to map flatnode index file '{}': {}"_format(
+                    m_index_file_name, e.what())};
+        }
+
+        m_pending.fill(osmium::Location{});
+    }
+
+    compressed_store_t(compressed_store_t const &) = delete;
+    compressed_store_t &operator=(compressed_store_t const &) = delete;
+
+    compressed_store_t(compressed_store_t &&) = delete;
+    compressed_store_t &operator=(compressed_store_t &&) = delete;
+
+    ~compressed_store_t() noexcept
+    {
+        try {
+            flush();
+        } catch (...) {
+            // Changes of the pending block are lost, there is nothing we can
+            // do about it here.
+        }
+
+        m_index.reset();
+        if (m_index_fd >= 0) {
+            close(m_index_fd);
+        }
+
+        if (m_remove_file) {
+            unlink(m_index_file_name.c_str());
+        }
+    }
+
+    void set(std::uint64_t id, osmium::Location location)
+    {
+        auto const block = id / block_size;
+        if (block != m_pending_block) {
+            flush();
+            m_pending_block = block;
+            m_pending.fill(osmium::Location{});
+            auto const entry = index_entry(block);
+            if (entry != 0) {
+                decode_block(entry, block_size - 1, m_pending.data());
+            }
+        }
+
+        m_pending[id % block_size] = location;
+        m_dirty = true;
+    }
+
+    osmium::Location get(std::uint64_t id) const noexcept
+    {
+        auto const block = id / block_size;
+        auto const pos = id % block_size;
+
+        if (block == m_pending_block) {
+            return m_pending[pos];
+        }
+
+        auto const entry = index_entry(block);
+        if (entry == 0) {
+            return osmium::Location{};
+        }
+
+        std::array<osmium::Location, block_size> locations;
+        decode_block(entry, pos, locations.data());
+        return locations[pos];
+    }
+
+    /// Write the pending block to the files.
+    void flush()
+    {
+        if (!m_dirty) {
+            return;
+        }
+        m_dirty = false;
+
+        std::uint64_t bitmap = 0;
+        m_buffer.assign(sizeof(bitmap), '\0');
+        osmium::DeltaEncode<std::int64_t> dx;
+        osmium::DeltaEncode<std::int64_t> dy;
+        for (std::size_t n = 0; n < block_size; ++n) {
+            auto const &location = m_pending[n];
+            if (location.valid()) {
+                bitmap |= 1ULL << n;
+                protozero::add_varint_to_buffer(
+                    &m_buffer,
+                    protozero::encode_zigzag64(dx.update(location.x())));
+                protozero::add_varint_to_buffer(
+                    &m_buffer,
+                    protozero::encode_zigzag64(dy.update(location.y())));
+            }
+        }
+        std::memcpy(&m_buffer[0], &bitmap, sizeof(bitmap));
+
+        auto entry = index_entry(m_pending_block);
+        if (entry == 0 && bitmap == 0) {
+            return;
+        }
+
+        auto const units = (m_buffer.size() + unit_size - 1) / unit_size;
+        if (units > (entry & capacity_mask)) {
+            // Leave a bit of room so that small updates fit in place.
+            auto const capacity = units + 1;
+            auto const offset = data_end();
+            auto const new_end = offset + capacity * unit_size;
+            if (new_end > m_data->size()) {
+                grow_file(m_data_fd, m_data, new_end);
+                advise(m_access);
+            }
+            if (m_pending_block >= num_blocks()) {
+                grow_file(m_index_fd, m_index.get(),
+                          (m_pending_block + 1) * sizeof(std::uint64_t));
+                advise(m_access);
+            }
+            set_data_end(new_end);
+            entry = ((offset / unit_size) << capacity_bits) | capacity;
+            m_index->get_addr<std::uint64_t>()[m_pending_block] = entry;
+        }
+
+        std::memcpy(m_data->get_addr<char>() + slot_offset(entry),
+                    m_buffer.data(), m_buffer.size());
+    }
+
+    /**
+     * Get the byte range in the data file containing the location of the
+     * id. Returns an empty range if there is no data for the id.
+     */
+    std::pair<std::size_t, std::size_t> data_range(std::uint64_t id) const
+        noexcept
+    {
+        auto const entry = index_entry(id / block_size);
+        if (entry == 0) {
+            return {0, 0};
+        }
+        auto const offset = slot_offset(entry);
+        return {offset, offset + (entry & capacity_mask) * unit_size};
+    }
+
+    void advise(access_t access) noexcept
+    {
+        m_access = access;
+        advise_mapping(*m_data, access);
+        advise_mapping(*m_index, access);
+    }
+
+private:
+    /// Number of ids in a block (the number of bits in the bitmap).
+    static constexpr std::size_t const block_size = 64;
+
+    /// Slots in the data file are allocated in units of this many bytes.
+    static constexpr std::size_t const unit_size = 16;
+
+    static constexpr std::size_t const header_size = 16;
+
+    static constexpr unsigned const capacity_bits = 16;
+    static constexpr std::uint64_t const capacity_mask =
+        (1ULL << capacity_bits) - 1;
+
+    static std::size_t slot_offset(std::uint64_t entry) noexcept
+    {
+        return (entry >> capacity_bits) * unit_size;
+    }
+
+    std::uint64_t num_blocks() const noexcept
+    {
+        return m_index->size() / sizeof(std::uint64_t);
+    }
+
+    std::uint64_t index_entry(std::uint64_t block) const noexcept
+    {
+        if (block >= num_blocks()) {
+            return 0;
+        }
+        return m_index->get_addr<std::uint64_t>()[block];
+    }
+
+    std::uint64_t data_end() const noexcept
+    {
+        return m_data->get_addr<std::uint64_t>()[1];
+    }
+
+    void set_data_end(std::uint64_t end) noexcept
+    {
+        m_data->get_addr<std::uint64_t>()[1] = end;
+    }
+
+    /**
+     * Decode the locations of the block with the specified index entry
+     * into locations (indexed by position in the block). Only the positions
+     * up to and including last are decoded. Invalid data in the file is
+     * treated as if there were no locations.
+     */
+    void decode_block(std::uint64_t entry, std::size_t last,
+                      osmium::Location *locations) const noexcept
+    {
+        auto const offset = slot_offset(entry);
+        auto const end_offset = offset + (entry & capacity_mask) * unit_size;
+        if (end_offset > data_end()) {
+            return;
+        }
+
+        char const *begin = m_data->get_addr<char>() + offset;
+        char const *const end = m_data->get_addr<char>() + end_offset;
+
+        std::uint64_t bitmap = 0;
+        std::memcpy(&bitmap, begin, sizeof(bitmap));
+        begin += sizeof(bitmap);
+
+        osmium::DeltaDecode<std::int64_t> dx;
+        osmium::DeltaDecode<std::int64_t> dy;
+
+        try {
+            for (std::size_t n = 0; n <= last; ++n) {
+                if ((bitmap & (1ULL << n)) == 0) {
+                    continue;
+                }
+                auto const x = static_cast<std::int32_t>(
+                    dx.update(protozero::decode_zigzag64(
+                        protozero::decode_varint(&begin, end))));
+                auto const y = static_cast<std::int32_t>(
+                    dy.update(protozero::decode_zigzag64(
+                        protozero::decode_varint(&begin, end))));
+                locations[n] = osmium::Location{x, y};
+            }
+        } catch (protozero::exception const &) {
+        }
+    }
+
+    std::string m_index_file_name;
+    int m_index_fd = -1;
+    std::unique_ptr<osmium::util::MemoryMapping> m_index;
+
+    int m_data_fd;
+    osmium::util::MemoryMapping *m_data;
+
+    access_t m_access = access_t::random;
+    bool m_remove_file;
+
+    /// The block with pending changes and its (decoded) locations.
+    std::uint64_t m_pending_block = std::numeric_limits<std::uint64_t>::max();
+    std::array<osmium::Location, block_size> m_pending;
+    bool m_dirty = false;
+
+    /// Buffer for encoding blocks.
+    std::string m_buffer;
+}; // class node_persistent_cache::compressed_store_t
+
+std::uint64_t node_persistent_cache::next_cache_id() noexcept
+{
+    static std::atomic<std::uint64_t> id{0};
+    return ++id;
+}
+
+std::uint64_t node_persistent_cache::encode(osmium::Location location) const
+    noexcept
+{
+    return location_bits(location) ^ m_xor;
+}
+
+osmium::Location node_persistent_cache::decode(std::uint64_t value) const
+    noexcept
+{
+    value ^= m_xor;
+    std::int32_t coordinates[2];
+    std::memcpy(coordinates, &value, sizeof(value));
+    return osmium::Location{coordinates[0], coordinates[1]};
+}
 
 void node_persistent_cache::set(osmid_t id, osmium::Location location)
 {
-    m_index->set(static_cast<osmium::unsigned_object_id_type>(id), location);
+    if (id < static_cast<osmid_t>(m_first_id)) {
+        throw std::runtime_error{
+            "Can not store node id {} in flatnode file."_format(id)};
+    }
+
+    auto const index = static_cast<std::uint64_t>(id);
+
+    if (m_compressed) {
+        m_compressed->set(index, location);
+        return;
+    }
+    auto const value = encode(location);
+
+    if (index >= num_ids()) {
+        // Everything after the end of the file is unused anyway.
+        if (!location.valid()) {
+            return;
+        }
+        grow(index + 1);
+    }
+
+    data()[index] = value;
+
+    if (value == 0 && m_format == flat_node_format::sparse) {
+        punch_hole_if_empty(index);
+    }
 }
 
 osmium::Location node_persistent_cache::get(osmid_t id) const noexcept
 {
-    return m_index->get_noexcept(
-        static_cast<osmium::unsigned_object_id_type>(id));
+    auto const index = static_cast<std::uint64_t>(id);
+
+    if (m_compressed) {
+        auto const location = m_compressed->get(index);
+        count_lookup(location.valid());
+        return location;
+    }
+
+    if (index < m_first_id || index >= num_ids()) {
+        count_lookup(false);
+        return osmium::Location{};
+    }
+
+    auto const location = decode(data()[index]);
+    count_lookup(location.valid());
+    return location;
+}
+
+void node_persistent_cache::grow_file(int fd,
+                                      osmium::util::MemoryMapping *mapping,
+                                      std::size_t min_size)
+{
+    auto const new_size = (min_size + grow_size - 1) / grow_size * grow_size;
+
+    // Extending the file with ftruncate() creates a hole (on file systems
+    // supporting that), this is exactly what we want for sparse files.
+    osmium::resize_file(fd, new_size);
+    mapping->resize(new_size);
+}
+
+void node_persistent_cache::grow(std::uint64_t min_ids)
+{
+    auto const old_ids = num_ids();
+    grow_file(m_fd, m_mapping.get(), min_ids * value_size);
+
+    if (m_format == flat_node_format::dense) {
+        std::fill(data() + old_ids, data() + num_ids(),
+                  location_bits(osmium::Location{}));
+    }
+
+    apply_advice();
+}
+
+void node_persistent_cache::advise(access_t access) noexcept
+{
+    m_access = access;
+    apply_advice();
+}
+
+void node_persistent_cache::apply_advice() noexcept
+{
+    if (m_compressed) {
+        m_compressed->advise(m_access);
+    } else {
+        advise_mapping(*m_mapping, m_access);
+    }
+}
+
+void node_persistent_cache::will_need(
+    osmium::memory::Buffer const &buffer) const noexcept
+{
+#ifndef _WIN32
+    try {
+        auto const page_size = osmium::get_pagesize();
+
+        // Collect the pages of the data file and advise the kernel for
+        // ranges of consecutive pages.
+        std::vector<std::size_t> pages;
+        for (auto const &way : buffer.select<osmium::Way>()) {
+            for (auto const &nr : way.nodes()) {
+                auto const index = static_cast<std::uint64_t>(nr.ref());
+                if (m_compressed) {
+                    // This reads the block index, which brings its page in
+                    // (synchronously), but that's ok for a hint.
+                    auto const range = m_compressed->data_range(index);
+                    if (range.first < range.second) {
+                        pages.push_back(range.first / page_size);
+                        pages.push_back((range.second - 1) / page_size);
+                    }
+                } else if (index >= m_first_id && index < num_ids()) {
+                    pages.push_back(index * value_size / page_size);
+                }
+            }
+        }
+
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+        auto *const base = m_mapping->get_addr<char>();
+        auto const num_pages = (m_mapping->size() + page_size - 1) / page_size;
+        auto it = pages.cbegin();
+        while (it != pages.cend() && *it < num_pages) {
+            auto const first = *it;
+            auto last = first;
+            while (++it != pages.cend() && *it == last + 1 &&
+                   *it < num_pages) {
+                ++last;
+            }
+            // Errors are ignored here, this is only a hint to the kernel.
+            madvise(base + first * page_size, (last - first + 1) * page_size,
+                    MADV_WILLNEED);
+        }
+    } catch (...) {
+        // This is only an optimization, so errors are ignored.
+    }
+#else
+    (void)buffer;
+#endif
+}
+
+void node_persistent_cache::punch_hole_if_empty(std::uint64_t index) noexcept
+{
+#ifdef __linux__
+    if (!m_can_punch_holes) {
+        return;
+    }
+
+    auto const ids_per_page = osmium::get_pagesize() / value_size;
+    auto const first = index - index % ids_per_page;
+
+    // The page is in memory anyway because we just wrote to it, so checking
+    // it is cheap. Id 0 is never zero in sparse files, so the first page is
+    // never removed.
+    auto const *const begin = data() + first;
+    auto const *const end = begin + ids_per_page;
+    if (first + ids_per_page > num_ids() ||
+        std::any_of(begin, end, [](std::uint64_t v) { return v != 0; })) {
+        return;
+    }
+
+    // NOLINTNEXTLINE(hicpp-signed-bitwise)
+    if (fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  static_cast<off_t>(first * value_size),
+                  static_cast<off_t>(ids_per_page * value_size)) == 0) {
+        ++m_holes_punched;
+    } else if (errno == EOPNOTSUPP) {
+        m_can_punch_holes = false;
+    }
+#else
+    (void)index;
+#endif
+}
+
+void node_persistent_cache::count_lookup(bool found) const noexcept
+{
+    // Counters are collected per thread and added to the (shared) counters
+    // of the cache in batches to avoid contention. Counts for another cache
+    // are dropped.
+    struct counter_t
+    {
+        std::uint64_t cache_id = 0;
+        std::uint64_t lookups = 0;
+        std::uint64_t found = 0;
+    };
+
+    constexpr std::uint64_t const batch_size = 1024;
+
+    static thread_local counter_t counter;
+
+    if (counter.cache_id != m_cache_id) {
+        counter = counter_t{};
+        counter.cache_id = m_cache_id;
+    }
+
+    ++counter.lookups;
+    if (found) {
+        ++counter.found;
+    }
+
+    if (counter.lookups >= batch_size) {
+        m_lookups.fetch_add(counter.lookups, std::memory_order_relaxed);
+        m_found.fetch_add(counter.found, std::memory_order_relaxed);
+        counter.lookups = 0;
+        counter.found = 0;
+    }
+}
+
+void node_persistent_cache::log_stats() const
+{
+    long minor_faults = 0;
+    long major_faults = 0;
+    get_page_faults(&minor_faults, &major_faults);
+
+    auto const lookups = m_lookups.load();
+    auto const found = m_found.load();
+
+    log_debug("Flatnode file '{}': {} lookups, {} found ({}%), {} holes "
+              "punched.",
+              m_file_name, lookups, found,
+              lookups == 0 ? 100 : found * 100 / lookups, m_holes_punched);
+    log_debug("Page faults while flatnode file was open: {} minor, {} major.",
+              minor_faults - m_minor_faults, major_faults - m_major_faults);
 }
 
 node_persistent_cache::node_persistent_cache(std::string file_name,
-                                             bool remove_file)
-: m_file_name(std::move(file_name)), m_remove_file(remove_file)
+                                             bool remove_file,
+                                             flat_node_format format)
+: m_file_name(std::move(file_name)), m_remove_file(remove_file),
+  m_cache_id(next_cache_id())
 {
     assert(!m_file_name.empty());
 
@@ -40,12 +699,70 @@ node_persistent_cache::node_persistent_cache(std::string file_name,
             m_file_name, std::strerror(errno))};
     }
 
-    m_index = std::make_unique<index_t>(m_fd);
+    get_page_faults(&m_minor_faults, &m_major_faults);
+
+    auto size = osmium::file_size(m_fd);
+    bool const new_file = size < value_size;
+
+    try {
+        if (new_file) {
+            size = grow_size;
+            osmium::resize_file(m_fd, size);
+        }
+        m_mapping = std::make_unique<osmium::util::MemoryMapping>(
+            size, osmium::util::MemoryMapping::mapping_mode::write_shared,
+            m_fd);
+    } catch (std::system_error const &e) {
+        close(m_fd);
+        throw std::runtime_error{"Unable to map flatnode file '{}': {}"_format(
+            m_file_name, e.what())};
+    }
+
+    if (new_file) {
+        m_format = format;
+        if (m_format == flat_node_format::sparse) {
+            std::memcpy(data(), sparse_magic, value_size);
+        } else if (m_format == flat_node_format::dense) {
+            std::fill(data(), data() + num_ids(),
+                      location_bits(osmium::Location{}));
+        }
+    } else if (std::memcmp(data(), sparse_magic, value_size) == 0) {
+        m_format = flat_node_format::sparse;
+    } else if (std::memcmp(data(), compressed_magic, value_size) == 0) {
+        m_format = flat_node_format::compressed;
+    }
+
+    if (m_format == flat_node_format::sparse) {
+        m_xor = location_bits(osmium::Location{});
+        m_first_id = 1;
+    } else if (m_format == flat_node_format::compressed) {
+        try {
+            m_compressed = std::make_unique<compressed_store_t>(
+                m_file_name + ".idx", m_fd, m_mapping.get(), new_file,
+                m_remove_file);
+        } catch (...) {
+            m_mapping.reset();
+            close(m_fd);
+            throw;
+        }
+    }
+
+    log_debug("Flatnode file '{}' uses the {} format.", m_file_name,
+              format_name(m_format));
+
+    apply_advice();
 }
 
 node_persistent_cache::~node_persistent_cache() noexcept
 {
-    m_index.reset();
+    try {
+        log_stats();
+    } catch (...) {
+    }
+
+    // The compressed store writes into the mapping of the data file.
+    m_compressed.reset();
+    m_mapping.reset();
     if (m_fd >= 0) {
         close(m_fd);
     }
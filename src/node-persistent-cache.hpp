@@ -10,32 +10,174 @@
  * For a full list of authors see the git log.
  */
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <string>
 
-#include <osmium/index/map/dense_file_array.hpp>
+#include <osmium/memory/buffer.hpp>
 #include <osmium/osm/location.hpp>
+#include <osmium/util/memory_mapping.hpp>
 
+#include "options.hpp"
 #include "osmtypes.hpp"
 
+/**
+ * Node locations stored in a memory-mapped file (the "flat node file").
+ *
+ * The file contains 8 bytes for each node id up to the largest id stored,
+ * the location of a node is at offset id * 8. There are two formats:
+ *
+ * In the *dense* format the locations are stored as they are, unused ids
+ * contain the invalid location. This is the format also used by older
+ * versions of osm2pgsql and by osmium's DenseFileArray.
+ *
+ * In the *sparse* format the locations are stored xor'ed with the invalid
+ * location, so unused ids are all zero bytes. This allows the file to have
+ * holes: Ranges of ids that were never used take up no space on disk and
+ * in the page cache, and pages where all nodes have been deleted are
+ * removed from the file again (on Linux). The slot of id 0, which is not
+ * a valid OSM node id, contains a magic value identifying the format.
+ *
+ * In the *compressed* format the locations of blocks of ids are stored
+ * delta-compressed and there is a separate index file (the name of the
+ * flat node file with ".idx" appended) containing the position of each
+ * block. See compressed_store_t for details.
+ *
+ * When an existing file is opened, its format is detected, the format
+ * given in the constructor is only used for new files.
+ *
+ * Concurrency: There is a single writer, only one thread may call set()
+ * (or any other non-const function). Setting a location can grow the file
+ * and map it to a different address, so nothing may be read while nodes
+ * are written. Once the writer is done, any number of threads can call
+ * get() without synchronization. In osm2pgsql this is guaranteed by the
+ * processing stages: Nodes are only changed before after_nodes() is called
+ * on the middle, ways and relations are only processed after that.
+ */
 class node_persistent_cache
 {
 public:
-    node_persistent_cache(std::string file_name, bool remove_file);
+    /// How the file will be accessed in the near future.
+    enum class access_t
+    {
+        /// ids are set and read (mostly) in order
+        sequential,
+        /// random access, for instance when looking up way nodes
+        random
+    };
+
+    node_persistent_cache(std::string file_name, bool remove_file,
+                          flat_node_format format = flat_node_format::dense);
+
+    node_persistent_cache(node_persistent_cache const &) = delete;
+    node_persistent_cache &operator=(node_persistent_cache const &) = delete;
+
+    node_persistent_cache(node_persistent_cache &&) = delete;
+    node_persistent_cache &operator=(node_persistent_cache &&) = delete;
+
     ~node_persistent_cache() noexcept;
 
+    /**
+     * Set the location of a node. Setting the invalid location removes
+     * the node.
+     *
+     * \throws std::runtime_error if the id can not be stored in the file.
+     */
     void set(osmid_t id, osmium::Location location);
+
+    /**
+     * Get the location of a node. Can be called from several threads, but
+     * only while no nodes are set.
+     */
     osmium::Location get(osmid_t id) const noexcept;
 
+    /// The format of the file.
+    flat_node_format format() const noexcept { return m_format; }
+
+    /**
+     * Tell the kernel how the file will be accessed from now on. This is
+     * only a hint, it doesn't change anything functionally.
+     */
+    void advise(access_t access) noexcept;
+
+    /**
+     * Tell the kernel that the locations of the nodes of all ways in the
+     * buffer will be needed soon, so it can start reading the pages of the
+     * file containing them in the background. Can be called from any
+     * thread, but only while the cache isn't changed.
+     */
+    void will_need(osmium::memory::Buffer const &buffer) const noexcept;
+
+    /// The number of pages removed from the file because they became empty.
+    std::uint64_t holes_punched() const noexcept { return m_holes_punched; }
+
 private:
-    using index_t =
-        osmium::index::map::DenseFileArray<osmium::unsigned_object_id_type,
-                                           osmium::Location>;
+    class compressed_store_t;
+
+    /// The number of bytes used for each id.
+    static constexpr std::size_t const value_size = sizeof(std::uint64_t);
+
+    /// The file is grown in steps of this many bytes (must be a multiple
+    /// of value_size).
+    static constexpr std::size_t const grow_size = 8UL * 1024UL * 1024UL;
+
+    static std::uint64_t next_cache_id() noexcept;
+
+    std::uint64_t *data() const noexcept
+    {
+        return m_mapping->get_addr<std::uint64_t>();
+    }
+
+    std::uint64_t num_ids() const noexcept
+    {
+        return m_mapping->size() / value_size;
+    }
+
+    std::uint64_t encode(osmium::Location location) const noexcept;
+    osmium::Location decode(std::uint64_t value) const noexcept;
+
+    static void grow_file(int fd, osmium::util::MemoryMapping *mapping,
+                          std::size_t min_size);
+
+    void grow(std::uint64_t min_ids);
+    void apply_advice() noexcept;
+    void punch_hole_if_empty(std::uint64_t index) noexcept;
+    void count_lookup(bool found) const noexcept;
+    void log_stats() const;
 
     std::string m_file_name;
     int m_fd = -1;
-    std::unique_ptr<index_t> m_index;
+    std::unique_ptr<osmium::util::MemoryMapping> m_mapping;
+    flat_node_format m_format = flat_node_format::dense;
+
+    /// Only used for the compressed format, m_mapping is its data file then.
+    std::unique_ptr<compressed_store_t> m_compressed;
+
+    /// Encoded values are the location xor'ed with this value.
+    std::uint64_t m_xor = 0;
+
+    /// The smallest id that can be stored (id 0 is the magic in sparse files).
+    std::uint64_t m_first_id = 0;
+
+    access_t m_access = access_t::random;
     bool m_remove_file;
+
+    /// Cleared when the file system turns out not to support hole punching.
+    bool m_can_punch_holes = true;
+
+    std::uint64_t m_holes_punched = 0;
+
+    /// Unique id of this cache used for the per-thread lookup counters.
+    std::uint64_t m_cache_id;
+
+    mutable std::atomic<std::uint64_t> m_lookups{0};
+    mutable std::atomic<std::uint64_t> m_found{0};
+
+    /// Page faults of the process when the file was opened.
+    long m_minor_faults = 0;
+    long m_major_faults = 0;
 };
 
 #endif // OSM2PGSQL_NODE_PERSISTENT_CACHE_HPP
@@ -52,6 +52,8 @@ struct option const long_options[] = {
     {"bbox", required_argument, nullptr, 'b'},
     {"cache", required_argument, nullptr, 'C'},
     {"cache-strategy", required_argument, nullptr, 204},
+    {"cluster-sort-dir", required_argument, nullptr, 220},
+    {"copy-streams", required_argument, nullptr, 223},
     {"create", no_argument, nullptr, 'c'},
     {"database", required_argument, nullptr, 'd'},
     {"disable-parallel-indexing", no_argument, nullptr, 'I'},
@@ -61,6 +63,7 @@ struct option const long_options[] = {
     {"expire-tiles", required_argument, nullptr, 'e'},
     {"extra-attributes", no_argument, nullptr, 'x'},
     {"flat-nodes", required_argument, nullptr, 'F'},
+    {"flat-nodes-format", required_argument, nullptr, 221},
     {"help", no_argument, nullptr, 'h'},
     {"host", required_argument, nullptr, 'H'},
     {"hstore", no_argument, nullptr, 'k'},
@@ -76,11 +79,15 @@ struct option const long_options[] = {
     {"log-sql", no_argument, nullptr, 402},
     {"log-sql-data", no_argument, nullptr, 403},
     {"merc", no_argument, nullptr, 'm'},
+    {"middle-compact", no_argument, nullptr, 224},
+    {"middle-dir", required_argument, nullptr, 219},
     {"middle-schema", required_argument, nullptr, 215},
+    {"middle-snapshot", required_argument, nullptr, 222},
     {"middle-way-node-index-id-shift", required_argument, nullptr, 300},
     {"multi-geometry", no_argument, nullptr, 'G'},
     {"number-processes", required_argument, nullptr, 205},
     {"output", required_argument, nullptr, 'O'},
+    {"output-flex-lua-per-thread", no_argument, nullptr, 218},
     {"output-pgsql-schema", required_argument, nullptr, 216},
     {"password", no_argument, nullptr, 'W'},
     {"port", required_argument, nullptr, 'P'},
@@ -143,6 +150,9 @@ Common options:\n\
                     information in slim mode instead of in PostgreSQL.\n\
                     This is a single large file (> 50GB). Only recommended\n\
                     for full planet imports. Default is disabled.\n\
+       --flat-nodes-format=FORMAT  Format of new flat node files: 'dense'\n\
+                    (default), 'sparse' (unused ids take no disk space), or\n\
+                    'compressed' (smaller, needs an extra index file).\n\
 \n\
 Database options:\n\
     -d|--database=DB  The name of the PostgreSQL database to connect to or\n\
@@ -184,7 +194,14 @@ Middle options:\n\
        --cache-strategy=STRATEGY  Deprecated. Not used any more.\n\
     -x|--extra-attributes  Include attributes (user name, user id, changeset\n\
                     id, timestamp and version) for each object in the database.\n\
+       --middle-compact  Only with --slim: store ways and relations in the\n\
+                    middle tables in a compact binary format. Updates are\n\
+                    only possible with --with-forward-dependencies=false.\n\
+       --middle-dir=DIR  Only with --slim: store middle data in files in DIR\n\
+                    instead of in database tables.\n\
        --middle-schema=SCHEMA  Schema to use for middle tables (default: none).\n\
+       --middle-snapshot=FILE  Only with --slim: keep middle data in memory and\n\
+                    store it in FILE after import for updates.\n\
        --middle-way-node-index-id-shift=SHIFT  Set ID shift for bucket index.\n\
 \n\
 Pgsql output options:\n\
@@ -226,10 +243,18 @@ Expiry options:\n\
 \n\
 Advanced options:\n\
     -I|--disable-parallel-indexing   Disable indexing all tables concurrently.\n\
+       --cluster-sort-dir=DIR  Cluster output tables by sorting the rows in\n\
+                   osm2pgsql using DIR for temporary files instead of\n\
+                   rewriting the tables in the database.\n\
+       --copy-streams=NUM  Number of database connections each thread\n\
+                   uses to COPY data into different tables at the same\n\
+                   time (default: 1).\n\
        --number-processes=NUM  Specifies the number of parallel processes used\n\
                    for certain operations (default depends on number of CPUs).\n\
        --with-forward-dependencies=BOOL  Propagate changes from nodes to ways\n\
                    and node/way members to relations (Default: true).\n\
+       --output-flex-lua-per-thread  Run the Lua config of the flex output\n\
+                   in a separate Lua interpreter in each thread.\n\
 ",
                    stdout);
     } else {
@@ -573,6 +598,43 @@ options_t::options_t(int argc, char *argv[]) : options_t()
                         optarg)};
             }
             break;
+        case 219:
+            middle_dir = optarg;
+            break;
+        case 220:
+            cluster_sort_dir = optarg;
+            break;
+        case 221: // --flat-nodes-format=FORMAT
+            if (std::strcmp(optarg, "dense") == 0) {
+                flat_node_file_format = flat_node_format::dense;
+            } else if (std::strcmp(optarg, "sparse") == 0) {
+                flat_node_file_format = flat_node_format::sparse;
+            } else if (std::strcmp(optarg, "compressed") == 0) {
+                flat_node_file_format = flat_node_format::compressed;
+            } else {
+                throw std::runtime_error{
+                    "Unknown value for --flat-nodes-format option: {}"_format(
+                        optarg)};
+            }
+            break;
+        case 222:
+            middle_snapshot = optarg;
+            break;
+        case 223: {
+            int const num = atoi(optarg);
+            if (num < 1 || num > 32) {
+                throw std::runtime_error{
+                    "--copy-streams must be between 1 and 32."};
+            }
+            copy_streams = static_cast<unsigned int>(num);
+            break;
+        }
+        case 224:
+            middle_compact = true;
+            break;
+        case 218:
+            flex_lua_per_thread = true;
+            break;
         case 300:
             way_node_index_id_shift = atoi(optarg);
             break;
@@ -694,6 +756,49 @@ void options_t::check_options()
         log_warn("Ignoring --flat-nodes/-F setting in non-slim mode");
     }
 
+    if (!slim && !middle_dir.empty()) {
+        throw std::runtime_error{"--middle-dir only makes sense with --slim."};
+    }
+
+    if (middle_compact) {
+        if (!slim) {
+            throw std::runtime_error{
+                "--middle-compact only makes sense with --slim."};
+        }
+        if (!middle_dir.empty() || !middle_snapshot.empty()) {
+            log_warn("Ignoring --middle-compact setting with --middle-dir or "
+                     "--middle-snapshot");
+            middle_compact = false;
+        } else if (!append && !droptemp && with_forward_dependencies) {
+            log_warn("Middle tables in compact format can only be updated "
+                     "with --with-forward-dependencies=false.");
+        }
+    }
+
+    if (!middle_snapshot.empty()) {
+        if (!slim) {
+            throw std::runtime_error{
+                "--middle-snapshot only makes sense with --slim."};
+        }
+        if (!middle_dir.empty()) {
+            throw std::runtime_error{
+                "--middle-snapshot can not be used with --middle-dir."};
+        }
+        if (!flat_node_file.empty()) {
+            log_warn("Ignoring --flat-nodes/-F setting with --middle-snapshot");
+        }
+    }
+
+    if (!cluster_sort_dir.empty()) {
+        if (append) {
+            log_warn("Ignoring --cluster-sort-dir setting in append mode");
+            cluster_sort_dir.clear();
+        } else if (expire_tiles_zoom != 0) {
+            throw std::runtime_error{
+                "--cluster-sort-dir can not be used with --expire-tiles."};
+        }
+    }
+
     // zoom level 31 is the technical limit because we use 32-bit integers for the x and y index of a tile ID
     if (expire_tiles_zoom_min > 31) {
         expire_tiles_zoom_min = 31;
@@ -707,6 +812,12 @@ void options_t::check_options()
                  "large and has been set to 31.");
     }
 
+    if (flex_lua_per_thread && output_backend != "flex") {
+        log_warn("--output-flex-lua-per-thread only makes sense with the flex"
+                 " output; ignored.");
+        flex_lua_per_thread = false;
+    }
+
     if (output_backend == "flex" || output_backend == "gazetteer") {
         if (style == DEFAULT_STYLE) {
             throw std::runtime_error{
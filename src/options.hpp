@@ -30,6 +30,17 @@ enum class hstore_column : char
     all = 2
 };
 
+/// Format of the flat node file
+enum class flat_node_format : char
+{
+    /// one location for each id, unused ids are filled with invalid locations
+    dense = 0,
+    /// like dense, but unused ids take up no disk space (sparse file)
+    sparse = 1,
+    /// blocks of ids are stored delta-compressed
+    compressed = 2
+};
+
 /**
  * Database options, not specific to a table
  */
@@ -143,6 +154,10 @@ public:
     bool keep_coastlines = false;
     bool parallel_indexing = true;
     unsigned int num_procs;
+
+    /// Number of COPY streams (database connections) per copy thread.
+    unsigned int copy_streams = 1;
+
     bool droptemp = false; ///< drop slim mode temp tables after act
 
     /**
@@ -151,6 +166,20 @@ public:
      */
     bool with_forward_dependencies = true;
 
+    /**
+     * Store ways and relations in the middle tables in the compact binary
+     * format (always used with --drop). These tables can only be updated
+     * without forward dependencies.
+     */
+    bool middle_compact = false;
+
+    /**
+     * Should every thread of the flex output run the Lua config in its own
+     * Lua interpreter? Lua code then runs in parallel, but global Lua state
+     * is not shared between threads.
+     */
+    bool flex_lua_per_thread = false;
+
     /// only copy rows that match an explicitly listed key
     bool hstore_match_only = false;
 
@@ -159,6 +188,28 @@ public:
     /// Name of the flat node file used. Empty if flat node file is not enabled.
     std::string flat_node_file{};
 
+    /// Format used when creating a new flat node file.
+    flat_node_format flat_node_file_format = flat_node_format::dense;
+
+    /**
+     * Directory for the files of the file-based middle. Empty if the middle
+     * data is stored in the database.
+     */
+    std::string middle_dir{};
+
+    /**
+     * File for the snapshot of the in-memory middle used in slim mode.
+     * Empty if the middle data is stored in the database or in files.
+     */
+    std::string middle_snapshot{};
+
+    /**
+     * Directory for temporary files used when sorting the rows of the
+     * output tables on the client side. Empty if the tables are clustered
+     * in the database.
+     */
+    std::string cluster_sort_dir{};
+
     std::string tag_transform_script;
 
     bool create = false;
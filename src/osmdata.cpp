@@ -8,15 +8,22 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
 #include <functional>
 #include <future>
 #include <memory>
-#include <mutex>
 #include <utility>
 #include <vector>
 
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm.hpp>
+#include <osmium/thread/queue.hpp>
+
 #include "db-copy.hpp"
 #include "format.hpp"
 #include "logging.hpp"
@@ -26,12 +33,329 @@
 #include "output.hpp"
 #include "util.hpp"
 
+/**
+ * Middle query instance used by a worker thread in parallel stage 1. It
+ * wraps the real middle query instance. When the locations of the nodes of
+ * a way in the current batch are requested for the first time, the node
+ * locations of all ways in the batch are retrieved at once, which is much
+ * faster than looking them up way by way. Later requests for the locations
+ * of ways in that batch are answered without another lookup.
+ *
+ * Batches without any way the output needs the geometry of (for instance
+ * batches with relations only) don't need any lookups. But if the output
+ * needs the geometry of only some of the ways in a batch, the locations
+ * for the other ways are still retrieved, because a single lookup for
+ * the whole batch is cheaper than one lookup per way.
+ */
+class batch_middle_query_t : public middle_query_t
+{
+public:
+    explicit batch_middle_query_t(std::shared_ptr<middle_query_t> mid)
+    : m_mid(std::move(mid))
+    {
+        assert(m_mid);
+    }
+
+    /**
+     * Start processing a new batch. The node locations of its ways are
+     * retrieved on the first call to nodes_get_list() for one of them.
+     */
+    void start_batch(osmium::memory::Buffer *batch)
+    {
+        m_batch = batch;
+        m_batch_begin = reinterpret_cast<std::uintptr_t>(batch->data());
+        m_batch_end = m_batch_begin + batch->committed();
+        m_locations_set = false;
+    }
+
+    size_t nodes_get_list(osmium::WayNodeList *nodes) const override
+    {
+        auto const addr = reinterpret_cast<std::uintptr_t>(nodes);
+        if (addr >= m_batch_begin && addr < m_batch_end) {
+            if (!m_locations_set) {
+                m_mid->nodes_get_lists(m_batch);
+                m_locations_set = true;
+            }
+            return static_cast<std::size_t>(std::count_if(
+                nodes->cbegin(), nodes->cend(), [](osmium::NodeRef const &nr) {
+                    return nr.location().valid();
+                }));
+        }
+        return m_mid->nodes_get_list(nodes);
+    }
+
+    std::size_t nodes_get_lists(osmium::memory::Buffer *buffer) const override
+    {
+        return m_mid->nodes_get_lists(buffer);
+    }
+
+    bool way_get(osmid_t id, osmium::memory::Buffer *buffer) const override
+    {
+        return m_mid->way_get(id, buffer);
+    }
+
+    size_t rel_members_get(osmium::Relation const &rel,
+                           osmium::memory::Buffer *buffer,
+                           osmium::osm_entity_bits::type types) const override
+    {
+        return m_mid->rel_members_get(rel, buffer, types);
+    }
+
+    bool relation_get(osmid_t id,
+                      osmium::memory::Buffer *buffer) const override
+    {
+        return m_mid->relation_get(id, buffer);
+    }
+
+    void prefetch_ways(idlist_t const &ids) override
+    {
+        m_mid->prefetch_ways(ids);
+    }
+
+    void prefetch_relations(idlist_t const &ids) override
+    {
+        m_mid->prefetch_relations(ids);
+    }
+
+private:
+    std::shared_ptr<middle_query_t> m_mid;
+
+    /// The current batch and its memory range.
+    osmium::memory::Buffer *m_batch = nullptr;
+    std::uintptr_t m_batch_begin = 0;
+    std::uintptr_t m_batch_end = 0;
+
+    /// Have the node locations of the current batch been set?
+    mutable bool m_locations_set = false;
+};
+
+/**
+ * In create mode the ways and relations from the input are processed by the
+ * output in several threads (parallel stage 1). The main thread still reads
+ * the input and stores all objects in the middle, but the objects that need
+ * to be handed to the output are copied into batches. These batches are
+ * processed by worker threads, each with its own clone of the output, its
+ * own middle query instance and its own database copy thread.
+ *
+ * This only works because the middle guarantees that objects of a type
+ * can be queried concurrently from other threads once the phase for that
+ * type is finished, i.e. node locations after after_nodes() and ways after
+ * after_ways().
+ */
+class stage1_processor_t
+{
+public:
+    stage1_processor_t(std::string const &conninfo,
+                       std::size_t copy_streams,
+                       std::shared_ptr<middle_t> const &mid,
+                       std::shared_ptr<output_t> output,
+                       std::size_t thread_count)
+    : m_output(std::move(output)), m_queue(thread_count * 2, "stage1")
+    {
+        assert(mid);
+        assert(m_output);
+
+        log_info("Processing ways and relations using {} threads.",
+                 thread_count);
+
+        // For each thread we create a clone of the output.
+        for (std::size_t i = 0; i < thread_count; ++i) {
+            auto const midq = std::make_shared<batch_middle_query_t>(
+                mid->get_query_instance());
+            auto copy_thread =
+                std::make_shared<db_copy_thread_t>(conninfo, copy_streams);
+            m_clones.push_back(m_output->clone(midq, copy_thread));
+            m_midqs.push_back(midq);
+        }
+
+        for (std::size_t i = 0; i < thread_count; ++i) {
+            m_workers.push_back(std::async(std::launch::async, run,
+                                           m_clones[i].get(), m_midqs[i].get(),
+                                           &m_queue, &m_failed));
+        }
+    }
+
+    stage1_processor_t(stage1_processor_t const &) = delete;
+    stage1_processor_t &operator=(stage1_processor_t const &) = delete;
+
+    stage1_processor_t(stage1_processor_t &&) = delete;
+    stage1_processor_t &operator=(stage1_processor_t &&) = delete;
+
+    ~stage1_processor_t() noexcept
+    {
+        // If finish() was not called, we are here because of an exception.
+        // Tell the workers to stop processing and wait for them to end.
+        if (!m_workers.empty()) {
+            m_failed = true;
+            try {
+                stop_workers();
+            } catch (...) {
+            }
+        }
+    }
+
+    /**
+     * Add an object to the current batch. Full batches are handed to the
+     * worker threads.
+     */
+    void add(osmium::OSMObject const &object)
+    {
+        m_batch.add_item(object);
+        m_batch.commit();
+
+        if (m_batch.committed() >= max_batch_size) {
+            // No need to go on reading the input if processing has failed.
+            // This will rethrow the exception from the failed worker.
+            if (m_failed) {
+                stop_workers();
+            }
+            m_queue.push(std::move(m_batch));
+            m_batch = new_batch();
+        }
+    }
+
+    /**
+     * Process all remaining objects and wait for the workers to finish.
+     * Flushes all data from the clones to the database and merges the
+     * expiry information back into the original output.
+     */
+    void finish()
+    {
+        if (m_batch.committed() > 0) {
+            m_queue.push(std::move(m_batch));
+            m_batch = new_batch();
+        }
+
+        stop_workers();
+
+        for (auto const &clone : m_clones) {
+            m_output->merge_expire_trees(clone.get());
+            m_output->merge_marked_way_ids(clone.get());
+        }
+        m_clones.clear();
+        m_midqs.clear();
+    }
+
+private:
+    /**
+     * Size of a batch in bytes. Large enough to keep the synchronization
+     * overhead low, small enough to distribute the work evenly.
+     */
+    static constexpr std::size_t const max_batch_size = 1024UL * 1024UL;
+
+    using queue_t = osmium::thread::Queue<osmium::memory::Buffer>;
+
+    static osmium::memory::Buffer new_batch()
+    {
+        return osmium::memory::Buffer{max_batch_size + 64UL * 1024UL,
+                                      osmium::memory::Buffer::auto_grow::yes};
+    }
+
+    static void process_batch(output_t *output, batch_middle_query_t *midq,
+                              osmium::memory::Buffer *batch)
+    {
+        midq->start_batch(batch);
+
+        for (auto &object : batch->select<osmium::OSMObject>()) {
+            if (object.type() == osmium::item_type::way) {
+                output->way_add(static_cast<osmium::Way *>(&object));
+            } else {
+                assert(object.type() == osmium::item_type::relation);
+                output->relation_add(
+                    static_cast<osmium::Relation const &>(object));
+            }
+        }
+    }
+
+    /**
+     * Runs in the worker threads: Process batches from the queue until an
+     * invalid buffer signals the end of the input. After an error in any of
+     * the workers the remaining batches are only drained from the queue so
+     * that the main thread doesn't block.
+     */
+    static void run(output_t *output, batch_middle_query_t *midq,
+                    queue_t *queue, std::atomic<bool> *failed)
+    {
+        std::exception_ptr error;
+
+        osmium::memory::Buffer batch;
+        while (true) {
+            queue->wait_and_pop(batch);
+            if (!batch) {
+                break;
+            }
+            if (*failed) {
+                continue;
+            }
+            try {
+                process_batch(output, midq, &batch);
+            } catch (...) {
+                error = std::current_exception();
+                *failed = true;
+            }
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        if (!*failed) {
+            output->sync();
+        }
+    }
+
+    void stop_workers()
+    {
+        // An invalid buffer tells a worker to stop.
+        for (std::size_t i = 0; i < m_workers.size(); ++i) {
+            m_queue.push(osmium::memory::Buffer{});
+        }
+
+        std::exception_ptr error;
+        for (auto &worker : m_workers) {
+            try {
+                worker.get();
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        m_workers.clear();
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    /// Clones of output, one clone per thread.
+    std::vector<std::shared_ptr<output_t>> m_clones;
+
+    /// Middle query instances used by the clones.
+    std::vector<std::shared_ptr<batch_middle_query_t>> m_midqs;
+
+    std::vector<std::future<void>> m_workers;
+
+    /// The output.
+    std::shared_ptr<output_t> m_output;
+
+    /// The batch currently being filled.
+    osmium::memory::Buffer m_batch = new_batch();
+
+    /// Queue with full batches waiting for the workers.
+    queue_t m_queue;
+
+    /// Set when one of the workers failed.
+    std::atomic<bool> m_failed{false};
+};
+
 osmdata_t::osmdata_t(std::unique_ptr<dependency_manager_t> dependency_manager,
                      std::shared_ptr<middle_t> mid,
                      std::shared_ptr<output_t> output, options_t const &options)
 : m_dependency_manager(std::move(dependency_manager)), m_mid(std::move(mid)),
   m_output(std::move(output)), m_conninfo(options.database_options.conninfo()),
   m_bbox(options.bbox), m_num_procs(options.num_procs),
+  m_copy_streams(options.copy_streams),
   m_append(options.append), m_droptemp(options.droptemp),
   m_with_extra_attrs(options.extra_attributes),
   m_with_forward_dependencies(options.with_forward_dependencies)
@@ -41,19 +365,10 @@ osmdata_t::osmdata_t(std::unique_ptr<dependency_manager_t> dependency_manager,
     assert(m_output);
 }
 
+osmdata_t::~osmdata_t() = default;
+
 void osmdata_t::node(osmium::Node const &node)
 {
-    if (node.visible()) {
-        if (!node.location().valid()) {
-            log_warn("Ignored node {} (version {}) with invalid location.",
-                     node.id(), node.version());
-            return;
-        }
-        if (m_bbox.valid() && !m_bbox.contains(node.location())) {
-            return;
-        }
-    }
-
     m_mid->node(node);
 
     if (node.deleted()) {
@@ -67,7 +382,25 @@ void osmdata_t::node(osmium::Node const &node)
     }
 }
 
-void osmdata_t::after_nodes() { m_mid->after_nodes(); }
+void osmdata_t::after_nodes()
+{
+    m_mid->after_nodes();
+    m_nodes_done = true;
+
+    // In create mode ways and relations are processed in parallel once the
+    // node locations are available.
+    if (!m_append && m_num_procs > 1) {
+        m_stage1_processor = std::make_unique<stage1_processor_t>(
+            m_conninfo, m_copy_streams, m_mid, m_output, m_num_procs);
+    }
+}
+
+void osmdata_t::prefetch(osmium::memory::Buffer const &buffer) const
+{
+    if (m_nodes_done) {
+        m_mid->prefetch_way_node_locations(buffer);
+    }
+}
 
 void osmdata_t::way(osmium::Way &way)
 {
@@ -108,7 +441,18 @@ void osmdata_t::relation(osmium::Relation const &rel)
     }
 }
 
-void osmdata_t::after_relations() { m_mid->after_relations(); }
+void osmdata_t::after_relations()
+{
+    if (m_stage1_processor) {
+        util::timer_t timer;
+        m_stage1_processor->finish();
+        m_stage1_processor.reset();
+        log_debug("Waiting for parallel stage 1 processing took {}",
+                  util::human_readable_duration(timer.stop()));
+    }
+
+    m_mid->after_relations();
+}
 
 void osmdata_t::node_add(osmium::Node const &node) const
 {
@@ -120,14 +464,22 @@ void osmdata_t::node_add(osmium::Node const &node) const
 void osmdata_t::way_add(osmium::Way *way) const
 {
     if (m_with_extra_attrs || !way->tags().empty()) {
-        m_output->way_add(way);
+        if (m_stage1_processor) {
+            m_stage1_processor->add(*way);
+        } else {
+            m_output->way_add(way);
+        }
     }
 }
 
 void osmdata_t::relation_add(osmium::Relation const &rel) const
 {
     if (m_with_extra_attrs || !rel.tags().empty()) {
-        m_output->relation_add(rel);
+        if (m_stage1_processor) {
+            m_stage1_processor->add(rel);
+        } else {
+            m_output->relation_add(rel);
+        }
     }
 }
 
@@ -180,6 +532,7 @@ class multithreaded_processor
 {
 public:
     multithreaded_processor(std::string const &conninfo,
+                            std::size_t copy_streams,
                             std::shared_ptr<middle_t> const &mid,
                             std::shared_ptr<output_t> output,
                             std::size_t thread_count)
@@ -191,8 +544,10 @@ public:
         // For each thread we create a clone of the output.
         for (std::size_t i = 0; i < thread_count; ++i) {
             auto const midq = mid->get_query_instance();
-            auto copy_thread = std::make_shared<db_copy_thread_t>(conninfo);
+            auto copy_thread =
+                std::make_shared<db_copy_thread_t>(conninfo, copy_streams);
             m_clones.push_back(m_output->clone(midq, copy_thread));
+            m_mid_queries.push_back(midq);
         }
     }
 
@@ -204,7 +559,8 @@ public:
      */
     void process_ways(idlist_t &&list)
     {
-        process_queue("way", std::move(list), &output_t::pending_way);
+        process_queue("way", std::move(list), &output_t::pending_way,
+                      &middle_query_t::prefetch_ways);
     }
 
     /**
@@ -215,7 +571,8 @@ public:
      */
     void process_relations(idlist_t &&list)
     {
-        process_queue("relation", std::move(list), &output_t::pending_relation);
+        process_queue("relation", std::move(list), &output_t::pending_relation,
+                      &middle_query_t::prefetch_relations);
     }
 
     /**
@@ -227,59 +584,102 @@ public:
     void process_relations_stage1c(idlist_t &&list)
     {
         process_queue("relation", std::move(list),
-                      &output_t::pending_relation_stage1c);
+                      &output_t::pending_relation_stage1c,
+                      &middle_query_t::prefetch_relations);
     }
 
     /**
-     * Collect expiry tree information from all clones and merge it back
-     * into the original output.
+     * Collect expiry tree information and marked ways from all clones and
+     * merge them back into the original output.
      */
-    void merge_expire_trees()
+    void merge_clone_data()
     {
         for (auto const &clone : m_clones) {
             m_output->merge_expire_trees(clone.get());
+            m_output->merge_marked_way_ids(clone.get());
         }
     }
 
 private:
-    /// Get the next id from the queue.
-    static osmid_t pop_id(idlist_t *queue, std::mutex *mutex)
-    {
-        osmid_t id = 0;
+    /**
+     * Number of ids handed to a worker at once. Neighbouring ids are often
+     * stored close to each other in the middle, so working on a range of
+     * them in one thread helps with locality of the lookups.
+     */
+    static constexpr std::size_t const chunk_size = 256;
 
-        std::lock_guard<std::mutex> const lock{*mutex};
-        if (!queue->empty()) {
-            id = queue->back();
-            queue->pop_back();
+    /**
+     * The work queue: A list of ids and an atomic cursor pointing to the
+     * first id not yet handed out to a worker.
+     */
+    struct work_queue_t
+    {
+        idlist_t const *list = nullptr;
+        std::atomic<std::size_t> cursor{0};
+
+        /// Number of ids not yet handed out to a worker.
+        std::size_t left() const noexcept
+        {
+            auto const pos = cursor.load();
+            return pos >= list->size() ? 0 : list->size() - pos;
         }
 
-        return id;
-    }
+        /// Make sure no more ids are handed out.
+        void drain() noexcept { cursor = list->size(); }
+    };
 
     // Pointer to a member function of output_t taking an osm_id
     using output_member_fn_ptr = void (output_t::*)(osmid_t);
 
+    // Pointer to a member function of middle_query_t prefetching objects
+    using prefetch_fn_ptr = void (middle_query_t::*)(idlist_t const &);
+
     /**
-     * Runs in the worker threads: As long as there are any, get ids from
-     * the queue and let the output process it by calling "func".
+     * Runs in the worker threads: As long as there are any, get chunks of
+     * ids from the queue, let the middle prefetch the objects in the chunk
+     * by calling "prefetch" and then let the output process them by
+     * calling "func".
+     *
+     * \returns The number of ids processed by this worker.
      */
-    static void run(std::shared_ptr<output_t> const &output, idlist_t *queue,
-                    std::mutex *mutex, output_member_fn_ptr func)
+    static std::size_t run(std::shared_ptr<output_t> const &output,
+                           std::shared_ptr<middle_query_t> const &mid,
+                           work_queue_t *queue, output_member_fn_ptr func,
+                           prefetch_fn_ptr prefetch)
     {
-        while (osmid_t const id = pop_id(queue, mutex)) {
-            (output.get()->*func)(id);
+        std::size_t count = 0;
+        auto const size = queue->list->size();
+        auto const list_begin = queue->list->cbegin();
+
+        while (true) {
+            auto const begin = queue->cursor.fetch_add(chunk_size);
+            if (begin >= size) {
+                break;
+            }
+            auto const end = std::min(begin + chunk_size, size);
+            idlist_t const ids(list_begin + static_cast<std::ptrdiff_t>(begin),
+                               list_begin + static_cast<std::ptrdiff_t>(end));
+            (mid.get()->*prefetch)(ids);
+            for (auto const id : ids) {
+                (output.get()->*func)(id);
+            }
+            count += ids.size();
         }
+
+        // Release the memory used for prefetched objects.
+        (mid.get()->*prefetch)({});
+
         output->sync();
+
+        return count;
     }
 
     /// Runs in a worker thread: Update progress display once per second.
-    static void print_stats(idlist_t *queue, std::mutex *mutex)
+    static void print_stats(work_queue_t const *queue)
     {
         std::size_t queue_size = 0;
         do {
-            mutex->lock();
-            queue_size = queue->size();
-            mutex->unlock();
+            queue_size = queue->left();
 
             if (get_logger().show_progress()) {
                 fmt::print(stderr, "\rLeft to process: {}...", queue_size);
@@ -290,35 +690,39 @@ private:
     }
 
     void process_queue(char const *type, idlist_t list,
-                       output_member_fn_ptr function)
+                       output_member_fn_ptr function, prefetch_fn_ptr prefetch)
     {
         auto const ids_queued = list.size();
 
         log_info("Going over {} pending {}s (using {} threads)"_format(
             ids_queued, type, m_clones.size()));
 
+        work_queue_t queue;
+        queue.list = &list;
+
         util::timer_t timer;
-        std::vector<std::future<void>> workers;
+        std::vector<std::future<std::size_t>> workers;
 
-        for (auto const &clone : m_clones) {
-            workers.push_back(std::async(std::launch::async, run,
-                                         std::cref(clone), &list, &m_mutex,
-                                         function));
+        for (std::size_t n = 0; n < m_clones.size(); ++n) {
+            workers.push_back(std::async(
+                std::launch::async, run, std::cref(m_clones[n]),
+                std::cref(m_mid_queries[n]), &queue, function, prefetch));
         }
-        workers.push_back(
-            std::async(std::launch::async, print_stats, &list, &m_mutex));
+        auto stats =
+            std::async(std::launch::async, print_stats, &queue);
 
+        std::vector<std::size_t> counts;
         for (auto &worker : workers) {
             try {
-                worker.get();
+                counts.push_back(worker.get());
             } catch (...) {
                 // Drain the queue, so that the other workers finish early.
-                m_mutex.lock();
-                list.clear();
-                m_mutex.unlock();
+                queue.drain();
+                stats.wait();
                 throw;
             }
         }
+        stats.get();
 
         timer.stop();
 
@@ -330,30 +734,36 @@ private:
                  ids_queued, type,
                  util::human_readable_duration(timer.elapsed()),
                  timer.per_second(ids_queued));
+
+        for (std::size_t n = 0; n < counts.size(); ++n) {
+            log_debug("  Thread {} processed {} {}s at a rate of {:.2f}/s", n,
+                      counts[n], type, timer.per_second(counts[n]));
+        }
     }
 
     /// Clones of output, one clone per thread.
     std::vector<std::shared_ptr<output_t>> m_clones;
 
+    /// Middle query instances used by the clones, one per thread.
+    std::vector<std::shared_ptr<middle_query_t>> m_mid_queries;
+
     /// The output.
     std::shared_ptr<output_t> m_output;
-
-    /// Mutex to make sure worker threads coordinate access to queue.
-    std::mutex m_mutex;
 };
 
 } // anonymous namespace
 
 void osmdata_t::process_dependents() const
 {
-    multithreaded_processor proc{m_conninfo, m_mid, m_output, m_num_procs};
+    multithreaded_processor proc{m_conninfo, m_copy_streams, m_mid, m_output,
+                                 m_num_procs};
 
     // stage 1b processing: process parents of changed objects
     if (m_dependency_manager->has_pending()) {
         proc.process_ways(m_dependency_manager->get_pending_way_ids());
         proc.process_relations(
             m_dependency_manager->get_pending_relation_ids());
-        proc.merge_expire_trees();
+        proc.merge_clone_data();
     }
 
     // stage 1c processing: mark parent relations of marked objects as changed
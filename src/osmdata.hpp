@@ -18,11 +18,13 @@
  * It contains the osmdata_t class.
  */
 
+#include <atomic>
 #include <memory>
 #include <string>
 
 #include <osmium/fwd.hpp>
 #include <osmium/handler.hpp>
+#include <osmium/memory/buffer.hpp>
 #include <osmium/osm/box.hpp>
 
 #include "dependency-manager.hpp"
@@ -31,6 +33,7 @@
 class middle_t;
 class options_t;
 class output_t;
+class stage1_processor_t;
 
 /**
  * This class guides the processing of the OSM data through its multiple
@@ -44,6 +47,8 @@ public:
               std::shared_ptr<middle_t> mid, std::shared_ptr<output_t> output,
               options_t const &options);
 
+    ~osmdata_t();
+
     void start() const;
 
     void node(osmium::Node const &node);
@@ -54,6 +59,19 @@ public:
     void after_ways();
     void after_relations();
 
+    /**
+     * The bounding box set by the user. Nodes outside of it are not
+     * imported. Filtering happens in the input pipeline.
+     */
+    osmium::Box const &bbox() const noexcept { return m_bbox; }
+
+    /**
+     * Called by the input pipeline for buffers read ahead of the one
+     * currently processed. Lets the middle prefetch the locations of way
+     * nodes once all nodes are done. Thread-safe.
+     */
+    void prefetch(osmium::memory::Buffer const &buffer) const;
+
     /**
      * Rest of the processing (stages 1b, 1c, 2, and database postprocessing).
      * This is called once after the input files are processed.
@@ -93,13 +111,24 @@ private:
     std::shared_ptr<middle_t> m_mid;
     std::shared_ptr<output_t> m_output;
 
+    /**
+     * Processes ways and relations in several threads in create mode. Only
+     * set between after_nodes() and after_relations() and only if more than
+     * one thread should be used.
+     */
+    std::unique_ptr<stage1_processor_t> m_stage1_processor;
+
     std::string m_conninfo;
 
+    /// Set in after_nodes(), from then on way nodes are prefetched.
+    std::atomic<bool> m_nodes_done{false};
+
     // Bounding box for node import (or invalid Box if everything should be
     // imported).
     osmium::Box m_bbox;
 
     unsigned int m_num_procs;
+    unsigned int m_copy_streams;
     bool m_append;
     bool m_droptemp;
     bool m_with_extra_attrs;
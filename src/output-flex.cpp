@@ -20,6 +20,7 @@
 #include "output-flex.hpp"
 #include "pgsql.hpp"
 #include "reprojection.hpp"
+#include "row-sorter.hpp"
 #include "thread-pool.hpp"
 #include "util.hpp"
 #include "version.hpp"
@@ -47,7 +48,8 @@ extern "C"
 #include <stdexcept>
 #include <string>
 
-// Mutex used to coordinate access to Lua code
+// Mutex used to coordinate access to Lua code if the Lua state is shared
+// between the clones of the output.
 static std::mutex lua_mutex;
 
 // Lua can't call functions on C++ objects directly. This macro defines simple
@@ -263,17 +265,17 @@ write_direction(db_copy_mgr_t<db_deleter_by_type_and_id_t> *copy_mgr,
                 flex_table_column_t const &column, char const *str)
 {
     if ((std::strcmp(str, "yes") == 0) || (std::strcmp(str, "1") == 0)) {
-        copy_mgr->add_column(1);
+        copy_mgr->add_column(int16_t{1});
         return;
     }
 
     if ((std::strcmp(str, "no") == 0) || (std::strcmp(str, "0") == 0)) {
-        copy_mgr->add_column(0);
+        copy_mgr->add_column(int16_t{0});
         return;
     }
 
     if (std::strcmp(str, "-1") == 0) {
-        copy_mgr->add_column(-1);
+        copy_mgr->add_column(int16_t{-1});
         return;
     }
 
@@ -300,7 +302,7 @@ void write_integer(db_copy_mgr_t<db_deleter_by_type_and_id_t> *copy_mgr,
 
     if (value >= std::numeric_limits<T>::min() &&
         value <= std::numeric_limits<T>::max()) {
-        copy_mgr->add_column(value);
+        copy_mgr->add_column(static_cast<T>(value));
         return;
     }
 
@@ -323,7 +325,7 @@ static void write_double(db_copy_mgr_t<db_deleter_by_type_and_id_t> *copy_mgr,
         return;
     }
 
-    copy_mgr->add_column(value);
+    copy_mgr->add_column(static_cast<float>(value));
 }
 
 using json_writer_type = rapidjson::Writer<rapidjson::StringBuffer>;
@@ -521,7 +523,7 @@ void output_flex_t::write_column(
             int64_t const value = lua_tointeger(lua_state(), -1);
             if (value >= std::numeric_limits<int16_t>::min() &&
                 value <= std::numeric_limits<int16_t>::max()) {
-                copy_mgr->add_column(value);
+                copy_mgr->add_column(static_cast<int16_t>(value));
             } else {
                 write_null(copy_mgr, column);
             }
@@ -529,7 +531,8 @@ void output_flex_t::write_column(
             write_integer<int16_t>(copy_mgr, column,
                                    lua_tolstring(lua_state(), -1, nullptr));
         } else if (ltype == LUA_TBOOLEAN) {
-            copy_mgr->add_column(lua_toboolean(lua_state(), -1));
+            copy_mgr->add_column(
+                static_cast<int16_t>(lua_toboolean(lua_state(), -1)));
         } else {
             throw std::runtime_error{
                 "Invalid type '{}' for int2 column."_format(
@@ -540,7 +543,7 @@ void output_flex_t::write_column(
             int64_t const value = lua_tointeger(lua_state(), -1);
             if (value >= std::numeric_limits<int32_t>::min() &&
                 value <= std::numeric_limits<int32_t>::max()) {
-                copy_mgr->add_column(value);
+                copy_mgr->add_column(static_cast<int32_t>(value));
             } else {
                 write_null(copy_mgr, column);
             }
@@ -548,7 +551,8 @@ void output_flex_t::write_column(
             write_integer<int32_t>(copy_mgr, column,
                                    lua_tolstring(lua_state(), -1, nullptr));
         } else if (ltype == LUA_TBOOLEAN) {
-            copy_mgr->add_column(lua_toboolean(lua_state(), -1));
+            copy_mgr->add_column(
+                static_cast<int32_t>(lua_toboolean(lua_state(), -1)));
         } else {
             throw std::runtime_error{
                 "Invalid type '{}' for int4 column."_format(
@@ -556,12 +560,14 @@ void output_flex_t::write_column(
         }
     } else if (column.type() == table_column_type::int8) {
         if (ltype == LUA_TNUMBER) {
-            copy_mgr->add_column(lua_tointeger(lua_state(), -1));
+            copy_mgr->add_column(
+                static_cast<int64_t>(lua_tointeger(lua_state(), -1)));
         } else if (ltype == LUA_TSTRING) {
             write_integer<int64_t>(copy_mgr, column,
                                    lua_tolstring(lua_state(), -1, nullptr));
         } else if (ltype == LUA_TBOOLEAN) {
-            copy_mgr->add_column(lua_toboolean(lua_state(), -1));
+            copy_mgr->add_column(
+                static_cast<int64_t>(lua_toboolean(lua_state(), -1)));
         } else {
             throw std::runtime_error{
                 "Invalid type '{}' for int8 column."_format(
@@ -569,7 +575,8 @@ void output_flex_t::write_column(
         }
     } else if (column.type() == table_column_type::real) {
         if (ltype == LUA_TNUMBER) {
-            copy_mgr->add_column(lua_tonumber(lua_state(), -1));
+            copy_mgr->add_column(
+                static_cast<float>(lua_tonumber(lua_state(), -1)));
         } else if (ltype == LUA_TSTRING) {
             write_double(copy_mgr, column,
                          lua_tolstring(lua_state(), -1, nullptr));
@@ -616,14 +623,20 @@ void output_flex_t::write_column(
         json_writer_type writer{stream};
         table_register_type tables;
         write_json(&writer, lua_state(), &tables);
-        copy_mgr->add_column(stream.GetString());
+        if (column.type() == table_column_type::jsonb) {
+            copy_mgr->add_jsonb_column(stream.GetString());
+        } else {
+            copy_mgr->add_column(stream.GetString());
+        }
     } else if (column.type() == table_column_type::direction) {
         switch (ltype) {
         case LUA_TBOOLEAN:
-            copy_mgr->add_column(lua_toboolean(lua_state(), -1));
+            copy_mgr->add_column(
+                static_cast<int16_t>(lua_toboolean(lua_state(), -1)));
             break;
         case LUA_TNUMBER:
-            copy_mgr->add_column(sgn(lua_tonumber(lua_state(), -1)));
+            copy_mgr->add_column(
+                static_cast<int16_t>(sgn(lua_tonumber(lua_state(), -1))));
             break;
         case LUA_TSTRING:
             write_direction(copy_mgr, column,
@@ -672,14 +685,14 @@ void output_flex_t::write_row(table_connection_t *table_connection,
                               .get_area<osmium::geom::IdentityProjection>()
                         : ewkb::parser_t(geom).get_area<reprojection>(
                               reprojection::create_projection(srid).get());
-                copy_mgr->add_column(area);
+                copy_mgr->add_column(static_cast<float>(area));
             }
         } else {
             write_column(copy_mgr, column);
         }
     }
 
-    copy_mgr->finish_line();
+    table_connection->finish_line(id_type, id, geom);
 }
 
 // Gets all way nodes from the middle the first time this is called.
@@ -933,11 +946,31 @@ int output_flex_t::app_define_table()
 
     luaL_checktype(lua_state(), 1, LUA_TTABLE);
 
-    auto &new_table = create_flex_table();
-    setup_id_columns(&new_table);
-    setup_flex_table_columns(&new_table);
+    std::size_t num_tables = 0;
+    if (m_has_own_lua_state) {
+        // This is a clone running the Lua config in its own Lua state. The
+        // tables have already been defined and checked in the main Lua state,
+        // here we only make sure that we get the same tables in the same
+        // order. The table objects in Lua only store the index.
+        std::string const table_name =
+            luaX_get_table_string(lua_state(), "name", -1, "The table");
+        lua_pop(lua_state(), 1);
+
+        if (m_num_clone_tables >= m_tables->size() ||
+            (*m_tables)[m_num_clone_tables].name() != table_name) {
+            throw std::runtime_error{
+                "Lua config defines different tables when run again for"
+                " another thread (table '{}')."_format(table_name)};
+        }
+        num_tables = ++m_num_clone_tables;
+    } else {
+        auto &new_table = create_flex_table();
+        setup_id_columns(&new_table);
+        setup_flex_table_columns(&new_table);
+        num_tables = m_tables->size();
+    }
 
-    lua_pushlightuserdata(lua_state(), (void *)(m_tables->size()));
+    lua_pushlightuserdata(lua_state(), (void *)(num_tables));
     luaL_getmetatable(lua_state(), osm2pgsql_table_name);
     lua_setmetatable(lua_state(), -2);
 
@@ -1261,10 +1294,18 @@ void output_flex_t::call_lua_function(prepared_lua_function_t func,
     m_calling_context = calling_context::main;
 }
 
+std::unique_lock<std::mutex> output_flex_t::lock_lua() const
+{
+    if (m_options.flex_lua_per_thread) {
+        return std::unique_lock<std::mutex>{};
+    }
+    return std::unique_lock<std::mutex>{lua_mutex};
+}
+
 void output_flex_t::get_mutex_and_call_lua_function(
     prepared_lua_function_t func, osmium::OSMObject const &object)
 {
-    std::lock_guard<std::mutex> guard{lua_mutex};
+    auto const guard = lock_lua();
     call_lua_function(func, object);
 }
 
@@ -1296,7 +1337,7 @@ void output_flex_t::select_relation_members(osmium::Relation const &relation)
         return;
     }
 
-    std::lock_guard<std::mutex> guard{lua_mutex};
+    auto const guard = lock_lua();
 
     m_context_relation = &relation;
     call_lua_function(m_select_relation_members, relation);
@@ -1562,6 +1603,15 @@ std::shared_ptr<output_t>
 output_flex_t::clone(std::shared_ptr<middle_query_t> const &mid,
                      std::shared_ptr<db_copy_thread_t> const &copy_thread) const
 {
+    if (m_options.flex_lua_per_thread) {
+        // The clone will load the Lua config into its own Lua state and
+        // collect marked ways in its own set.
+        return std::make_shared<output_flex_t>(
+            mid, m_thread_pool, *get_options(), copy_thread, true, nullptr,
+            m_process_node, m_process_way, m_process_relation,
+            m_select_relation_members, m_tables, std::make_shared<idset_t>());
+    }
+
     return std::make_shared<output_flex_t>(
         mid, m_thread_pool, *get_options(), copy_thread, true, m_lua_state,
         m_process_node, m_process_way, m_process_relation,
@@ -1599,6 +1649,15 @@ output_flex_t::output_flex_t(
         if (m_select_relation_members) {
             m_output_requirements.full_ways = true;
         }
+    } else if (!m_lua_state) {
+        m_has_own_lua_state = true;
+        init_lua(m_options.style);
+
+        if (m_num_clone_tables != m_tables->size()) {
+            throw std::runtime_error{
+                "Lua config defines different tables when run again for"
+                " another thread."};
+        }
     }
 
     if (m_tables->empty()) {
@@ -1606,6 +1665,17 @@ output_flex_t::output_flex_t(
             "No tables defined in Lua config. Nothing to do!"};
     }
 
+    if (!is_clone && !m_options.append &&
+        !m_options.cluster_sort_dir.empty()) {
+        for (auto &table : *m_tables) {
+            if (table.cluster_by_geom()) {
+                table.set_sorter(std::make_shared<row_sorter_t>(
+                    reprojection::create_projection(table.srid()),
+                    m_options.cluster_sort_dir));
+            }
+        }
+    }
+
     assert(m_table_connections.empty());
     for (auto &table : *m_tables) {
         m_table_connections.emplace_back(&table, m_copy_thread);
@@ -1766,6 +1836,19 @@ void output_flex_t::reprocess_marked()
     m_stage2_way_ids->clear();
 }
 
+void output_flex_t::merge_marked_way_ids(output_t *other)
+{
+    auto *oflex = dynamic_cast<output_flex_t *>(other);
+    if (!oflex || oflex->m_stage2_way_ids == m_stage2_way_ids) {
+        return;
+    }
+
+    for (osmid_t const id : *oflex->m_stage2_way_ids) {
+        m_stage2_way_ids->set(id);
+    }
+    oflex->m_stage2_way_ids->clear();
+}
+
 void output_flex_t::merge_expire_trees(output_t *other)
 {
     auto *opgsql = dynamic_cast<output_flex_t *>(other);
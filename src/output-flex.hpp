@@ -26,6 +26,7 @@ extern "C"
 
 #include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
@@ -152,6 +153,7 @@ public:
     void relation_delete(osmid_t id) override;
 
     void merge_expire_trees(output_t *other) override;
+    void merge_marked_way_ids(output_t *other) override;
 
     int app_define_table();
     int app_mark_way();
@@ -175,6 +177,12 @@ private:
     void call_lua_function(prepared_lua_function_t func,
                            osmium::OSMObject const &object);
 
+    /**
+     * Aquire the lua_mutex unless every clone has its own Lua state. The
+     * mutex is released when the returned lock goes out of scope.
+     */
+    std::unique_lock<std::mutex> lock_lua() const;
+
     /// Aquire the lua_mutex and the call `call_lua_function()`.
     void get_mutex_and_call_lua_function(prepared_lua_function_t func,
                                          osmium::OSMObject const &object);
@@ -222,13 +230,16 @@ private:
     std::vector<table_connection_t> m_table_connections;
 
     // This is shared between all clones of the output and must only be
-    // accessed while protected using the lua_mutex.
+    // accessed while protected using the lua_mutex. If each clone has its
+    // own Lua state, each clone has its own set which is merged into the
+    // set of the main output with merge_marked_way_ids().
     std::shared_ptr<idset_t> m_stage2_way_ids;
 
     std::shared_ptr<db_copy_thread_t> m_copy_thread;
 
     // This is shared between all clones of the output and must only be
-    // accessed while protected using the lua_mutex.
+    // accessed while protected using the lua_mutex. Unless the option
+    // --output-flex-lua-per-thread is set, then each clone has its own.
     std::shared_ptr<lua_State> m_lua_state;
 
     expire_tiles m_expire;
@@ -259,6 +270,12 @@ private:
      * add_row() command.
      */
     bool m_disable_add_row = false;
+
+    /// Is this a clone which has loaded the Lua config into its own state?
+    bool m_has_own_lua_state = false;
+
+    /// Number of tables defined so far in the Lua state of the clone.
+    std::size_t m_num_clone_tables = 0;
 };
 
 #endif // OSM2PGSQL_OUTPUT_FLEX_HPP
@@ -37,6 +37,7 @@
 #include "output-pgsql.hpp"
 #include "pgsql.hpp"
 #include "reprojection.hpp"
+#include "row-sorter.hpp"
 #include "taginfo-impl.hpp"
 #include "tagtransform.hpp"
 #include "util.hpp"
@@ -437,10 +438,17 @@ output_pgsql_t::output_pgsql_t(
             std::abort(); // should never be here
         }
 
+        std::shared_ptr<row_sorter_t> sorter;
+        if (!m_options.append && !m_options.cluster_sort_dir.empty()) {
+            sorter = std::make_shared<row_sorter_t>(
+                m_options.projection, m_options.cluster_sort_dir);
+        }
+
         m_tables[i] = std::make_unique<table_t>(
             name, type, columns, m_options.hstore_columns,
             m_options.projection->target_srs(), m_options.append,
-            m_options.hstore_mode, copy_thread, m_options.output_dbschema);
+            m_options.hstore_mode, copy_thread, m_options.output_dbschema,
+            std::move(sorter));
     }
 }
 
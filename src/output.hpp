@@ -83,6 +83,12 @@ public:
 
     virtual void merge_expire_trees(output_t *other);
 
+    /**
+     * Merge the ids of ways marked for stage 2 processing in a clone back
+     * into this output. Only needed if the clones don't share this set.
+     */
+    virtual void merge_marked_way_ids(output_t *) {}
+
     struct output_requirements const &get_requirements() const noexcept
     {
         return m_output_requirements;
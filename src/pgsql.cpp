@@ -15,10 +15,17 @@
 
 #include <array>
 #include <cassert>
+#include <cerrno>
 #include <stdexcept>
 #include <string>
 #include <utility>
 
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <poll.h>
+#endif
+
 pg_conn_t::pg_conn_t(std::string const &conninfo)
 : m_conn(PQconnectdb(conninfo.c_str()))
 {
@@ -81,27 +88,109 @@ void pg_conn_t::exec(std::string const &sql) const
     }
 }
 
+void pg_conn_t::set_nonblocking() const
+{
+    assert(m_conn);
+
+    if (PQsetnonblocking(m_conn.get(), 1) != 0) {
+        throw std::runtime_error{
+            "Can not set database connection to non-blocking mode: {}"_format(
+                error_msg())};
+    }
+}
+
+void pg_conn_t::wait_for_write() const
+{
+    assert(m_conn);
+
+    int const sock = PQsocket(m_conn.get());
+    if (sock < 0) {
+        throw std::runtime_error{"Invalid database connection socket."};
+    }
+
+#ifdef _WIN32
+    WSAPOLLFD pfd{};
+    pfd.fd = static_cast<SOCKET>(sock);
+    pfd.events = POLLRDNORM | POLLWRNORM;
+    int const r = WSAPoll(&pfd, 1, -1);
+    bool const readable = (pfd.revents & (POLLRDNORM | POLLHUP | POLLERR)) != 0;
+#else
+    pollfd pfd{};
+    pfd.fd = sock;
+    pfd.events = POLLIN | POLLOUT;
+    int r = 0;
+    while ((r = poll(&pfd, 1, -1)) < 0 && errno == EINTR) {
+    }
+    bool const readable = (pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+#endif
+
+    if (r < 0) {
+        throw std::runtime_error{"Waiting for database connection failed."};
+    }
+
+    // The server might send messages (like notices) while we are sending
+    // data. They have to be read, otherwise the server might block.
+    if (readable && PQconsumeInput(m_conn.get()) == 0) {
+        throw std::runtime_error{"Database error: {}"_format(error_msg())};
+    }
+}
+
+void pg_conn_t::flush() const
+{
+    assert(m_conn);
+
+    int r = 0;
+    while ((r = PQflush(m_conn.get())) == 1) {
+        wait_for_write();
+    }
+
+    if (r != 0) {
+        throw std::runtime_error{
+            "Sending data to database failed: {}"_format(error_msg())};
+    }
+}
+
+bool pg_conn_t::try_flush() const
+{
+    assert(m_conn);
+
+    int const r = PQflush(m_conn.get());
+    if (r < 0) {
+        throw std::runtime_error{
+            "Sending data to database failed: {}"_format(error_msg())};
+    }
+
+    return r == 0;
+}
+
 void pg_conn_t::copy_data(std::string const &sql,
                           std::string const &context) const
 {
     assert(m_conn);
 
     log_sql_data("Copy data to '{}':\n{}", context, sql);
-    int const r = PQputCopyData(m_conn.get(), sql.c_str(), (int)sql.size());
 
-    if (r == 1) {
-        return; // success
+    // In non-blocking mode, data from the last call might still be
+    // buffered in libpq. Wait for it to be sent first, so that no more
+    // than one buffer is kept in memory there.
+    flush();
+
+    int r = PQputCopyData(m_conn.get(), sql.c_str(), (int)sql.size());
+    if (r == 0) {
+        // Only happens in non-blocking mode if libpq can't buffer the data.
+        // Wait until the buffered data is sent and try again.
+        flush();
+        r = PQputCopyData(m_conn.get(), sql.c_str(), (int)sql.size());
     }
 
-    switch (r) {
-    case 0: // need to wait for write ready
-        log_error("{} - COPY unexpectedly busy", context);
-        break;
-    case -1: // error occurred
-        log_error("{} - error on COPY: {}", context, error_msg());
-        break;
+    // Send as much as possible now without waiting, the rest is sent on
+    // the next call or in flush().
+    if (r == 1 && PQflush(m_conn.get()) >= 0) {
+        return; // success
     }
 
+    log_error("{} - error on COPY: {}", context, error_msg());
+
     if (sql.size() < 1100) {
         log_error("Data: {}", sql);
     } else {
@@ -116,11 +205,20 @@ void pg_conn_t::end_copy(std::string const &context) const
 {
     assert(m_conn);
 
-    if (PQputCopyEnd(m_conn.get(), nullptr) != 1) {
+    int r = PQputCopyEnd(m_conn.get(), nullptr);
+    if (r == 0) {
+        // See copy_data().
+        flush();
+        r = PQputCopyEnd(m_conn.get(), nullptr);
+    }
+
+    if (r != 1) {
         throw std::runtime_error{"Ending COPY mode for '{}' failed: {}."_format(
             context, error_msg())};
     }
 
+    flush();
+
     pg_result_t const res{PQgetResult(m_conn.get())};
     if (PQresultStatus(res.get()) != PGRES_COMMAND_OK) {
         throw std::runtime_error{fmt::format(
@@ -147,7 +245,8 @@ static std::string concat_params(int num_params,
 
 pg_result_t
 pg_conn_t::exec_prepared_internal(char const *stmt, int num_params,
-                                  char const *const *param_values) const
+                                  char const *const *param_values,
+                                  bool binary_result) const
 {
     assert(m_conn);
 
@@ -156,7 +255,7 @@ pg_conn_t::exec_prepared_internal(char const *stmt, int num_params,
                 concat_params(num_params, param_values));
     }
     pg_result_t res{PQexecPrepared(m_conn.get(), stmt, num_params, param_values,
-                                   nullptr, nullptr, 0)};
+                                   nullptr, nullptr, binary_result ? 1 : 0)};
     if (PQresultStatus(res.get()) != PGRES_TUPLES_OK) {
         log_error("SQL command failed: EXECUTE {}({})", stmt,
                   concat_params(num_params, param_values));
@@ -167,6 +266,24 @@ pg_conn_t::exec_prepared_internal(char const *stmt, int num_params,
     return res;
 }
 
+void pg_conn_t::exec_params(char const *sql, int num_params,
+                            char const *const *param_values) const
+{
+    assert(m_conn);
+
+    log_sql("{}", sql);
+    if (get_logger().log_sql_data()) {
+        log_sql_data("Parameters: {}", concat_params(num_params, param_values));
+    }
+    pg_result_t res{PQexecParams(m_conn.get(), sql, num_params, nullptr,
+                                 param_values, nullptr, nullptr, 0)};
+    if (PQresultStatus(res.get()) != PGRES_COMMAND_OK) {
+        log_error("SQL command failed: {}", sql);
+        throw std::runtime_error{"Database error: {} ({})"_format(
+            error_msg(), PQresultStatus(res.get()))};
+    }
+}
+
 pg_result_t pg_conn_t::exec_prepared(char const *stmt, char const *p1, char const *p2) const
 {
     std::array<const char *, 2> params{{p1, p2}};
@@ -190,6 +307,21 @@ pg_result_t pg_conn_t::exec_prepared(char const *stmt, osmid_t id) const
     return exec_prepared(stmt, buffer.c_str());
 }
 
+pg_result_t pg_conn_t::exec_prepared_binary(char const *stmt,
+                                            std::string const &param) const
+{
+    char const *const value = param.c_str();
+    return exec_prepared_internal(stmt, 1, &value, true);
+}
+
+pg_result_t pg_conn_t::exec_prepared_binary(char const *stmt,
+                                            osmid_t id) const
+{
+    util::integer_to_buffer buffer{id};
+    char const *const value = buffer.c_str();
+    return exec_prepared_internal(stmt, 1, &value, true);
+}
+
 std::string tablespace_clause(std::string const &name)
 {
     std::string sql;
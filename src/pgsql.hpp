@@ -129,6 +129,19 @@ public:
     /// Execute a prepared statement with one integer parameter.
     pg_result_t exec_prepared(char const *stmt, osmid_t id) const;
 
+    /**
+     * Execute a prepared statement with one string parameter and get the
+     * result in binary format.
+     */
+    pg_result_t exec_prepared_binary(char const *stmt,
+                                     std::string const &param) const;
+
+    /**
+     * Execute a prepared statement with one integer parameter and get the
+     * result in binary format.
+     */
+    pg_result_t exec_prepared_binary(char const *stmt, osmid_t id) const;
+
     pg_result_t query(ExecStatusType expect, char const *sql) const;
 
     pg_result_t query(ExecStatusType expect, std::string const &sql) const;
@@ -139,6 +152,37 @@ public:
 
     void exec(std::string const &sql) const;
 
+    /**
+     * Execute an SQL command with parameters. The parameters are sent
+     * separately from the command text, so large values (like arrays with
+     * many ids) don't have to be parsed as part of the SQL.
+     */
+    void exec_params(char const *sql, int num_params,
+                     char const *const *param_values) const;
+
+    /**
+     * Switch the connection into non-blocking mode. In this mode
+     * copy_data() only hands the data to libpq and sends as much as
+     * possible without waiting for the socket, so the caller can do other
+     * work while the data is sent. Call flush() to wait until everything
+     * is sent. Other commands still block until they are done.
+     */
+    void set_nonblocking() const;
+
+    /**
+     * Send all data still buffered in libpq to the server, waiting for
+     * the socket if necessary.
+     */
+    void flush() const;
+
+    /**
+     * Send as much of the data buffered in libpq as possible without
+     * waiting for the socket.
+     *
+     * \return true if everything is sent.
+     */
+    bool try_flush() const;
+
     void copy_data(std::string const &sql, std::string const &context) const;
 
     void end_copy(std::string const &context) const;
@@ -149,8 +193,15 @@ public:
     void close() noexcept { m_conn.reset(); }
 
 private:
+    /**
+     * Wait until the connection socket is ready for writing after PQflush()
+     * could not send all data. Input arriving in the meantime is consumed.
+     */
+    void wait_for_write() const;
+
     pg_result_t exec_prepared_internal(char const *stmt, int num_params,
-                                       char const *const *param_values) const;
+                                       char const *const *param_values,
+                                       bool binary_result = false) const;
 
     struct pg_conn_deleter_t
     {
@@ -0,0 +1,406 @@
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+#include "format.hpp"
+#include "logging.hpp"
+#include "row-sorter.hpp"
+#include "wkb.hpp"
+
+#include <osmium/geom/mercator_projection.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+
+#include <unistd.h>
+
+std::uint64_t hilbert_index(std::uint32_t x, std::uint32_t y) noexcept
+{
+    std::uint64_t index = 0;
+
+    for (std::uint32_t s = 1UL << 31U; s > 0; s >>= 1U) {
+        std::uint32_t const rx = (x & s) ? 1 : 0;
+        std::uint32_t const ry = (y & s) ? 1 : 0;
+        index += static_cast<std::uint64_t>(s) * s * ((3U * rx) ^ ry);
+
+        // Rotate the quadrant so that the curve inside it has the right
+        // orientation.
+        if (ry == 0) {
+            if (rx == 1) {
+                x = ~x;
+                y = ~y;
+            }
+            std::swap(x, y);
+        }
+    }
+
+    return index;
+}
+
+namespace {
+
+struct bbox_t
+{
+    double min_x = std::numeric_limits<double>::max();
+    double min_y = std::numeric_limits<double>::max();
+    double max_x = std::numeric_limits<double>::lowest();
+    double max_y = std::numeric_limits<double>::lowest();
+
+    void extend(osmium::geom::Coordinates const &c) noexcept
+    {
+        min_x = std::min(min_x, c.x);
+        min_y = std::min(min_y, c.y);
+        max_x = std::max(max_x, c.x);
+        max_y = std::max(max_y, c.y);
+    }
+
+    bool valid() const noexcept { return min_x <= max_x; }
+};
+
+void add_points(ewkb::parser_t *parser, bbox_t *bbox)
+{
+    auto const num = parser->read_length();
+    for (std::uint32_t i = 0; i < num; ++i) {
+        bbox->extend(parser->read_point());
+    }
+}
+
+void add_geometry(ewkb::parser_t *parser, bbox_t *bbox)
+{
+    switch (parser->read_header()) {
+    case ewkb::wkb_point:
+        bbox->extend(parser->read_point());
+        break;
+    case ewkb::wkb_line:
+        add_points(parser, bbox);
+        break;
+    case ewkb::wkb_polygon: {
+        auto const num_rings = parser->read_length();
+        if (num_rings > 0) {
+            // The outer ring is enough for the bounding box.
+            add_points(parser, bbox);
+            for (std::uint32_t i = 1; i < num_rings; ++i) {
+                parser->skip_points(parser->read_length());
+            }
+        }
+        break;
+    }
+    case ewkb::wkb_multi_point:
+    case ewkb::wkb_multi_line:
+    case ewkb::wkb_multi_polygon:
+    case ewkb::wkb_collection: {
+        auto const num = parser->read_length();
+        for (std::uint32_t i = 0; i < num; ++i) {
+            add_geometry(parser, bbox);
+        }
+        break;
+    }
+    default:
+        throw std::runtime_error{"Invalid EWKB geometry found"};
+    }
+}
+
+std::uint32_t to_curve_coordinate(double c) noexcept
+{
+    constexpr double const max = osmium::geom::detail::max_coordinate_epsg3857;
+    constexpr double const scale =
+        static_cast<double>(std::numeric_limits<std::uint32_t>::max());
+
+    if (!(c > -max)) { // also catches NaN
+        return 0;
+    }
+    if (c >= max) {
+        return std::numeric_limits<std::uint32_t>::max();
+    }
+
+    return static_cast<std::uint32_t>((c + max) / (2 * max) * scale);
+}
+
+/// Description of the write operation for error messages.
+constexpr char const *const write_what = "Writing temporary file for sorting";
+
+} // anonymous namespace
+
+std::uint64_t geom_sort_key(std::string const &wkb, reprojection const &proj)
+{
+    if (wkb.empty()) {
+        return 0;
+    }
+
+    bbox_t bbox;
+    ewkb::parser_t parser{wkb};
+    add_geometry(&parser, &bbox);
+
+    if (!bbox.valid()) {
+        return 0;
+    }
+
+    auto const center = proj.target_to_tile(osmium::geom::Coordinates{
+        (bbox.min_x + bbox.max_x) / 2, (bbox.min_y + bbox.max_y) / 2});
+
+    // The y axis is flipped so that the order is the same as the order
+    // of tiles.
+    return hilbert_index(to_curve_coordinate(center.x),
+                         to_curve_coordinate(-center.y));
+}
+
+/**
+ * Reads the rows of a sorted run back from its temporary file.
+ */
+class row_sorter_t::run_reader_t
+{
+public:
+    explicit run_reader_t(std::FILE *file) : m_file(file)
+    {
+        std::rewind(m_file);
+        next();
+    }
+
+    bool at_end() const noexcept { return m_at_end; }
+
+    entry_t const &entry() const noexcept { return m_entry; }
+
+    std::string const &data() const noexcept { return m_data; }
+
+    void next()
+    {
+        if (!read_value(&m_entry.key)) {
+            m_at_end = true;
+            return;
+        }
+
+        if (!read_value(&m_entry.seq) || !read_value(&m_entry.id) ||
+            !read_value(&m_entry.size) || !read_value(&m_entry.type)) {
+            throw_read_error();
+        }
+
+        m_data.resize(m_entry.size);
+        if (std::fread(&m_data[0], 1, m_entry.size, m_file) != m_entry.size) {
+            throw_read_error();
+        }
+    }
+
+private:
+    template <typename T>
+    bool read_value(T *value)
+    {
+        return std::fread(value, sizeof(T), 1, m_file) == 1;
+    }
+
+    [[noreturn]] static void throw_read_error()
+    {
+        throw std::runtime_error{
+            "Reading temporary file for sorting failed."};
+    }
+
+    std::FILE *m_file;
+    entry_t m_entry{};
+    std::string m_data;
+    bool m_at_end = false;
+}; // class row_sorter_t::run_reader_t
+
+row_sorter_t::row_sorter_t(std::shared_ptr<reprojection> proj,
+                           std::string tmp_dir, std::size_t max_memory)
+: m_proj(std::move(proj)), m_tmp_dir(std::move(tmp_dir)),
+  m_max_memory(max_memory)
+{
+    assert(m_proj);
+}
+
+void row_sorter_t::add(std::string const &wkb, char type, osmid_t id,
+                       char const *data, std::size_t size)
+{
+    // Computing the key doesn't need the lock.
+    auto const key = geom_sort_key(wkb, *m_proj);
+
+    std::vector<entry_t> entries;
+    std::string run_data;
+
+    {
+        std::lock_guard<std::mutex> const guard{m_mutex};
+
+        m_entries.push_back(entry_t{key, m_seq++, id, m_data.size(),
+                                    static_cast<std::uint32_t>(size), type});
+        m_data.append(data, size);
+        ++m_count;
+
+        if (m_data.size() + m_entries.size() * sizeof(entry_t) <=
+            m_max_memory) {
+            return;
+        }
+
+        // Take the full run out, other threads can add new rows while it
+        // is sorted and written.
+        using std::swap;
+        swap(entries, m_entries);
+        swap(run_data, m_data);
+        ++m_runs_in_progress;
+    }
+
+    util::file_ptr_t file;
+    try {
+        file = write_run(&entries, run_data);
+    } catch (...) {
+        std::lock_guard<std::mutex> const guard{m_mutex};
+        --m_runs_in_progress;
+        m_run_written.notify_all();
+        throw;
+    }
+
+    std::lock_guard<std::mutex> const guard{m_mutex};
+    m_runs.push_back(std::move(file));
+    --m_runs_in_progress;
+    m_run_written.notify_all();
+}
+
+void row_sorter_t::remove(char type, osmid_t id)
+{
+    std::lock_guard<std::mutex> const guard{m_mutex};
+    m_removed[std::make_pair(type, id)] = m_seq++;
+}
+
+bool row_sorter_t::is_removed(char type, osmid_t id, std::uint64_t seq) const
+{
+    if (m_removed.empty()) {
+        return false;
+    }
+
+    auto const it = m_removed.find(std::make_pair(type, id));
+    return it != m_removed.end() && it->second > seq;
+}
+
+util::file_ptr_t
+row_sorter_t::write_run(std::vector<entry_t> *entries,
+                        std::string const &data) const
+{
+    assert(entries);
+
+    std::sort(entries->begin(), entries->end(),
+              [](entry_t const &a, entry_t const &b) {
+                  return std::make_pair(a.key, a.seq) <
+                         std::make_pair(b.key, b.seq);
+              });
+
+    std::string name = m_tmp_dir + "/osm2pgsql-sort-XXXXXX";
+    int const fd = mkstemp(&name[0]);
+    if (fd < 0) {
+        throw std::runtime_error{
+            "Unable to create temporary file for sorting in '{}': {}"_format(
+                m_tmp_dir, std::strerror(errno))};
+    }
+
+    // The file is only accessed through the open file descriptor and will
+    // be removed automatically when it is closed.
+    unlink(name.c_str());
+
+    util::file_ptr_t file{fdopen(fd, "w+b")};
+    if (!file) {
+        close(fd);
+        throw std::runtime_error{
+            "Unable to create temporary file for sorting in '{}': {}"_format(
+                m_tmp_dir, std::strerror(errno))};
+    }
+
+    for (auto const &entry : *entries) {
+        util::write_value(file.get(), entry.key, write_what);
+        util::write_value(file.get(), entry.seq, write_what);
+        util::write_value(file.get(), entry.id, write_what);
+        util::write_value(file.get(), entry.size, write_what);
+        util::write_value(file.get(), entry.type, write_what);
+        util::write_data(file.get(), data.data() + entry.offset, entry.size,
+                         write_what);
+    }
+
+    if (std::fflush(file.get()) != 0) {
+        throw std::runtime_error{
+            "Writing temporary file for sorting failed: {}"_format(
+                std::strerror(errno))};
+    }
+
+    log_debug("Wrote sorted run with {} rows to temporary file.",
+              entries->size());
+
+    return file;
+}
+
+void row_sorter_t::for_each(
+    std::function<void(char const *, std::size_t)> const &func)
+{
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_run_written.wait(lock, [this]() { return m_runs_in_progress == 0; });
+
+    if (m_runs.empty()) {
+        std::sort(m_entries.begin(), m_entries.end(),
+                  [](entry_t const &a, entry_t const &b) {
+                      return std::make_pair(a.key, a.seq) <
+                             std::make_pair(b.key, b.seq);
+                  });
+
+        for (auto const &entry : m_entries) {
+            if (!is_removed(entry.type, entry.id, entry.seq)) {
+                func(m_data.data() + entry.offset, entry.size);
+            }
+        }
+    } else {
+        if (!m_entries.empty()) {
+            m_runs.push_back(write_run(&m_entries, m_data));
+        }
+
+        std::vector<run_reader_t> readers;
+        readers.reserve(m_runs.size());
+        for (auto const &run : m_runs) {
+            readers.emplace_back(run.get());
+        }
+
+        auto const greater = [&readers](std::size_t a, std::size_t b) {
+            auto const &ea = readers[a].entry();
+            auto const &eb = readers[b].entry();
+            return std::make_pair(ea.key, ea.seq) >
+                   std::make_pair(eb.key, eb.seq);
+        };
+
+        std::priority_queue<std::size_t, std::vector<std::size_t>,
+                            decltype(greater)>
+            queue{greater};
+
+        for (std::size_t i = 0; i < readers.size(); ++i) {
+            if (!readers[i].at_end()) {
+                queue.push(i);
+            }
+        }
+
+        while (!queue.empty()) {
+            auto const n = queue.top();
+            queue.pop();
+
+            auto &reader = readers[n];
+            auto const &entry = reader.entry();
+            if (!is_removed(entry.type, entry.id, entry.seq)) {
+                func(reader.data().data(), reader.data().size());
+            }
+
+            reader.next();
+            if (!reader.at_end()) {
+                queue.push(n);
+            }
+        }
+    }
+
+    m_entries.clear();
+    m_entries.shrink_to_fit();
+    m_data.clear();
+    m_data.shrink_to_fit();
+    m_runs.clear();
+    m_removed.clear();
+}
@@ -0,0 +1,170 @@
+#ifndef OSM2PGSQL_ROW_SORTER_HPP
+#define OSM2PGSQL_ROW_SORTER_HPP
+
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+/**
+ * \file
+ *
+ * Sorting of table rows by geometry on the client side. This is used to
+ * write the output tables in clustered order on import so that they don't
+ * have to be rewritten by the database afterwards.
+ */
+
+#include "osmtypes.hpp"
+#include "reprojection.hpp"
+#include "util.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Return the position of the point (x, y) on a Hilbert curve filling the
+ * square from (0, 0) to (2^32 - 1, 2^32 - 1).
+ */
+std::uint64_t hilbert_index(std::uint32_t x, std::uint32_t y) noexcept;
+
+/**
+ * Compute the key for sorting a geometry. This is the Hilbert index of the
+ * center of the bounding box of the geometry in web mercator coordinates.
+ *
+ * \param wkb The geometry in (E)WKB format as created by ewkb::writer_t.
+ * \param proj The projection the coordinates of the geometry are in.
+ */
+std::uint64_t geom_sort_key(std::string const &wkb, reprojection const &proj);
+
+/**
+ * External merge sort for rows of one table.
+ *
+ * Rows are added in the format they will be sent to the database in
+ * together with the geometry they are sorted by and the OSM object they
+ * belong to. Rows are collected in memory, if the memory limit is reached
+ * they are sorted and written to a temporary file. At the end all sorted
+ * runs are merged.
+ *
+ * Rows can be removed by object before the sorted rows are read. This is
+ * needed because objects processed again in stage 2 are deleted from the
+ * output tables first.
+ *
+ * Adding and removing rows is thread-safe. When the memory limit is reached
+ * the rows in memory are taken out under the lock, but they are sorted and
+ * written out without holding it, so other threads can go on adding rows
+ * in the meantime.
+ */
+class row_sorter_t
+{
+public:
+    /// Default memory limit for rows kept in memory.
+    static constexpr std::size_t const default_max_memory =
+        128UL * 1024UL * 1024UL;
+
+    /**
+     * \param proj The projection of the geometries added.
+     * \param tmp_dir The directory where temporary files are created.
+     * \param max_memory Memory used for rows before they are written out.
+     */
+    row_sorter_t(std::shared_ptr<reprojection> proj, std::string tmp_dir,
+                 std::size_t max_memory = default_max_memory);
+
+    /**
+     * Add a row.
+     *
+     * \param wkb The geometry the row is sorted by (can be empty).
+     * \param type The type of the object ('X' if the type is not used).
+     * \param id The id of the object the row belongs to.
+     * \param data The data of the row.
+     * \param size The size of the data.
+     */
+    void add(std::string const &wkb, char type, osmid_t id, char const *data,
+             std::size_t size);
+
+    /// Remove all rows added for this object so far.
+    void remove(char type, osmid_t id);
+
+    /**
+     * Call the function with the data and size of all rows not removed in
+     * sorted order. Must only be called once after all rows have been added.
+     */
+    void
+    for_each(std::function<void(char const *, std::size_t)> const &func);
+
+    /// The number of rows added.
+    std::size_t size() const noexcept { return m_count; }
+
+    /// The number of runs written to temporary files.
+    std::size_t num_runs() const noexcept { return m_runs.size(); }
+
+private:
+    struct entry_t
+    {
+        std::uint64_t key;
+        std::uint64_t seq;
+        osmid_t id;
+        std::size_t offset;
+        std::uint32_t size;
+        char type;
+    };
+
+    struct object_hash_t
+    {
+        std::size_t operator()(std::pair<char, osmid_t> const &obj) const
+            noexcept
+        {
+            return std::hash<osmid_t>{}(obj.second) ^
+                   static_cast<std::size_t>(obj.first);
+        }
+    };
+
+    class run_reader_t;
+
+    /// Sort the entries and write them to a new temporary file.
+    util::file_ptr_t write_run(std::vector<entry_t> *entries,
+                         std::string const &data) const;
+
+    bool is_removed(char type, osmid_t id, std::uint64_t seq) const;
+
+    std::shared_ptr<reprojection> m_proj;
+    std::string m_tmp_dir;
+    std::size_t m_max_memory;
+
+    std::mutex m_mutex;
+
+    /// Signalled when a run has been written.
+    std::condition_variable m_run_written;
+
+    /// The number of runs currently being written outside the lock.
+    std::size_t m_runs_in_progress = 0;
+
+    /// Rows in memory, the data is in m_data.
+    std::vector<entry_t> m_entries;
+    std::string m_data;
+
+    /// Temporary files with sorted runs.
+    std::vector<util::file_ptr_t> m_runs;
+
+    /// Removed objects and the sequence number of the latest removal.
+    std::unordered_map<std::pair<char, osmid_t>, std::uint64_t, object_hash_t>
+        m_removed;
+
+    /// Sequence number of the next row or removal.
+    std::uint64_t m_seq = 0;
+
+    std::size_t m_count = 0;
+}; // class row_sorter_t
+
+#endif // OSM2PGSQL_ROW_SORTER_HPP
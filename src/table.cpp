@@ -27,11 +27,13 @@ table_t::table_t(std::string const &name, std::string const &type,
                  columns_t const &columns, hstores_t const &hstore_columns,
                  int const srid, bool const append, hstore_column hstore_mode,
                  std::shared_ptr<db_copy_thread_t> const &copy_thread,
-                 std::string const &schema)
+                 std::string const &schema,
+                 std::shared_ptr<row_sorter_t> sorter)
 : m_target(std::make_shared<db_target_descr_t>(name.c_str(), "osm_id")),
   m_type(type), m_srid(fmt::to_string(srid)), m_append(append),
   m_hstore_mode(hstore_mode), m_columns(columns),
-  m_hstore_columns(hstore_columns), m_copy(copy_thread)
+  m_hstore_columns(hstore_columns), m_copy(copy_thread),
+  m_sorter(std::move(sorter))
 {
     m_target->schema = schema;
 
@@ -50,7 +52,7 @@ table_t::table_t(table_t const &other,
   m_srid(other.m_srid), m_append(other.m_append),
   m_hstore_mode(other.m_hstore_mode), m_columns(other.m_columns),
   m_hstore_columns(other.m_hstore_columns), m_table_space(other.m_table_space),
-  m_copy(copy_thread)
+  m_copy(copy_thread), m_sorter(other.m_sorter)
 {
     // if the other table has already started, then we want to execute
     // the same stuff to get into the same state. but if it hasn't, then
@@ -186,47 +188,71 @@ void table_t::stop(bool updateable, bool enable_hstore_index,
     auto const qual_tmp_name = qualified_name(
         m_target->schema, m_target->name + "_tmp");
 
+    bool const sorted = m_sorter != nullptr;
+    if (sorted) {
+        log_info("Writing {} rows to table '{}' sorted by geometry...",
+                 m_sorter->size(), m_target->name);
+        // Use a separate connection, so that the tables can be loaded in
+        // parallel.
+        auto const copy_thread =
+            std::make_shared<db_copy_thread_t>(m_conninfo);
+        db_copy_mgr_t<db_deleter_by_id_t> copy{copy_thread};
+        copy.add_sorted_lines(m_target, m_sorter.get());
+        copy.sync();
+        copy_thread->finish();
+        m_sorter.reset();
+    }
+
     if (!m_append) {
         if (m_srid != "4326") {
             drop_geom_check_trigger(m_sql_conn.get(), m_target->schema,
                                     m_target->name);
         }
 
-        log_info("Clustering table '{}' by geometry...", m_target->name);
-
-        // Notices about invalid geometries are expected and can be ignored
-        // because they say nothing about the validity of the geometry in OSM.
-        m_sql_conn->exec("SET client_min_messages = WARNING");
-
-        std::string sql =
-            "CREATE TABLE {} {} AS SELECT * FROM {}"_format(
-                qual_tmp_name, m_table_space, qual_name);
-
-        auto const postgis_version = get_postgis_version(*m_sql_conn);
-
-        sql += " ORDER BY ";
-        if (postgis_version.major == 2 && postgis_version.minor < 4) {
-            log_debug("Using GeoHash for clustering table '{}'",
-                      m_target->name);
-            if (m_srid == "4326") {
-                sql += "ST_GeoHash(way,10)";
+        if (sorted) {
+            // The rows are already in clustered order. The table is not
+            // rewritten, so the autovacuum setting has to be reset here.
+            m_sql_conn->exec(
+                "ALTER TABLE {} RESET (autovacuum_enabled)"_format(qual_name));
+        } else {
+            log_info("Clustering table '{}' by geometry...", m_target->name);
+
+            // Notices about invalid geometries are expected and can be
+            // ignored because they say nothing about the validity of the
+            // geometry in OSM.
+            m_sql_conn->exec("SET client_min_messages = WARNING");
+
+            std::string sql =
+                "CREATE TABLE {} {} AS SELECT * FROM {}"_format(
+                    qual_tmp_name, m_table_space, qual_name);
+
+            auto const postgis_version = get_postgis_version(*m_sql_conn);
+
+            sql += " ORDER BY ";
+            if (postgis_version.major == 2 && postgis_version.minor < 4) {
+                log_debug("Using GeoHash for clustering table '{}'",
+                          m_target->name);
+                if (m_srid == "4326") {
+                    sql += "ST_GeoHash(way,10)";
+                } else {
+                    sql += "ST_GeoHash(ST_Transform(ST_Envelope(way),4326)"
+                           ",10)";
+                }
+                sql += " COLLATE \"C\"";
             } else {
-                sql += "ST_GeoHash(ST_Transform(ST_Envelope(way),4326),10)";
+                log_debug("Using native order for clustering table '{}'",
+                          m_target->name);
+                // Since Postgis 2.4 the order function for geometries gives
+                // useful results.
+                sql += "way";
             }
-            sql += " COLLATE \"C\"";
-        } else {
-            log_debug("Using native order for clustering table '{}'",
-                      m_target->name);
-            // Since Postgis 2.4 the order function for geometries gives
-            // useful results.
-            sql += "way";
-        }
 
-        m_sql_conn->exec(sql);
+            m_sql_conn->exec(sql);
 
-        m_sql_conn->exec("DROP TABLE {}"_format(qual_name));
-        m_sql_conn->exec("ALTER TABLE {} RENAME TO \"{}\""_format(
-            qual_tmp_name, m_target->name));
+            m_sql_conn->exec("DROP TABLE {}"_format(qual_name));
+            m_sql_conn->exec("ALTER TABLE {} RENAME TO \"{}\""_format(
+                qual_tmp_name, m_target->name));
+        }
 
         log_info("Creating geometry index on table '{}'...", m_target->name);
 
@@ -271,6 +297,11 @@ void table_t::stop(bool updateable, bool enable_hstore_index,
 
 void table_t::delete_row(osmid_t const id)
 {
+    if (m_sorter) {
+        m_sorter->remove('X', id);
+        return;
+    }
+
     m_copy.new_line(m_target);
     m_copy.delete_object(id);
 }
@@ -304,8 +335,12 @@ void table_t::write_row(osmid_t id, taglist_t const &tags,
     //add the geometry - encoding it to hex along the way
     m_copy.add_hex_geom(geom);
 
-    //send all the data to postgres
-    m_copy.finish_line();
+    //send all the data to postgres (or to the sorter first)
+    if (m_sorter) {
+        m_copy.finish_sorted_line(m_sorter.get(), geom, 'X', id);
+    } else {
+        m_copy.finish_line();
+    }
 }
 
 void table_t::write_columns(taglist_t const &tags, std::vector<bool> *used)
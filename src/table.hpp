@@ -31,7 +31,8 @@ public:
             columns_t const &columns, hstores_t const &hstore_columns, int srid,
             bool append, hstore_column hstore_mode,
             std::shared_ptr<db_copy_thread_t> const &copy_thread,
-            std::string const &schema);
+            std::string const &schema,
+            std::shared_ptr<row_sorter_t> sorter = nullptr);
     table_t(table_t const &other,
             std::shared_ptr<db_copy_thread_t> const &copy_thread);
 
@@ -81,6 +82,13 @@ protected:
     std::string m_table_space;
 
     db_copy_mgr_t<db_deleter_by_id_t> m_copy;
+
+    /**
+     * Rows are sorted by geometry here instead of sending them to the
+     * database directly if the table is clustered on the client side.
+     * Shared between all clones of the table.
+     */
+    std::shared_ptr<row_sorter_t> m_sorter;
 };
 
 #endif // OSM2PGSQL_TABLE_HPP
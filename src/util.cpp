@@ -11,8 +11,11 @@
 
 #include "util.hpp"
 
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <iterator>
+#include <stdexcept>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -35,6 +38,15 @@ std::string const &string_id_list_t::get()
     return m_list;
 }
 
+void write_data(std::FILE *file, void const *data, std::size_t size,
+                char const *what)
+{
+    if (std::fwrite(data, 1, size, file) != size) {
+        throw std::runtime_error{
+            "{} failed: {}"_format(what, std::strerror(errno))};
+    }
+}
+
 std::string human_readable_duration(uint64_t seconds)
 {
     if (seconds < 60) {
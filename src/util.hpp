@@ -17,8 +17,10 @@
 #include <cassert>
 #include <chrono>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <ctime>
+#include <memory>
 #include <string>
 
 namespace util {
@@ -123,6 +125,28 @@ private:
 
 }; // class timer_t
 
+struct file_closer_t
+{
+    void operator()(std::FILE *file) const noexcept { std::fclose(file); }
+};
+
+/// Owning pointer to a stdio file, the file is closed when it is destroyed.
+using file_ptr_t = std::unique_ptr<std::FILE, file_closer_t>;
+
+/**
+ * Write size bytes of data to the file. On error a std::runtime_error is
+ * thrown, the message starts with what, for instance "Writing xyz".
+ */
+void write_data(std::FILE *file, void const *data, std::size_t size,
+                char const *what);
+
+/// Write the value to the file in native byte order, see write_data().
+template <typename T>
+void write_value(std::FILE *file, T value, char const *what)
+{
+    write_data(file, &value, sizeof(T), what);
+}
+
 std::string human_readable_duration(uint64_t seconds);
 
 std::string human_readable_duration(std::chrono::milliseconds ms);
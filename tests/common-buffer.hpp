@@ -26,6 +26,8 @@ class test_buffer_t
 public:
     osmium::memory::Buffer const &buffer() const noexcept { return m_buffer; }
 
+    osmium::memory::Buffer &buffer() noexcept { return m_buffer; }
+
     osmium::Node const &add_node(std::string const &data)
     {
         return m_buffer.get<osmium::Node>(add_opl(data));
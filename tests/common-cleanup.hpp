@@ -56,6 +56,44 @@ private:
     std::string m_filename;
 };
 
+/**
+ * RAII structure to remove a directory and everything in it upon
+ * destruction.
+ *
+ * Per default will also make sure that the directory does not exist
+ * when it is constructed.
+ */
+class dir_t
+{
+public:
+    dir_t(std::string const &dirname, bool remove_on_construct = true)
+    : m_dirname(dirname)
+    {
+        if (remove_on_construct) {
+            delete_dir(false);
+        }
+    }
+
+    ~dir_t() noexcept { delete_dir(true); }
+
+private:
+    void delete_dir(bool warn) const noexcept
+    {
+        if (m_dirname.empty()) {
+            return;
+        }
+
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(m_dirname, ec);
+        if (ec && warn) {
+            fmt::print(stderr, "WARNING: Unable to remove \"{}\": {}\n",
+                       m_dirname, ec.message());
+        }
+    }
+
+    std::string m_dirname;
+};
+
 } // namespace cleanup
 } // namespace testing
 
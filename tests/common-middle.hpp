@@ -0,0 +1,69 @@
+#ifndef OSM2PGSQL_TESTS_COMMON_MIDDLE_HPP
+#define OSM2PGSQL_TESTS_COMMON_MIDDLE_HPP
+
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+#include <catch.hpp>
+
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm.hpp>
+#include <osmium/osm/crc.hpp>
+#include <osmium/osm/crc_zlib.hpp>
+
+#include "middle.hpp"
+#include "osmtypes.hpp"
+
+#include <cstdint>
+
+namespace testing {
+
+/// Checksum over all data of an OSM object.
+template <typename T>
+std::uint32_t crc(T const &object)
+{
+    osmium::CRC<osmium::CRC_zlib> crc;
+    crc.update(object);
+    return crc().checksum();
+}
+
+/// Check that the middle returns exactly the same way.
+inline void check_way(middle_query_t *mid_q, osmium::Way const &orig_way)
+{
+    osmium::memory::Buffer outbuf{4096, osmium::memory::Buffer::auto_grow::yes};
+    REQUIRE(mid_q->way_get(orig_way.id(), &outbuf));
+    REQUIRE(crc(orig_way) == crc(outbuf.get<osmium::Way>(0)));
+}
+
+/// Return true if the middle doesn't have the way.
+inline bool no_way(middle_query_t *mid_q, osmid_t id)
+{
+    osmium::memory::Buffer outbuf{4096, osmium::memory::Buffer::auto_grow::yes};
+    return !mid_q->way_get(id, &outbuf);
+}
+
+/// Check that the middle returns exactly the same relation.
+inline void check_relation(middle_query_t *mid_q,
+                           osmium::Relation const &orig_rel)
+{
+    osmium::memory::Buffer outbuf{4096, osmium::memory::Buffer::auto_grow::yes};
+    REQUIRE(mid_q->relation_get(orig_rel.id(), &outbuf));
+    REQUIRE(crc(orig_rel) == crc(outbuf.get<osmium::Relation>(0)));
+}
+
+/// Return true if the middle doesn't have the relation.
+inline bool no_relation(middle_query_t *mid_q, osmid_t id)
+{
+    osmium::memory::Buffer outbuf{4096, osmium::memory::Buffer::auto_grow::yes};
+    return !mid_q->relation_get(id, &outbuf);
+}
+
+} // namespace testing
+
+#endif // OSM2PGSQL_TESTS_COMMON_MIDDLE_HPP
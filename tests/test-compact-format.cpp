@@ -0,0 +1,132 @@
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+#include <catch.hpp>
+
+#include <osmium/osm/crc.hpp>
+#include <osmium/osm/crc_zlib.hpp>
+
+#include "compact-format.hpp"
+
+#include "common-buffer.hpp"
+
+#include <string>
+
+template <typename T>
+static std::uint32_t crc(T const &object)
+{
+    osmium::CRC<osmium::CRC_zlib> crc;
+    crc.update(object);
+    return crc().checksum();
+}
+
+TEST_CASE("compact format: way", "[NoDB]")
+{
+    test_buffer_t buffer;
+    auto const &way = buffer.add_way(
+        "w20 Nn10,n11,n5,n100000000000 Thighway=residential,name=Main%20%St");
+
+    std::string data;
+    compact_encode_way(way, false, &data);
+
+    // 1 byte count + 4 nodes with at most 6 bytes each + tags
+    REQUIRE(data.size() < 1 + 4 * 6 + 1 + 2 * 8 + 2 * 12);
+
+    osmium::memory::Buffer outbuf{1024, osmium::memory::Buffer::auto_grow::yes};
+    compact_decode_way(20, data.data(), data.size(), &outbuf);
+    outbuf.commit();
+
+    auto const &result = outbuf.get<osmium::Way>(0);
+    REQUIRE(result.id() == 20);
+    REQUIRE(crc(result) == crc(way));
+}
+
+TEST_CASE("compact format: way without tags", "[NoDB]")
+{
+    test_buffer_t buffer;
+    auto const &way = buffer.add_way("w-3 Nn1,n2");
+
+    std::string data;
+    compact_encode_way(way, false, &data);
+
+    osmium::memory::Buffer outbuf{1024, osmium::memory::Buffer::auto_grow::yes};
+    compact_decode_way(-3, data.data(), data.size(), &outbuf);
+    outbuf.commit();
+
+    auto const &result = outbuf.get<osmium::Way>(0);
+    REQUIRE(result.tags().empty());
+    REQUIRE(result.nodes().size() == 2);
+    REQUIRE(crc(result) == crc(way));
+}
+
+TEST_CASE("compact format: way with attributes", "[NoDB]")
+{
+    test_buffer_t buffer;
+    auto const &way =
+        buffer.add_way("w20 v3 c12 t2020-01-02T03:04:05Z i7 ufoo Nn10 Tx=y");
+
+    std::string data;
+    compact_encode_way(way, true, &data);
+
+    osmium::memory::Buffer outbuf{1024, osmium::memory::Buffer::auto_grow::yes};
+    compact_decode_way(20, data.data(), data.size(), &outbuf);
+    outbuf.commit();
+
+    auto const &tags = outbuf.get<osmium::Way>(0).tags();
+    REQUIRE(tags.size() == 6);
+    REQUIRE(std::string{tags["x"]} == "y");
+    REQUIRE(std::string{tags["osm_user"]} == "foo");
+    REQUIRE(std::string{tags["osm_uid"]} == "7");
+    REQUIRE(std::string{tags["osm_version"]} == "3");
+    REQUIRE(std::string{tags["osm_timestamp"]} == "2020-01-02T03:04:05Z");
+    REQUIRE(std::string{tags["osm_changeset"]} == "12");
+}
+
+TEST_CASE("compact format: relation", "[NoDB]")
+{
+    test_buffer_t buffer;
+    auto const &relation = buffer.add_relation(
+        "r30 Mw20@outer,n12@,r31@sub,w3@inner Ttype=multipolygon,name=x");
+
+    std::string data;
+    compact_encode_relation(relation, false, &data);
+
+    osmium::memory::Buffer outbuf{1024, osmium::memory::Buffer::auto_grow::yes};
+    compact_decode_relation(30, data.data(), data.size(), &outbuf);
+    outbuf.commit();
+
+    auto const &result = outbuf.get<osmium::Relation>(0);
+    REQUIRE(result.id() == 30);
+    REQUIRE(result.members().size() == 4);
+    REQUIRE(crc(result) == crc(relation));
+}
+
+TEST_CASE("compact format: invalid data", "[NoDB]")
+{
+    test_buffer_t buffer;
+    auto const &way = buffer.add_way("w20 Nn10,n11 Tfoo=bar");
+
+    std::string data;
+    compact_encode_way(way, false, &data);
+
+    osmium::memory::Buffer outbuf{1024, osmium::memory::Buffer::auto_grow::yes};
+
+    SECTION("truncated")
+    {
+        REQUIRE_THROWS(compact_decode_way(20, data.data(), data.size() - 1,
+                                          &outbuf));
+    }
+
+    SECTION("extra bytes")
+    {
+        data += 'x';
+        REQUIRE_THROWS(
+            compact_decode_way(20, data.data(), data.size(), &outbuf));
+    }
+}
@@ -0,0 +1,45 @@
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+#include <catch.hpp>
+
+#include "db-copy.hpp"
+
+#include <string>
+
+TEST_CASE("db_copy_buffer_pool_t reuses buffers", "[NoDB]")
+{
+    db_copy_buffer_pool_t pool;
+    REQUIRE(pool.size() == 0);
+
+    auto small = pool.get(1000);
+    REQUIRE(small.empty());
+    REQUIRE(small.capacity() >= 1000);
+
+    auto large = pool.get(100000);
+    REQUIRE(large.capacity() >= 100000);
+    large = "some data";
+    auto const *const large_data = large.data();
+
+    pool.put(std::move(small));
+    pool.put(std::move(large));
+    REQUIRE(pool.size() == 2);
+
+    // the smallest buffer large enough is used and it is empty
+    auto buffer = pool.get(50000);
+    REQUIRE(buffer.empty());
+    REQUIRE(buffer.data() == large_data);
+    REQUIRE(pool.size() == 1);
+
+    // the pool doesn't grow beyond its maximum size
+    for (int i = 0; i < db_copy_buffer_pool_t::Max_free_buffers + 2; ++i) {
+        pool.put(std::string(100, 'x'));
+    }
+    REQUIRE(pool.size() == db_copy_buffer_pool_t::Max_free_buffers);
+}
@@ -0,0 +1,181 @@
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+#include <catch.hpp>
+
+#include "db-copy-escape.hpp"
+
+#include <osmium/io/any_input.hpp>
+#include <osmium/io/reader.hpp>
+#include <osmium/osm.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Simple escaping one character at a time to compare against.
+static void reference_escape(std::string *out, char const *s, bool quoted)
+{
+    for (char const *c = s; *c; ++c) {
+        switch (*c) {
+        case '"':
+            *out += quoted ? "\\\\\"" : "\\\"";
+            break;
+        case '\\':
+            *out += quoted ? "\\\\\\\\" : "\\\\";
+            break;
+        case '\n':
+            *out += "\\n";
+            break;
+        case '\r':
+            *out += "\\r";
+            break;
+        case '\t':
+            *out += "\\t";
+            break;
+        default:
+            *out += *c;
+            break;
+        }
+    }
+}
+
+static std::string escape(char const *s, bool quoted)
+{
+    std::string out;
+    append_copy_escaped(&out, s, quoted);
+    return out;
+}
+
+static std::string reference_escape(char const *s, bool quoted)
+{
+    std::string out;
+    reference_escape(&out, s, quoted);
+    return out;
+}
+
+TEST_CASE("Escape strings for COPY", "[NoDB]")
+{
+    REQUIRE(escape("", false).empty());
+    REQUIRE(escape("foo bar", false) == "foo bar");
+    REQUIRE(escape("a\tb\nc\rd", false) == "a\\tb\\nc\\rd");
+    REQUIRE(escape("\"x\\y\"", false) == "\\\"x\\\\y\\\"");
+    REQUIRE(escape("\"x\\y\"", true) == "\\\\\"x\\\\\\\\y\\\\\"");
+
+    // UTF-8 characters are not changed
+    REQUIRE(escape("Stra\xc3\x9f" "e", false) == "Stra\xc3\x9f" "e");
+}
+
+TEST_CASE("Escape characters at all positions of long strings", "[NoDB]")
+{
+    char const specials[] = {'\t', '\n', '\r', '\\', '"'};
+    auto const quoted = GENERATE(false, true);
+
+    for (std::size_t len = 1; len <= 70; ++len) {
+        for (std::size_t pos = 0; pos < len; ++pos) {
+            for (char const c : specials) {
+                std::string s(len, 'a');
+                s[pos] = c;
+                REQUIRE(escape(s.c_str(), quoted) ==
+                        reference_escape(s.c_str(), quoted));
+
+                // and with a second special character later on
+                s.back() = '\\';
+                REQUIRE(escape(s.c_str(), quoted) ==
+                        reference_escape(s.c_str(), quoted));
+            }
+        }
+    }
+}
+
+TEST_CASE("Find characters to escape", "[NoDB]")
+{
+    std::string const s(100, 'x');
+    auto const *const begin = s.data();
+    auto const *const end = s.data() + s.size();
+
+    REQUIRE(find_copy_escape_char(begin, end) == end);
+    REQUIRE(find_copy_escape_char(begin, begin) == begin);
+
+    // Bytes with the highest bit set don't match anything.
+    std::string const high(64, '\xdc');
+    REQUIRE(find_copy_escape_char(high.data(), high.data() + high.size()) ==
+            high.data() + high.size());
+
+    // The range end is respected even if there is a special character after.
+    std::string t(40, 'x');
+    t[35] = '"';
+    REQUIRE(find_copy_escape_char(t.data(), t.data() + 35) == t.data() + 35);
+    REQUIRE(find_copy_escape_char(t.data(), t.data() + 36) == t.data() + 35);
+}
+
+TEST_CASE("Count trailing zeros", "[NoDB]")
+{
+    REQUIRE(count_trailing_zeros(1U) == 0);
+    REQUIRE(count_trailing_zeros(0x18U) == 3);
+    REQUIRE(count_trailing_zeros(0x80000000U) == 31);
+}
+
+TEST_CASE("COPY escaping benchmark", "[.][benchmark]")
+{
+    std::vector<std::string> strings;
+    std::size_t bytes = 0;
+
+    osmium::io::Reader reader{TESTDATA_DIR "liechtenstein-2013-08-03.osm.pbf"};
+    while (auto buffer = reader.read()) {
+        for (auto const &object : buffer.select<osmium::OSMObject>()) {
+            for (auto const &tag : object.tags()) {
+                strings.emplace_back(tag.key());
+                strings.emplace_back(tag.value());
+                bytes += strings[strings.size() - 2].size() +
+                         strings.back().size();
+            }
+        }
+    }
+    reader.close();
+
+    REQUIRE_FALSE(strings.empty());
+
+    constexpr int const rounds = 100;
+
+    auto const time = [&](char const *name, bool quoted, auto &&func) {
+        std::string out;
+        out.reserve(bytes * 2);
+        auto const start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; ++i) {
+            out.clear();
+            for (auto const &s : strings) {
+                func(&out, s.c_str(), quoted);
+            }
+        }
+        auto const duration =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start);
+        std::printf("%s (%s): %zu strings with %zu bytes %d times in %lld ms "
+                    "(%.0f MB/s)\n",
+                    name, quoted ? "quoted" : "plain", strings.size(), bytes,
+                    rounds, static_cast<long long>(duration.count() / 1000),
+                    static_cast<double>(bytes) * rounds /
+                        static_cast<double>(duration.count()));
+        return out;
+    };
+
+    for (bool const quoted : {false, true}) {
+        auto const expected = time("reference", quoted,
+                                   [](std::string *out, char const *s, bool q) {
+                                       reference_escape(out, s, q);
+                                   });
+        auto const result = time("append_copy_escaped", quoted,
+                                 [](std::string *out, char const *s, bool q) {
+                                     append_copy_escaped(out, s, q);
+                                 });
+        REQUIRE(result == expected);
+    }
+}
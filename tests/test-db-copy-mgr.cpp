@@ -20,7 +20,8 @@ static testing::pg::tempdb_t db;
 
 using copy_mgr_t = db_copy_mgr_t<db_deleter_by_id_t>;
 
-static std::shared_ptr<db_target_descr_t> setup_table(std::string const &cols)
+static std::shared_ptr<db_target_descr_t> setup_table(std::string const &cols,
+                                                      bool binary = false)
 {
     auto conn = db.connect();
     conn.exec("DROP TABLE IF EXISTS test_copy_mgr");
@@ -30,6 +31,7 @@ static std::shared_ptr<db_target_descr_t> setup_table(std::string const &cols)
     auto table = std::make_shared<db_target_descr_t>();
     table->name = "test_copy_mgr";
     table->id = "id";
+    table->binary = binary;
 
     return table;
 }
@@ -50,8 +52,8 @@ void add_array(copy_mgr_t &mgr, std::shared_ptr<db_target_descr_t> const &t,
                int id, std::vector<T> const &values)
 {
     mgr.new_line(t);
-    mgr.add_column(id);
-    mgr.new_array();
+    mgr.add_column(static_cast<int64_t>(id));
+    mgr.new_array<T>();
     for (auto const &v : values) {
         mgr.add_array_elem(v);
     }
@@ -67,7 +69,7 @@ add_hash(copy_mgr_t &mgr, std::shared_ptr<db_target_descr_t> const &t, int id,
 {
     mgr.new_line(t);
 
-    mgr.add_column(id);
+    mgr.add_column(static_cast<int64_t>(id));
     mgr.new_hash();
     for (auto const &v : values) {
         mgr.add_hash_elem(v.first, v.second);
@@ -197,3 +199,115 @@ TEST_CASE("copy_mgr_t")
         }
     }
 }
+
+TEST_CASE("copy_mgr_t with binary format")
+{
+    copy_mgr_t mgr(std::make_shared<db_copy_thread_t>(db.conninfo()));
+
+    SECTION("Insert null")
+    {
+        auto t = setup_table("big int8, t text", true);
+
+        mgr.new_line(t);
+        mgr.add_column(int64_t{0});
+        mgr.add_null_column();
+        mgr.add_null_column();
+        mgr.finish_line();
+        mgr.sync();
+
+        auto conn = db.connect();
+        auto res = conn.require_row("SELECT * FROM test_copy_mgr");
+
+        CHECK(res.is_null(0, 1));
+        CHECK(res.is_null(0, 2));
+    }
+
+    SECTION("Insert numbers")
+    {
+        auto t = setup_table(
+            "big int8, small int2, medium int4, b boolean, r real, d float8",
+            true);
+
+        add_row(mgr, t, int64_t{34}, int64_t{0xfff12345678LL}, int16_t{-4457},
+                int32_t{-1}, true, 1.5F, -0.25);
+        check_row({"34", "17588196497016", "-4457", "-1", "t", "1.5", "-0.25"});
+    }
+
+    SECTION("Insert strings")
+    {
+        auto t = setup_table("s0 text, s1 varchar, j jsonb", true);
+
+        mgr.new_line(t);
+        mgr.add_column(int64_t{-2});
+        mgr.add_column("va\tr \"q\" \\");
+        mgr.add_column(std::string{"meme\n"});
+        mgr.add_jsonb_column("{\"a\": 1}");
+        mgr.finish_line();
+        mgr.sync();
+
+        check_row({"-2", "va\tr \"q\" \\", "meme\n", "{\"a\": 1}"});
+    }
+
+    SECTION("Insert int arrays")
+    {
+        auto t = setup_table("a int8[]", true);
+
+        add_array<int64_t>(mgr, t, -9000, {45, -2, 0, 56});
+        check_row({"-9000", "{45,-2,0,56}"});
+    }
+
+    SECTION("Insert empty array")
+    {
+        auto t = setup_table("a int8[] NOT NULL", true);
+
+        add_array<int64_t>(mgr, t, 7, {});
+        check_row({"7", "{}"});
+    }
+
+    SECTION("Insert string arrays")
+    {
+        auto t = setup_table("a text[]", true);
+
+        add_array<std::string>(mgr, t, 3, {"foo", "", "with \"quote\"", "s\\l"});
+
+        auto c = db.connect();
+        CHECK(c.result_as_string("SELECT a[1] FROM test_copy_mgr") == "foo");
+        CHECK(c.result_as_string("SELECT a[2] FROM test_copy_mgr").empty());
+        CHECK(c.result_as_string("SELECT a[3] FROM test_copy_mgr") ==
+              "with \"quote\"");
+        CHECK(c.result_as_string("SELECT a[4] FROM test_copy_mgr") == "s\\l");
+    }
+
+    SECTION("Insert hashes")
+    {
+        auto t = setup_table("h hstore", true);
+
+        std::vector<std::pair<std::string, std::string>> const values = {
+            {"one", "two"}, {"\"key\"", "\"value\""}, {"key\\5", "value\\5"}};
+
+        add_hash(mgr, t, 42, values);
+
+        auto c = db.connect();
+
+        for (auto const &v : values) {
+            auto const res = c.result_as_string(
+                "SELECT h->'{}' FROM test_copy_mgr"_format(v.first));
+            CHECK(res == v.second);
+        }
+    }
+
+    SECTION("Mix binary and text format")
+    {
+        auto t = setup_table("t text", true);
+        auto t_text = std::make_shared<db_target_descr_t>(*t);
+        t_text->binary = false;
+
+        add_row(mgr, t, int64_t{1}, "binary");
+        add_row(mgr, t_text, int64_t{2}, "text");
+
+        auto c = db.connect();
+        CHECK(c.result_as_string(
+                  "SELECT string_agg(t, ',' ORDER BY id) FROM test_copy_mgr") ==
+              "binary,text");
+    }
+}
@@ -11,6 +11,7 @@
 
 #include "common-pg.hpp"
 #include "db-copy.hpp"
+#include "format.hpp"
 #include "gazetteer-style.hpp"
 
 static testing::pg::tempdb_t db;
@@ -148,6 +149,82 @@ TEST_CASE("db_copy_thread_t with db_deleter_by_id_t")
     }
 }
 
+TEST_CASE("db_copy_thread_t with several copy streams")
+{
+    auto conn = db.connect();
+    conn.exec("DROP TABLE IF EXISTS test_copy_thread");
+    conn.exec("DROP TABLE IF EXISTS test_copy_thread2");
+    conn.exec("DROP TABLE IF EXISTS test_copy_thread3");
+    conn.exec("CREATE TABLE test_copy_thread (id int8)");
+    conn.exec("CREATE TABLE test_copy_thread2 (id int8)");
+    conn.exec("CREATE TABLE test_copy_thread3 (id int8)");
+
+    std::vector<std::shared_ptr<db_target_descr_t>> tables;
+    for (auto const *name :
+         {"test_copy_thread", "test_copy_thread2", "test_copy_thread3"}) {
+        tables.push_back(std::make_shared<db_target_descr_t>(name, "id"));
+    }
+
+    // Two streams for three tables, so streams have to be reused.
+    db_copy_thread_t t(db.conninfo(), 2);
+    using cmd_copy_t = db_cmd_copy_delete_t<db_deleter_by_id_t>;
+
+    for (int i = 0; i < 3; ++i) {
+        for (auto const &table : tables) {
+            auto cmd = std::make_unique<cmd_copy_t>(table);
+            cmd->buffer += "{}\n"_format(i);
+            t.add_buffer(std::unique_ptr<db_cmd_t>(cmd.release()));
+        }
+    }
+
+    // The delete must see the rows copied before, maybe on another stream.
+    auto cmd = std::make_unique<cmd_copy_t>(tables[1]);
+    cmd->add_deletable(0);
+    cmd->buffer += "3\n";
+    t.add_buffer(std::unique_ptr<db_cmd_t>(cmd.release()));
+
+    t.sync_and_wait();
+
+    REQUIRE(table_count(conn) == 3);
+    REQUIRE(conn.result_as_int("SELECT count(*) FROM test_copy_thread2") == 3);
+    REQUIRE(conn.result_as_int(
+                "SELECT count(*) FROM test_copy_thread2 WHERE id = 0") == 0);
+    REQUIRE(conn.result_as_int("SELECT count(*) FROM test_copy_thread3") == 3);
+}
+
+TEST_CASE("db_copy_thread_t with db_deleter_by_type_and_id_t")
+{
+    auto conn = db.connect();
+    conn.exec("DROP TABLE IF EXISTS test_copy_thread");
+    conn.exec("CREATE TABLE test_copy_thread ("
+              "osm_type char(1),"
+              "osm_id bigint)");
+
+    auto table = std::make_shared<db_target_descr_t>();
+    table->name = "test_copy_thread";
+    table->id = "osm_type,osm_id";
+
+    db_copy_thread_t t(db.conninfo());
+    using cmd_copy_t = db_cmd_copy_delete_t<db_deleter_by_type_and_id_t>;
+    auto cmd = std::make_unique<cmd_copy_t>(table);
+
+    cmd->buffer += "N\t42\nN\t43\nW\t42\nR\t42\n";
+    t.add_buffer(std::unique_ptr<db_cmd_t>(cmd.release()));
+    t.sync_and_wait();
+
+    cmd = std::make_unique<cmd_copy_t>(table);
+    cmd->add_deletable('N', 42);
+    cmd->add_deletable('R', 42);
+    cmd->add_deletable('W', 43);
+
+    t.add_buffer(std::unique_ptr<db_cmd_t>(cmd.release()));
+    t.sync_and_wait();
+
+    REQUIRE(table_count(conn) == 2);
+    REQUIRE(table_count(conn, "WHERE osm_type = 'N' AND osm_id = 43") == 1);
+    REQUIRE(table_count(conn, "WHERE osm_type = 'W' AND osm_id = 42") == 1);
+}
+
 TEST_CASE("db_copy_thread_t with db_deleter_place_t")
 {
     auto conn = db.connect();
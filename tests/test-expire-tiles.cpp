@@ -255,6 +255,45 @@ TEST_CASE("expire centroids", "[NoDB]")
     }
 }
 
+namespace {
+
+struct tile_output_counter
+{
+    void output_dirty_tile(int64_t /*x*/, int64_t /*y*/, uint32_t /*zoom*/)
+    {
+        ++count;
+    }
+
+    std::size_t count = 0;
+};
+
+} // anonymous namespace
+
+TEST_CASE("expire many tiles with duplicates", "[NoDB]")
+{
+    uint32_t const zoom = 18;
+
+    // Large enough to need several merges of the list of dirty tiles
+    double const size = 1100 * EARTH_CIRCUMFERENCE / (1U << zoom);
+
+    expire_tiles et1(zoom, 2 * size, defproj);
+    et1.from_bbox(0, 0, size, size);
+
+    expire_tiles et2(zoom, 2 * size, defproj);
+    et2.from_bbox(0, 0, size, size);
+    et2.from_bbox(0, 0, size / 2, size / 2);
+    et2.from_bbox(0, 0, size, size);
+
+    tile_output_counter counter1;
+    et1.output_and_destroy(counter1, zoom);
+
+    tile_output_counter counter2;
+    et2.output_and_destroy(counter2, zoom);
+
+    CHECK(counter1.count > 1100 * 1100);
+    CHECK(counter1.count == counter2.count);
+}
+
 /**
  * After expiring a random set of tiles in one expire_tiles object
  * and a different set in another, when they are merged together they are the
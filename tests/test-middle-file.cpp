@@ -0,0 +1,342 @@
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+#include <catch.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include "middle-file.hpp"
+
+#include "common-buffer.hpp"
+#include "common-cleanup.hpp"
+#include "common-middle.hpp"
+#include "common-options.hpp"
+
+namespace {
+
+options_t file_options(bool append)
+{
+    options_t options = testing::opt_t().slim();
+    options.middle_dir = "test_middle_file.dir";
+    options.append = append;
+    return options;
+}
+
+} // namespace
+
+TEST_CASE("file middle: import and update", "[NoDB]")
+{
+    testing::cleanup::dir_t cleaner{"test_middle_file.dir"};
+    auto thread_pool = std::make_shared<thread_pool_t>(1U);
+
+    test_buffer_t buffer;
+    auto const &node10 = buffer.add_node("n10 x1.0 y2.0");
+    auto const &node11 = buffer.add_node("n11 x1.1 y2.1");
+    auto const &node12 = buffer.add_node("n12 x1.2 y2.2");
+    auto const &node12a = buffer.add_node("n12 x3.2 y4.2");
+
+    auto const &way20 =
+        buffer.add_way("w20 Nn10,n11 Thighway=residential,name=High_Street");
+    auto const &way21 = buffer.add_way("w21 Nn11,n12");
+    auto const &way21a = buffer.add_way("w21 Nn10,n11");
+    auto const &way22 = buffer.add_way("w22 Nn12,n10 Tpower=line");
+    auto const &way20d = buffer.add_way("w20 dD");
+
+    auto const &rel30 =
+        buffer.add_relation("r30 Mw20@outer,n12@ Ttype=multipolygon");
+    auto const &rel31 = buffer.add_relation("r31 Mw21@ Ttype=route");
+    auto const &rel31d = buffer.add_relation("r31 dD");
+
+    {
+        auto const options = file_options(false);
+        auto mid = std::make_shared<middle_file_t>(thread_pool, &options);
+        mid->start();
+
+        mid->node(node10);
+        mid->node(node11);
+        mid->node(node12);
+        mid->after_nodes();
+        mid->way(way20);
+        mid->way(way21);
+        mid->after_ways();
+        mid->relation(rel30);
+        mid->relation(rel31);
+        mid->after_relations();
+
+        auto const mid_q = mid->get_query_instance();
+        testing::check_way(mid_q.get(), way20);
+        testing::check_way(mid_q.get(), way21);
+        REQUIRE(testing::no_way(mid_q.get(), 22));
+        testing::check_relation(mid_q.get(), rel30);
+        testing::check_relation(mid_q.get(), rel31);
+        REQUIRE(testing::no_relation(mid_q.get(), 32));
+
+        osmium::memory::Buffer outbuf{4096,
+                                      osmium::memory::Buffer::auto_grow::yes};
+        REQUIRE(mid_q->way_get(21, &outbuf));
+        auto &nodes = outbuf.get<osmium::Way>(0).nodes();
+        REQUIRE(mid_q->nodes_get_list(&nodes) == 2);
+        REQUIRE(nodes[0].location() == node11.location());
+        REQUIRE(nodes[1].location() == node12.location());
+
+        test_buffer_t ways;
+        ways.add_way("w1 Nn12,n10,n99");
+        ways.add_way("w2 Nn11,n12");
+        REQUIRE(mid_q->nodes_get_lists(&ways.buffer()) == 4);
+        auto const &w1 = ways.buffer().get<osmium::Way>(0);
+        REQUIRE(w1.nodes()[0].location() == node12.location());
+        REQUIRE(w1.nodes()[1].location() == node10.location());
+        REQUIRE_FALSE(w1.nodes()[2].location().valid());
+
+        osmium::memory::Buffer membuf{4096,
+                                      osmium::memory::Buffer::auto_grow::yes};
+        REQUIRE(mid_q->rel_members_get(rel30, &membuf,
+                                       osmium::osm_entity_bits::way) == 1);
+        REQUIRE(testing::crc(membuf.get<osmium::Way>(0)) ==
+                testing::crc(way20));
+        mid->stop();
+    }
+
+    auto const options = file_options(true);
+
+    SECTION("Data is there when opened again")
+    {
+        auto mid = std::make_shared<middle_file_t>(thread_pool, &options);
+        mid->start();
+
+        auto const mid_q = mid->get_query_instance();
+        testing::check_way(mid_q.get(), way20);
+        testing::check_way(mid_q.get(), way21);
+        testing::check_relation(mid_q.get(), rel30);
+        testing::check_relation(mid_q.get(), rel31);
+
+        REQUIRE(mid->get_ways_by_node(10) == idlist_t{20});
+        REQUIRE(mid->get_ways_by_node(11) == idlist_t{20, 21});
+        REQUIRE(mid->get_rels_by_node(12) == idlist_t{30});
+        REQUIRE(mid->get_rels_by_way(21) == idlist_t{31});
+        REQUIRE(mid->get_rels_by_way(22).empty());
+
+        REQUIRE(mid->get_ways_by_nodes({10, 12}) == idlist_t{20, 21});
+        REQUIRE(mid->get_rels_by_nodes({10, 12}) == idlist_t{30});
+        REQUIRE(mid->get_rels_by_ways({20, 21, 22}) == idlist_t{30, 31});
+    }
+
+    SECTION("Changed and deleted objects")
+    {
+        {
+            auto mid = std::make_shared<middle_file_t>(thread_pool, &options);
+            mid->start();
+
+            mid->node(node12a);
+            mid->after_nodes();
+            mid->way(way20d);
+            mid->way(way21a);
+            mid->way(way22);
+            mid->after_ways();
+            mid->relation(rel31d);
+
+            // Reverse lookups must work before the indexes are merged.
+            REQUIRE(mid->get_ways_by_node(10) == idlist_t{21, 22});
+            REQUIRE(mid->get_ways_by_node(12) == idlist_t{22});
+            REQUIRE(mid->get_rels_by_way(21).empty());
+
+            mid->after_relations();
+        }
+
+        auto mid = std::make_shared<middle_file_t>(thread_pool, &options);
+        mid->start();
+
+        auto const mid_q = mid->get_query_instance();
+        REQUIRE(testing::no_way(mid_q.get(), 20));
+        testing::check_way(mid_q.get(), way21a);
+        testing::check_way(mid_q.get(), way22);
+        testing::check_relation(mid_q.get(), rel30);
+        REQUIRE(testing::no_relation(mid_q.get(), 31));
+
+        REQUIRE(mid->get_ways_by_node(10) == idlist_t{21, 22});
+        REQUIRE(mid->get_ways_by_node(11) == idlist_t{21});
+        REQUIRE(mid->get_rels_by_way(20) == idlist_t{30});
+        REQUIRE(mid->get_rels_by_way(21).empty());
+
+        osmium::memory::Buffer outbuf{4096,
+                                      osmium::memory::Buffer::auto_grow::yes};
+        REQUIRE(mid_q->way_get(22, &outbuf));
+        auto &nodes = outbuf.get<osmium::Way>(0).nodes();
+        REQUIRE(mid_q->nodes_get_list(&nodes) == 2);
+        REQUIRE(nodes[0].location() == node12a.location());
+        REQUIRE(nodes[1].location() == node10.location());
+    }
+}
+
+TEST_CASE("file middle: update needs data from finished import", "[NoDB]")
+{
+    testing::cleanup::dir_t cleaner{"test_middle_file.dir"};
+    auto thread_pool = std::make_shared<thread_pool_t>(1U);
+
+    test_buffer_t buffer;
+    auto const &way20 = buffer.add_way("w20 Nn10,n11");
+
+    auto const import = [&](options_t const &options) {
+        auto mid = std::make_shared<middle_file_t>(thread_pool, &options);
+        mid->start();
+        mid->after_nodes();
+        mid->way(way20);
+        mid->after_ways();
+        mid->after_relations();
+        mid->stop();
+    };
+
+    auto options = file_options(true);
+
+    SECTION("Empty middle directory")
+    {
+        boost::filesystem::create_directories("test_middle_file.dir");
+        REQUIRE_THROWS(
+            std::make_shared<middle_file_t>(thread_pool, &options));
+    }
+
+    SECTION("Import with --drop")
+    {
+        auto import_options = file_options(false);
+        import_options.droptemp = true;
+        import(import_options);
+        REQUIRE_THROWS(
+            std::make_shared<middle_file_t>(thread_pool, &options));
+    }
+
+    SECTION("Missing data file")
+    {
+        import(file_options(false));
+        boost::filesystem::remove("test_middle_file.dir/ways.data");
+        REQUIRE_THROWS(
+            std::make_shared<middle_file_t>(thread_pool, &options));
+    }
+
+    SECTION("Import without forward dependencies")
+    {
+        auto import_options = file_options(false);
+        import_options.with_forward_dependencies = false;
+        import(import_options);
+        REQUIRE_FALSE(boost::filesystem::exists(
+            "test_middle_file.dir/ways-by-node.idx"));
+
+        REQUIRE_THROWS(
+            std::make_shared<middle_file_t>(thread_pool, &options));
+
+        options.with_forward_dependencies = false;
+        auto mid = std::make_shared<middle_file_t>(thread_pool, &options);
+        mid->start();
+        testing::check_way(mid->get_query_instance().get(), way20);
+    }
+}
+
+TEST_CASE("file middle: object store is compacted", "[NoDB]")
+{
+    testing::cleanup::dir_t cleaner{"test_middle_file.dir"};
+    boost::filesystem::create_directories("test_middle_file.dir");
+
+    mmap_object_store_t store{"test_middle_file.dir/objects.data", true};
+    mmap_id_index_t index{"test_middle_file.dir/objects.idx", true};
+
+    test_buffer_t buffer;
+    auto const &way1 = buffer.add_way("w1 Nn1,n2 Thighway=primary");
+    auto const &way2 = buffer.add_way("w2 Nn2,n3");
+    auto const &way3 = buffer.add_way("w3 Nn3,n4");
+
+    index.set(1, store.add(way1));
+    index.set(2, store.add(way2));
+    index.set(3, store.add(way3));
+    index.merge();
+
+    // Nothing to do if there are no old objects.
+    auto const size = store.size();
+    REQUIRE_FALSE(store.compact(&index));
+    REQUIRE(store.size() == size);
+
+    // Way 2 is changed several times and way 3 is deleted.
+    for (int i = 0; i < 5; ++i) {
+        index.set(2, store.add(way2));
+    }
+    index.remove(3);
+    index.merge();
+
+    REQUIRE(store.compact(&index));
+    REQUIRE(store.size() == sizeof(std::uint64_t) + way1.padded_size() +
+                                way2.padded_size());
+    REQUIRE(index.size() == 2);
+    auto const get_way = [&](osmid_t id) -> osmium::Way const & {
+        return static_cast<osmium::Way const &>(store.get(index.get(id)));
+    };
+    REQUIRE(testing::crc(get_way(1)) == testing::crc(way1));
+    REQUIRE(testing::crc(get_way(2)) == testing::crc(way2));
+    REQUIRE(index.get(3) == mmap_id_index_t::not_found_value());
+
+    // New objects are appended to the compacted store.
+    index.set(3, store.add(way3));
+    REQUIRE(testing::crc(get_way(3)) == testing::crc(way3));
+}
+
+TEST_CASE("file middle: compacted after many changes", "[NoDB]")
+{
+    testing::cleanup::dir_t cleaner{"test_middle_file.dir"};
+    auto thread_pool = std::make_shared<thread_pool_t>(1U);
+
+    test_buffer_t buffer;
+    auto const &way20 = buffer.add_way("w20 Nn10,n11 Thighway=residential");
+    auto const &way21 = buffer.add_way("w21 Nn11,n12");
+    auto const &rel30 = buffer.add_relation("r30 Mw20@ Ttype=route");
+
+    {
+        auto const options = file_options(false);
+        auto mid = std::make_shared<middle_file_t>(thread_pool, &options);
+        mid->start();
+        mid->after_nodes();
+        mid->way(way20);
+        mid->way(way21);
+        mid->after_ways();
+        mid->relation(rel30);
+        mid->after_relations();
+        mid->stop();
+    }
+
+    auto const options = file_options(true);
+
+    // Each update moves way 21 and relation 30 to other members, the old
+    // versions are removed from the files at some point.
+    for (osmid_t n = 13; n < 20; ++n) {
+        test_buffer_t changes;
+        auto const &way = changes.add_way("w21 Nn11,n{}"_format(n));
+        auto const &rel =
+            changes.add_relation("r30 Mw{}@ Ttype=route"_format(n % 2 + 20));
+
+        auto mid = std::make_shared<middle_file_t>(thread_pool, &options);
+        mid->start();
+        mid->after_nodes();
+        mid->way(way);
+        mid->after_ways();
+        mid->relation(rel);
+        mid->after_relations();
+
+        auto const mid_q = mid->get_query_instance();
+        testing::check_way(mid_q.get(), way20);
+        testing::check_way(mid_q.get(), way);
+        testing::check_relation(mid_q.get(), rel);
+
+        REQUIRE(mid->get_ways_by_node(11) == idlist_t{20, 21});
+        REQUIRE(mid->get_ways_by_node(n) == idlist_t{21});
+        REQUIRE(mid->get_ways_by_node(n - 1).empty());
+        REQUIRE(mid->get_rels_by_way(n % 2 + 20) == idlist_t{30});
+        mid->stop();
+    }
+
+    // Without compaction all 8 versions of way 21 would still be there.
+    mmap_object_store_t const ways{"test_middle_file.dir/ways.data", false};
+    REQUIRE(ways.size() < sizeof(std::uint64_t) +
+                              3 * (way20.padded_size() + way21.padded_size()));
+}
@@ -0,0 +1,265 @@
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+#include <catch.hpp>
+
+#include "middle-ram.hpp"
+
+#include "common-buffer.hpp"
+#include "common-cleanup.hpp"
+#include "common-middle.hpp"
+#include "common-options.hpp"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+char const *const snapshot_file = "test_middle_ram.snapshot";
+
+options_t snapshot_options(bool append)
+{
+    options_t options = testing::opt_t().slim();
+    options.middle_snapshot = snapshot_file;
+    options.append = append;
+    return options;
+}
+
+osmium::Location get_location(middle_query_t *mid_q, osmid_t id)
+{
+    test_buffer_t buffer;
+    buffer.add_way(1, {id});
+    mid_q->nodes_get_lists(&buffer.buffer());
+    return buffer.buffer().get<osmium::Way>(0).nodes()[0].location();
+}
+
+} // namespace
+
+TEST_CASE("ram middle: snapshot and update", "[NoDB]")
+{
+    testing::cleanup::file_t snapshot_cleaner{snapshot_file};
+    auto thread_pool = std::make_shared<thread_pool_t>(1U);
+
+    test_buffer_t buffer;
+    auto const &node10 = buffer.add_node("n10 x1.0 y2.0");
+    auto const &node11 = buffer.add_node("n11 x1.1 y2.1");
+    auto const &node12 = buffer.add_node("n12 x1.2 y2.2");
+    auto const &node12a = buffer.add_node("n12 x3.2 y4.2");
+    auto const &node13 = buffer.add_node("n13 x1.3 y2.3");
+    auto const &node11d = buffer.add_node("n11 dD");
+
+    auto const &way20 =
+        buffer.add_way("w20 Nn10,n11 Thighway=residential,name=High_Street");
+    auto const &way21 = buffer.add_way("w21 Nn11,n12");
+    auto const &way21a = buffer.add_way("w21 Nn10,n13");
+    auto const &way22 = buffer.add_way("w22 Nn12,n10 Tpower=line");
+    auto const &way20d = buffer.add_way("w20 dD");
+
+    auto const &rel30 =
+        buffer.add_relation("r30 Mw20@outer,n12@ Ttype=multipolygon");
+    auto const &rel31 = buffer.add_relation("r31 Mw21@ Ttype=route");
+    auto const &rel31d = buffer.add_relation("r31 dD");
+
+    {
+        auto const options = snapshot_options(false);
+        auto mid = std::make_shared<middle_ram_t>(thread_pool, &options);
+        mid->start();
+
+        mid->node(node10);
+        mid->node(node11);
+        mid->node(node12);
+        mid->after_nodes();
+        mid->way(way20);
+        mid->way(way21);
+        mid->after_ways();
+        mid->relation(rel30);
+        mid->relation(rel31);
+        mid->after_relations();
+
+        auto const mid_q = mid->get_query_instance();
+        testing::check_way(mid_q.get(), way20);
+        testing::check_relation(mid_q.get(), rel31);
+
+        mid->stop();
+    }
+
+    auto const options = snapshot_options(true);
+
+    SECTION("Data is there when opened again")
+    {
+        auto mid = std::make_shared<middle_ram_t>(thread_pool, &options);
+        mid->start();
+
+        auto const mid_q = mid->get_query_instance();
+        testing::check_way(mid_q.get(), way20);
+        testing::check_way(mid_q.get(), way21);
+        REQUIRE(testing::no_way(mid_q.get(), 22));
+        testing::check_relation(mid_q.get(), rel30);
+        testing::check_relation(mid_q.get(), rel31);
+        REQUIRE(get_location(mid_q.get(), 11) == node11.location());
+
+        osmium::memory::Buffer membuf{4096,
+                                      osmium::memory::Buffer::auto_grow::yes};
+        REQUIRE(mid_q->rel_members_get(rel30, &membuf,
+                                       osmium::osm_entity_bits::way) == 1);
+        REQUIRE(testing::crc(membuf.get<osmium::Way>(0)) ==
+                testing::crc(way20));
+
+        REQUIRE(mid->get_ways_by_node(10) == idlist_t{20});
+        REQUIRE(mid->get_ways_by_node(11) == idlist_t{20, 21});
+        REQUIRE(mid->get_rels_by_node(12) == idlist_t{30});
+        REQUIRE(mid->get_rels_by_way(21) == idlist_t{31});
+        REQUIRE(mid->get_rels_by_way(22).empty());
+    }
+
+    SECTION("Changed and deleted objects")
+    {
+        {
+            auto mid = std::make_shared<middle_ram_t>(thread_pool, &options);
+            mid->start();
+
+            mid->node(node11d);
+            mid->node(node12a);
+            mid->node(node13);
+            mid->after_nodes();
+            mid->way(way20d);
+            mid->way(way21a);
+            mid->way(way22);
+            mid->after_ways();
+            mid->relation(rel31d);
+            mid->after_relations();
+
+            auto const mid_q = mid->get_query_instance();
+            REQUIRE(testing::no_way(mid_q.get(), 20));
+            testing::check_way(mid_q.get(), way21a);
+            REQUIRE_FALSE(get_location(mid_q.get(), 11).valid());
+            REQUIRE(get_location(mid_q.get(), 12) == node12a.location());
+
+            REQUIRE(mid->get_ways_by_node(10) == idlist_t{21, 22});
+            REQUIRE(mid->get_ways_by_node(11).empty());
+            REQUIRE(mid->get_ways_by_node(12) == idlist_t{22});
+            REQUIRE(mid->get_rels_by_way(21).empty());
+
+            mid->stop();
+        }
+
+        // The snapshot contains the merged data now.
+        auto mid = std::make_shared<middle_ram_t>(thread_pool, &options);
+        mid->start();
+
+        auto const mid_q = mid->get_query_instance();
+        REQUIRE(testing::no_way(mid_q.get(), 20));
+        testing::check_way(mid_q.get(), way21a);
+        testing::check_way(mid_q.get(), way22);
+        testing::check_relation(mid_q.get(), rel30);
+        REQUIRE(testing::no_relation(mid_q.get(), 31));
+
+        REQUIRE(get_location(mid_q.get(), 10) == node10.location());
+        REQUIRE_FALSE(get_location(mid_q.get(), 11).valid());
+        REQUIRE(get_location(mid_q.get(), 12) == node12a.location());
+        REQUIRE(get_location(mid_q.get(), 13) == node13.location());
+
+        REQUIRE(mid->get_ways_by_node(10) == idlist_t{21, 22});
+        REQUIRE(mid->get_ways_by_node(13) == idlist_t{21});
+        REQUIRE(mid->get_rels_by_node(12) == idlist_t{30});
+    }
+}
+
+TEST_CASE("ram middle: read ways while adding relations", "[NoDB]")
+{
+    testing::cleanup::file_t snapshot_cleaner{snapshot_file};
+    auto thread_pool = std::make_shared<thread_pool_t>(1U);
+
+    test_buffer_t buffer;
+    buffer.add_node("n10 x1.0 y2.0");
+    buffer.add_node("n11 x1.1 y2.1");
+    auto const &way20 = buffer.add_way("w20 Nn10,n11 Thighway=residential");
+    buffer.add_way("w21 Nn11,n10 Thighway=primary");
+
+    // Enough relations with many members to need more than one buffer in
+    // the object store.
+    std::string members{"Mw20@"};
+    for (int i = 0; i < 200; ++i) {
+        members += ",w21@outer";
+    }
+    std::size_t const num_relations = 10000;
+
+    {
+        auto options = snapshot_options(false);
+        options.num_procs = 4;
+        auto mid = std::make_shared<middle_ram_t>(thread_pool, &options);
+        mid->start();
+
+        for (auto const &node : buffer.buffer().select<osmium::Node>()) {
+            mid->node(node);
+        }
+        mid->after_nodes();
+        for (auto const &way : buffer.buffer().select<osmium::Way>()) {
+            mid->way(way);
+        }
+        mid->after_ways();
+
+        // Like the parallel stage 1 workers, read ways from other threads
+        // while the relations are added.
+        std::atomic<bool> done{false};
+        std::atomic<bool> failed{false};
+        std::vector<std::thread> readers;
+        for (unsigned n = 0; n < options.num_procs; ++n) {
+            readers.emplace_back([&]() {
+                auto const mid_q = mid->get_query_instance();
+                auto const expected = testing::crc(way20);
+                osmium::memory::Buffer outbuf{
+                    4096, osmium::memory::Buffer::auto_grow::yes};
+                while (!done) {
+                    outbuf.clear();
+                    if (!mid_q->way_get(20, &outbuf) ||
+                        testing::crc(outbuf.get<osmium::Way>(0)) != expected) {
+                        failed = true;
+                    }
+                }
+            });
+        }
+
+        for (std::size_t n = 1; n <= num_relations; ++n) {
+            test_buffer_t rel_buffer;
+            mid->relation(rel_buffer.add_relation(
+                "r{} {} Ttype=multipolygon"_format(n, members)));
+        }
+        done = true;
+        for (auto &reader : readers) {
+            reader.join();
+        }
+        REQUIRE_FALSE(failed);
+
+        mid->after_relations();
+        mid->stop();
+    }
+
+    auto const options = snapshot_options(true);
+    auto mid = std::make_shared<middle_ram_t>(thread_pool, &options);
+    mid->start();
+
+    auto const mid_q = mid->get_query_instance();
+    testing::check_way(mid_q.get(), way20);
+
+    osmium::memory::Buffer outbuf{4096, osmium::memory::Buffer::auto_grow::yes};
+    REQUIRE(mid_q->relation_get(num_relations, &outbuf));
+    REQUIRE(outbuf.get<osmium::Relation>(0).members().size() == 201);
+    REQUIRE(mid->get_rels_by_way(20).size() == num_relations);
+}
+
+TEST_CASE("ram middle: missing snapshot", "[NoDB]")
+{
+    auto thread_pool = std::make_shared<thread_pool_t>(1U);
+    auto const options = snapshot_options(true);
+
+    REQUIRE_THROWS(std::make_shared<middle_ram_t>(thread_pool, &options));
+}
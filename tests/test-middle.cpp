@@ -81,6 +81,27 @@ struct options_flat_node_cache
     }
 };
 
+struct options_slim_way_node_index_id_shift
+{
+    static options_t options(testing::pg::tempdb_t const &tmpdb)
+    {
+        options_t o = testing::opt_t().slim(tmpdb);
+        o.way_node_index_id_shift = 4;
+        return o;
+    }
+};
+
+struct options_slim_compact
+{
+    static options_t options(testing::pg::tempdb_t const &tmpdb)
+    {
+        options_t o = testing::opt_t().slim(tmpdb);
+        o.middle_compact = true;
+        o.with_forward_dependencies = false;
+        return o;
+    }
+};
+
 struct options_ram_optimized
 {
     static options_t options(testing::pg::tempdb_t const &)
@@ -91,7 +112,8 @@ struct options_ram_optimized
 
 TEMPLATE_TEST_CASE("middle import", "", options_slim_default,
                    options_slim_with_lc_prefix, options_slim_with_uc_prefix,
-                   options_slim_with_schema, options_ram_optimized)
+                   options_slim_with_schema, options_slim_compact,
+                   options_ram_optimized)
 {
     options_t const options = TestType::options(db);
     testing::cleanup::file_t flatnode_cleaner{options.flat_node_file};
@@ -274,7 +296,8 @@ static bool no_node(std::shared_ptr<middle_pgsql_t> const &mid, osmid_t id)
 }
 
 TEMPLATE_TEST_CASE("middle: add, delete and update node", "",
-                   options_slim_default, options_flat_node_cache)
+                   options_slim_default, options_flat_node_cache,
+                   options_slim_compact)
 {
     auto thread_pool = std::make_shared<thread_pool_t>(1U);
 
@@ -468,7 +491,8 @@ static bool no_way(std::shared_ptr<middle_pgsql_t> const &mid, osmid_t id)
 }
 
 TEMPLATE_TEST_CASE("middle: add, delete and update way", "",
-                   options_slim_default, options_flat_node_cache)
+                   options_slim_default, options_flat_node_cache,
+                   options_slim_compact)
 {
     auto thread_pool = std::make_shared<thread_pool_t>(1U);
 
@@ -615,7 +639,7 @@ TEMPLATE_TEST_CASE("middle: add, delete and update way", "",
 }
 
 TEMPLATE_TEST_CASE("middle: add way with attributes", "", options_slim_default,
-                   options_flat_node_cache)
+                   options_flat_node_cache, options_slim_compact)
 {
     auto thread_pool = std::make_shared<thread_pool_t>(1U);
 
@@ -701,7 +725,8 @@ static bool no_relation(std::shared_ptr<middle_pgsql_t> const &mid, osmid_t id)
 }
 
 TEMPLATE_TEST_CASE("middle: add, delete and update relation", "",
-                   options_slim_default, options_flat_node_cache)
+                   options_slim_default, options_flat_node_cache,
+                   options_slim_compact)
 {
     auto thread_pool = std::make_shared<thread_pool_t>(1U);
 
@@ -844,7 +869,8 @@ TEMPLATE_TEST_CASE("middle: add, delete and update relation", "",
 }
 
 TEMPLATE_TEST_CASE("middle: add relation with attributes", "",
-                   options_slim_default, options_flat_node_cache)
+                   options_slim_default, options_flat_node_cache,
+                   options_slim_compact)
 {
     auto thread_pool = std::make_shared<thread_pool_t>(1U);
 
@@ -895,6 +921,84 @@ TEMPLATE_TEST_CASE("middle: add relation with attributes", "",
     }
 }
 
+TEST_CASE("middle: relation with too many node and way members")
+{
+    auto thread_pool = std::make_shared<thread_pool_t>(1U);
+
+    options_t options = options_slim_default::options(db);
+
+    // The offsets of the members are stored in int2 columns.
+    std::string members;
+    for (int i = 1; i <= 40000; ++i) {
+        members += "w{},"_format(i);
+    }
+    members.resize(members.size() - 1);
+
+    test_buffer_t buffer;
+    auto const &relation30 = buffer.add_relation("r30 M" + members);
+
+    auto mid = std::make_shared<middle_pgsql_t>(thread_pool, &options);
+    mid->start();
+
+    REQUIRE_THROWS_AS(mid->relation(relation30), std::runtime_error);
+}
+
+TEST_CASE("middle: format of middle tables is detected in append mode")
+{
+    auto thread_pool = std::make_shared<thread_pool_t>(1U);
+
+    test_buffer_t buffer;
+    auto const &way20 = buffer.add_way("w20 Nn10,n11 Thighway=primary");
+    auto const &rel30 = buffer.add_relation("r30 Mw20@ Ttype=route");
+
+    options_t options = testing::opt_t().slim(db);
+    options.with_forward_dependencies = false;
+
+    SECTION("Compact format") { options.middle_compact = true; }
+    SECTION("Array format") { options.middle_compact = false; }
+
+    {
+        auto mid = std::make_shared<middle_pgsql_t>(thread_pool, &options);
+        mid->start();
+
+        mid->after_nodes();
+        mid->way(way20);
+        mid->after_ways();
+        mid->relation(rel30);
+        mid->after_relations();
+    }
+
+    auto conn = db.connect();
+    REQUIRE(conn.get_count("pg_attribute",
+                           "attrelid = 'planet_osm_ways'::regclass"
+                           " AND attname = 'data'") ==
+            (options.middle_compact ? 1 : 0));
+
+    // The format is detected from the table, not from the option.
+    options.append = true;
+    options.middle_compact = !options.middle_compact;
+
+    {
+        auto mid = std::make_shared<middle_pgsql_t>(thread_pool, &options);
+        mid->start();
+
+        check_way(mid, way20);
+        check_relation(mid, rel30);
+    }
+
+    options.with_forward_dependencies = true;
+    if (options.middle_compact) {
+        // Tables were created in array format.
+        auto mid = std::make_shared<middle_pgsql_t>(thread_pool, &options);
+        mid->start();
+        check_way(mid, way20);
+    } else {
+        REQUIRE_THROWS_WITH(
+            std::make_shared<middle_pgsql_t>(thread_pool, &options),
+            Catch::Contains("compact format"));
+    }
+}
+
 TEMPLATE_TEST_CASE("middle: change nodes in way", "", options_slim_default,
                    options_flat_node_cache)
 {
@@ -1117,3 +1221,185 @@ TEMPLATE_TEST_CASE("middle: change nodes in relation", "", options_slim_default,
         check_relation(mid, rel31);
     }
 }
+
+TEMPLATE_TEST_CASE("middle: look up dependent objects in bulk", "",
+                   options_slim_default, options_slim_way_node_index_id_shift)
+{
+    auto thread_pool = std::make_shared<thread_pool_t>(1U);
+
+    options_t options = TestType::options(db);
+
+    // Nodes 16 to 19 are in the same bucket of the way node index if the
+    // ids are shifted, so the lookups have to filter out the other nodes.
+    test_buffer_t buffer;
+    auto const &way20 = buffer.add_way("w20 Nn10,n11");
+    auto const &way21 = buffer.add_way("w21 Nn11,n16");
+    auto const &way22 = buffer.add_way("w22 Nn17,n40");
+    auto const &way23 = buffer.add_way("w23 Nn18,n19");
+
+    auto const &rel30 = buffer.add_relation("r30 Mn10@,w20@ Ttype=route");
+    auto const &rel31 = buffer.add_relation("r31 Mw21@,n40@ Ttype=route");
+    auto const &rel32 = buffer.add_relation("r32 Mn16@,w23@ Ttype=route");
+
+    {
+        auto mid = std::make_shared<middle_pgsql_t>(thread_pool, &options);
+        mid->start();
+
+        mid->after_nodes();
+        mid->way(way20);
+        mid->way(way21);
+        mid->way(way22);
+        mid->way(way23);
+        mid->after_ways();
+        mid->relation(rel30);
+        mid->relation(rel31);
+        mid->relation(rel32);
+        mid->after_relations();
+    }
+
+    options.append = true;
+
+    auto mid = std::make_shared<middle_pgsql_t>(thread_pool, &options);
+    mid->start();
+
+    // Merge the results of the lookups for single ids.
+    auto const merged = [](idlist_t const &ids, auto &&func) {
+        idlist_t result;
+        for (auto const id : ids) {
+            auto const list = func(id);
+            result.insert(result.end(), list.begin(), list.end());
+        }
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        return result;
+    };
+
+    auto const ways_by_node = [&](osmid_t id) {
+        return mid->get_ways_by_node(id);
+    };
+    auto const rels_by_node = [&](osmid_t id) {
+        return mid->get_rels_by_node(id);
+    };
+    auto const rels_by_way = [&](osmid_t id) {
+        return mid->get_rels_by_way(id);
+    };
+
+    for (idlist_t const &node_ids :
+         {idlist_t{}, idlist_t{10}, idlist_t{11}, idlist_t{12, 13},
+          idlist_t{16}, idlist_t{17, 40}, idlist_t{10, 16, 19},
+          idlist_t{10, 11, 16, 17, 18, 19, 40}}) {
+        REQUIRE(mid->get_ways_by_nodes(node_ids) ==
+                merged(node_ids, ways_by_node));
+        REQUIRE(mid->get_rels_by_nodes(node_ids) ==
+                merged(node_ids, rels_by_node));
+    }
+
+    for (idlist_t const &way_ids :
+         {idlist_t{}, idlist_t{20}, idlist_t{22}, idlist_t{21, 23},
+          idlist_t{20, 21, 22, 23, 24}}) {
+        REQUIRE(mid->get_rels_by_ways(way_ids) ==
+                merged(way_ids, rels_by_way));
+    }
+
+    REQUIRE(mid->get_ways_by_nodes({10, 11, 16, 17, 18, 19, 40}) ==
+            idlist_t{20, 21, 22, 23});
+    REQUIRE(mid->get_ways_by_nodes({16}) == idlist_t{21});
+    REQUIRE(mid->get_rels_by_nodes({16, 17, 40}) == idlist_t{31, 32});
+    REQUIRE(mid->get_rels_by_ways({20, 23}) == idlist_t{30, 32});
+}
+
+TEMPLATE_TEST_CASE("middle: prefetch ways and relations", "",
+                   options_slim_default, options_flat_node_cache,
+                   options_slim_compact)
+{
+    auto thread_pool = std::make_shared<thread_pool_t>(1U);
+
+    options_t options = TestType::options(db);
+
+    testing::cleanup::file_t flatnode_cleaner{options.flat_node_file};
+
+    test_buffer_t buffer;
+    auto const &node10 = buffer.add_node("n10 x1.0 y0.0");
+    auto const &node11 = buffer.add_node("n11 x1.1 y0.0");
+    auto const &node12 = buffer.add_node("n12 x1.2 y0.0");
+
+    auto const &way20 = buffer.add_way("w20 Nn10,n11 Thighway=primary");
+    auto const &way21 = buffer.add_way("w21 Nn11,n12");
+
+    auto const &rel30 =
+        buffer.add_relation("r30 Mw20@outer,n10@,w21@ Ttype=multipolygon");
+
+    {
+        auto mid = std::make_shared<middle_pgsql_t>(thread_pool, &options);
+        mid->start();
+
+        mid->node(node10);
+        mid->node(node11);
+        mid->node(node12);
+        mid->after_nodes();
+        mid->way(way20);
+        mid->way(way21);
+        mid->after_ways();
+        mid->relation(rel30);
+        mid->after_relations();
+    }
+
+    // Use append mode so that the node cache is empty.
+    options.append = true;
+
+    auto mid = std::make_shared<middle_pgsql_t>(thread_pool, &options);
+    mid->start();
+    auto const mid_q = mid->get_query_instance();
+
+    osmium::memory::Buffer outbuf{4096, osmium::memory::Buffer::auto_grow::yes};
+
+    SECTION("Prefetch ways")
+    {
+        mid_q->prefetch_ways({20, 21, 22});
+
+        REQUIRE(mid_q->way_get(20, &outbuf));
+        REQUIRE_FALSE(mid_q->way_get(22, &outbuf));
+
+        auto &way = outbuf.get<osmium::Way>(0);
+
+        osmium::CRC<osmium::CRC_zlib> orig_crc;
+        orig_crc.update(way20);
+        osmium::CRC<osmium::CRC_zlib> test_crc;
+        test_crc.update(way);
+        REQUIRE(orig_crc().checksum() == test_crc().checksum());
+
+        REQUIRE(mid_q->nodes_get_list(&way.nodes()) == 2);
+        expect_location(way.nodes()[0].location(), node10);
+        expect_location(way.nodes()[1].location(), node11);
+    }
+
+    SECTION("Prefetch relations")
+    {
+        mid_q->prefetch_relations({30, 31});
+
+        REQUIRE(mid_q->relation_get(30, &outbuf));
+        REQUIRE_FALSE(mid_q->relation_get(31, &outbuf));
+
+        auto const &rel = outbuf.get<osmium::Relation>(0);
+
+        osmium::CRC<osmium::CRC_zlib> orig_crc;
+        orig_crc.update(rel30);
+        osmium::CRC<osmium::CRC_zlib> test_crc;
+        test_crc.update(rel);
+        REQUIRE(orig_crc().checksum() == test_crc().checksum());
+
+        osmium::memory::Buffer membuf{4096,
+                                      osmium::memory::Buffer::auto_grow::yes};
+        REQUIRE(mid_q->rel_members_get(rel, &membuf,
+                                       osmium::osm_entity_bits::way) == 2);
+
+        auto it = membuf.select<osmium::Way>().begin();
+        REQUIRE(it->id() == 20);
+        ++it;
+        auto &way = *it;
+        REQUIRE(way.id() == 21);
+        REQUIRE(mid_q->nodes_get_list(&way.nodes()) == 2);
+        expect_location(way.nodes()[0].location(), node11);
+        expect_location(way.nodes()[1].location(), node12);
+    }
+}
@@ -11,9 +11,15 @@
 
 #include "node-locations.hpp"
 
-TEST_CASE("node locations basics", "[NoDB]")
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+TEMPLATE_TEST_CASE("node locations basics", "[NoDB]", node_locations_varint_t,
+                   node_locations_fixed_t)
 {
-    node_locations_t nl;
+    TestType nl;
     REQUIRE(nl.size() == 0);
 
     REQUIRE(nl.set(3, {1.2, 3.4}));
@@ -33,9 +39,10 @@ TEST_CASE("node locations basics", "[NoDB]")
     REQUIRE(nl.size() == 0);
 }
 
-TEST_CASE("node locations in more than one block", "[NoDB]")
+TEMPLATE_TEST_CASE("node locations in more than one block", "[NoDB]", node_locations_varint_t,
+                   node_locations_fixed_t)
 {
-    node_locations_t nl;
+    TestType nl;
 
     osmid_t max_id = 0;
 
@@ -76,9 +83,10 @@ TEST_CASE("node locations in more than one block", "[NoDB]")
     }
 }
 
-TEST_CASE("huge ids should work", "[NoDB]")
+TEMPLATE_TEST_CASE("huge ids should work", "[NoDB]", node_locations_varint_t,
+                   node_locations_fixed_t)
 {
-    node_locations_t nl;
+    TestType nl;
 
     REQUIRE(nl.set(1ULL, {1.0, 9.9}));
     REQUIRE(nl.set(1ULL << 16U, {1.1, 9.8}));
@@ -98,9 +106,10 @@ TEST_CASE("huge ids should work", "[NoDB]")
     REQUIRE(nl.get((1ULL << 48U) - 1U) == osmium::Location{});
 }
 
-TEST_CASE("full node locations store", "[NoDB]")
+TEMPLATE_TEST_CASE("full node locations store", "[NoDB]", node_locations_varint_t,
+                   node_locations_fixed_t)
 {
-    node_locations_t nl{30};
+    TestType nl{30};
     REQUIRE(nl.size() == 0);
 
     REQUIRE(nl.set(3, {1.2, 3.4}));
@@ -109,3 +118,150 @@ TEST_CASE("full node locations store", "[NoDB]")
     REQUIRE(nl.size() == 1);
 }
 
+
+TEMPLATE_TEST_CASE("node locations with different coordinate ranges",
+                   "[NoDB]", node_locations_varint_t, node_locations_fixed_t)
+{
+    TestType nl;
+
+    // Ids and coordinates of the blocks need lanes of different widths
+    std::uint32_t n = 42;
+    osmid_t id = 0;
+    for (std::int32_t i = 0; i < 1000; ++i) {
+        n = n * 1103515245U + 12345U;
+        id += 1 + (i % 7 == 0 ? static_cast<osmid_t>(n % 100000U) : 0);
+        std::int32_t const range = 1 << ((i / 32) % 31);
+        nl.set(id, osmium::Location{
+                       static_cast<std::int32_t>(n % range) - range / 2,
+                       static_cast<std::int32_t>(n % 1800000000U) - 900000000});
+    }
+
+    REQUIRE(nl.size() == 1000);
+
+    n = 42;
+    id = 0;
+    for (std::int32_t i = 0; i < 1000; ++i) {
+        n = n * 1103515245U + 12345U;
+        auto const gap = (i % 7 == 0 ? static_cast<osmid_t>(n % 100000U) : 0);
+        if (gap > 0) {
+            REQUIRE(nl.get(id + 1) == osmium::Location{});
+        }
+        id += 1 + gap;
+        std::int32_t const range = 1 << ((i / 32) % 31);
+        REQUIRE(nl.get(id) ==
+                osmium::Location{
+                    static_cast<std::int32_t>(n % range) - range / 2,
+                    static_cast<std::int32_t>(n % 1800000000U) - 900000000});
+    }
+}
+
+TEMPLATE_TEST_CASE("node locations sorted lookup", "[NoDB]",
+                   node_locations_varint_t, node_locations_fixed_t)
+{
+    TestType nl;
+
+    for (osmid_t id = 1; id <= 100; ++id) {
+        nl.set(id * 3, {id + 0.1, id + 0.2});
+    }
+
+    idlist_t ids;
+    for (osmid_t id = 0; id <= 310; ++id) {
+        ids.push_back(id);
+        if (id % 10 == 0) {
+            ids.push_back(id); // duplicates are allowed
+        }
+    }
+
+    std::vector<osmium::Location> locations;
+    nl.get_sorted(ids, &locations);
+
+    REQUIRE(locations.size() == ids.size());
+    for (std::size_t i = 0; i < ids.size(); ++i) {
+        REQUIRE(locations[i] == nl.get(ids[i]));
+    }
+}
+
+TEMPLATE_TEST_CASE("node locations iteration", "[NoDB]",
+                   node_locations_varint_t, node_locations_fixed_t)
+{
+    TestType nl;
+
+    for (osmid_t id = 1; id <= 100; ++id) {
+        nl.set(id * 3, {id + 0.1, -id - 0.2});
+    }
+
+    std::vector<std::pair<osmid_t, osmium::Location>> result;
+    nl.for_each([&](osmid_t id, osmium::Location location) {
+        result.emplace_back(id, location);
+    });
+
+    REQUIRE(result.size() == 100);
+    for (osmid_t id = 1; id <= 100; ++id) {
+        auto const &entry = result[static_cast<std::size_t>(id - 1)];
+        REQUIRE(entry.first == id * 3);
+        REQUIRE(entry.second == osmium::Location(id + 0.1, -id - 0.2));
+    }
+}
+
+TEST_CASE("node locations decoded block cache", "[NoDB]")
+{
+    node_locations_varint_t nl;
+
+    for (osmid_t id = 1; id <= 100; ++id) {
+        nl.set(id, {id + 0.1, id + 0.2});
+    }
+
+    // Blocks are decoded once and then found in the cache, except the
+    // last block which is never cached.
+    for (int i = 0; i < 100; ++i) {
+        for (osmid_t id = 1; id <= 64; ++id) {
+            REQUIRE(nl.get(id) == osmium::Location{id + 0.1, id + 0.2});
+        }
+    }
+
+    auto const stats = nl.cache_stats();
+    REQUIRE(stats.first > 0);
+    REQUIRE(stats.second > 0);
+    REQUIRE(stats.first > stats.second * 100);
+
+    // Cached blocks from before are not used after clear()
+    nl.clear();
+    for (osmid_t id = 1; id <= 100; ++id) {
+        nl.set(id, {id + 0.3, id + 0.4});
+    }
+    for (osmid_t id = 1; id <= 100; ++id) {
+        REQUIRE(nl.get(id) == osmium::Location{id + 0.3, id + 0.4});
+    }
+}
+
+TEMPLATE_TEST_CASE("node locations lookup benchmark", "[.][benchmark]",
+                   node_locations_varint_t, node_locations_fixed_t)
+{
+    constexpr osmid_t const num_nodes = 10000000;
+
+    TestType nl;
+    for (osmid_t id = 1; id <= num_nodes; ++id) {
+        nl.set(id * 2, osmium::Location{static_cast<std::int32_t>(id * 13),
+                                        static_cast<std::int32_t>(id * 7)});
+    }
+
+    auto const start = std::chrono::steady_clock::now();
+
+    std::uint64_t found = 0;
+    std::uint32_t n = 42;
+    for (osmid_t i = 0; i < num_nodes; ++i) {
+        n = n * 1103515245U + 12345U;
+        found += nl.get(static_cast<osmid_t>(n % (2 * num_nodes))).valid();
+    }
+
+    auto const duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    std::printf("%zu nodes in %zu bytes, %lld lookups (%llu found) in %lld ms\n",
+                nl.size(), nl.used_memory(),
+                static_cast<long long>(num_nodes),
+                static_cast<unsigned long long>(found),
+                static_cast<long long>(duration.count()));
+
+    REQUIRE(found > 0);
+}
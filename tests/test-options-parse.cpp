@@ -48,6 +48,8 @@ TEST_CASE("Incompatible arguments", "[NoDB]")
     bad_opt({"-j", "-k"}, "You can not specify both");
 
     bad_opt({"-a"}, "--append can only be used with slim mode");
+
+    bad_opt({"--middle-compact"}, "--middle-compact only makes sense with");
 }
 
 TEST_CASE("Middle selection", "[NoDB]")
@@ -57,6 +59,12 @@ TEST_CASE("Middle selection", "[NoDB]")
 
     options = opt({});
     REQUIRE_FALSE(options.slim);
+
+    options = opt({"--slim"});
+    REQUIRE_FALSE(options.middle_compact);
+
+    options = opt({"--slim", "--middle-compact"});
+    REQUIRE(options.middle_compact);
 }
 
 TEST_CASE("Lua styles", "[NoDB]")
@@ -144,3 +144,17 @@ TEST_CASE("ordered index with huge gaps in ids", "[NoDB]")
     REQUIRE(index.get_block((3ULL << 32U) + 2U) == 3);
 }
 
+TEST_CASE("ordered index with huge gaps in offsets", "[NoDB]")
+{
+    constexpr std::size_t const block_size = 4;
+    ordered_index_t index{block_size};
+
+    index.add(1, 0);
+    index.add(2, (1ULL << 32U) + 3U);
+    index.add(3, (1ULL << 40U) + 7U);
+    REQUIRE(index.size() == 3);
+
+    REQUIRE(index.get(1) == 0);
+    REQUIRE(index.get(2) == (1ULL << 32U) + 3U);
+    REQUIRE(index.get(3) == (1ULL << 40U) + 7U);
+}
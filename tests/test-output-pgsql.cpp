@@ -59,6 +59,26 @@ TEST_CASE("liechtenstein slim regression simple")
                                 "5972593.4)'::geometry, 0.1)"));
 }
 
+TEST_CASE("liechtenstein slim with rows sorted on the client side")
+{
+    options_t options = testing::opt_t().slim();
+    options.cluster_sort_dir = ".";
+
+    REQUIRE_NOTHROW(db.run_file(options, "liechtenstein-2013-08-03.osm.pbf"));
+
+    auto conn = db.db().connect();
+    require_tables(conn);
+
+    REQUIRE(1342 == conn.get_count("osm2pgsql_test_point"));
+    REQUIRE(3231 == conn.get_count("osm2pgsql_test_line"));
+    REQUIRE(375 == conn.get_count("osm2pgsql_test_roads"));
+    REQUIRE(4130 == conn.get_count("osm2pgsql_test_polygon"));
+
+    conn.assert_double(
+        311.289,
+        "SELECT way_area FROM osm2pgsql_test_polygon WHERE osm_id = 3265");
+}
+
 TEST_CASE("liechtenstein slim latlon")
 {
     REQUIRE_NOTHROW(db.run_file(testing::opt_t().slim().srs(PROJ_LATLONG),
@@ -285,3 +285,67 @@ TEST_CASE("invalid location")
     REQUIRE(output->relation.added == 0);
 }
 
+
+TEST_CASE("nodes outside bbox are not imported")
+{
+    options_t options = testing::opt_t().slim();
+    options.bbox = osmium::Box{-1.0, -1.0, 0.0, 1.0};
+
+    auto const middle = std::make_shared<counting_middle_t>(false);
+    auto const output = std::make_shared<counting_output_t>(options);
+
+    auto counts = std::make_shared<counts_t>();
+    auto dependency_manager =
+        std::make_unique<counting_dependency_manager_t>(counts);
+
+    testing::parse_file(options, std::move(dependency_manager), middle,
+                        {output}, "test_multipolygon.osm", false);
+
+    auto const *mid_test = middle.get();
+    REQUIRE(mid_test->node_count.added == 96);
+    REQUIRE(mid_test->way_count.added == 140);
+    REQUIRE(mid_test->relation_count.added == 40);
+}
+
+TEST_CASE("merge multiple input files")
+{
+    options_t const options = testing::opt_t().slim();
+
+    auto const middle = std::make_shared<counting_middle_t>(false);
+    auto const output = std::make_shared<counting_output_t>(options);
+
+    auto counts = std::make_shared<counts_t>();
+    auto dependency_manager =
+        std::make_unique<counting_dependency_manager_t>(counts);
+
+    osmdata_t osmdata{std::move(dependency_manager), middle, output, options};
+    osmdata.start();
+
+    std::vector<std::string> const data = {
+        "n1 v1 Ta=b x1 y1\n"
+        "n2 v1 x2 y2\n"
+        "n5 v1 x5 y5\n"
+        "w1 v1 Ta=b Nn1,n2\n",
+        "n2 v2 x2 y2\n"
+        "n3 v1 x3 y3\n"
+        "w1 v2 Ta=b Nn1,n2,n3\n"
+        "r1 v1 Ta=b Mn1@\n",
+        "n4 v1 Ta=b x4 y4\n"
+        "w7 v1 Ta=b Nn4,n5\n"};
+
+    std::vector<osmium::io::File> files;
+    for (auto const &d : data) {
+        files.emplace_back(d.data(), d.size(), "opl");
+    }
+    process_files(files, &osmdata, false, false);
+
+    REQUIRE(output->node.added == 2);
+    REQUIRE(output->way.added == 2);
+    REQUIRE(output->relation.added == 1);
+    REQUIRE(output->sum_nds == 5);
+
+    auto const *mid_test = middle.get();
+    REQUIRE(mid_test->node_count.added == 5);
+    REQUIRE(mid_test->way_count.added == 2);
+    REQUIRE(mid_test->relation_count.added == 1);
+}
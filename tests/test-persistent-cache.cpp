@@ -11,8 +11,14 @@
 
 #include "node-persistent-cache.hpp"
 
+#include "common-buffer.hpp"
 #include "common-cleanup.hpp"
 
+#include <osmium/util/file.hpp>
+
+#include <future>
+#include <vector>
+
 static void write_and_read_location(node_persistent_cache &cache, osmid_t id,
                                     double x, double y)
 {
@@ -34,12 +40,18 @@ static void delete_location(node_persistent_cache &cache, osmid_t id)
 
 TEST_CASE("Persistent cache", "[NoDB]")
 {
+    auto const format =
+        GENERATE(flat_node_format::dense, flat_node_format::sparse,
+                 flat_node_format::compressed);
+
     std::string const flat_node_file = "test_middle_flat.flat.nodes.bin";
     testing::cleanup::file_t flatnode_cleaner{flat_node_file};
+    testing::cleanup::file_t index_cleaner{flat_node_file + ".idx"};
 
     // create a new cache
     {
-        node_persistent_cache cache{flat_node_file, false};
+        node_persistent_cache cache{flat_node_file, false, format};
+        REQUIRE(cache.format() == format);
 
         // write in order
         write_and_read_location(cache, 10, 10.01, -45.3);
@@ -60,9 +72,10 @@ TEST_CASE("Persistent cache", "[NoDB]")
         REQUIRE(cache.get(7772947204) == osmium::Location{});
     }
 
-    // reopen the cache
+    // reopen the cache, the format is detected from the file
     {
         node_persistent_cache cache{flat_node_file, false};
+        REQUIRE(cache.format() == format);
 
         // read all previously written locations
         read_location(cache, 10, 10.01, -45.3);
@@ -103,3 +116,165 @@ TEST_CASE("Persistent cache", "[NoDB]")
         read_location(cache, 9934, -179.999, 89.1);
     }
 }
+
+TEST_CASE("Sparse persistent cache", "[NoDB]")
+{
+    std::string const flat_node_file = "test_middle_flat.flat.nodes.bin";
+    testing::cleanup::file_t flatnode_cleaner{flat_node_file};
+
+    osmid_t const ids_per_page = osmium::get_pagesize() / 8;
+
+    node_persistent_cache cache{flat_node_file, false,
+                                flat_node_format::sparse};
+
+    // id 0 holds the format magic and can't be used
+    REQUIRE_THROWS(cache.set(0, osmium::Location{1.0, 2.0}));
+    REQUIRE(cache.get(0) == osmium::Location{});
+
+    // fill the second page and one id on the third page
+    for (osmid_t id = ids_per_page; id < 2 * ids_per_page; ++id) {
+        cache.set(id, osmium::Location{1.0, 2.0});
+    }
+    write_and_read_location(cache, 2 * ids_per_page, 3.0, 4.0);
+
+    // a node far away leaves a large hole
+    write_and_read_location(cache, 100000000, 5.0, 6.0);
+    REQUIRE(cache.get(99999999) == osmium::Location{});
+
+    // delete all nodes on the second page
+    for (osmid_t id = ids_per_page; id < 2 * ids_per_page; ++id) {
+        delete_location(cache, id);
+    }
+
+#ifdef __linux__
+    REQUIRE(cache.holes_punched() == 1);
+#endif
+
+    // the page is still usable after the hole was punched
+    REQUIRE(cache.get(ids_per_page) == osmium::Location{});
+    write_and_read_location(cache, ids_per_page + 1, 7.0, 8.0);
+    read_location(cache, 2 * ids_per_page, 3.0, 4.0);
+    read_location(cache, 100000000, 5.0, 6.0);
+}
+
+TEST_CASE("Compressed persistent cache", "[NoDB]")
+{
+    std::string const flat_node_file = "test_middle_flat.flat.nodes.bin";
+    testing::cleanup::file_t flatnode_cleaner{flat_node_file};
+    testing::cleanup::file_t index_cleaner{flat_node_file + ".idx"};
+
+    {
+        node_persistent_cache cache{flat_node_file, false,
+                                    flat_node_format::compressed};
+
+        // fill some blocks with nearby locations
+        for (osmid_t id = 1; id <= 1000; ++id) {
+            cache.set(id, osmium::Location{static_cast<int32_t>(id * 10),
+                                           static_cast<int32_t>(id * 20)});
+        }
+
+        // a node far away and one in a block on its own
+        write_and_read_location(cache, 100000000, 5.0, 6.0);
+        write_and_read_location(cache, 2000, -179.9, -89.9);
+    }
+
+    // reopen the cache and change it in place
+    {
+        node_persistent_cache cache{flat_node_file, false};
+        REQUIRE(cache.format() == flat_node_format::compressed);
+
+        for (osmid_t id = 1; id <= 1000; ++id) {
+            REQUIRE(cache.get(id) ==
+                    osmium::Location{static_cast<int32_t>(id * 10),
+                                     static_cast<int32_t>(id * 20)});
+        }
+        read_location(cache, 100000000, 5.0, 6.0);
+        read_location(cache, 2000, -179.9, -89.9);
+        REQUIRE(cache.get(1001) == osmium::Location{});
+        REQUIRE(cache.get(99999999) == osmium::Location{});
+
+        // this makes the block larger than its slot
+        write_and_read_location(cache, 100, 179.9, 89.9);
+        delete_location(cache, 101);
+        delete_location(cache, 2000);
+
+        // add a node to a block that doesn't exist yet
+        write_and_read_location(cache, 5000, 1.0, 1.0);
+    }
+
+    // check the changes
+    {
+        node_persistent_cache cache{flat_node_file, false};
+
+        read_location(cache, 100, 179.9, 89.9);
+        REQUIRE(cache.get(101) == osmium::Location{});
+        REQUIRE(cache.get(2000) == osmium::Location{});
+        read_location(cache, 5000, 1.0, 1.0);
+        REQUIRE(cache.get(99) == osmium::Location{990, 1980});
+        REQUIRE(cache.get(102) == osmium::Location{1020, 2040});
+        read_location(cache, 100000000, 5.0, 6.0);
+    }
+}
+
+TEST_CASE("Prefetching way nodes doesn't change the cache", "[NoDB]")
+{
+    auto const format =
+        GENERATE(flat_node_format::dense, flat_node_format::sparse,
+                 flat_node_format::compressed);
+
+    std::string const flat_node_file = "test_middle_flat.flat.nodes.bin";
+    testing::cleanup::file_t flatnode_cleaner{flat_node_file};
+    testing::cleanup::file_t index_cleaner{flat_node_file + ".idx"};
+
+    node_persistent_cache cache{flat_node_file, false, format};
+    write_and_read_location(cache, 1, 1.0, 1.0);
+    write_and_read_location(cache, 2, 2.0, 2.0);
+    write_and_read_location(cache, 3000000, 3.0, 3.0);
+
+    test_buffer_t buffer;
+    buffer.add_way(10, {1, 2, 3000000});
+    // node ids not in the file or not valid are ignored
+    buffer.add_way(11, {5, 999999999, -7});
+
+    cache.advise(node_persistent_cache::access_t::random);
+    cache.will_need(buffer.buffer());
+
+    read_location(cache, 1, 1.0, 1.0);
+    read_location(cache, 2, 2.0, 2.0);
+    read_location(cache, 3000000, 3.0, 3.0);
+    REQUIRE(cache.get(5) == osmium::Location{});
+}
+
+TEST_CASE("Cache can be read from several threads", "[NoDB]")
+{
+    auto const format =
+        GENERATE(flat_node_format::dense, flat_node_format::sparse,
+                 flat_node_format::compressed);
+
+    std::string const flat_node_file = "test_middle_flat.flat.nodes.bin";
+    testing::cleanup::file_t flatnode_cleaner{flat_node_file};
+    testing::cleanup::file_t index_cleaner{flat_node_file + ".idx"};
+
+    node_persistent_cache cache{flat_node_file, false, format};
+    write_and_read_location(cache, 1, 1.0, 1.0);
+    write_and_read_location(cache, 3000000, 3.0, 3.0);
+    delete_location(cache, 1);
+
+    // All nodes are written, now several threads can read.
+    std::vector<std::future<bool>> results;
+    for (int i = 0; i < 4; ++i) {
+        results.push_back(std::async(std::launch::async, [&cache]() {
+            bool ok = true;
+            for (int n = 0; n < 1000; ++n) {
+                ok = ok &&
+                     cache.get(3000000) == osmium::Location(3.0, 3.0) &&
+                     cache.get(1) == osmium::Location{};
+            }
+            return ok;
+        }));
+    }
+
+    for (auto &result : results) {
+        REQUIRE(result.get());
+    }
+}
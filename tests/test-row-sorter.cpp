@@ -0,0 +1,201 @@
+/**
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This file is part of osm2pgsql (https://osm2pgsql.org/).
+ *
+ * Copyright (C) 2006-2021 by the osm2pgsql developer community.
+ * For a full list of authors see the git log.
+ */
+
+#include <catch.hpp>
+
+#include "reprojection.hpp"
+#include "row-sorter.hpp"
+#include "wkb.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+std::vector<std::string> sorted_rows(row_sorter_t *sorter)
+{
+    std::vector<std::string> rows;
+    sorter->for_each([&rows](char const *data, std::size_t size) {
+        rows.emplace_back(data, size);
+    });
+    return rows;
+}
+
+std::string point(double x, double y)
+{
+    return ewkb::create_point(x, y, PROJ_SPHERE_MERC);
+}
+
+} // anonymous namespace
+
+TEST_CASE("Hilbert index of the quadrants", "[NoDB]")
+{
+    constexpr std::uint32_t const half = 1UL << 31U;
+
+    // The top two bits of the index are the number of the quadrant.
+    REQUIRE(hilbert_index(0, 0) == 0);
+    REQUIRE(hilbert_index(0, half) >> 62U == 1);
+    REQUIRE(hilbert_index(half, half) >> 62U == 2);
+    REQUIRE(hilbert_index(half, 0) >> 62U == 3);
+    REQUIRE(hilbert_index(0xffffffffUL, 0) == 0xffffffffffffffffULL);
+}
+
+TEST_CASE("Consecutive Hilbert indexes are neighbours", "[NoDB]")
+{
+    constexpr std::uint32_t const step = 1UL << 28U;
+
+    std::vector<std::pair<std::uint64_t, std::pair<int, int>>> cells;
+    for (int x = 0; x < 16; ++x) {
+        for (int y = 0; y < 16; ++y) {
+            auto const index =
+                hilbert_index(static_cast<std::uint32_t>(x) * step,
+                              static_cast<std::uint32_t>(y) * step);
+            cells.emplace_back(index, std::make_pair(x, y));
+        }
+    }
+
+    std::sort(cells.begin(), cells.end());
+
+    for (std::size_t i = 1; i < cells.size(); ++i) {
+        auto const &a = cells[i - 1].second;
+        auto const &b = cells[i].second;
+        REQUIRE(std::abs(a.first - b.first) + std::abs(a.second - b.second) ==
+                1);
+    }
+}
+
+TEST_CASE("Sort key of geometries", "[NoDB]")
+{
+    auto const proj = reprojection::create_projection(PROJ_SPHERE_MERC);
+
+    REQUIRE(geom_sort_key("", *proj) == 0);
+
+    REQUIRE(geom_sort_key(point(1000.0, 2000.0), *proj) ==
+            geom_sort_key(point(1000.0, 2000.0), *proj));
+
+    // North-west corner of the world comes first
+    REQUIRE(geom_sort_key(point(-20037509.0, 20037509.0), *proj) == 0);
+
+    // The key of a line is the key of the center of its bounding box
+    ewkb::writer_t writer{PROJ_SPHERE_MERC};
+    writer.linestring_start();
+    writer.add_location(osmium::geom::Coordinates{1000.0, 1000.0});
+    writer.add_location(osmium::geom::Coordinates{3000.0, 5000.0});
+    auto const line = writer.linestring_finish(2);
+    REQUIRE(geom_sort_key(line, *proj) ==
+            geom_sort_key(point(2000.0, 3000.0), *proj));
+}
+
+TEST_CASE("Rows are sorted in memory", "[NoDB]")
+{
+    row_sorter_t sorter{reprojection::create_projection(PROJ_SPHERE_MERC),
+                        "."};
+
+    sorter.add(point(10000.0, -10000.0), 'X', 3, "c", 1);
+    sorter.add(point(-10000.0, 10000.0), 'X', 1, "a", 1);
+    sorter.add(point(-10000.0, -10000.0), 'X', 2, "b", 1);
+    sorter.add(point(-10000.0, 10000.0), 'X', 4, "d", 1);
+
+    REQUIRE(sorter.size() == 4);
+    REQUIRE(sorter.num_runs() == 0);
+    REQUIRE(sorted_rows(&sorter) ==
+            std::vector<std::string>{"a", "d", "b", "c"});
+}
+
+TEST_CASE("Rows are sorted with temporary files", "[NoDB]")
+{
+    auto const proj = reprojection::create_projection(PROJ_SPHERE_MERC);
+    row_sorter_t sorter{proj, ".", 1024};
+
+    std::vector<std::pair<std::uint64_t, std::string>> expected;
+    std::uint32_t n = 12345;
+    for (osmid_t id = 1; id <= 500; ++id) {
+        // simple pseudo-random coordinates
+        n = n * 1103515245U + 12345U;
+        double const x = (n % 40000U) * 1000.0 - 20000000.0;
+        n = n * 1103515245U + 12345U;
+        double const y = (n % 40000U) * 1000.0 - 20000000.0;
+
+        auto const wkb = point(x, y);
+        std::string const data = "row" + std::to_string(id);
+        sorter.add(wkb, 'X', id, data.data(), data.size());
+        expected.emplace_back(geom_sort_key(wkb, *proj), data);
+    }
+
+    REQUIRE(sorter.num_runs() > 1);
+
+    std::stable_sort(
+        expected.begin(), expected.end(),
+        [](std::pair<std::uint64_t, std::string> const &a,
+           std::pair<std::uint64_t, std::string> const &b) {
+            return a.first < b.first;
+        });
+
+    auto const rows = sorted_rows(&sorter);
+    REQUIRE(rows.size() == expected.size());
+    for (std::size_t i = 0; i < rows.size(); ++i) {
+        REQUIRE(rows[i] == expected[i].second);
+    }
+}
+
+TEST_CASE("Removed rows are not returned", "[NoDB]")
+{
+    std::size_t const max_memory = GENERATE(1, 1024 * 1024);
+
+    row_sorter_t sorter{reprojection::create_projection(PROJ_SPHERE_MERC),
+                        ".", max_memory};
+
+    sorter.add(point(1.0, 1.0), 'N', 1, "n1", 2);
+    sorter.add(point(2.0, 2.0), 'W', 1, "w1", 2);
+    sorter.add(point(3.0, 3.0), 'N', 2, "n2", 2);
+    sorter.remove('N', 1);
+    sorter.remove('N', 3);
+    sorter.add(point(4.0, 4.0), 'N', 1, "n1new", 5);
+
+    auto rows = sorted_rows(&sorter);
+    std::sort(rows.begin(), rows.end());
+    REQUIRE(rows == std::vector<std::string>{"n1new", "n2", "w1"});
+}
+
+TEST_CASE("Rows can be added from several threads", "[NoDB]")
+{
+    auto const proj = reprojection::create_projection(PROJ_SPHERE_MERC);
+    row_sorter_t sorter{proj, ".", 1024};
+
+    std::vector<std::thread> threads;
+    for (osmid_t t = 0; t < 4; ++t) {
+        threads.emplace_back([&sorter, t]() {
+            for (osmid_t id = t * 1000 + 1; id <= t * 1000 + 500; ++id) {
+                std::string const data = std::to_string(id);
+                sorter.add(point(static_cast<double>(id), 1.0), 'X', id,
+                           data.data(), data.size());
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE(sorter.size() == 2000);
+    REQUIRE(sorter.num_runs() > 1);
+
+    auto const key = [&proj](std::string const &row) {
+        return geom_sort_key(point(std::stod(row), 1.0), *proj);
+    };
+
+    auto const rows = sorted_rows(&sorter);
+    REQUIRE(rows.size() == 2000);
+    for (std::size_t i = 1; i < rows.size(); ++i) {
+        REQUIRE(key(rows[i - 1]) <= key(rows[i]));
+    }
+}